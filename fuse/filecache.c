@@ -16,16 +16,25 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200809L // for clock_gettime
+
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <openssl/sha.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "../utils/hash.h"
 #include "../utils/xdelta3.h"
@@ -35,26 +44,207 @@
 #include "../mfapi/mfconn.h"
 #include "../utils/http.h"
 #include "../utils/strings.h"
+#include "filecache.h"
 
 static int      filecache_update_file(const char *filecache_path,
                                       mfconn * conn, const char *quickkey,
                                       uint64_t local_revision,
-                                      uint64_t remote_revision);
+                                      uint64_t remote_revision,
+                                      uint64_t fsize,
+                                      const unsigned char *fhash,
+                                      uint64_t * checksum);
 static int      filecache_download_file(const char *filecache_path,
                                         const char *quickkey,
                                         uint64_t remote_revision,
-                                        mfconn * conn);
-static int      filecache_download_patch(mfconn * conn, const char *quickkey,
-                                         uint64_t source_revision,
-                                         uint64_t target_revision,
-                                         const char *phash,
-                                         const char *filecache_path);
+                                        uint64_t fsize,
+                                        const unsigned char *fhash,
+                                        uint64_t * checksum, mfconn * conn);
+static int      filecache_check_download(mfhttp * http, const char *path,
+                                         int64_t fsize,
+                                         const unsigned char *fhash,
+                                         uint64_t * checksum);
+static int      filecache_check_file(const char *path, int64_t fsize,
+                                     const unsigned char *fhash,
+                                     uint64_t * checksum);
+static int      filecache_download_patches(mfconn * conn,
+                                           const char *quickkey,
+                                           mfpatch ** patches,
+                                           int num_patches,
+                                           const char *filecache_path,
+                                           uint64_t fsize);
 static int      filecache_patch_file(const char *filecache_path,
                                      const char *quickkey,
-                                     uint64_t source_revision,
-                                     uint64_t target_revision);
+                                     mfpatch ** patches, int num_patches);
+static bool     filecache_prefer_patches(const char *quickkey,
+                                         int num_patches, uint64_t fsize);
+static void     filecache_record_transfer(mfhttp * http);
+static void     filecache_cost_sample(double *estimate, double sample);
+
+/*
+ * Estimates used to decide whether a cached file is brought up to date by
+ * patching it or by downloading it anew. They start out with conservative
+ * guesses and are refined with every transfer the file cache does.
+ *
+ * Files are retrieved from several threads which do not necessarily hold
+ * the global lock of the fuse context, so the estimates are only read and
+ * written with filecache_costs_mutex held.
+ */
+struct filecache_costs {
+    double          latency;    // seconds until the first byte of a request
+    double          throughput; // download speed in bytes per second
+    double          patch_ratio;        // patch size relative to the file
+    double          local_rate; // bytes per second for hashing and patching
+};
+
+static struct filecache_costs filecache_costs = {
+    0.5, 1024.0 * 1024.0, 0.25, 50.0 * 1024.0 * 1024.0
+};
+
+static pthread_mutex_t filecache_costs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// weight of a new sample in the moving averages above
+#define FILECACHE_COST_WEIGHT 0.2
+// transfers smaller than this are dominated by latency and are not used to
+// estimate the throughput
+#define FILECACHE_MIN_THROUGHPUT_SAMPLE 65536
+
+static const char filecache_shard_chars[] =
+    "0123456789abcdefghijklmnopqrstuvwxyz";
+
+char           *filecache_shard_path(const char *filecache,
+                                     const char *quickkey)
+{
+    return strdup_printf("%s/%c/%c", filecache, quickkey[0], quickkey[1]);
+}
+
+char           *filecache_shard_path_by_index(const char *filecache,
+                                              int index)
+{
+    return strdup_printf("%s/%c/%c", filecache,
+                         filecache_shard_chars[index / 36],
+                         filecache_shard_chars[index % 36]);
+}
+
+/*
+ * everything in the cache is named after a quickkey of 15 lowercase letters
+ * and numbers followed by an underscore
+ */
+static bool filecache_is_quickkey_filename(const char *name)
+{
+    int             i;
+
+    for (i = 0; i < 15; i++) {
+        if (!islower(name[i]) && !isdigit(name[i]))
+            return false;
+    }
+
+    return name[i] == '_';
+}
+
+/*
+ * create the subdirectories of the file cache and move files that were
+ * stored directly in the file cache by earlier versions into them
+ */
+int filecache_init(const char *filecache)
+{
+    int             i;
+    char           *path;
+    char           *oldpath;
+    char           *newpath;
+    DIR            *dirp;
+    struct dirent  *endp;
+    struct dirent  *entryp;
+    long            name_max;
+    int             retval;
+    int             num_moved;
+
+    for (i = 0; i < FILECACHE_NUM_SHARDS; i++) {
+        // create the first level when visiting its first subdirectory
+        if (i % 36 == 0) {
+            path = strdup_printf("%s/%c", filecache,
+                                 filecache_shard_chars[i / 36]);
+            if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+                fprintf(stderr, "cannot create %s\n", path);
+                free(path);
+                return -1;
+            }
+            free(path);
+        }
+        path = filecache_shard_path_by_index(filecache, i);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "cannot create %s\n", path);
+            free(path);
+            return -1;
+        }
+        free(path);
+    }
 
+    // from the readdir_r man page
+    name_max = pathconf(filecache, _PC_NAME_MAX);
+    if (name_max == -1)         /* Limit not defined, or error */
+        name_max = 255;         /* Take a guess */
+    entryp = malloc(offsetof(struct dirent, d_name) + name_max + 1);
+
+    dirp = opendir(filecache);
+    if (dirp == NULL) {
+        fprintf(stderr, "cannot open filecache\n");
+        free(entryp);
+        return -1;
+    }
+
+    num_moved = 0;
+    for (;;) {
+        endp = NULL;
+        retval = readdir_r(dirp, entryp, &endp);
+        if (retval != 0) {
+            fprintf(stderr, "readdir_r failed\n");
+            free(entryp);
+            closedir(dirp);
+            return -1;
+        }
+        if (endp == NULL) {
+            break;
+        }
+
+        if (!filecache_is_quickkey_filename(entryp->d_name))
+            continue;
+
+        oldpath = strdup_printf("%s/%s", filecache, entryp->d_name);
+        path = filecache_shard_path(filecache, entryp->d_name);
+        newpath = strdup_printf("%s/%s", path, entryp->d_name);
+        free(path);
+        retval = rename(oldpath, newpath);
+        if (retval != 0) {
+            fprintf(stderr, "cannot move %s to %s\n", oldpath, newpath);
+        } else {
+            num_moved++;
+        }
+        free(oldpath);
+        free(newpath);
+    }
+
+    free(entryp);
+    closedir(dirp);
+
+    if (num_moved > 0) {
+        fprintf(stderr, "moved %d files into the sharded file cache\n",
+                num_moved);
+    }
+
+    return 0;
+}
+
+/*
+ * upload the changes made to the cached file in its _new copy as a patch
+ *
+ * source_fhash is the SHA256 of the cached file and target_fhash and
+ * target_fsize are the SHA256 and the size of the _new copy if the caller
+ * already knows them. Otherwise they are computed from the files.
+ */
 int filecache_upload_patch(const char *quickkey, uint64_t local_revision,
+                           const unsigned char *source_fhash,
+                           const unsigned char *target_fhash,
+                           uint64_t target_fsize,
                            const char *filecache_path, mfconn * conn)
 {
     FILE           *source_fh;
@@ -93,24 +283,31 @@ int filecache_upload_patch(const char *quickkey, uint64_t local_revision,
     }
     free(newfile);
 
-    retval = calc_sha256(source_fh, hash, NULL);
-
-    if (retval != 0) {
-        fprintf(stderr, "failed to calculate hash\n");
-        fclose(source_fh);
-        fclose(target_fh);
-        return -1;
+    if (source_fhash != NULL) {
+        memcpy(hash, source_fhash, SHA256_DIGEST_LENGTH);
+    } else {
+        retval = calc_sha256(source_fh, hash, NULL);
+        if (retval != 0) {
+            fprintf(stderr, "failed to calculate hash\n");
+            fclose(source_fh);
+            fclose(target_fh);
+            return -1;
+        }
     }
 
     source_hash = binary2hex(hash, SHA256_DIGEST_LENGTH);
 
-    retval = calc_sha256(target_fh, hash, &target_size);
-
-    if (retval != 0) {
-        fprintf(stderr, "failed to calculate hash\n");
-        fclose(source_fh);
-        fclose(target_fh);
-        return -1;
+    if (target_fhash != NULL) {
+        memcpy(hash, target_fhash, SHA256_DIGEST_LENGTH);
+        target_size = target_fsize;
+    } else {
+        retval = calc_sha256(target_fh, hash, &target_size);
+        if (retval != 0) {
+            fprintf(stderr, "failed to calculate hash\n");
+            fclose(source_fh);
+            fclose(target_fh);
+            return -1;
+        }
     }
 
     target_hash = binary2hex(hash, SHA256_DIGEST_LENGTH);
@@ -160,11 +357,16 @@ int filecache_upload_patch(const char *quickkey, uint64_t local_revision,
     return 0;
 }
 
+/*
+ * *retrieved tells whether the file had to be downloaded or patched. In that
+ * case, it was verified against fhash and *checksum holds its fast checksum
+ * for later checks of the cached file.
+ */
 int filecache_open_file(const char *quickkey, uint64_t local_revision,
                         uint64_t remote_revision, uint64_t fsize,
                         const unsigned char *fhash,
                         const char *filecache_path, mfconn * conn, mode_t mode,
-                        bool update)
+                        bool update, bool * retrieved, uint64_t * checksum)
 {
     char           *cachefile;
     char           *newfile;
@@ -176,6 +378,8 @@ int filecache_open_file(const char *quickkey, uint64_t local_revision,
     int             source;
     int             dest;
 
+    *retrieved = false;
+
     if (update) {
         cachefile = strdup_printf("%s/%s_%d", filecache_path, quickkey,
                                   remote_revision);
@@ -251,7 +455,8 @@ int filecache_open_file(const char *quickkey, uint64_t local_revision,
         /* file exists, so we have to update it with one or more patches from
          * the remote */
         retval = filecache_update_file(filecache_path, conn, quickkey,
-                                       local_revision, remote_revision);
+                                       local_revision, remote_revision,
+                                       fsize, fhash, checksum);
         if (retval != 0) {
             fprintf(stderr, "update_file failed\n");
             return -1;
@@ -260,23 +465,19 @@ int filecache_open_file(const char *quickkey, uint64_t local_revision,
     } else {
         /* download the file */
         retval = filecache_download_file(filecache_path, quickkey,
-                                         remote_revision, conn);
+                                         remote_revision, fsize, fhash,
+                                         checksum, conn);
         if (retval != 0) {
             fprintf(stderr, "filecache_download_file failed\n");
             return -1;
         }
     }
+    *retrieved = true;
 
-    /* check whether the patched or newly downloaded file matches the hash we
-     * have stored */
+    /* the patched or newly downloaded file was already checked against the
+     * hash we have stored */
     cachefile =
         strdup_printf("%s/%s_%d", filecache_path, quickkey, remote_revision);
-    retval = file_check_integrity(cachefile, fsize, fhash);
-    if (retval != 0) {
-        fprintf(stderr, "checking integrity failed\n");
-        free(cachefile);
-        return -1;
-    }
 
     if ((mode & O_ACCMODE) == O_RDONLY) {
         // if file is opened in readonly mode, we open it directly
@@ -303,15 +504,25 @@ int filecache_open_file(const char *quickkey, uint64_t local_revision,
     return fd;
 }
 
+/*
+ * large files are downloaded over several connections whose number depends
+ * on the throughput a single connection achieved so far
+ *
+ * the downloaded file is checked against fsize and fhash and removed if it
+ * does not match
+ */
 static int filecache_download_file(const char *filecache_path,
                                    const char *quickkey,
-                                   uint64_t remote_revision, mfconn * conn)
+                                   uint64_t remote_revision, uint64_t fsize,
+                                   const unsigned char *fhash,
+                                   uint64_t * checksum, mfconn * conn)
 {
     const char     *url;
     mffile         *file;
     mfhttp         *http;
     char           *cachefile;
     int             retval;
+    double          throughput;
 
     cachefile = strdup_printf("%s/%s_%d", filecache_path, quickkey,
                               remote_revision);
@@ -337,12 +548,27 @@ static int filecache_download_file(const char *filecache_path,
         return -1;
     }
 
+    pthread_mutex_lock(&filecache_costs_mutex);
+    throughput = filecache_costs.throughput;
+    pthread_mutex_unlock(&filecache_costs_mutex);
+
     http = http_create();
-    retval = http_get_file(http, url, cachefile);
+    retval = http_get_file_segmented(http, url, cachefile, fsize,
+                                     throughput);
+    if (retval == 0) {
+        filecache_record_transfer(http);
+        retval = filecache_check_download(http, cachefile, fsize, fhash,
+                                          checksum);
+        if (retval != 0) {
+            fprintf(stderr, "checking integrity failed\n");
+            unlink(cachefile);
+        }
+    } else {
+        fprintf(stderr, "download failed\n");
+    }
     http_destroy(http);
 
     if (retval != 0) {
-        fprintf(stderr, "download failed\n");
         free(cachefile);
         file_free(file);
         return -1;
@@ -357,13 +583,20 @@ static int filecache_download_file(const char *filecache_path,
 static int filecache_update_file(const char *filecache_path, mfconn * conn,
                                  const char *quickkey,
                                  uint64_t local_revision,
-                                 uint64_t remote_revision)
+                                 uint64_t remote_revision, uint64_t fsize,
+                                 const unsigned char *fhash,
+                                 uint64_t * checksum)
 {
     unsigned char   hash2[SHA256_DIGEST_LENGTH];
     int             retval;
     int             i;
+    int             num_patches;
     uint64_t        last_target_revision;
     char           *cachefile;
+    char           *patchfile;
+    struct timespec start;
+    struct timespec end;
+    double          elapsed;
 
     mfpatch       **patches = NULL;
 
@@ -380,7 +613,8 @@ static int filecache_update_file(const char *filecache_path, mfconn * conn,
         free(patches);
 
         retval = filecache_download_file(filecache_path, quickkey,
-                                         remote_revision, conn);
+                                         remote_revision, fsize, fhash,
+                                         checksum, conn);
         if (retval != 0) {
             fprintf(stderr, "filecache_download_file failed\n");
             return -1;
@@ -389,173 +623,334 @@ static int filecache_update_file(const char *filecache_path, mfconn * conn,
         return 0;
     }
 
+    /* verify that the patches form a chain from the local revision to the
+     * requested remote revision before downloading anything */
     last_target_revision = local_revision;
-    // else, go through all patches and download and apply them
-    for (i = 0; patches[i] != NULL; i++) {
-        /* verify that the source revision is equal to the last target
-         * revision */
-        if (patch_get_source_revision(patches[i]) != last_target_revision) {
+    for (num_patches = 0; patches[num_patches] != NULL; num_patches++) {
+        if (patch_get_source_revision(patches[num_patches])
+            != last_target_revision) {
             fprintf(stderr, "the source revision is unequal the last "
                     "target revision\n");
+            retval = -1;
             break;
         }
-        last_target_revision = patch_get_target_revision(patches[i]);
-
-        retval =
-            filecache_download_patch(conn, quickkey,
-                                     patch_get_source_revision(patches[i]),
-                                     patch_get_target_revision(patches[i]),
-                                     patch_get_hash(patches[i]),
-                                     filecache_path);
+        last_target_revision =
+            patch_get_target_revision(patches[num_patches]);
+    }
+
+    if (retval == 0 && last_target_revision != remote_revision) {
+        fprintf(stderr, "last_target_revision is not equal to the requested "
+                "remote revision\n");
+        retval = -1;
+    }
+
+    /* a long chain of patches can be more expensive than downloading the
+     * whole file again */
+    if (retval == 0
+        && !filecache_prefer_patches(quickkey, num_patches, fsize)) {
+        for (i = 0; i < num_patches; i++)
+            patch_free(patches[i]);
+        free(patches);
+
+        retval = filecache_download_file(filecache_path, quickkey,
+                                         remote_revision, fsize, fhash,
+                                         checksum, conn);
         if (retval != 0) {
-            fprintf(stderr, "filecache_download_patch failed\n");
-            break;
+            fprintf(stderr, "filecache_download_file failed\n");
+            return -1;
         }
 
-        /* verify that the file to patch has the right hash */
-        cachefile =
-            strdup_printf("%s/%s_%d", filecache_path, quickkey,
-                          patch_get_source_revision(patches[i]));
-        hex2binary(patch_get_source_hash(patches[i]), hash2);
+        return 0;
+    }
+
+    /* verify that the file to patch has the right hash */
+    if (retval == 0) {
+        cachefile = strdup_printf("%s/%s_%" PRIu64, filecache_path, quickkey,
+                                  local_revision);
+        hex2binary(patch_get_source_hash(patches[0]), hash2);
         retval = file_check_integrity_hash(cachefile, hash2);
         free(cachefile);
         if (retval != 0) {
             fprintf(stderr, "the source file has the wrong hash\n");
-            break;
         }
+    }
 
-        /* now apply the patch in patchfile to the file in cachefile */
-        retval = filecache_patch_file(filecache_path, quickkey,
-                                      patch_get_source_revision(patches[i]),
-                                      patch_get_target_revision(patches[i]));
+    /* download all patches */
+    if (retval == 0) {
+        retval = filecache_download_patches(conn, quickkey, patches,
+                                            num_patches, filecache_path,
+                                            fsize);
+        if (retval != 0) {
+            fprintf(stderr, "filecache_download_patches failed\n");
+        }
+    }
+
+    /* merge all patches and apply them to the file in cachefile at once so
+     * that no intermediate revisions have to be written out */
+    if (retval == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        retval = filecache_patch_file(filecache_path, quickkey, patches,
+                                      num_patches);
+        clock_gettime(CLOCK_MONOTONIC, &end);
         if (retval != 0) {
             fprintf(stderr, "filecache_patch_file failed\n");
-            break;
         }
+        elapsed = (end.tv_sec - start.tv_sec)
+            + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (retval == 0 && elapsed > 0 && fsize > 0) {
+            filecache_cost_sample(&filecache_costs.local_rate,
+                                  fsize / elapsed);
+        }
+    }
 
-        /* verify that the patched file has the right hash */
-        cachefile =
-            strdup_printf("%s/%s_%d", filecache_path, quickkey,
-                          patch_get_target_revision(patches[i]));
-        hex2binary(patch_get_target_hash(patches[i]), hash2);
-        retval = file_check_integrity_hash(cachefile, hash2);
-        free(cachefile);
+    /* verify that the patched file has the right hash, which must also be the
+     * hash we have stored */
+    if (retval == 0) {
+        cachefile = strdup_printf("%s/%s_%" PRIu64, filecache_path, quickkey,
+                                  remote_revision);
+        hex2binary(patch_get_target_hash(patches[num_patches - 1]), hash2);
+        if (memcmp(hash2, fhash, SHA256_DIGEST_LENGTH) != 0) {
+            fprintf(stderr, "the patches do not lead to the expected hash\n");
+            retval = -1;
+        } else {
+            retval = filecache_check_file(cachefile, fsize, fhash, checksum);
+        }
         if (retval != 0) {
             fprintf(stderr, "the target file has the wrong hash\n");
-            break;
+            unlink(cachefile);
         }
-
-        free(patches[i]);
+        free(cachefile);
     }
 
-    /* check if the terminating NULL was reached or if processing was aborted
-     * before that */
-    if (patches[i] != NULL) {
-        for (; patches[i] != NULL; i++)
-            free(patches[i]);
-        free(patches);
-        return -1;
+    /* the patches are of no use anymore once applied or after a failure
+     *
+     * num_patches stops short of the end of the list if the chain was
+     * broken, so free everything up to the terminating NULL */
+    for (i = 0; patches[i] != NULL; i++) {
+        patchfile = strdup_printf("%s/%s_patch_%" PRIu64 "_%" PRIu64,
+                                  filecache_path, quickkey,
+                                  patch_get_source_revision(patches[i]),
+                                  patch_get_target_revision(patches[i]));
+        unlink(patchfile);
+        free(patchfile);
+        patch_free(patches[i]);
     }
-
     free(patches);
 
-    /* verify that the last target revision is equal to the requested remote
-     * revision */
-    if (last_target_revision != remote_revision) {
-        fprintf(stderr, "last_target_revision is not equal to the requested "
-                "remote revision\n");
+    if (retval != 0)
         return -1;
-    }
 
     return 0;
 }
 
-static int filecache_download_patch(mfconn * conn, const char *quickkey,
-                                    uint64_t source_revision,
-                                    uint64_t target_revision,
-                                    const char *phash,
-                                    const char *filecache_path)
+/*
+ * retrieve the links of all patches in the chain and download them
+ *
+ * The device/get_patch calls are done one after the other because every
+ * signed call depends on the secret key of the previous one. The downloads
+ * themselves are not signed, so they are all handed to the transfer engine
+ * at once and run concurrently.
+ */
+static int filecache_download_patches(mfconn * conn, const char *quickkey,
+                                      mfpatch ** patches, int num_patches,
+                                      const char *filecache_path,
+                                      uint64_t fsize)
 {
-    mfpatch        *patch;
-    const char     *url;
-    mfhttp         *http;
+    mfpatch       **links;
+    mfhttp        **https;
+    char          **patchfiles;
     int             retval;
-    char           *patchfile;
+    int             i;
     unsigned char   hash2[SHA256_DIGEST_LENGTH];
 
-    /* first retrieve the patch url */
-    patch = patch_alloc();
-    retval = mfconn_api_device_get_patch(conn, patch, quickkey,
-                                         source_revision, target_revision);
+    links = (mfpatch **) calloc(num_patches, sizeof(mfpatch *));
+    https = (mfhttp **) calloc(num_patches, sizeof(mfhttp *));
+    patchfiles = (char **)calloc(num_patches, sizeof(char *));
+
+    /* first retrieve the patch urls */
+    retval = 0;
+    for (i = 0; retval == 0 && i < num_patches; i++) {
+        links[i] = patch_alloc();
+        retval = mfconn_api_device_get_patch(conn, links[i], quickkey,
+                                             patch_get_source_revision
+                                             (patches[i]),
+                                             patch_get_target_revision
+                                             (patches[i]));
+        if (retval != 0) {
+            fprintf(stderr, "mfconn_api_device_get_patch failed\n");
+            break;
+        }
 
-    if (retval != 0) {
-        fprintf(stderr, "mfconn_api_device_get_patch failed\n");
-        patch_free(patch);
-        return -1;
+        /* verify if the retrieved patch hash is the expected patch hash */
+        if (strcmp(patch_get_hash(patches[i]), patch_get_hash(links[i]))
+            != 0) {
+            fprintf(stderr, "the expected patch hash is not equal the hash "
+                    "returned by device/get_patch\n");
+            retval = -1;
+            break;
+        }
+
+        if (patch_get_link(links[i]) == NULL
+            || patch_get_link(links[i])[0] == '\0') {
+            fprintf(stderr, "patch_get_link failed\n");
+            retval = -1;
+            break;
+        }
+
+        patchfiles[i] = strdup_printf("%s/%s_patch_%" PRIu64 "_%" PRIu64,
+                                      filecache_path, quickkey,
+                                      patch_get_source_revision(patches[i]),
+                                      patch_get_target_revision(patches[i]));
     }
 
-    /* verify if the retrieved patch hash is the expected patch hash */
-    if (strcmp(phash, patch_get_hash(patch)) != 0) {
-        fprintf(stderr, "the expected patch hash is not equal the hash "
-                "returned by device/get_patch\n");
-        patch_free(patch);
-        return -1;
+    /* then start all downloads */
+    for (i = 0; retval == 0 && i < num_patches; i++) {
+        https[i] = http_create();
+        if (http_get_file_async(https[i], patch_get_link(links[i]),
+                                patchfiles[i], NULL, NULL) != 0) {
+            fprintf(stderr, "cannot start download\n");
+            http_destroy(https[i]);
+            https[i] = NULL;
+            retval = -1;
+        }
     }
 
-    /* then download the patch */
-    url = patch_get_link(patch);
+    /* and wait for all of them, including the ones that were started before
+     * a failure */
+    for (i = 0; i < num_patches; i++) {
+        if (https[i] == NULL)
+            continue;
+        if (http_wait(https[i]) == 0) {
+            filecache_record_transfer(https[i]);
+            hex2binary(patch_get_hash(links[i]), hash2);
+            if (retval == 0
+                && filecache_check_download(https[i], patchfiles[i], -1,
+                                            hash2, NULL) != 0) {
+                fprintf(stderr, "the patch has the wrong hash\n");
+                retval = -1;
+            }
+            if (fsize > 0) {
+                filecache_cost_sample(&filecache_costs.patch_ratio,
+                                      http_get_download_size(https[i])
+                                      / fsize);
+            }
+        } else {
+            fprintf(stderr, "download failed\n");
+            retval = -1;
+        }
+        http_destroy(https[i]);
+    }
 
-    if (url == NULL || url[0] == '\0') {
-        fprintf(stderr, "patch_get_link failed\n");
-        patch_free(patch);
-        return -1;
+    for (i = 0; i < num_patches; i++) {
+        if (links[i] != NULL)
+            patch_free(links[i]);
+        free(patchfiles[i]);
     }
+    free(links);
+    free(https);
+    free(patchfiles);
 
-    patchfile =
-        strdup_printf("%s/%s_patch_%d_%d", filecache_path, quickkey,
-                      source_revision, target_revision);
+    if (retval != 0)
+        return -1;
 
-    http = http_create();
-    retval = http_get_file(http, url, patchfile);
-    http_destroy(http);
+    return 0;
+}
 
-    if (retval != 0) {
-        fprintf(stderr, "download failed\n");
-        free(patchfile);
-        patch_free(patch);
+/*
+ * compare the hash and size of a file with the expected hash and, unless it
+ * is negative, the expected size
+ */
+static int filecache_compare_hash(const unsigned char *hash, uint64_t size,
+                                  int64_t fsize, const unsigned char *fhash)
+{
+    char           *hexhash;
+
+    if (fsize >= 0 && size != (uint64_t) fsize) {
+        fprintf(stderr, "expected %" PRId64 " bytes but got %" PRIu64 "\n",
+                fsize, size);
         return -1;
     }
 
-    /* verify the integrity of the patch */
-    hex2binary(patch_get_hash(patch), hash2);
-    retval = file_check_integrity_hash(patchfile, hash2);
-
-    if (retval != 0) {
-        fprintf(stderr, "file_check_integrity_hash failed for patch\n");
-        patch_free(patch);
+    if (memcmp(fhash, hash, SHA256_DIGEST_LENGTH) != 0) {
+        fprintf(stderr, "hashes are not equal\n");
+        hexhash = binary2hex(fhash, SHA256_DIGEST_LENGTH);
+        fprintf(stderr, "remote:     %s\n", hexhash);
+        free(hexhash);
+        hexhash = binary2hex(hash, SHA256_DIGEST_LENGTH);
+        fprintf(stderr, "downloaded: %s\n", hexhash);
+        free(hexhash);
         return -1;
     }
 
-    patch_free(patch);
+    return 0;
+}
+
+/*
+ * check a file against the expected hash and, unless it is negative, the
+ * expected size and store its fast checksum in checksum unless that is NULL
+ */
+static int filecache_check_file(const char *path, int64_t fsize,
+                                const unsigned char *fhash,
+                                uint64_t * checksum)
+{
+    struct hash_file file;
+
+    memset(&file, 0, sizeof(file));
+    file.path = path;
+    hash_files(&file, 1, 1);
+    if (file.retval != 0)
+        return -1;
+
+    if (filecache_compare_hash(file.hash, file.size, fsize, fhash) != 0)
+        return -1;
+
+    if (checksum != NULL)
+        *checksum = file.checksum;
+
+    return 0;
+}
+
+/*
+ * check a finished download like filecache_check_file
+ *
+ * The hash and checksum that were computed while the data arrived are used
+ * if there are any. Only otherwise the file is read again.
+ */
+static int filecache_check_download(mfhttp * http, const char *path,
+                                    int64_t fsize, const unsigned char *fhash,
+                                    uint64_t * checksum)
+{
+    unsigned char   hash[SHA256_DIGEST_LENGTH];
+    uint64_t        sum;
+    uint64_t        size;
+
+    if (http_get_file_hash(http, hash, &sum, &size) != 0)
+        return filecache_check_file(path, fsize, fhash, checksum);
+
+    if (filecache_compare_hash(hash, size, fsize, fhash) != 0)
+        return -1;
+
+    if (checksum != NULL)
+        *checksum = sum;
 
     return 0;
 }
 
 static int filecache_patch_file(const char *filecache_path,
-                                const char *quickkey,
-                                uint64_t source_revision,
-                                uint64_t target_revision)
+                                const char *quickkey, mfpatch ** patches,
+                                int num_patches)
 {
     char           *patchfile;
     char           *sourcefile;
     char           *targetfile;
     FILE           *sourcefile_fh;
-    FILE           *patchfile_fh;
+    FILE          **patchfile_fhs;
     FILE           *targetfile_fh;
     int             retval;
+    int             i;
 
-    sourcefile =
-        strdup_printf("%s/%s_%d", filecache_path, quickkey, source_revision);
+    sourcefile = strdup_printf("%s/%s_%" PRIu64, filecache_path, quickkey,
+                               patch_get_source_revision(patches[0]));
     sourcefile_fh = fopen(sourcefile, "r");
     if (sourcefile_fh == NULL) {
         fprintf(stderr, "cannot open %s\n", sourcefile);
@@ -565,44 +960,123 @@ static int filecache_patch_file(const char *filecache_path,
 
     free(sourcefile);
 
-    patchfile =
-        strdup_printf("%s/%s_patch_%d_%d", filecache_path, quickkey,
-                      source_revision, target_revision);
-    patchfile_fh = fopen(patchfile, "r");
-    if (patchfile_fh == NULL) {
-        fprintf(stderr, "cannot open %s\n", patchfile);
+    patchfile_fhs = (FILE **) calloc(num_patches, sizeof(FILE *));
+    for (i = 0; i < num_patches; i++) {
+        patchfile = strdup_printf("%s/%s_patch_%" PRIu64 "_%" PRIu64,
+                                  filecache_path, quickkey,
+                                  patch_get_source_revision(patches[i]),
+                                  patch_get_target_revision(patches[i]));
+        patchfile_fhs[i] = fopen(patchfile, "r");
+        if (patchfile_fhs[i] == NULL) {
+            fprintf(stderr, "cannot open %s\n", patchfile);
+            free(patchfile);
+            break;
+        }
         free(patchfile);
+    }
+
+    if (i != num_patches) {
+        while (i-- > 0)
+            fclose(patchfile_fhs[i]);
+        free(patchfile_fhs);
         fclose(sourcefile_fh);
         return -1;
     }
 
-    free(patchfile);
-
-    targetfile =
-        strdup_printf("%s/%s_%d", filecache_path, quickkey, target_revision);
-    targetfile_fh = fopen(targetfile, "w");
+    // the target file is read back from for target copies
+    targetfile = strdup_printf("%s/%s_%" PRIu64, filecache_path, quickkey,
+                               patch_get_target_revision(patches
+                                                         [num_patches - 1]));
+    targetfile_fh = fopen(targetfile, "w+");
     if (targetfile_fh == NULL) {
         fprintf(stderr, "cannot open %s\n", targetfile);
         fclose(sourcefile_fh);
-        fclose(patchfile_fh);
+        for (i = 0; i < num_patches; i++)
+            fclose(patchfile_fhs[i]);
+        free(patchfile_fhs);
         free(targetfile);
         return -1;
     }
 
-    free(targetfile);
+    retval = xdelta3_patch_chain(sourcefile_fh, patchfile_fhs, num_patches,
+                                 targetfile_fh);
+
+    fclose(sourcefile_fh);
+    for (i = 0; i < num_patches; i++)
+        fclose(patchfile_fhs[i]);
+    free(patchfile_fhs);
+    fclose(targetfile_fh);
 
-    retval = xdelta3_patch(sourcefile_fh, patchfile_fh, targetfile_fh);
     if (retval != 0) {
         fprintf(stderr, "unable to patch\n");
-        fclose(sourcefile_fh);
-        fclose(patchfile_fh);
-        fclose(targetfile_fh);
+        unlink(targetfile);
+        free(targetfile);
         return -1;
     }
 
-    fclose(sourcefile_fh);
-    fclose(patchfile_fh);
-    fclose(targetfile_fh);
+    free(targetfile);
 
     return 0;
 }
+
+/*
+ * decide whether applying num_patches patches is cheaper than downloading the
+ * file of size fsize anew
+ *
+ * Downloading takes a file/get_links call and the transfer of the whole file.
+ * Patching takes a device/get_patch call for every patch in the chain, one
+ * round of concurrent patch transfers sharing the bandwidth and three passes
+ * over the file locally: checking the source hash, applying the merged patch
+ * and checking the target hash.
+ */
+static bool filecache_prefer_patches(const char *quickkey, int num_patches,
+                                     uint64_t fsize)
+{
+    struct filecache_costs costs;
+    double          patch_cost;
+    double          download_cost;
+
+    pthread_mutex_lock(&filecache_costs_mutex);
+    costs = filecache_costs;
+    pthread_mutex_unlock(&filecache_costs_mutex);
+
+    patch_cost = (num_patches + 1) * costs.latency
+        + num_patches * costs.patch_ratio * fsize / costs.throughput
+        + 3.0 * fsize / costs.local_rate;
+    download_cost = 2 * costs.latency + fsize / costs.throughput;
+
+    fprintf(stderr, "%s: %d patches estimated at %.3f s, download of %"
+            PRIu64 " bytes estimated at %.3f s (latency %.3f s, "
+            "throughput %.0f B/s, patch ratio %.3f, local %.0f B/s) - %s\n",
+            quickkey, num_patches, patch_cost, fsize, download_cost,
+            costs.latency, costs.throughput, costs.patch_ratio,
+            costs.local_rate,
+            patch_cost <= download_cost ? "patching" : "downloading");
+
+    return patch_cost <= download_cost;
+}
+
+// update the latency and throughput estimates from a finished transfer
+static void filecache_record_transfer(mfhttp * http)
+{
+    double          latency;
+    double          speed;
+
+    latency = http_get_latency(http);
+    if (latency > 0)
+        filecache_cost_sample(&filecache_costs.latency, latency);
+
+    speed = http_get_download_speed(http);
+    if (speed > 0
+        && http_get_download_size(http) >= FILECACHE_MIN_THROUGHPUT_SAMPLE) {
+        filecache_cost_sample(&filecache_costs.throughput, speed);
+    }
+}
+
+// move one of the filecache_costs estimates towards a new sample
+static void filecache_cost_sample(double *estimate, double sample)
+{
+    pthread_mutex_lock(&filecache_costs_mutex);
+    *estimate += FILECACHE_COST_WEIGHT * (sample - *estimate);
+    pthread_mutex_unlock(&filecache_costs_mutex);
+}
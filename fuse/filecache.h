@@ -19,15 +19,34 @@
 #ifndef __FUSE_FILECACHE_H__
 #define __FUSE_FILECACHE_H__
 
+/*
+ * cached files are spread over two levels of subdirectories named after the
+ * first two characters of their quickkey. The functions below taking a
+ * filecache argument expect the subdirectory for the given quickkey.
+ */
+#define FILECACHE_NUM_SHARDS (36 * 36)
+
+int             filecache_init(const char *filecache);
+
+char           *filecache_shard_path(const char *filecache,
+                                     const char *quickkey);
+
+char           *filecache_shard_path_by_index(const char *filecache,
+                                              int index);
+
 int             filecache_open_file(const char *quickkey,
                                     uint64_t local_revision,
                                     uint64_t remote_revision, uint64_t fsize,
                                     const unsigned char *fhash,
                                     const char *filecache, mfconn * conn,
-                                    mode_t mode, bool update);
+                                    mode_t mode, bool update,
+                                    bool * retrieved, uint64_t * checksum);
 
 int             filecache_upload_patch(const char *quickkey,
                                        uint64_t local_revision,
+                                       const unsigned char *source_fhash,
+                                       const unsigned char *target_fhash,
+                                       uint64_t target_fsize,
                                        const char *filecache, mfconn * conn);
 
 #endif
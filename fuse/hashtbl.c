@@ -39,15 +39,18 @@
 #include <dirent.h>
 #include <ctype.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "hashtbl.h"
 #include "filecache.h"
 #include "../mfapi/mfconn.h"
 #include "../mfapi/file.h"
 #include "../mfapi/folder.h"
+#include "../mfapi/listing.h"
 #include "../mfapi/apicalls.h"
 #include "../utils/strings.h"
 #include "../utils/hash.h"
+#include "../utils/stringv.h"
 
 /*
  * we build a hashtable using the first three characters of the file or folder
@@ -56,6 +59,16 @@
  */
 #define NUM_BUCKETS 46656
 
+/* at most this many folders are listed in parallel when relisting the known
+ * folders, but not more than there are sessions */
+#define FOLDER_TREE_LIST_THREADS 8
+/* folders whose listings are held in memory at the same time */
+#define FOLDER_TREE_LIST_GROUP 64
+/* entries per folder/get_content call */
+#define FOLDER_TREE_CHUNK_SIZE 1000
+/* revisions per device/get_changes call */
+#define FOLDER_TREE_CHANGES_BLOCK 500
+
 struct h_entry {
     /*
      * keys are either 13 (folders) or 15 (files) long since the structure
@@ -110,6 +123,11 @@ struct h_entry {
     uint64_t        atime;
     /* file size */
     uint64_t        fsize;
+    /* fast checksum of the cached file to detect damage on disk without
+     * computing the SHA256 again. It is only valid if checksum_revision is
+     * equal to local_revision */
+    uint64_t        checksum;
+    uint64_t        checksum_revision;
 };
 
 /*
@@ -144,15 +162,24 @@ static struct h_entry *folder_tree_allocate_entry(folder_tree * tree,
                                                   struct h_entry *new_parent);
 static struct h_entry *folder_tree_add_file(folder_tree * tree, mffile * file,
                                             struct h_entry *new_parent);
+static struct h_entry *folder_tree_add_file_item(folder_tree * tree,
+                                                 const struct mflisting_entry
+                                                 *item,
+                                                 struct h_entry *new_parent);
 static struct h_entry *folder_tree_add_folder(folder_tree * tree,
                                               mffolder * folder,
                                               struct h_entry *new_parent);
+static struct h_entry *folder_tree_add_folder_item(folder_tree * tree,
+                                                   const struct
+                                                   mflisting_entry *item,
+                                                   struct h_entry *new_parent);
 static void     folder_tree_remove(folder_tree * tree, const char *key);
 static bool     folder_tree_is_parent_of(struct h_entry *parent,
                                          struct h_entry *child);
 static bool     is_valid_cache_filename(const char *name, char key[],
-                                        uint64_t * revision);
+                                        uint64_t * revision, bool * partial);
 static int      atime_compare(const void *a, const void *b);
+static int      fsize_compare_desc(const void *a, const void *b);
 
 /* functions with remote access */
 static struct h_entry *folder_tree_lookup_path(folder_tree * tree,
@@ -160,17 +187,30 @@ static struct h_entry *folder_tree_lookup_path(folder_tree * tree,
                                                const char *path);
 static int      folder_tree_rebuild_helper(folder_tree * tree, mfconn * conn,
                                            struct h_entry *curr_entry);
+static void     folder_tree_store_content(folder_tree * tree,
+                                          struct h_entry *curr_entry,
+                                          mflisting * folders,
+                                          mflisting * files);
+static int      folder_tree_relist(folder_tree * tree, mfconn * conn);
+static int      folder_tree_apply_changes(struct mfconn_device_change
+                                          *changes, void *user_ptr);
 static int      folder_tree_update_file_info(folder_tree * tree, mfconn * conn,
                                              const char *key);
 static int      folder_tree_update_folder_info(folder_tree * tree,
                                                mfconn * conn, const char *key);
+static int      folder_tree_store_file_info(folder_tree * tree, mfconn * conn,
+                                            const char *key, mffile * file,
+                                            int retval);
+static int      folder_tree_store_folder_info(folder_tree * tree,
+                                              mfconn * conn, const char *key,
+                                              mffolder * folder, int retval);
 
 /* persistant storage file layout:
  *
  * byte 0: 0x4D -> ASCII M
  * byte 1: 0x46 -> ASCII F
  * byte 2: 0x53 -> ASCII S  --> MFS == MediaFire Storage
- * byte 3: 0x00 -> version information
+ * byte 3: 0x01 -> version information
  * bytes 4-11   -> last seen device revision
  * bytes 12-19  -> number of h_entry structs including root (num_hts)
  * bytes 20...  -> h_entry structs, the first one being root
@@ -220,7 +260,7 @@ int folder_tree_store(folder_tree * tree, FILE * stream)
     }
 
     /* write four header bytes */
-    ret = fwrite("MFS\0", 1, 4, stream);
+    ret = fwrite("MFS\1", 1, 4, stream);
     if (ret != 4) {
         fprintf(stderr, "cannot fwrite\n");
         return -1;
@@ -317,7 +357,7 @@ folder_tree    *folder_tree_load(FILE * stream, const char *filecache)
     }
 
     if (tmp_buffer[0] != 'M' || tmp_buffer[1] != 'F'
-        || tmp_buffer[2] != 'S' || tmp_buffer[3] != 0) {
+        || tmp_buffer[2] != 'S' || tmp_buffer[3] != 1) {
         fprintf(stderr, "invalid magic\n");
         return NULL;
     }
@@ -487,6 +527,9 @@ static struct h_entry *folder_tree_lookup_key(folder_tree * tree,
  * given a path, return the h_entry struct of the last component
  *
  * the path must start with a slash
+ *
+ * if conn is NULL (offline mode), the contents of folders that are out of
+ * date are not retrieved and the stored state is used instead
  */
 static struct h_entry *folder_tree_lookup_path(folder_tree * tree,
                                                mfconn * conn, const char *path)
@@ -516,8 +559,8 @@ static struct h_entry *folder_tree_lookup_path(folder_tree * tree,
     result = NULL;
 
     for (;;) {
-        // make sure that curr_dir is up to date
-        if (curr_dir->atime == 0
+        // make sure that curr_dir is up to date unless running offline
+        if (conn != NULL && curr_dir->atime == 0
             && curr_dir->local_revision != curr_dir->remote_revision) {
             folder_tree_rebuild_helper(tree, conn, curr_dir);
         }
@@ -537,7 +580,7 @@ static struct h_entry *folder_tree_lookup_path(folder_tree * tree,
                     result = curr_dir->children[i];
 
                     // make sure that result is up to date
-                    if (result->atime == 0
+                    if (conn != NULL && result->atime == 0
                         && result->local_revision != result->remote_revision) {
                         folder_tree_rebuild_helper(tree, conn, result);
                     }
@@ -723,6 +766,97 @@ int folder_tree_readdir(folder_tree * tree, mfconn * conn, const char *path,
     return 0;
 }
 
+/*
+ * recursively append the paths of all files below entry whose cached
+ * revision differs from their remote revision to paths
+ */
+static int folder_tree_collect_outdated_helper(folder_tree * tree,
+                                               mfconn * conn,
+                                               struct h_entry *entry,
+                                               const char *path,
+                                               stringv * paths)
+{
+    struct h_entry *child;
+    char           *child_path;
+    uint64_t        i;
+    int             retval;
+
+    if (conn != NULL && entry->local_revision != entry->remote_revision) {
+        retval = folder_tree_rebuild_helper(tree, conn, entry);
+        if (retval != 0) {
+            fprintf(stderr, "folder_tree_rebuild_helper failed\n");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < entry->num_children; i++) {
+        child = entry->children[i];
+        // the root path already ends with a slash
+        if (path[1] == '\0')
+            child_path = strdup_printf("/%s", child->name);
+        else
+            child_path = strdup_printf("%s/%s", path, child->name);
+
+        if (child->atime == 0) {
+            retval = folder_tree_collect_outdated_helper(tree, conn, child,
+                                                         child_path, paths);
+        } else if (child->local_revision != child->remote_revision) {
+            retval = stringv_add(paths, child_path);
+        } else {
+            retval = 0;
+        }
+        free(child_path);
+        if (retval != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * append the paths of all files below the folder with the given key that are
+ * not cached at their current remote revision to paths
+ */
+int folder_tree_collect_outdated(folder_tree * tree, mfconn * conn,
+                                 const char *key, stringv * paths)
+{
+    struct h_entry *entry;
+    struct h_entry *parent;
+    char           *path;
+    char           *tmp;
+    int             retval;
+
+    entry = folder_tree_lookup_key(tree, key);
+    if (entry == NULL || entry->atime != 0) {
+        fprintf(stderr, "%s is not a known folder\n", key);
+        return -1;
+    }
+
+    // assemble the path of the folder by following its parents to the root
+    path = strdup("");
+    for (parent = entry; parent != NULL && parent != &(tree->root);
+         parent = parent->parent) {
+        tmp = strdup_printf("/%s%s", parent->name, path);
+        free(path);
+        path = tmp;
+    }
+    if (parent == NULL) {
+        fprintf(stderr, "%s is not connected to the root\n", key);
+        free(path);
+        return -1;
+    }
+    if (path[0] == '\0') {
+        free(path);
+        path = strdup("/");
+    }
+
+    retval = folder_tree_collect_outdated_helper(tree, conn, entry, path,
+                                                 paths);
+    free(path);
+
+    return retval;
+}
+
 int folder_tree_tmp_open(folder_tree * tree)
 {
     char           *tmpfilename;
@@ -745,11 +879,18 @@ int folder_tree_tmp_open(folder_tree * tree)
     return fd;
 }
 
+/*
+ * fhash and fsize are the SHA256 and the size of the changed file if they
+ * are known or NULL and zero otherwise
+ */
 int folder_tree_upload_patch(folder_tree * tree, mfconn * conn,
-                             const char *path)
+                             const char *path, const unsigned char *fhash,
+                             uint64_t fsize)
 {
     struct h_entry *entry;
     int             retval;
+    char           *shard;
+    const unsigned char *source_fhash;
 
     entry = folder_tree_lookup_path(tree, conn, path);
     /* either file not found or found entry is not a file */
@@ -757,8 +898,16 @@ int folder_tree_upload_patch(folder_tree * tree, mfconn * conn,
         return -ENOENT;
     }
 
+    // the cached file was checked against the hash of the remote revision
+    // when it was retrieved
+    source_fhash = NULL;
+    if (entry->local_revision == entry->remote_revision)
+        source_fhash = entry->hash;
+
+    shard = filecache_shard_path(tree->filecache, entry->key);
     retval = filecache_upload_patch(entry->key, entry->local_revision,
-                                    tree->filecache, conn);
+                                    source_fhash, fhash, fsize, shard, conn);
+    free(shard);
 
     if (retval != 0) {
         fprintf(stderr, "filecache_upload_patch failed\n");
@@ -773,6 +922,9 @@ int folder_tree_open_file(folder_tree * tree, mfconn * conn, const char *path,
 {
     struct h_entry *entry;
     int             retval;
+    char           *shard;
+    bool            retrieved;
+    uint64_t        checksum;
 
     entry = folder_tree_lookup_path(tree, conn, path);
 
@@ -783,10 +935,12 @@ int folder_tree_open_file(folder_tree * tree, mfconn * conn, const char *path,
     fprintf(stderr, "opening %s with local %" PRIu64 " and remote %" PRIu64
             "\n", entry->key, entry->local_revision, entry->remote_revision);
 
+    shard = filecache_shard_path(tree->filecache, entry->key);
     retval = filecache_open_file(entry->key, entry->local_revision,
                                  entry->remote_revision, entry->fsize,
-                                 entry->hash, tree->filecache, conn, mode,
-                                 update);
+                                 entry->hash, shard, conn, mode, update,
+                                 &retrieved, &checksum);
+    free(shard);
     if (retval == -1) {
         fprintf(stderr, "filecache_open_file failed\n");
         return -1;
@@ -798,12 +952,132 @@ int folder_tree_open_file(folder_tree * tree, mfconn * conn, const char *path,
          * was necessary */
         entry->local_revision = entry->remote_revision;
     }
+    if (retrieved) {
+        entry->checksum = checksum;
+        entry->checksum_revision = entry->local_revision;
+    }
     // however the file was opened, its access time has to be updated
     entry->atime = time(NULL);
 
     return retval;
 }
 
+/*
+ * Bringing a file up to date with folder_tree_open_file needs the tree for
+ * the whole transfer. A fetch instead takes what is needed from the entry in
+ * folder_tree_fetch_prepare, does the transfer in folder_tree_fetch_run
+ * without touching the tree and writes the result back into the entry in
+ * folder_tree_fetch_commit. Only preparing and committing need exclusive
+ * access to the tree, so the transfer can run while other threads use it.
+ */
+struct folder_tree_fetch {
+    char            key[MFAPI_MAX_LEN_KEY + 1];
+    uint64_t        local_revision;
+    uint64_t        remote_revision;
+    uint64_t        fsize;
+    unsigned char   hash[SHA256_DIGEST_LENGTH];
+    char           *shard;
+    // filled in by folder_tree_fetch_run
+    int             retval;
+    bool            retrieved;
+    uint64_t        checksum;
+};
+
+/*
+ * returns NULL if path is not a file or if it is already cached at its
+ * remote revision
+ */
+folder_tree_fetch *folder_tree_fetch_prepare(folder_tree * tree,
+                                             mfconn * conn, const char *path)
+{
+    struct h_entry *entry;
+    folder_tree_fetch *fetch;
+
+    entry = folder_tree_lookup_path(tree, conn, path);
+    if (entry == NULL || entry->atime == 0)
+        return NULL;
+
+    if (entry->local_revision == entry->remote_revision)
+        return NULL;
+
+    fetch = (folder_tree_fetch *) calloc(1, sizeof(folder_tree_fetch));
+    memcpy(fetch->key, entry->key, sizeof(fetch->key));
+    fetch->local_revision = entry->local_revision;
+    fetch->remote_revision = entry->remote_revision;
+    fetch->fsize = entry->fsize;
+    memcpy(fetch->hash, entry->hash, sizeof(fetch->hash));
+    fetch->shard = filecache_shard_path(tree->filecache, entry->key);
+    fetch->retval = -1;
+
+    return fetch;
+}
+
+int folder_tree_fetch_run(folder_tree_fetch * fetch, mfconn * conn)
+{
+    int             fd;
+
+    fprintf(stderr, "fetching %s with local %" PRIu64 " and remote %" PRIu64
+            "\n", fetch->key, fetch->local_revision, fetch->remote_revision);
+
+    fd = filecache_open_file(fetch->key, fetch->local_revision,
+                             fetch->remote_revision, fetch->fsize,
+                             fetch->hash, fetch->shard, conn, O_RDONLY, true,
+                             &(fetch->retrieved), &(fetch->checksum));
+    if (fd < 0) {
+        fprintf(stderr, "filecache_open_file failed\n");
+        fetch->retval = -1;
+        return -1;
+    }
+    close(fd);
+
+    fetch->retval = 0;
+
+    return 0;
+}
+
+/*
+ * record a successful fetch in the entry of its file
+ *
+ * The tree may have changed during the transfer. If the file was removed in
+ * the meantime, the retrieved revision is removed from the cache again. If
+ * its cached revision changed, the fetch is ignored.
+ */
+void folder_tree_fetch_commit(folder_tree * tree, folder_tree_fetch * fetch)
+{
+    struct h_entry *entry;
+    char           *cachefile;
+
+    if (fetch->retval != 0)
+        return;
+
+    entry = folder_tree_lookup_key(tree, fetch->key);
+    if (entry == NULL || entry->atime == 0) {
+        if (fetch->retrieved) {
+            cachefile = strdup_printf("%s/%s_%" PRIu64, fetch->shard,
+                                      fetch->key, fetch->remote_revision);
+            unlink(cachefile);
+            free(cachefile);
+        }
+        return;
+    }
+
+    if (entry->local_revision != fetch->local_revision)
+        return;
+
+    entry->local_revision = fetch->remote_revision;
+    if (fetch->retrieved) {
+        entry->checksum = fetch->checksum;
+        entry->checksum_revision = entry->local_revision;
+    }
+    entry->atime = time(NULL);
+}
+
+void folder_tree_fetch_free(folder_tree_fetch * fetch)
+{
+    free(fetch->shard);
+    free(fetch);
+}
+
 static bool folder_tree_is_root(struct h_entry *entry)
 {
     if (entry == NULL) {
@@ -956,53 +1230,69 @@ static struct h_entry *folder_tree_allocate_entry(folder_tree * tree,
  */
 static struct h_entry *folder_tree_add_file(folder_tree * tree, mffile * file,
                                             struct h_entry *new_parent)
+{
+    struct mflisting_entry item;
+
+    if (file == NULL) {
+        fprintf(stderr, "file cannot be NULL\n");
+        return NULL;
+    }
+
+    memset(&item, 0, sizeof(item));
+    strncpy(item.key, file_get_key(file), sizeof(item.key) - 1);
+    item.name = file_get_name(file);
+    item.revision = file_get_revision(file);
+    item.created = file_get_created(file);
+    item.size = file_get_size(file);
+    /* convert the hex string into its binary representation */
+    hex2binary(file_get_hash(file), item.hash);
+
+    return folder_tree_add_file_item(tree, &item, new_parent);
+}
+
+/* same as folder_tree_add_file but for an entry of a folder listing */
+static struct h_entry *folder_tree_add_file_item(folder_tree * tree,
+                                                 const struct mflisting_entry
+                                                 *item,
+                                                 struct h_entry *new_parent)
 {
     struct h_entry *old_entry;
     struct h_entry *new_entry;
     uint64_t        old_revision;
-    const char     *key;
 
     if (tree == NULL) {
         fprintf(stderr, "tree cannot be NULL\n");
         return NULL;
     }
 
-    if (file == NULL) {
-        fprintf(stderr, "file cannot be NULL\n");
-        return NULL;
-    }
-
     if (new_parent == NULL) {
         fprintf(stderr, "new parent cannot be NULL\n");
         return NULL;
     }
 
-    key = file_get_key(file);
-
     /* if the file already existed in the hashtable, store its old revision
      * so that we can schedule an update of its content at the end of this
      * function */
-    old_entry = folder_tree_lookup_key(tree, key);
+    old_entry = folder_tree_lookup_key(tree, item->key);
     if (old_entry != NULL) {
         old_revision = old_entry->local_revision;
     }
 
-    new_entry = folder_tree_allocate_entry(tree, key, new_parent);
+    new_entry = folder_tree_allocate_entry(tree, item->key, new_parent);
 
-    strncpy(new_entry->key, key, sizeof(new_entry->key));
-    strncpy(new_entry->name, file_get_name(file), sizeof(new_entry->name));
+    strncpy(new_entry->key, item->key, sizeof(new_entry->key));
+    strncpy(new_entry->name, item->name, sizeof(new_entry->name));
     new_entry->parent = new_parent;
-    new_entry->remote_revision = file_get_revision(file);
-    new_entry->ctime = file_get_created(file);
-    new_entry->fsize = file_get_size(file);
+    new_entry->remote_revision = item->revision;
+    new_entry->ctime = item->created;
+    new_entry->fsize = item->size;
     if (old_entry != NULL) {
         new_entry->local_revision = old_revision;
     } else {
         new_entry->local_revision = 0;
     }
 
-    /* convert the hex string into its binary representation */
-    hex2binary(file_get_hash(file), new_entry->hash);
+    memcpy(new_entry->hash, item->hash, sizeof(new_entry->hash));
 
     /* mark this h_entry struct as a file if its atime is not set yet */
     if (new_entry->atime == 0)
@@ -1022,10 +1312,39 @@ static struct h_entry *folder_tree_add_file(folder_tree * tree, mffile * file,
 static struct h_entry *folder_tree_add_folder(folder_tree * tree,
                                               mffolder * folder,
                                               struct h_entry *new_parent)
+{
+    struct mflisting_entry item;
+    const char     *key;
+
+    if (folder == NULL) {
+        fprintf(stderr, "folder cannot be NULL\n");
+        return NULL;
+    }
+
+    memset(&item, 0, sizeof(item));
+    /* can be NULL for root */
+    key = folder_get_key(folder);
+    if (key != NULL)
+        strncpy(item.key, key, sizeof(item.key) - 1);
+    item.name = folder_get_name(folder);
+    item.revision = folder_get_revision(folder);
+    item.created = folder_get_created(folder);
+
+    return folder_tree_add_folder_item(tree, &item, new_parent);
+}
+
+/*
+ * same as folder_tree_add_folder but for an entry of a folder listing
+ *
+ * an empty key stands for the root
+ */
+static struct h_entry *folder_tree_add_folder_item(folder_tree * tree,
+                                                   const struct
+                                                   mflisting_entry *item,
+                                                   struct h_entry *new_parent)
 {
     struct h_entry *new_entry;
     const char     *key;
-    const char     *name;
     uint64_t        old_revision;
     struct h_entry *old_entry;
 
@@ -1034,17 +1353,12 @@ static struct h_entry *folder_tree_add_folder(folder_tree * tree,
         return NULL;
     }
 
-    if (folder == NULL) {
-        fprintf(stderr, "folder cannot be NULL\n");
-        return NULL;
-    }
-
     if (new_parent == NULL) {
         fprintf(stderr, "new parent cannot be NULL\n");
         return NULL;
     }
 
-    key = folder_get_key(folder);
+    key = item->key[0] != '\0' ? item->key : NULL;
 
     /* if the folder already existed in the hashtable, store its old revision
      * so that we can schedule an update of its content at the end of this
@@ -1060,11 +1374,10 @@ static struct h_entry *folder_tree_add_folder(folder_tree * tree,
     if (key != NULL)
         strncpy(new_entry->key, key, sizeof(new_entry->key));
     /* can be NULL for root */
-    name = folder_get_name(folder);
-    if (name != NULL)
-        strncpy(new_entry->name, name, sizeof(new_entry->name));
-    new_entry->remote_revision = folder_get_revision(folder);
-    new_entry->ctime = folder_get_created(folder);
+    if (item->name != NULL)
+        strncpy(new_entry->name, item->name, sizeof(new_entry->name));
+    new_entry->remote_revision = item->revision;
+    new_entry->ctime = item->created;
     new_entry->parent = new_parent;
     if (old_entry != NULL) {
         new_entry->local_revision = old_revision;
@@ -1083,10 +1396,47 @@ static int folder_tree_rebuild_helper(folder_tree * tree, mfconn * conn,
                                       struct h_entry *curr_entry)
 {
     int             retval;
-    mffolder      **folder_result;
-    mffile        **file_result;
-    int             i;
-    const char     *key;
+    mflisting       folders;
+    mflisting       files;
+
+    listing_init(&folders);
+    listing_init(&files);
+
+    /* first folders */
+    retval =
+        mfconn_api_folder_get_content(conn, 0, curr_entry->key, &folders);
+    if (retval != 0) {
+        fprintf(stderr, "folder/get_content failed\n");
+        listing_free(&folders);
+        return -1;
+    }
+
+    /* then files */
+    retval = mfconn_api_folder_get_content(conn, 1, curr_entry->key, &files);
+    if (retval != 0) {
+        fprintf(stderr, "folder/get_content failed\n");
+        listing_free(&folders);
+        listing_free(&files);
+        return -1;
+    }
+
+    folder_tree_store_content(tree, curr_entry, &folders, &files);
+
+    listing_free(&folders);
+    listing_free(&files);
+
+    return 0;
+}
+
+/*
+ * replace the children of curr_entry by the given listings of its remote
+ * folders and files
+ */
+static void folder_tree_store_content(folder_tree * tree,
+                                      struct h_entry *curr_entry,
+                                      mflisting * folders, mflisting * files)
+{
+    size_t          i;
 
     /*
      * free the old children array of this folder to make sure that any
@@ -1105,66 +1455,16 @@ static int folder_tree_rebuild_helper(folder_tree * tree, mfconn * conn,
     curr_entry->children = NULL;
     curr_entry->num_children = 0;
 
-    /* first folders */
-    folder_result = NULL;
-    retval =
-        mfconn_api_folder_get_content(conn, 0, curr_entry->key, &folder_result,
-                                      NULL);
-    if (retval != 0) {
-        fprintf(stderr, "folder/get_content failed\n");
-        if (folder_result != NULL) {
-            for (i = 0; folder_result[i] != NULL; i++) {
-                free(folder_result[i]);
-            }
-            free(folder_result);
-        }
-        return -1;
-    }
-
-    for (i = 0; folder_result[i] != NULL; i++) {
-        key = folder_get_key(folder_result[i]);
-        if (key == NULL) {
-            fprintf(stderr, "folder_get_key returned NULL\n");
-            folder_free(folder_result[i]);
-            continue;
-        }
-        folder_tree_add_folder(tree, folder_result[i], curr_entry);
-        folder_free(folder_result[i]);
-    }
-    free(folder_result);
-
-    /* then files */
-    file_result = NULL;
-    retval =
-        mfconn_api_folder_get_content(conn, 1, curr_entry->key, NULL,
-                                      &file_result);
-    if (retval != 0) {
-        fprintf(stderr, "folder/get_content failed\n");
-        if (file_result != NULL) {
-            for (i = 0; file_result[i] != NULL; i++) {
-                file_free(file_result[i]);
-            }
-            free(file_result);
-        }
-        return -1;
+    for (i = 0; i < folders->num_entries; i++) {
+        folder_tree_add_folder_item(tree, folders->entries + i, curr_entry);
     }
 
-    for (i = 0; file_result[i] != NULL; i++) {
-        key = file_get_key(file_result[i]);
-        if (key == NULL) {
-            fprintf(stderr, "file_get_key returned NULL\n");
-            file_free(file_result[i]);
-            continue;
-        }
-        folder_tree_add_file(tree, file_result[i], curr_entry);
-        file_free(file_result[i]);
+    for (i = 0; i < files->num_entries; i++) {
+        folder_tree_add_file_item(tree, files->entries + i, curr_entry);
     }
-    free(file_result);
 
     /* since the children have been updated, no update is needed anymore */
     curr_entry->local_revision = curr_entry->remote_revision;
-
-    return 0;
 }
 
 /* When trying to delete a non-existing key, nothing happens */
@@ -1296,19 +1596,40 @@ static int folder_tree_update_file_info(folder_tree * tree, mfconn * conn,
 {
     mffile         *file;
     int             retval;
-    struct h_entry *parent;
-    struct h_entry *new_entry;
 
     file = file_alloc();
 
     retval = mfconn_api_file_get_info(conn, file, key);
+    retval = folder_tree_store_file_info(tree, conn, key, file, retval);
+
+    file_free(file);
+
+    return retval;
+}
+
+/*
+ * store the outcome of a file/get_info call for key, which returned retval
+ *
+ * returns -1 if the call failed without an answer from the server, in which
+ * case the local entry is left alone
+ */
+static int folder_tree_store_file_info(folder_tree * tree, mfconn * conn,
+                                       const char *key, mffile * file,
+                                       int retval)
+{
+    struct h_entry *parent;
+    struct h_entry *new_entry;
+
     if (retval != 0) {
         fprintf(stderr, "api call unsuccessful\n");
+        /* without an answer from the server nothing is known about the
+         * object, so keep it until the call can be made again */
+        if (retval < MFAPI_MIN_ERROR_CODE)
+            return -1;
         /* maybe there is a different reason but for now just assume that an
          * unsuccessful call to file/get_info means that the remote file
          * vanished. Thus we remove the object locally */
         folder_tree_remove(tree, key);
-        file_free(file);
         return 0;
     }
 
@@ -1326,12 +1647,9 @@ static int folder_tree_update_file_info(folder_tree * tree, mfconn * conn,
 
     if (new_entry == NULL) {
         fprintf(stderr, "folder_tree_add_file failed\n");
-        file_free(file);
         return -1;
     }
 
-    file_free(file);
-
     return 0;
 }
 
@@ -1352,8 +1670,6 @@ static int folder_tree_update_folder_info(folder_tree * tree, mfconn * conn,
 {
     mffolder       *folder;
     int             retval;
-    struct h_entry *parent;
-    struct h_entry *new_entry;
 
     if (key != NULL && strcmp(key, "trash") == 0) {
         fprintf(stderr, "cannot get folder info of trash\n");
@@ -1363,13 +1679,36 @@ static int folder_tree_update_folder_info(folder_tree * tree, mfconn * conn,
     folder = folder_alloc();
 
     retval = mfconn_api_folder_get_info(conn, folder, key);
+    retval = folder_tree_store_folder_info(tree, conn, key, folder, retval);
+
+    folder_free(folder);
+
+    return retval;
+}
+
+/*
+ * store the outcome of a folder/get_info call for key, which returned retval
+ *
+ * returns -1 if the call failed without an answer from the server, in which
+ * case the local entry is left alone
+ */
+static int folder_tree_store_folder_info(folder_tree * tree, mfconn * conn,
+                                         const char *key, mffolder * folder,
+                                         int retval)
+{
+    struct h_entry *parent;
+    struct h_entry *new_entry;
+
     if (retval != 0) {
         fprintf(stderr, "api call unsuccessful\n");
+        /* without an answer from the server nothing is known about the
+         * object, so keep it until the call can be made again */
+        if (retval < MFAPI_MIN_ERROR_CODE)
+            return -1;
         /* maybe there is a different reason but for now just assume that an
          * unsuccessful call to file/get_info means that the remote file
          * vanished. Thus we remove the object locally */
         folder_tree_remove(tree, key);
-        folder_free(folder);
         return 0;
     }
 
@@ -1393,71 +1732,216 @@ static int folder_tree_update_folder_info(folder_tree * tree, mfconn * conn,
 
     if (new_entry == NULL) {
         fprintf(stderr, "folder_tree_add_folder failed\n");
-        folder_free(folder);
         return -1;
     }
 
-    folder_free(folder);
-
     return 0;
 }
 
 /*
- * ask the remote if there are changes after the locally stored revision
- *
- * if yes, integrate those changes
+ * file/get_info and folder/get_info results that are fetched ahead of time
+ * with the batch API calls, so that a long list of changes does not cost one
+ * round trip per entry
  *
- * the expect_changes parameter allows to skip the call to device/get_status
- * because sometimes one knows that there should be a remote change, so it is
- * useless to waste time on the additional call
+ * keys are looked up in the order in which they were added
  */
-void folder_tree_update(folder_tree * tree, mfconn * conn, bool expect_changes)
+struct folder_tree_batch {
+    char          **keys;
+    mffile        **files;
+    mffolder      **folders;
+    int            *results;
+    int             num_keys;
+    int             next;
+};
+
+static void folder_tree_batch_add(struct folder_tree_batch *batch,
+                                  const char *key)
 {
-    uint64_t        revision_remote;
-    uint64_t        i;
-    struct mfconn_device_change *changes;
-    int             retval;
-    struct h_entry *tmp_entry;
-    const char     *key;
-    uint64_t        revision;
+    int             i;
 
-    if (!expect_changes) {
-        retval = mfconn_api_device_get_status(conn, &revision_remote);
-        if (retval != 0) {
-            fprintf(stderr, "device/get_status failed\n");
+    // the server might answer a key that is asked for twice only once
+    for (i = 0; i < batch->num_keys; i++) {
+        if (strcmp(batch->keys[i], key) == 0)
             return;
-        }
+    }
 
-        if (tree->revision == revision_remote) {
-            fprintf(stderr, "Request to update but nothing to do\n");
-            return;
+    batch->keys = (char **)realloc(batch->keys,
+                                   sizeof(char *) * (batch->num_keys + 1));
+    batch->keys[batch->num_keys++] = strdup(key);
+}
+
+// forget key, e.g. because it is going to be removed anyway
+static void folder_tree_batch_drop(struct folder_tree_batch *batch,
+                                   const char *key)
+{
+    int             i;
+
+    for (i = 0; i < batch->num_keys; i++) {
+        if (strcmp(batch->keys[i], key) != 0)
+            continue;
+        free(batch->keys[i]);
+        memmove(batch->keys + i, batch->keys + i + 1,
+                sizeof(char *) * (batch->num_keys - i - 1));
+        batch->num_keys--;
+        i--;
+    }
+}
+
+static void folder_tree_batch_get_files(struct folder_tree_batch *batch,
+                                        mfconn * conn)
+{
+    int             i;
+
+    if (batch->num_keys == 0)
+        return;
+
+    batch->files = (mffile **) malloc(sizeof(mffile *) * batch->num_keys);
+    batch->results = (int *)malloc(sizeof(int) * batch->num_keys);
+    for (i = 0; i < batch->num_keys; i++)
+        batch->files[i] = file_alloc();
+
+    mfconn_api_file_get_info_batch(conn, batch->files,
+                                   (const char **)batch->keys,
+                                   batch->num_keys, batch->results);
+}
+
+static void folder_tree_batch_get_folders(struct folder_tree_batch *batch,
+                                          mfconn * conn)
+{
+    int             i;
+
+    if (batch->num_keys == 0)
+        return;
+
+    batch->folders = (mffolder **) malloc(sizeof(mffolder *)
+                                          * batch->num_keys);
+    batch->results = (int *)malloc(sizeof(int) * batch->num_keys);
+    for (i = 0; i < batch->num_keys; i++)
+        batch->folders[i] = folder_alloc();
+
+    mfconn_api_folder_get_info_batch(conn, batch->folders,
+                                     (const char **)batch->keys,
+                                     batch->num_keys, batch->results);
+}
+
+// the index of the fetched information of key or -1
+static int folder_tree_batch_find(struct folder_tree_batch *batch,
+                                  const char *key)
+{
+    int             i;
+
+    for (i = batch->next; i < batch->num_keys; i++) {
+        if (strcmp(batch->keys[i], key) == 0) {
+            batch->next = i + 1;
+            return i;
         }
     }
 
-    /*
-     * we maintain the information of each entries parent but that does not
-     * mean that we can rely on it when fetching updates via
-     * device/get_changes. If a remote object has been permanently removed
-     * (trash was emptied) then it will not show up in the results of
-     * device/get_changes and thus a remote file will vanish without that file
-     * showing up in the device/get_changes output. The only way to clean up
-     * those removed files is to use folder/get_content for all folders that
-     * changed.
-     */
+    return -1;
+}
+
+static void folder_tree_batch_free(struct folder_tree_batch *batch)
+{
+    int             i;
+
+    for (i = 0; i < batch->num_keys; i++) {
+        free(batch->keys[i]);
+        if (batch->files != NULL)
+            file_free(batch->files[i]);
+        if (batch->folders != NULL)
+            folder_free(batch->folders[i]);
+    }
+    free(batch->keys);
+    free(batch->files);
+    free(batch->folders);
+    free(batch->results);
+}
+
+/* state passed to folder_tree_apply_changes */
+struct folder_tree_changes {
+    folder_tree    *tree;
+    mfconn         *conn;
+    uint64_t        num_changes;
+};
+
+/* folders that folder_tree_relist lists in parallel */
+struct folder_tree_relist {
+    mfconn         *conn;
+    struct h_entry **folders;
+    /* the current group of folders starts at first */
+    size_t          first;
+    size_t          num_group;
+    size_t          next;
+    /* the folders and files of each folder in the group */
+    mflisting       listings[FOLDER_TREE_LIST_GROUP * 2];
+    int             results[FOLDER_TREE_LIST_GROUP];
+    pthread_mutex_t mutex;
+};
+
+/*
+ * apply one block of changes as passed by mfconn_api_device_get_changes
+ *
+ * only the changes of a single block are held in memory at any time and
+ * the revision of the tree moves on with every block that was applied
+ */
+static int folder_tree_apply_changes(struct mfconn_device_change *changes,
+                                     void *user_ptr)
+{
+    struct folder_tree_changes *state;
+    folder_tree    *tree;
+    mfconn         *conn;
+    uint64_t        i;
+    int             j;
+    struct folder_tree_batch files;
+    struct folder_tree_batch folders;
+    struct h_entry *tmp_entry;
+    const char     *key;
+    uint64_t        revision;
+    int             retval;
+    int             failed;
+
+    state = (struct folder_tree_changes *)user_ptr;
+    tree = state->tree;
+    conn = state->conn;
 
     /*
-     * changes have to be applied in the right order but the result of
-     * mfconn_api_device_get_changes is already sorted by revision
+     * fetch the information of all updated files and folders in as few calls
+     * as possible. The same conditions as below decide which ones need it.
+     * The remote state is the same whether it is retrieved now or while
+     * applying the changes.
      */
-
-    changes = NULL;
-    retval = mfconn_api_device_get_changes(conn, tree->revision, &changes);
-    if (retval != 0) {
-        fprintf(stderr, "device/get_changes() failed\n");
-        free(changes);
-        return;
+    memset(&files, 0, sizeof(files));
+    memset(&folders, 0, sizeof(folders));
+    for (i = 0; changes[i].change != MFCONN_DEVICE_CHANGE_END; i++) {
+        key = changes[i].key;
+        if (strcmp(changes[i].parent, "trash") == 0)
+            continue;
+        tmp_entry = folder_tree_lookup_key(tree, key);
+        if (tmp_entry != NULL
+            && tmp_entry->remote_revision >= changes[i].revision)
+            continue;
+        switch (changes[i].change) {
+            case MFCONN_DEVICE_CHANGE_DELETED_FOLDER:
+                folder_tree_batch_drop(&folders, key);
+                break;
+            case MFCONN_DEVICE_CHANGE_DELETED_FILE:
+                folder_tree_batch_drop(&files, key);
+                break;
+            case MFCONN_DEVICE_CHANGE_UPDATED_FOLDER:
+                if (strcmp(key, "trash") != 0)
+                    folder_tree_batch_add(&folders, key);
+                break;
+            case MFCONN_DEVICE_CHANGE_UPDATED_FILE:
+                folder_tree_batch_add(&files, key);
+                break;
+            case MFCONN_DEVICE_CHANGE_END:
+                break;
+        }
     }
+    folder_tree_batch_get_folders(&folders, conn);
+    folder_tree_batch_get_files(&files, conn);
 
+    failed = 0;
     for (i = 0; changes[i].change != MFCONN_DEVICE_CHANGE_END; i++) {
         key = changes[i].key;
         revision = changes[i].revision;
@@ -1488,7 +1972,15 @@ void folder_tree_update(folder_tree * tree, mfconn * conn, bool expect_changes)
                  * new remote revision is higher than the local revision and
                  * will also fetch the content if this is the case
                  * */
-                folder_tree_update_folder_info(tree, conn, changes[i].key);
+                j = folder_tree_batch_find(&folders, key);
+                if (j >= 0)
+                    retval = folder_tree_store_folder_info(tree, conn, key,
+                                                           folders.folders[j],
+                                                           folders.results[j]);
+                else
+                    retval = folder_tree_update_folder_info(tree, conn, key);
+                if (retval != 0)
+                    failed = 1;
                 break;
             case MFCONN_DEVICE_CHANGE_UPDATED_FILE:
                 /* ignore files updated in trash */
@@ -1502,13 +1994,317 @@ void folder_tree_update(folder_tree * tree, mfconn * conn, bool expect_changes)
                     break;
                 }
                 /* if a file changed, update its info */
-                folder_tree_update_file_info(tree, conn, key);
+                j = folder_tree_batch_find(&files, key);
+                if (j >= 0)
+                    retval = folder_tree_store_file_info(tree, conn, key,
+                                                         files.files[j],
+                                                         files.results[j]);
+                else
+                    retval = folder_tree_update_file_info(tree, conn, key);
+                if (retval != 0)
+                    failed = 1;
                 break;
             case MFCONN_DEVICE_CHANGE_END:
                 break;
         }
     }
 
+    folder_tree_batch_free(&files);
+    folder_tree_batch_free(&folders);
+
+    /* a change that could not be applied is tried again with the whole block
+     * on the next update, which skips what was applied already */
+    if (failed != 0) {
+        fprintf(stderr, "not all changes could be applied\n");
+        return -1;
+    }
+
+    /* the terminating change carries the last revision of this block */
+    tree->revision = changes[i].revision;
+    state->num_changes += i;
+
+    return 0;
+}
+
+/*
+ * the folders whose content is known locally, that is the root and all
+ * folders that have been listed before
+ *
+ * returns the number of folders and, if calls is not NULL, the number of
+ * folder/get_content calls it takes to list all of them
+ */
+static size_t folder_tree_known_folders(folder_tree * tree,
+                                        struct h_entry ***folders,
+                                        uint64_t * calls)
+{
+    struct h_entry *entry;
+    size_t          num_folders;
+    size_t          max_folders;
+    uint64_t        i;
+    uint64_t        j;
+
+    max_folders = 64;
+    *folders = (struct h_entry **)malloc(sizeof(struct h_entry *)
+                                         * max_folders);
+    (*folders)[0] = &(tree->root);
+    num_folders = 1;
+    if (calls != NULL)
+        *calls = 2 + tree->root.num_children / FOLDER_TREE_CHUNK_SIZE;
+
+    for (i = 0; i < NUM_BUCKETS; i++) {
+        for (j = 0; j < tree->bucket_lens[i]; j++) {
+            entry = tree->buckets[i][j];
+            /* skip files and folders that were never listed */
+            if (entry->atime != 0 || entry->local_revision == 0)
+                continue;
+            if (num_folders == max_folders) {
+                max_folders *= 2;
+                *folders = (struct h_entry **)realloc(*folders,
+                                                      sizeof(struct h_entry *)
+                                                      * max_folders);
+            }
+            (*folders)[num_folders++] = entry;
+            /* one call for the folders and one for the files, more if there
+             * are many children */
+            if (calls != NULL)
+                *calls += 2 + entry->num_children / FOLDER_TREE_CHUNK_SIZE;
+        }
+    }
+
+    return num_folders;
+}
+
+/* the number of threads that relist folders */
+static int folder_tree_list_threads(mfconn * conn)
+{
+    int             num_threads;
+
+    num_threads = mfconn_get_num_sessions(conn);
+    if (num_threads > FOLDER_TREE_LIST_THREADS)
+        num_threads = FOLDER_TREE_LIST_THREADS;
+
+    return num_threads;
+}
+
+/*
+ * decide whether it is cheaper to relist all known folders than to replay
+ * the changes of num_revisions revisions
+ *
+ * replaying costs a device/get_changes call per block of revisions and, as
+ * each revision can touch a different entry, up to one batched get_info call
+ * per MFAPI_MAX_BATCH_KEYS revisions. All these calls are made one after the
+ * other. Relisting costs two folder/get_content calls per known folder which
+ * are spread over the relisting threads.
+ */
+static bool folder_tree_prefer_relist(folder_tree * tree, mfconn * conn,
+                                      uint64_t num_revisions)
+{
+    struct h_entry **folders;
+    uint64_t        replay_calls;
+    uint64_t        relist_calls;
+    int             num_threads;
+
+    replay_calls = 1 + num_revisions / FOLDER_TREE_CHANGES_BLOCK
+        + num_revisions / MFAPI_MAX_BATCH_KEYS;
+
+    folder_tree_known_folders(tree, &folders, &relist_calls);
+    free(folders);
+    num_threads = folder_tree_list_threads(conn);
+    relist_calls = (relist_calls + num_threads - 1) / num_threads;
+
+    fprintf(stderr, "%" PRIu64 " revisions behind: about %" PRIu64
+            " calls to replay them, %" PRIu64 " to relist\n", num_revisions,
+            replay_calls, relist_calls);
+
+    return relist_calls < replay_calls;
+}
+
+/* list the folders of the current group until there are none left */
+static void    *folder_tree_relist_worker(void *user_ptr)
+{
+    struct folder_tree_relist *state;
+    const char     *key;
+    size_t          i;
+    int             retval;
+
+    state = (struct folder_tree_relist *)user_ptr;
+
+    for (;;) {
+        pthread_mutex_lock(&(state->mutex));
+        i = state->next++;
+        pthread_mutex_unlock(&(state->mutex));
+
+        if (i >= state->num_group)
+            break;
+
+        /* the tree is not touched while the workers run */
+        key = state->folders[state->first + i]->key;
+        retval = mfconn_api_folder_get_content(state->conn, 0, key,
+                                               state->listings + 2 * i);
+        if (retval == 0)
+            retval = mfconn_api_folder_get_content(state->conn, 1, key,
+                                                   state->listings + 2 * i +
+                                                   1);
+        state->results[i] = retval;
+    }
+
+    return NULL;
+}
+
+/*
+ * bring the tree up to date by listing all folders whose content is known
+ * instead of replaying the changes that led there
+ *
+ * folders that were never listed are left alone as they are listed once they
+ * are looked at anyways. The listings are fetched in parallel, a group of
+ * folders at a time to bound the memory, and are stored by this thread.
+ */
+static int folder_tree_relist(folder_tree * tree, mfconn * conn)
+{
+    struct folder_tree_relist state;
+    pthread_t       threads[FOLDER_TREE_LIST_THREADS];
+    size_t          num_folders;
+    size_t          i;
+    int             max_threads;
+    int             num_threads;
+    int             t;
+    int             retval;
+
+    memset(&state, 0, sizeof(state));
+    state.conn = conn;
+    max_threads = folder_tree_list_threads(conn);
+    pthread_mutex_init(&(state.mutex), NULL);
+    for (i = 0; i < FOLDER_TREE_LIST_GROUP * 2; i++)
+        listing_init(state.listings + i);
+
+    num_folders = folder_tree_known_folders(tree, &state.folders, NULL);
+
+    retval = 0;
+    for (state.first = 0; state.first < num_folders && retval == 0;
+         state.first += state.num_group) {
+        state.num_group = num_folders - state.first;
+        if (state.num_group > FOLDER_TREE_LIST_GROUP)
+            state.num_group = FOLDER_TREE_LIST_GROUP;
+        state.next = 0;
+
+        for (t = 0; t < max_threads; t++) {
+            if (pthread_create(&threads[t], NULL, folder_tree_relist_worker,
+                               &state) != 0) {
+                fprintf(stderr, "pthread_create failed\n");
+                break;
+            }
+        }
+        // list in this thread as well in case not a single thread was created
+        if (t == 0)
+            folder_tree_relist_worker(&state);
+        num_threads = t;
+        for (t = 0; t < num_threads; t++) {
+            pthread_join(threads[t], NULL);
+        }
+
+        for (i = 0; i < state.num_group; i++) {
+            /* an error reported by the API means that the folder is gone. It
+             * drops out of the listing of its parent and housekeeping will
+             * clean it up */
+            if (state.results[i] >= MFAPI_MIN_ERROR_CODE)
+                continue;
+            if (state.results[i] != 0) {
+                fprintf(stderr, "folder/get_content failed\n");
+                retval = -1;
+                break;
+            }
+            folder_tree_store_content(tree, state.folders[state.first + i],
+                                      state.listings + 2 * i,
+                                      state.listings + 2 * i + 1);
+        }
+    }
+
+    fprintf(stderr, "relisted %zu folders\n", num_folders);
+
+    for (i = 0; i < FOLDER_TREE_LIST_GROUP * 2; i++)
+        listing_free(state.listings + i);
+    free(state.folders);
+    pthread_mutex_destroy(&(state.mutex));
+
+    return retval;
+}
+
+/*
+ * ask the remote if there are changes after the locally stored revision
+ *
+ * if yes, integrate those changes
+ *
+ * the expect_changes parameter allows to skip the call to device/get_status
+ * because sometimes one knows that there should be a remote change, so it is
+ * useless to waste time on the additional call
+ */
+void folder_tree_update(folder_tree * tree, mfconn * conn, bool expect_changes)
+{
+    uint64_t        revision_remote;
+    struct folder_tree_changes state;
+    int             retval;
+
+    if (!expect_changes) {
+        retval = mfconn_api_device_get_status(conn, &revision_remote);
+        if (retval != 0) {
+            fprintf(stderr, "device/get_status failed\n");
+            return;
+        }
+
+        if (tree->revision == revision_remote) {
+            fprintf(stderr, "Request to update but nothing to do\n");
+            return;
+        }
+
+        /*
+         * after a long time offline, there can be far more changes than
+         * there are folders whose content we know. In that case it is
+         * faster to list those folders again.
+         */
+        if (revision_remote > tree->revision
+            && folder_tree_prefer_relist(tree, conn,
+                                         revision_remote - tree->revision)) {
+            retval = folder_tree_relist(tree, conn);
+            if (retval == 0) {
+                /* changes that happen while listing will be picked up by
+                 * the next update */
+                tree->revision = revision_remote;
+                folder_tree_housekeep(tree, conn);
+                return;
+            }
+            fprintf(stderr, "relisting failed, replaying changes instead\n");
+        }
+    }
+
+    /*
+     * we maintain the information of each entries parent but that does not
+     * mean that we can rely on it when fetching updates via
+     * device/get_changes. If a remote object has been permanently removed
+     * (trash was emptied) then it will not show up in the results of
+     * device/get_changes and thus a remote file will vanish without that file
+     * showing up in the device/get_changes output. The only way to clean up
+     * those removed files is to use folder/get_content for all folders that
+     * changed.
+     */
+
+    /*
+     * changes have to be applied in the right order but
+     * mfconn_api_device_get_changes hands them over sorted by revision,
+     * block by block
+     */
+
+    state.tree = tree;
+    state.conn = conn;
+    state.num_changes = 0;
+    retval = mfconn_api_device_get_changes(conn, tree->revision,
+                                           folder_tree_apply_changes, &state,
+                                           &revision_remote);
+    if (retval != 0) {
+        fprintf(stderr, "device/get_changes() failed\n");
+        return;
+    }
+    fprintf(stderr, "applied %" PRIu64 " changes\n", state.num_changes);
+
     /*
      * we have to manually check the root because it never shows up in the
      * results from device_get_changes
@@ -1527,9 +2323,8 @@ void folder_tree_update(folder_tree * tree, mfconn * conn, bool expect_changes)
 
     folder_tree_rebuild_helper(tree, conn, &(tree->root));
 
-    /* the new revision of the tree is the revision of the terminating change
-     * */
-    tree->revision = changes[i].revision;
+    /* the new revision of the tree is the current device revision */
+    tree->revision = revision_remote;
 
     /*
      * it can happen that another change happened remotely while we were
@@ -1552,9 +2347,6 @@ void folder_tree_update(folder_tree * tree, mfconn * conn, bool expect_changes)
     folder_tree_housekeep(tree, conn);
     fprintf(stderr, "tree after cleaning:\n");
     folder_tree_debug(tree);
-
-    /* free allocated memory */
-    free(changes);
 }
 
 /*
@@ -1618,6 +2410,8 @@ void folder_tree_housekeep(folder_tree * tree, mfconn * conn)
                     j,
                     k;
     bool            found;
+    struct folder_tree_batch files;
+    struct folder_tree_batch folders;
 
     /*
      * find objects with children who claim to have a different parent
@@ -1694,6 +2488,8 @@ void folder_tree_housekeep(folder_tree * tree, mfconn * conn)
      * if the remote entries have been removed completely (including from the
      * trash)
      * */
+    memset(&files, 0, sizeof(files));
+    memset(&folders, 0, sizeof(folders));
     for (i = 0; i < NUM_BUCKETS; i++) {
         for (j = 0; j < tree->bucket_lens[i]; j++) {
             if (!folder_tree_is_parent_of
@@ -1704,17 +2500,29 @@ void folder_tree_housekeep(folder_tree * tree, mfconn * conn)
                         tree->buckets[i][j]->parent->key);
                 if (tree->buckets[i][j]->atime == 0) {
                     /* folder */
-                    folder_tree_update_folder_info(tree, conn,
-                                                   tree->buckets[i][j]->key);
+                    folder_tree_batch_add(&folders, tree->buckets[i][j]->key);
                 } else {
                     /* file */
-                    folder_tree_update_file_info(tree, conn,
-                                                 tree->buckets[i][j]->key);
+                    folder_tree_batch_add(&files, tree->buckets[i][j]->key);
                 }
             }
         }
     }
 
+    /* ask for all of them at once and only then change the hashtable */
+    folder_tree_batch_get_folders(&folders, conn);
+    folder_tree_batch_get_files(&files, conn);
+    for (k = 0; k < (uint64_t) folders.num_keys; k++) {
+        folder_tree_store_folder_info(tree, conn, folders.keys[k],
+                                      folders.folders[k], folders.results[k]);
+    }
+    for (k = 0; k < (uint64_t) files.num_keys; k++) {
+        folder_tree_store_file_info(tree, conn, files.keys[k],
+                                    files.files[k], files.results[k]);
+    }
+    folder_tree_batch_free(&files);
+    folder_tree_batch_free(&folders);
+
     /* TODO: should this routine call folder_tree_cleanup_filecache to remove
      * unreferenced or outdated files in the cache? */
 }
@@ -1759,9 +2567,12 @@ static int atime_compare(const void *a, const void *b)
  * from a-z and numbers from 0-9, the 16th has to be an underscore,
  * the 17th has to be a number from 1-9 and the remaining characters
  * (if any) be a number from 0-9
+ *
+ * the same name followed by .part or .part.progress belongs to a download
+ * that has not finished yet, in which case partial is set
  */
 static bool is_valid_cache_filename(const char *name, char key[],
-                                    uint64_t * revision)
+                                    uint64_t * revision, bool * partial)
 {
     int             i;
 
@@ -1774,9 +2585,15 @@ static bool is_valid_cache_filename(const char *name, char key[],
     i++;
     if (name[i] < 49 || name[i] > 57)
         return false;
-    for (; name[i] != '\0'; i++) {
-        if (!isdigit(name[i]))
-            return false;
+    for (; isdigit(name[i]); i++) ;
+
+    if (strcmp(name + i, ".part") == 0
+        || strcmp(name + i, ".part.progress") == 0) {
+        *partial = true;
+    } else if (name[i] == '\0') {
+        *partial = false;
+    } else {
+        return false;
     }
 
     // now copy the first 15 bytes from the name to the key
@@ -1788,7 +2605,18 @@ static bool is_valid_cache_filename(const char *name, char key[],
     return true;
 }
 
-/* go through all files in the filecache and check:
+/* state shared by the threads scanning the file cache */
+struct cleanup_state {
+    folder_tree    *tree;
+    pthread_mutex_t mutex;
+    int             next_shard;
+    size_t          num_cachefiles;
+    struct h_entry **cachefiles;
+    uint64_t        partial_size;
+    bool            failed;
+};
+
+/* go through all files in one subdirectory of the filecache and check:
  *
  *  - does the filename match the known pattern?
  *      (do not act on other files to avoid accidentally touching user
@@ -1797,12 +2625,22 @@ static bool is_valid_cache_filename(const char *name, char key[],
  *      - if no, delete
  *  - check if its revision is equal the remote revision
  *      - if no, delete
- *  - check if its size and hash verifies
+ *  - check if its size verifies
  *      - if no, delete
- *  - once all files in the cache have been processed this way, check if
- *    the sum of their sizes is greater than X and delete the oldest
+ *
+ * what is left of an unfinished download is deleted as well if its quickkey
+ * is unknown or its revision is not the remote one. Otherwise it is kept so
+ * that the download can be resumed, and its size counts towards the size of
+ * the cache.
+ *
+ * files that pass are added to the list of cached files in the state, whose
+ * hashes are verified all at once afterwards. The
+ * hashtable is only read without the lock because it is not modified while
+ * the scan is running. Modifications of its entries are done with the lock
+ * held.
  */
-void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
+static int folder_tree_cleanup_shard(struct cleanup_state *state,
+                                     const char *shard)
 {
     struct dirent  *endp;
     struct dirent  *entryp;
@@ -1812,27 +2650,24 @@ void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
     char           *filepath;
     char            key[MFAPI_MAX_LEN_KEY + 1];
     uint64_t        revision;
+    bool            partial;
+    struct stat     st;
     struct h_entry *entry;
-    size_t          num_cachefiles;
-    size_t          i;
-    uint64_t        sum_size;
     struct h_entry **cachefiles;
 
     // from the readdir_r man page
-    name_max = pathconf(tree->filecache, _PC_NAME_MAX);
+    name_max = pathconf(shard, _PC_NAME_MAX);
     if (name_max == -1)         /* Limit not defined, or error */
         name_max = 255;         /* Take a guess */
     entryp = malloc(offsetof(struct dirent, d_name) + name_max + 1);
 
-    dirp = opendir(tree->filecache);
+    dirp = opendir(shard);
     if (dirp == NULL) {
-        fprintf(stderr, "cannot open filecache\n");
-        return;
+        fprintf(stderr, "cannot open %s\n", shard);
+        free(entryp);
+        return -1;
     }
 
-    num_cachefiles = 0;
-    cachefiles = NULL;
-
     for (;;) {
         endp = NULL;
         retval = readdir_r(dirp, entryp, &endp);
@@ -1840,9 +2675,7 @@ void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
             fprintf(stderr, "readdir_r failed\n");
             free(entryp);
             closedir(dirp);
-            if (cachefiles != NULL)
-                free(cachefiles);
-            return;
+            return -1;
         }
         if (endp == NULL) {
             break;
@@ -1851,15 +2684,16 @@ void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
             strcmp(entryp->d_name, "..") == 0)
             continue;
 
-        if (!is_valid_cache_filename(entryp->d_name, key, &revision)) {
+        if (!is_valid_cache_filename(entryp->d_name, key, &revision,
+                                     &partial)) {
             fprintf(stderr, "not a valid cachefile: %s (ignoring)\n",
                     entryp->d_name);
             continue;
         }
 
-        filepath = strdup_printf("%s/%s", tree->filecache, entryp->d_name);
+        filepath = strdup_printf("%s/%s", shard, entryp->d_name);
 
-        entry = folder_tree_lookup_key(tree, key);
+        entry = folder_tree_lookup_key(state->tree, key);
         if (entry == NULL) {
             fprintf(stderr, "delete file not in hashtable: %s\n",
                     entryp->d_name);
@@ -1871,6 +2705,29 @@ void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
             continue;
         }
 
+        if (partial && revision != entry->remote_revision) {
+            fprintf(stderr, "delete partial file with revision %" PRIu64
+                    " different from remote %" PRIu64 ": %s\n", revision,
+                    entry->remote_revision, entryp->d_name);
+            retval = unlink(filepath);
+            if (retval != 0) {
+                fprintf(stderr, "unlink failed\n");
+            }
+            free(filepath);
+            continue;
+        }
+
+        if (partial) {
+            retval = stat(filepath, &st);
+            if (retval == 0) {
+                pthread_mutex_lock(&(state->mutex));
+                state->partial_size += st.st_size;
+                pthread_mutex_unlock(&(state->mutex));
+            }
+            free(filepath);
+            continue;
+        }
+
         if (revision != entry->remote_revision) {
             fprintf(stderr, "delete file with revision %" PRIu64
                     " different from remote %" PRIu64 ": %s\n", revision,
@@ -1879,7 +2736,9 @@ void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
             if (retval != 0) {
                 fprintf(stderr, "unlink failed\n");
             }
+            pthread_mutex_lock(&(state->mutex));
             entry->local_revision = 0;
+            pthread_mutex_unlock(&(state->mutex));
             free(filepath);
             continue;
         }
@@ -1892,20 +2751,24 @@ void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
             if (retval != 0) {
                 fprintf(stderr, "unlink failed\n");
             }
+            pthread_mutex_lock(&(state->mutex));
             entry->local_revision = 0;
+            pthread_mutex_unlock(&(state->mutex));
             free(filepath);
             continue;
         }
 
-        retval = file_check_integrity(filepath, entry->fsize, entry->hash);
+        retval = file_check_integrity_size(filepath, entry->fsize);
         if (retval != 0) {
-            fprintf(stderr, "delete file with invalid content: %s\n",
+            fprintf(stderr, "delete file with invalid size: %s\n",
                     entryp->d_name);
             retval = unlink(filepath);
             if (retval != 0) {
                 fprintf(stderr, "unlink failed\n");
             }
+            pthread_mutex_lock(&(state->mutex));
             entry->local_revision = 0;
+            pthread_mutex_unlock(&(state->mutex));
             free(filepath);
             continue;
         }
@@ -1913,30 +2776,211 @@ void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
 
         // everything is okay with this one, so append it to the list of files
         // in the cache
-        num_cachefiles++;
+        pthread_mutex_lock(&(state->mutex));
         cachefiles =
-            (struct h_entry **)realloc(cachefiles,
-                                       num_cachefiles *
+            (struct h_entry **)realloc(state->cachefiles,
+                                       (state->num_cachefiles + 1) *
                                        sizeof(struct h_entry *));
         if (cachefiles == NULL) {
+            pthread_mutex_unlock(&(state->mutex));
             fprintf(stderr, "realloc failed\n");
             free(entryp);
             closedir(dirp);
-            return;
+            return -1;
         }
-        cachefiles[num_cachefiles - 1] = entry;
+        state->cachefiles = cachefiles;
+        state->cachefiles[state->num_cachefiles] = entry;
+        state->num_cachefiles++;
+        pthread_mutex_unlock(&(state->mutex));
     }
 
     free(entryp);
     closedir(dirp);
 
+    return 0;
+}
+
+/* take subdirectories of the filecache until there are none left */
+static void    *folder_tree_cleanup_worker(void *user_ptr)
+{
+    struct cleanup_state *state;
+    int             shard_index;
+    char           *shard;
+
+    state = (struct cleanup_state *)user_ptr;
+
+    for (;;) {
+        pthread_mutex_lock(&(state->mutex));
+        if (state->failed || state->next_shard >= FILECACHE_NUM_SHARDS) {
+            pthread_mutex_unlock(&(state->mutex));
+            break;
+        }
+        shard_index = state->next_shard++;
+        pthread_mutex_unlock(&(state->mutex));
+
+        shard = filecache_shard_path_by_index(state->tree->filecache,
+                                              shard_index);
+        if (folder_tree_cleanup_shard(state, shard) != 0) {
+            pthread_mutex_lock(&(state->mutex));
+            state->failed = true;
+            pthread_mutex_unlock(&(state->mutex));
+        }
+        free(shard);
+    }
+
+    return NULL;
+}
+
+static int fsize_compare_desc(const void *a, const void *b)
+{
+    uint64_t        fsize_a;
+    uint64_t        fsize_b;
+
+    fsize_a = (*(struct h_entry **)a)->fsize;
+    fsize_b = (*(struct h_entry **)b)->fsize;
+
+    return (fsize_a < fsize_b) - (fsize_a > fsize_b);
+}
+
+/*
+ * verify the content of the files that passed folder_tree_cleanup_shard and
+ * delete the invalid ones from the cache and from the list
+ *
+ * Files that were verified with SHA256 before only need to match the fast
+ * checksum recorded back then, which still catches truncation and damage on
+ * disk. Only the other files are hashed with SHA256, and their checksum is
+ * recorded for the next time.
+ *
+ * The largest files go first, so that the threads finish at about the same
+ * time even if the cache holds only a few huge files.
+ */
+static void folder_tree_cleanup_hashes(folder_tree * tree,
+                                       struct h_entry **cachefiles,
+                                       size_t * num_cachefiles,
+                                       int num_threads)
+{
+    struct hash_file *files;
+    struct h_entry *entry;
+    char           *shard;
+    size_t          i;
+    size_t          num_valid;
+
+    qsort(cachefiles, *num_cachefiles, sizeof(struct h_entry *),
+          fsize_compare_desc);
+
+    files = (struct hash_file *)calloc(*num_cachefiles,
+                                       sizeof(struct hash_file));
+    for (i = 0; i < *num_cachefiles; i++) {
+        entry = cachefiles[i];
+        shard = filecache_shard_path(tree->filecache, entry->key);
+        files[i].path = strdup_printf("%s/%s_%" PRIu64, shard, entry->key,
+                                      entry->remote_revision);
+        files[i].checksum_only = entry->local_revision != 0
+            && entry->checksum_revision == entry->local_revision;
+        free(shard);
+    }
+
+    hash_files(files, *num_cachefiles, num_threads);
+
+    num_valid = 0;
+    for (i = 0; i < *num_cachefiles; i++) {
+        entry = cachefiles[i];
+        if (files[i].retval != 0 || files[i].size != entry->fsize
+            || (files[i].checksum_only
+                && files[i].checksum != entry->checksum)
+            || (!files[i].checksum_only
+                && memcmp(files[i].hash, entry->hash,
+                          SHA256_DIGEST_LENGTH) != 0)) {
+            fprintf(stderr, "delete file with invalid content: %s\n",
+                    files[i].path);
+            if (unlink(files[i].path) != 0) {
+                fprintf(stderr, "unlink failed\n");
+            }
+            entry->local_revision = 0;
+        } else {
+            entry->checksum = files[i].checksum;
+            entry->checksum_revision = entry->local_revision;
+            cachefiles[num_valid++] = entry;
+        }
+        free((char *)files[i].path);
+    }
+    free(files);
+
+    *num_cachefiles = num_valid;
+}
+
+/* check all files in the filecache as described for
+ * folder_tree_cleanup_shard and folder_tree_cleanup_hashes, using one
+ * thread per online processor
+ *
+ * once all files in the cache have been processed this way, check if the sum
+ * of their sizes is greater than allowed_size and delete the oldest
+ */
+void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
+{
+    struct cleanup_state state;
+    pthread_t      *threads;
+    long            num_threads;
+    long            t;
+    size_t          i;
+    int             retval;
+    char           *filepath;
+    char           *shard;
+    struct h_entry *entry;
+    size_t          num_cachefiles;
+    uint64_t        sum_size;
+    struct h_entry **cachefiles;
+
+    state.tree = tree;
+    state.next_shard = 0;
+    state.num_cachefiles = 0;
+    state.cachefiles = NULL;
+    state.partial_size = 0;
+    state.failed = false;
+    pthread_mutex_init(&(state.mutex), NULL);
+
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > 16)
+        num_threads = 16;
+
+    threads = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+    for (t = 0; t < num_threads; t++) {
+        retval = pthread_create(&threads[t], NULL, folder_tree_cleanup_worker,
+                                &state);
+        if (retval != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            break;
+        }
+    }
+    // scan in this thread as well in case not a single thread was created
+    if (t == 0)
+        folder_tree_cleanup_worker(&state);
+    for (i = 0; i < (size_t) t; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&(state.mutex));
+
+    num_cachefiles = state.num_cachefiles;
+    cachefiles = state.cachefiles;
+
+    if (state.failed) {
+        free(cachefiles);
+        return;
+    }
+
+    folder_tree_cleanup_hashes(tree, cachefiles, &num_cachefiles,
+                               num_threads);
+
     // return if there are no files in the cache
     if (num_cachefiles == 0)
         return;
 
     // now calculate the sum of valid files in the cache and check whether it
-    // is larger than allowed
-    sum_size = 0;
+    // is larger than allowed. Unfinished downloads take up space as well.
+    sum_size = state.partial_size;
     for (i = 0; i < num_cachefiles; i++) {
         sum_size += cachefiles[i]->fsize;
     }
@@ -1954,8 +2998,10 @@ void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
         entry = cachefiles[i];
         fprintf(stderr, "delete file to free space: %s_%" PRIu64 "\n",
                 entry->key, entry->remote_revision);
-        filepath = strdup_printf("%s/%s_%" PRIu64, tree->filecache, entry->key,
+        shard = filecache_shard_path(tree->filecache, entry->key);
+        filepath = strdup_printf("%s/%s_%" PRIu64, shard, entry->key,
                                  entry->remote_revision);
+        free(shard);
         retval = unlink(filepath);
         if (retval != 0) {
             fprintf(stderr, "unlink failed\n");
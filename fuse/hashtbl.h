@@ -26,6 +26,7 @@
 #include <sys/types.h>
 
 #include "../mfapi/mfconn.h"
+#include "../utils/stringv.h"
 
 typedef struct folder_tree folder_tree;
 
@@ -79,9 +80,28 @@ int             folder_tree_open_file(folder_tree * tree, mfconn * conn,
                                       const char *path, mode_t mode,
                                       bool update);
 
+int             folder_tree_collect_outdated(folder_tree * tree,
+                                             mfconn * conn, const char *key,
+                                             stringv * paths);
+
+typedef struct folder_tree_fetch folder_tree_fetch;
+
+folder_tree_fetch *folder_tree_fetch_prepare(folder_tree * tree,
+                                             mfconn * conn, const char *path);
+
+int             folder_tree_fetch_run(folder_tree_fetch * fetch,
+                                      mfconn * conn);
+
+void            folder_tree_fetch_commit(folder_tree * tree,
+                                         folder_tree_fetch * fetch);
+
+void            folder_tree_fetch_free(folder_tree_fetch * fetch);
+
 int             folder_tree_tmp_open(folder_tree * tree);
 
 int             folder_tree_upload_patch(folder_tree * tree, mfconn * conn,
-                                         const char *path);
+                                         const char *path,
+                                         const unsigned char *fhash,
+                                         uint64_t fsize);
 
 #endif
@@ -39,7 +39,9 @@
 
 #include "../mfapi/mfconn.h"
 #include "hashtbl.h"
+#include "filecache.h"
 #include "operations.h"
+#include "../utils/http.h"
 #include "../utils/strings.h"
 #include "../utils/stringv.h"
 
@@ -55,6 +57,12 @@ struct mediafirefs_user_options {
     char           *server;
     int             app_id;
     char           *api_key;
+    int             offline;
+    int             rate_metadata;
+    int             rate_data;
+    int             rate_prefetch;
+    int             rate_upload;
+    int             sessions;
 };
 
 static struct fuse_operations mediafirefs_oper = {
@@ -85,7 +93,7 @@ static struct fuse_operations mediafirefs_oper = {
     .readdir = mediafirefs_readdir,
     .releasedir = mediafirefs_releasedir,
     .fsyncdir = mediafirefs_fsyncdir,
-//  .init = mediafirefs_init,
+    .init = mediafirefs_init,
     .destroy = mediafirefs_destroy,
     .access = mediafirefs_access,
     .create = mediafirefs_create,
@@ -108,6 +116,14 @@ static void usage(const char *progname)
             "    --server domain        server domain\n"
             "    -i, --app-id id        App ID\n"
             "    -k, --api-key key      API Key\n"
+            "    --offline              mount the cache read-only without\n"
+            "                           connecting to MediaFire\n"
+            "    --rate-metadata KiB/s  bandwidth cap for API calls\n"
+            "    --rate-data KiB/s      bandwidth cap for reading files\n"
+            "    --rate-prefetch KiB/s  bandwidth cap for prefetching\n"
+            "    --rate-upload KiB/s    bandwidth cap for uploading\n"
+            "    --sessions num         number of sessions for making API\n"
+            "                           calls in parallel (default: 4)\n"
             "\n"
             "Notice that long options are separated from their arguments by\n"
             "a space and not an equal sign.\n" "\n", progname);
@@ -258,6 +274,17 @@ static void parse_arguments(int *argc, char ***argv,
         {"-k %s", offsetof(struct mediafirefs_user_options, api_key), 0},
         {"--api-key %s", offsetof(struct mediafirefs_user_options, api_key),
          0},
+        {"--offline", offsetof(struct mediafirefs_user_options, offline), 1},
+        {"--rate-metadata %d",
+         offsetof(struct mediafirefs_user_options, rate_metadata), 0},
+        {"--rate-data %d",
+         offsetof(struct mediafirefs_user_options, rate_data), 0},
+        {"--rate-prefetch %d",
+         offsetof(struct mediafirefs_user_options, rate_prefetch), 0},
+        {"--rate-upload %d",
+         offsetof(struct mediafirefs_user_options, rate_upload), 0},
+        {"--sessions %d",
+         offsetof(struct mediafirefs_user_options, sessions), 0},
         FUSE_OPT_END
     };
 
@@ -280,7 +307,7 @@ static void parse_arguments(int *argc, char ***argv,
 }
 
 static void connect_mf(struct mediafirefs_user_options *options,
-                       mfconn ** conn)
+                       const char *session_file, mfconn ** conn)
 {
     if (options->app_id == -1) {
         options->app_id = 42709;
@@ -292,12 +319,15 @@ static void connect_mf(struct mediafirefs_user_options *options,
 
     *conn = mfconn_create(options->server, options->username,
                           options->password, options->app_id,
-                          options->api_key, 3);
+                          options->api_key, 3, session_file);
 
     if (*conn == NULL) {
         fprintf(stderr, "Cannot establish connection\n");
         exit(1);
     }
+
+    if (mfconn_set_num_sessions(*conn, options->sessions) != 0)
+        exit(1);
 }
 
 static void open_hashtbl(const char *dircache, const char *filecache,
@@ -314,6 +344,11 @@ static void open_hashtbl(const char *dircache, const char *filecache,
 
         fclose(fp);
 
+        if (*tree != NULL && conn == NULL) {
+            // offline, so neither clean up the cache nor update the tree
+            return;
+        }
+
         if (*tree != NULL) {
 
             // TODO: make the maximum cache size configurable
@@ -329,6 +364,10 @@ static void open_hashtbl(const char *dircache, const char *filecache,
                 " a new one\n");
     }
     // file doesn't exist or is corrupt
+    if (conn == NULL) {
+        fprintf(stderr, "cannot go offline without a directory cache\n");
+        exit(1);
+    }
     fprintf(stderr, "creating new hashtable\n");
     *tree = folder_tree_create(filecache);
 
@@ -391,12 +430,11 @@ static void setup_conf_dir(char **configfile)
     free((void *)configdir);
 }
 
-static void setup_cache_dir(const char *ekey, char **dircache,
-                            char **filecache)
+// create $XDG_CACHE_HOME/mediafire-tools or $HOME/.cache/mediafire-tools
+static char    *get_cache_dir(void)
 {
     const char     *homedir;
     const char     *cachedir;
-    const char     *usercachedir;
 
     homedir = getenv("HOME");
     if (homedir == NULL) {
@@ -429,6 +467,94 @@ static void setup_cache_dir(const char *ekey, char **dircache,
         fprintf(stderr, "cannot create %s\n", cachedir);
         exit(1);
     }
+
+    return (char *)cachedir;
+}
+
+// the ekey that was last seen for username or NULL
+static char    *read_ekey(const char *cachedir, const char *username)
+{
+    char           *ekeyfile;
+    char           *line = NULL;
+    size_t          len = 0;
+    FILE           *fp;
+
+    ekeyfile = strdup_printf("%s/%s.ekey", cachedir, username);
+    fp = fopen(ekeyfile, "r");
+    free(ekeyfile);
+    if (fp == NULL)
+        return NULL;
+    if (getline(&line, &len, fp) == -1) {
+        fclose(fp);
+        free(line);
+        return NULL;
+    }
+    fclose(fp);
+    // replace possible trailing newline by zero
+    if (line[strlen(line) - 1] == '\n')
+        line[strlen(line) - 1] = '\0';
+
+    return line;
+}
+
+/*
+ * the file in the cache directory of username that keeps its sessions across
+ * mounts or NULL if the ekey of username is not known yet
+ */
+static char    *get_session_file(const char *username)
+{
+    char           *cachedir;
+    char           *ekey;
+    char           *session_file;
+
+    cachedir = get_cache_dir();
+    ekey = read_ekey(cachedir, username);
+    if (ekey == NULL) {
+        free(cachedir);
+        return NULL;
+    }
+    session_file = strdup_printf("%s/%s/session", cachedir, ekey);
+    free(cachedir);
+    free(ekey);
+
+    return session_file;
+}
+
+/*
+ * when online, ekey is the one of the current connection and it is
+ * remembered for the given username so that a later offline mount (ekey set
+ * to NULL) can find the right cache directory without logging in
+ */
+static void setup_cache_dir(const char *username, const char *ekey,
+                            char **dircache, char **filecache,
+                            char **pinnedfile)
+{
+    char           *cachedir;
+    const char     *usercachedir;
+    char           *ekeyfile;
+    char           *line = NULL;
+    FILE           *fp;
+
+    cachedir = get_cache_dir();
+    ekeyfile = strdup_printf("%s/%s.ekey", cachedir, username);
+    if (ekey == NULL) {
+        line = read_ekey(cachedir, username);
+        if (line == NULL) {
+            fprintf(stderr, "no cache found for %s\n", username);
+            exit(1);
+        }
+        ekey = line;
+    } else {
+        fp = fopen(ekeyfile, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "cannot open %s for writing\n", ekeyfile);
+        } else {
+            fprintf(fp, "%s\n", ekey);
+            fclose(fp);
+        }
+    }
+    free(ekeyfile);
+
     /* now create the subdirectory for the current ekey */
     usercachedir = strdup_printf("%s/%s", cachedir, ekey);
     /* EEXIST is okay, so only fail if it is something else */
@@ -439,6 +565,7 @@ static void setup_cache_dir(const char *ekey, char **dircache,
     }
 
     *dircache = strdup_printf("%s/directorytree", usercachedir);
+    *pinnedfile = strdup_printf("%s/pinned", usercachedir);
 
     *filecache = strdup_printf("%s/files", usercachedir);
     if (mkdir(*filecache, 0755) != 0 && errno != EEXIST) {
@@ -446,9 +573,41 @@ static void setup_cache_dir(const char *ekey, char **dircache,
         fprintf(stderr, "cannot create %s\n", *filecache);
         exit(1);
     }
+    if (filecache_init(*filecache) != 0) {
+        fprintf(stderr, "cannot set up %s\n", *filecache);
+        exit(1);
+    }
 
-    free((void *)cachedir);
+    free(cachedir);
     free((void *)usercachedir);
+    free(line);
+}
+
+static stringv *load_pinned(const char *pinnedfile)
+{
+    stringv        *sv;
+    char           *line = NULL;
+    size_t          len = 0;
+    FILE           *fp;
+
+    sv = stringv_alloc();
+
+    fp = fopen(pinnedfile, "r");
+    if (fp == NULL)
+        return sv;
+
+    // one folder key per line - an empty line stands for the root
+    while (getline(&line, &len, fp) != -1) {
+        if (line[strlen(line) - 1] == '\n')
+            line[strlen(line) - 1] = '\0';
+        if (!stringv_mem(sv, line))
+            stringv_add(sv, line);
+    }
+    free(line);
+
+    fclose(fp);
+
+    return sv;
 }
 
 int main(int argc, char *argv[])
@@ -456,9 +615,10 @@ int main(int argc, char *argv[])
     int             ret,
                     i;
     struct mediafirefs_context_private *ctx;
+    char           *session_file;
 
     struct mediafirefs_user_options options = {
-        NULL, NULL, NULL, NULL, -1, NULL
+        NULL, NULL, NULL, NULL, -1, NULL, 0, 0, 0, 0, 0, 4
     };
 
     ctx = calloc(1, sizeof(struct mediafirefs_context_private));
@@ -471,24 +631,54 @@ int main(int argc, char *argv[])
         printf("login: ");
         options.username = string_line_from_stdin(false);
     }
-    if (options.password == NULL) {
+    if (options.password == NULL && !options.offline) {
         printf("passwd: ");
         options.password = string_line_from_stdin(true);
     }
 
-    connect_mf(&options, &(ctx->conn));
-
-    setup_cache_dir(mfconn_get_ekey(ctx->conn), &(ctx->dircache),
-                    &(ctx->filecache));
+    if (options.rate_metadata > 0)
+        http_set_class_rate(HTTP_CLASS_METADATA,
+                            options.rate_metadata * 1024ULL);
+    if (options.rate_data > 0)
+        http_set_class_rate(HTTP_CLASS_DATA, options.rate_data * 1024ULL);
+    if (options.rate_prefetch > 0)
+        http_set_class_rate(HTTP_CLASS_PREFETCH,
+                            options.rate_prefetch * 1024ULL);
+    if (options.rate_upload > 0)
+        http_set_class_rate(HTTP_CLASS_UPLOAD, options.rate_upload * 1024ULL);
+
+    if (options.offline) {
+        ctx->offline = true;
+        ctx->conn = NULL;
+        setup_cache_dir(options.username, NULL, &(ctx->dircache),
+                        &(ctx->filecache), &(ctx->pinnedfile));
+        // nothing can be uploaded, so let the kernel refuse writes
+        argv = (char **)realloc(argv, sizeof(char *) * (argc + 1));
+        argv[argc++] = strdup("-oro");
+    } else {
+        session_file = get_session_file(options.username);
+        connect_mf(&options, session_file, &(ctx->conn));
+        free(session_file);
+        setup_cache_dir(options.username, mfconn_get_ekey(ctx->conn),
+                        &(ctx->dircache), &(ctx->filecache),
+                        &(ctx->pinnedfile));
+        // the ekey might only be known now that we are logged in
+        session_file = get_session_file(options.username);
+        mfconn_set_session_file(ctx->conn, session_file);
+        free(session_file);
+    }
 
     open_hashtbl(ctx->dircache, ctx->filecache, ctx->conn, &(ctx->tree));
 
     ctx->sv_writefiles = stringv_alloc();
     ctx->sv_readonlyfiles = stringv_alloc();
+    ctx->sv_pinned = load_pinned(ctx->pinnedfile);
     ctx->last_status_check = 0;
     ctx->interval_status_check = 60;    // TODO: make this configurable
 
     pthread_mutex_init(&(ctx->mutex), NULL);
+    pthread_cond_init(&(ctx->prefetch_cond), NULL);
+    pthread_cond_init(&(ctx->prefetch_done), NULL);
 
     ret = fuse_main(argc, argv, &mediafirefs_oper, ctx);
 
@@ -497,11 +687,17 @@ int main(int argc, char *argv[])
     }
     free(argv);
 
+    http_pool_cleanup();
+
     free(ctx->configfile);
     free(ctx->dircache);
     free(ctx->filecache);
+    free(ctx->pinnedfile);
     stringv_free(ctx->sv_writefiles);
     stringv_free(ctx->sv_readonlyfiles);
+    stringv_free(ctx->sv_pinned);
+    pthread_cond_destroy(&(ctx->prefetch_done));
+    pthread_cond_destroy(&(ctx->prefetch_cond));
     pthread_mutex_destroy(&(ctx->mutex));
     free(ctx);
 
@@ -37,11 +37,12 @@
 #include <libgen.h>
 #include <stdbool.h>
 #include <time.h>
-#include <openssl/sha.h>
+#include <openssl/evp.h>
 
 #include "../mfapi/mfconn.h"
 #include "../mfapi/apicalls.h"
 #include "../utils/stringv.h"
+#include "../utils/http.h"
 #include "../utils/hash.h"
 #include "hashtbl.h"
 #include "operations.h"
@@ -103,8 +104,83 @@ struct mediafirefs_openfile {
     bool            is_readonly;
     // whether or not to do a new file upload when closing
     bool            is_local;
+    // SHA256 of the file while it is written in order, so that it does not
+    // have to be read again for the upload when closing
+    EVP_MD_CTX     *hash_ctx;
+    // everything before this offset went into hash_ctx
+    uint64_t        hash_offset;
+    // cleared by a write before hash_offset or if hash_ctx could not be set
+    // up, after which the file is hashed as a whole when closing
+    bool            hash_sequential;
 };
 
+static void openfile_hash_init(struct mediafirefs_openfile *openfile)
+{
+    openfile->hash_ctx = EVP_MD_CTX_new();
+    openfile->hash_offset = 0;
+    openfile->hash_sequential = openfile->hash_ctx != NULL
+        && hash_init(openfile->hash_ctx) == 0;
+}
+
+// account for size bytes of buf that were written at offset
+static void openfile_hash_write(struct mediafirefs_openfile *openfile,
+                                const char *buf, size_t size, off_t offset)
+{
+    uint64_t        start;
+
+    if (!openfile->hash_sequential)
+        return;
+
+    start = (uint64_t) offset;
+    if (start < openfile->hash_offset) {
+        openfile->hash_sequential = false;
+        return;
+    }
+    // a write past hash_offset leaves a part that was in the file before or
+    // is a hole, which is read from the file
+    if (start > openfile->hash_offset
+        && hash_update_fd(openfile->hash_ctx, NULL, openfile->fd,
+                          openfile->hash_offset,
+                          start - openfile->hash_offset) != 0) {
+        openfile->hash_sequential = false;
+        return;
+    }
+
+    EVP_DigestUpdate(openfile->hash_ctx, buf, size);
+    openfile->hash_offset = start + size;
+}
+
+/*
+ * complete the hash with what the file holds beyond the last write
+ *
+ * returns -1 if the file was not written in order and has to be hashed as a
+ * whole
+ */
+static int openfile_hash_final(struct mediafirefs_openfile *openfile,
+                               unsigned char *hash, uint64_t * size)
+{
+    struct stat     st;
+
+    *size = 0;
+    if (!openfile->hash_sequential)
+        return -1;
+    openfile->hash_sequential = false;
+
+    if (fstat(openfile->fd, &st) != 0
+        || (uint64_t) st.st_size < openfile->hash_offset)
+        return -1;
+
+    if (hash_update_fd(openfile->hash_ctx, NULL, openfile->fd,
+                       openfile->hash_offset,
+                       st.st_size - openfile->hash_offset) != 0
+        || EVP_DigestFinal_ex(openfile->hash_ctx, hash, NULL) != 1)
+        return -1;
+
+    *size = st.st_size;
+
+    return 0;
+}
+
 int mediafirefs_getattr(const char *path, struct stat *stbuf)
 {
     /*
@@ -121,9 +197,12 @@ int mediafirefs_getattr(const char *path, struct stat *stbuf)
     pthread_mutex_lock(&(ctx->mutex));
 
     now = time(NULL);
-    if (now - ctx->last_status_check > ctx->interval_status_check) {
+    if (!ctx->offline
+        && now - ctx->last_status_check > ctx->interval_status_check) {
         folder_tree_update(ctx->tree, ctx->conn, false);
         ctx->last_status_check = now;
+        // let pinned files catch up with the changes
+        pthread_cond_signal(&(ctx->prefetch_cond));
     }
 
     retval = folder_tree_getattr(ctx->tree, ctx->conn, path, stbuf);
@@ -171,6 +250,17 @@ void mediafirefs_destroy(void *user_ptr)
 
     pthread_mutex_lock(&(ctx->mutex));
 
+    if (ctx->prefetch_started) {
+        ctx->prefetch_stop = true;
+        pthread_cond_signal(&(ctx->prefetch_cond));
+        pthread_mutex_unlock(&(ctx->mutex));
+        pthread_join(ctx->prefetch_thread, NULL);
+        pthread_mutex_lock(&(ctx->mutex));
+        ctx->prefetch_started = false;
+    }
+
+    http_print_class_stats(stderr);
+
     fprintf(stderr, "storing hashtable\n");
 
     fd = fopen(ctx->dircache, "w+");
@@ -187,7 +277,8 @@ void mediafirefs_destroy(void *user_ptr)
 
     folder_tree_destroy(ctx->tree);
 
-    mfconn_destroy(ctx->conn);
+    if (ctx->conn != NULL)
+        mfconn_destroy(ctx->conn);
 
     pthread_mutex_unlock(&(ctx->mutex));
 }
@@ -372,6 +463,10 @@ int mediafirefs_open(const char *path, struct fuse_file_info *file_info)
 
     pthread_mutex_lock(&(ctx->mutex));
 
+    // the prefetch thread is bringing this file up to date without the lock
+    while (ctx->prefetch_path != NULL && strcmp(ctx->prefetch_path, path) == 0)
+        pthread_cond_wait(&(ctx->prefetch_done), &(ctx->mutex));
+
     /* if file is not opened read-only, check if it was already opened in a
      * not read-only mode and abort if yes */
     if ((file_info->flags & O_ACCMODE) != O_RDONLY
@@ -396,8 +491,9 @@ int mediafirefs_open(const char *path, struct fuse_file_info *file_info)
         is_open = true;
     }
 
+    // when offline, only what is in the cache can be served
     fd = folder_tree_open_file(ctx->tree, ctx->conn, path, file_info->flags,
-                               !is_open);
+                               !is_open && !ctx->offline);
     if (fd < 0) {
         fprintf(stderr, "folder_tree_file_open unsuccessful\n");
         pthread_mutex_unlock(&(ctx->mutex));
@@ -408,6 +504,7 @@ int mediafirefs_open(const char *path, struct fuse_file_info *file_info)
     openfile->fd = fd;
     openfile->is_local = false;
     openfile->path = strdup(path);
+    openfile_hash_init(openfile);
 
     if ((file_info->flags & O_ACCMODE) == O_RDONLY) {
         openfile->is_readonly = true;
@@ -456,6 +553,7 @@ int mediafirefs_create(const char *path, mode_t mode,
     openfile->is_local = true;
     openfile->is_readonly = false;
     openfile->path = strdup(path);
+    openfile_hash_init(openfile);
     file_info->fh = (uintptr_t) openfile;
 
     // add to writefiles
@@ -491,13 +589,16 @@ int mediafirefs_write(const char *path, const char *buf, size_t size,
     (void)path;
     ssize_t         retval;
     struct mediafirefs_context_private *ctx;
+    struct mediafirefs_openfile *openfile;
 
     ctx = fuse_get_context()->private_data;
     pthread_mutex_lock(&(ctx->mutex));
 
-    retval =
-        pwrite(((struct mediafirefs_openfile *)(uintptr_t) file_info->fh)->fd,
-               buf, size, offset);
+    openfile = (struct mediafirefs_openfile *)(uintptr_t) file_info->fh;
+
+    retval = pwrite(openfile->fd, buf, size, offset);
+    if (retval > 0)
+        openfile_hash_write(openfile, buf, retval, offset);
 
     pthread_mutex_unlock(&(ctx->mutex));
 
@@ -520,16 +621,14 @@ int mediafirefs_release(const char *path, struct fuse_file_info *file_info)
     char           *file_name;
     char           *dir_name;
     const char     *folder_key;
-    char           *upload_key;
     char           *temp1;
     char           *temp2;
     int             retval;
     struct mediafirefs_context_private *ctx;
     struct mediafirefs_openfile *openfile;
-    struct mfconn_upload_check_result check_result;
-    unsigned char   bhash[SHA256_DIGEST_LENGTH];
-    char           *hash;
+    unsigned char   hash[SHA256_DIGEST_LENGTH];
     uint64_t        size;
+    bool            hashed;
 
     ctx = fuse_get_context()->private_data;
 
@@ -548,6 +647,7 @@ int mediafirefs_release(const char *path, struct fuse_file_info *file_info)
 
         close(openfile->fd);
         free(openfile->path);
+        EVP_MD_CTX_free(openfile->hash_ctx);
         free(openfile);
         pthread_mutex_unlock(&(ctx->mutex));
         return 0;
@@ -564,6 +664,9 @@ int mediafirefs_release(const char *path, struct fuse_file_info *file_info)
                 openfile->path);
         exit(1);
     }
+
+    hashed = openfile_hash_final(openfile, hash, &size) == 0;
+
     // if the file only exists locally, an initial upload has to be done
     if (openfile->is_local) {
         // pass a copy because dirname and basename may modify their argument
@@ -573,89 +676,25 @@ int mediafirefs_release(const char *path, struct fuse_file_info *file_info)
         dir_name = dirname(temp2);
 
         fh = fdopen(openfile->fd, "r");
-        rewind(fh);
 
         folder_key = folder_tree_path_get_key(ctx->tree, ctx->conn, dir_name);
 
-        retval = calc_sha256(fh, bhash, &size);
-        rewind(fh);
+        retval = mfconn_upload_file(ctx->conn, folder_key, fh, file_name,
+                                    hashed ? hash : NULL, size);
 
-        if (retval != 0) {
-            fprintf(stderr, "failed to calculate hash\n");
-            fclose(fh);
-            free(temp1);
-            free(temp2);
-            free(openfile->path);
-            free(openfile);
-            pthread_mutex_unlock(&(ctx->mutex));
-            return -EACCES;
-        }
-
-        hash = binary2hex(bhash, SHA256_DIGEST_LENGTH);
-
-        retval = mfconn_api_upload_check(ctx->conn, file_name, hash, size,
-                                         folder_key, &check_result);
+        fclose(fh);
+        free(temp1);
+        free(temp2);
+        free(openfile->path);
+        EVP_MD_CTX_free(openfile->hash_ctx);
+        free(openfile);
 
         if (retval != 0) {
-            fclose(fh);
-            free(temp1);
-            free(temp2);
-            free(openfile->path);
-            free(openfile);
-            free(hash);
-            fprintf(stderr, "mfconn_api_upload_check failed\n");
+            fprintf(stderr, "mfconn_upload_file failed\n");
             pthread_mutex_unlock(&(ctx->mutex));
             return -EACCES;
         }
 
-        if (check_result.hash_exists) {
-            // hash exists, so use upload/instant
-
-            retval = mfconn_api_upload_instant(ctx->conn, NULL,
-                                               file_name, hash, size,
-                                               folder_key);
-
-            fclose(fh);
-            free(temp1);
-            free(temp2);
-            free(openfile->path);
-            free(openfile);
-            free(hash);
-
-            if (retval != 0) {
-                fprintf(stderr, "mfconn_api_upload_instant failed\n");
-                pthread_mutex_unlock(&(ctx->mutex));
-                return -EACCES;
-            }
-        } else {
-            // hash does not exist, so do full upload
-            upload_key = NULL;
-            retval = mfconn_api_upload_simple(ctx->conn, folder_key,
-                                              fh, file_name, &upload_key);
-
-            fclose(fh);
-            free(temp1);
-            free(temp2);
-            free(openfile->path);
-            free(openfile);
-            free(hash);
-
-            if (retval != 0 || upload_key == NULL) {
-                fprintf(stderr, "mfconn_api_upload_simple failed\n");
-                pthread_mutex_unlock(&(ctx->mutex));
-                return -EACCES;
-            }
-            // poll for completion
-            retval = mfconn_upload_poll_for_completion(ctx->conn, upload_key);
-            free(upload_key);
-
-            if (retval != 0) {
-                fprintf(stderr, "mfconn_upload_poll_for_completion failed\n");
-                pthread_mutex_unlock(&(ctx->mutex));
-                return -1;
-            }
-        }
-
         folder_tree_update(ctx->tree, ctx->conn, true);
         pthread_mutex_unlock(&(ctx->mutex));
         return 0;
@@ -666,8 +705,10 @@ int mediafirefs_release(const char *path, struct fuse_file_info *file_info)
 
     close(openfile->fd);
 
-    retval = folder_tree_upload_patch(ctx->tree, ctx->conn, openfile->path);
+    retval = folder_tree_upload_patch(ctx->tree, ctx->conn, openfile->path,
+                                      hashed ? hash : NULL, size);
     free(openfile->path);
+    EVP_MD_CTX_free(openfile->hash_ctx);
     free(openfile);
 
     if (retval != 0) {
@@ -957,80 +998,170 @@ int mediafirefs_fsync(const char *path, int datasync,
     return -ENOSYS;
 }
 
+// write the folder keys of all pinned directories one per line
+static int mediafirefs_store_pinned(struct mediafirefs_context_private *ctx)
+{
+    FILE           *fh;
+    size_t          i;
+
+    fh = fopen(ctx->pinnedfile, "w");
+    if (fh == NULL) {
+        fprintf(stderr, "cannot open %s for writing\n", ctx->pinnedfile);
+        return -1;
+    }
+
+    for (i = 0; i < stringv_len(ctx->sv_pinned); i++) {
+        fprintf(fh, "%s\n", stringv_get(ctx->sv_pinned, i));
+    }
+
+    fclose(fh);
+
+    return 0;
+}
+
+/*
+ * the only supported extended attribute is MEDIAFIREFS_XATTR_PINNED on
+ * directories. Setting it to any value pins the directory, removing it unpins
+ * the directory again.
+ */
 int mediafirefs_setxattr(const char *path, const char *name,
                          const char *value, size_t size, int flags)
 {
-    (void)path;
-    (void)name;
     (void)value;
     (void)size;
     (void)flags;
+    const char     *key;
     struct mediafirefs_context_private *ctx;
 
     ctx = fuse_get_context()->private_data;
 
+    if (strcmp(name, MEDIAFIREFS_XATTR_PINNED) != 0)
+        return -ENOTSUP;
+
+    if (ctx->offline)
+        return -EROFS;
+
     pthread_mutex_lock(&(ctx->mutex));
 
-    fprintf(stderr, "setxattr not implemented\n");
+    if (!folder_tree_path_is_directory(ctx->tree, ctx->conn, path)) {
+        fprintf(stderr, "only directories can be pinned\n");
+        pthread_mutex_unlock(&(ctx->mutex));
+        return -ENOTSUP;
+    }
+
+    key = folder_tree_path_get_key(ctx->tree, ctx->conn, path);
+    if (key == NULL) {
+        fprintf(stderr, "key is NULL\n");
+        pthread_mutex_unlock(&(ctx->mutex));
+        return -ENOENT;
+    }
+
+    if (!stringv_mem(ctx->sv_pinned, key)) {
+        fprintf(stderr, "pinning %s\n", path);
+        stringv_add(ctx->sv_pinned, key);
+        mediafirefs_store_pinned(ctx);
+        // fetch the contents right away
+        pthread_cond_signal(&(ctx->prefetch_cond));
+    }
 
     pthread_mutex_unlock(&(ctx->mutex));
 
-    return -ENOSYS;
+    return 0;
+}
+
+static bool mediafirefs_path_is_pinned(struct mediafirefs_context_private
+                                       *ctx, const char *path)
+{
+    const char     *key;
+
+    if (!folder_tree_path_is_directory(ctx->tree, ctx->conn, path))
+        return false;
+
+    key = folder_tree_path_get_key(ctx->tree, ctx->conn, path);
+    if (key == NULL)
+        return false;
+
+    return stringv_mem(ctx->sv_pinned, key);
 }
 
 int mediafirefs_getxattr(const char *path, const char *name, char *value,
                          size_t size)
 {
-    (void)path;
-    (void)name;
-    (void)value;
-    (void)size;
+    bool            is_pinned;
     struct mediafirefs_context_private *ctx;
 
     ctx = fuse_get_context()->private_data;
 
+    if (strcmp(name, MEDIAFIREFS_XATTR_PINNED) != 0)
+        return -ENODATA;
+
     pthread_mutex_lock(&(ctx->mutex));
+    is_pinned = mediafirefs_path_is_pinned(ctx, path);
+    pthread_mutex_unlock(&(ctx->mutex));
 
-    fprintf(stderr, "getxattr not implemented\n");
+    if (!is_pinned)
+        return -ENODATA;
 
-    pthread_mutex_unlock(&(ctx->mutex));
+    // the value is "1"
+    if (size == 0)
+        return 1;
+    value[0] = '1';
 
-    return -ENOSYS;
+    return 1;
 }
 
 int mediafirefs_listxattr(const char *path, char *list, size_t size)
 {
-    (void)path;
-    (void)list;
-    (void)size;
+    bool            is_pinned;
     struct mediafirefs_context_private *ctx;
 
     ctx = fuse_get_context()->private_data;
 
     pthread_mutex_lock(&(ctx->mutex));
+    is_pinned = mediafirefs_path_is_pinned(ctx, path);
+    pthread_mutex_unlock(&(ctx->mutex));
 
-    fprintf(stderr, "listxattr not implemented\n");
+    if (!is_pinned)
+        return 0;
 
-    pthread_mutex_unlock(&(ctx->mutex));
+    // the list consists of zero terminated names
+    if (size == 0)
+        return sizeof(MEDIAFIREFS_XATTR_PINNED);
+    if (size < sizeof(MEDIAFIREFS_XATTR_PINNED))
+        return -ERANGE;
+    memcpy(list, MEDIAFIREFS_XATTR_PINNED, sizeof(MEDIAFIREFS_XATTR_PINNED));
 
-    return -ENOSYS;
+    return sizeof(MEDIAFIREFS_XATTR_PINNED);
 }
 
-int mediafirefs_removexattr(const char *path, const char *list)
+int mediafirefs_removexattr(const char *path, const char *name)
 {
-    (void)path;
-    (void)list;
+    const char     *key;
     struct mediafirefs_context_private *ctx;
 
     ctx = fuse_get_context()->private_data;
 
+    if (strcmp(name, MEDIAFIREFS_XATTR_PINNED) != 0)
+        return -ENODATA;
+
+    if (ctx->offline)
+        return -EROFS;
+
     pthread_mutex_lock(&(ctx->mutex));
 
-    fprintf(stderr, "removexattr not implemented\n");
+    if (!mediafirefs_path_is_pinned(ctx, path)) {
+        pthread_mutex_unlock(&(ctx->mutex));
+        return -ENODATA;
+    }
+
+    key = folder_tree_path_get_key(ctx->tree, ctx->conn, path);
+    fprintf(stderr, "unpinning %s\n", path);
+    stringv_del(ctx->sv_pinned, key);
+    mediafirefs_store_pinned(ctx);
 
     pthread_mutex_unlock(&(ctx->mutex));
 
-    return -ENOSYS;
+    return 0;
 }
 
 int mediafirefs_opendir(const char *path, struct fuse_file_info *file_info)
@@ -1087,12 +1218,111 @@ int mediafirefs_fsyncdir(const char *path, int datasync,
 }
 
 /*
-void* mediafirefs_init(struct fuse_conn_info *conn)
+ * background thread keeping all files below pinned directories cached at
+ * their latest remote revision
+ *
+ * Whenever it wakes up, it collects the outdated files and then brings them
+ * up to date one by one. The global lock is only held to look up a file and
+ * to record the result while the transfer itself runs without it, so that
+ * other operations are not held up by prefetching. Files that are currently
+ * open are skipped for the same reason as in mediafirefs_open and opening the
+ * file that is being transferred waits until the transfer is done.
+ */
+static void    *mediafirefs_prefetch(void *user_ptr)
+{
+    struct mediafirefs_context_private *ctx;
+    stringv        *paths;
+    const char     *path;
+    size_t          i;
+    folder_tree_fetch *fetch;
+    time_t          now;
+    struct timespec deadline;
+
+    ctx = (struct mediafirefs_context_private *)user_ptr;
+
+    // interactive transfers take precedence over everything done here
+    http_set_thread_class(HTTP_CLASS_PREFETCH);
+
+    pthread_mutex_lock(&(ctx->mutex));
+
+    while (!ctx->prefetch_stop) {
+        now = time(NULL);
+        if (now - ctx->last_status_check > ctx->interval_status_check) {
+            folder_tree_update(ctx->tree, ctx->conn, false);
+            ctx->last_status_check = now;
+        }
+
+        paths = stringv_alloc();
+        for (i = 0; i < stringv_len(ctx->sv_pinned); i++) {
+            folder_tree_collect_outdated(ctx->tree, ctx->conn,
+                                         stringv_get(ctx->sv_pinned, i),
+                                         paths);
+        }
+
+        for (i = 0; i < stringv_len(paths) && !ctx->prefetch_stop; i++) {
+            path = stringv_get(paths, i);
+            if (stringv_mem(ctx->sv_readonlyfiles, path)
+                || stringv_mem(ctx->sv_writefiles, path))
+                continue;
+
+            fetch = folder_tree_fetch_prepare(ctx->tree, ctx->conn, path);
+            if (fetch == NULL)
+                continue;
+
+            fprintf(stderr, "prefetching %s\n", path);
+            ctx->prefetch_path = path;
+            pthread_mutex_unlock(&(ctx->mutex));
+
+            folder_tree_fetch_run(fetch, ctx->conn);
+
+            pthread_mutex_lock(&(ctx->mutex));
+            folder_tree_fetch_commit(ctx->tree, fetch);
+            folder_tree_fetch_free(fetch);
+            ctx->prefetch_path = NULL;
+            pthread_cond_broadcast(&(ctx->prefetch_done));
+        }
+
+        stringv_free(paths);
+
+        if (ctx->prefetch_stop)
+            break;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += ctx->interval_status_check;
+        pthread_cond_timedwait(&(ctx->prefetch_cond), &(ctx->mutex),
+                               &deadline);
+    }
+
+    pthread_mutex_unlock(&(ctx->mutex));
+
+    return NULL;
+}
+
+/*
+ * the prefetching thread is started here and not in main() because fuse
+ * forks into the background after main() handed over control
+ */
+void           *mediafirefs_init(struct fuse_conn_info *conn)
 {
     (void)conn;
-    fprintf(stderr, "init is a no-op");
+    struct mediafirefs_context_private *ctx;
+
+    ctx = fuse_get_context()->private_data;
+
+    if (ctx->offline)
+        return ctx;
+
+    pthread_mutex_lock(&(ctx->mutex));
+    if (pthread_create(&(ctx->prefetch_thread), NULL, mediafirefs_prefetch,
+                       ctx) == 0) {
+        ctx->prefetch_started = true;
+    } else {
+        fprintf(stderr, "cannot start prefetching thread\n");
+    }
+    pthread_mutex_unlock(&(ctx->mutex));
+
+    return ctx;
 }
-*/
 
 int mediafirefs_access(const char *path, int mode)
 {
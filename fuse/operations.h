@@ -21,6 +21,7 @@
 
 #include <fuse/fuse.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <sys/types.h>
 #include <pthread.h>
 
@@ -51,8 +52,25 @@ struct mediafirefs_context_private {
     stringv        *sv_writefiles;
     /* stores all files that have been opened for reading only */
     stringv        *sv_readonlyfiles;
+    /* if set, no network access is done and the filesystem is read-only */
+    bool            offline;
+    /* folder keys of the pinned directories and where they are stored */
+    stringv        *sv_pinned;
+    char           *pinnedfile;
+    /* the thread keeping the files in pinned directories up to date */
+    pthread_t       prefetch_thread;
+    pthread_cond_t  prefetch_cond;
+    bool            prefetch_started;
+    bool            prefetch_stop;
+    /* the file the prefetch thread is transferring without holding mutex
+     * and the condition signalled when it is done with it */
+    const char     *prefetch_path;
+    pthread_cond_t  prefetch_done;
 };
 
+/* extended attribute marking a directory as pinned */
+#define MEDIAFIREFS_XATTR_PINNED "user.mediafire.pinned"
+
 int             mediafirefs_getattr(const char *path, struct stat *stbuf);
 int             mediafirefs_readlink(const char *path, char *buf,
                                      size_t bufsize);
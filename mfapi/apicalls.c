@@ -17,10 +17,12 @@
  */
 
 #include <jansson.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 #include "../utils/http.h"
+#include "apicalls.h"
 
 const char     *mfconn_file_link_types[] = {
     "normal_download",
@@ -112,3 +114,56 @@ int mfapi_decode_common(mfhttp * conn, void *user_ptr)
 
     return 0;
 }
+
+/*
+ * join keys with commas for the calls that accept a list of keys
+ *
+ * the *_batch variants of those calls send at most MFAPI_MAX_BATCH_KEYS keys
+ * per request and report the result of every key in an array of ints
+ */
+char           *mfapi_join_keys(const char **keys, int num_keys)
+{
+    char           *joined;
+    size_t          len = 0;
+    int             i;
+
+    for (i = 0; i < num_keys; i++)
+        len += strlen(keys[i]) + 1;
+
+    joined = (char *)malloc(len + 1);
+    if (joined == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return NULL;
+    }
+
+    len = 0;
+    for (i = 0; i < num_keys; i++) {
+        if (i > 0)
+            joined[len++] = ',';
+        strcpy(joined + len, keys[i]);
+        len += strlen(keys[i]);
+    }
+    joined[len] = '\0';
+
+    return joined;
+}
+
+/*
+ * the index of the first key that equals key and has no result yet (-1 in
+ * results) or -1 if there is none
+ */
+int mfapi_batch_match(const char **keys, int num_keys, const int *results,
+                      const char *key)
+{
+    int             i;
+
+    if (key == NULL)
+        return -1;
+
+    for (i = 0; i < num_keys; i++) {
+        if (results[i] == -1 && strcmp(keys[i], key) == 0)
+            return i;
+    }
+
+    return -1;
+}
@@ -36,6 +36,13 @@
 
 #define MFAPI_VERSION "1.2"
 
+/* calls that take a list of keys are made for this many keys at a time, which
+ * keeps the URL of the request short */
+#define MFAPI_MAX_BATCH_KEYS 100
+
+/* error codes of the API start at this value, lower ones are from curl */
+#define MFAPI_MIN_ERROR_CODE 100
+
 enum mfconn_device_change_type {
     MFCONN_DEVICE_CHANGE_DELETED_FOLDER,
     MFCONN_DEVICE_CHANGE_DELETED_FILE,
@@ -57,6 +64,8 @@ enum mfconn_file_link_type {
 
 extern const char *mfconn_file_link_types[];    // declared in apicalls.c
 
+struct mflisting;               // declared in listing.h
+
 struct mfconn_device_change {
     enum mfconn_device_change_type change;
     char            key[16];
@@ -69,21 +78,46 @@ struct mfconn_upload_check_result {
     bool            in_account;
     bool            file_exists;
     bool            different_hash;
-    /* TODO: add resumable_upload */
+    /* the state of a resumable upload, only filled in if it was asked for */
+    bool            all_units_ready;
+    uint32_t        number_of_units;
+    uint64_t        unit_size;
+    /* unit i was received if bit i % 16 of word i / 16 is set */
+    uint16_t       *bitmap;
+    uint32_t        bitmap_count;
+    /* the key to poll, once all units were received */
+    char           *upload_key;
 };
 
 int             mfapi_check_response(json_t * response, const char *apicall);
 
 int             mfapi_decode_common(mfhttp * conn, void *user_ptr);
 
+char           *mfapi_join_keys(const char **keys, int num_keys);
+
+int             mfapi_batch_match(const char **keys, int num_keys,
+                                  const int *results, const char *key);
+
 int             mfconn_api_file_get_info(mfconn * conn, mffile * file,
                                          const char *quickkey);
 
+int             mfconn_api_file_get_info_batch(mfconn * conn,
+                                               mffile ** files,
+                                               const char **quickkeys,
+                                               int num_keys, int *results);
+
 int             mfconn_api_file_get_links(mfconn * conn, mffile * file,
                                           const char *quickkey,
                                           enum mfconn_file_link_type
                                           link_mask);
 
+int             mfconn_api_file_get_links_batch(mfconn * conn,
+                                                mffile ** files,
+                                                const char **quickkeys,
+                                                int num_keys,
+                                                enum mfconn_file_link_type
+                                                link_mask, int *results);
+
 int             mfconn_api_file_move(mfconn * conn, const char *quickkey,
                                      const char *folderkey);
 
@@ -95,12 +129,16 @@ int             mfconn_api_folder_create(mfconn * conn, const char *parent,
 
 long            mfconn_api_folder_get_content(mfconn * conn, const int mode,
                                               const char *folderkey,
-                                              mffolder *** folder_result,
-                                              mffile *** file_result);
+                                              struct mflisting *listing);
 
 int             mfconn_api_folder_get_info(mfconn * conn, mffolder * folder,
                                            const char *folderkey);
 
+int             mfconn_api_folder_get_info_batch(mfconn * conn,
+                                                 mffolder ** folders,
+                                                 const char **folderkeys,
+                                                 int num_keys, int *results);
+
 int             mfconn_api_folder_move(mfconn * conn,
                                        const char *folder_key_src,
                                        const char *folder_key_dst);
@@ -125,11 +163,20 @@ int             mfconn_api_folder_delete(mfconn * conn, const char *folderkey);
 
 int             mfconn_api_file_delete(mfconn * conn, const char *quickkey);
 
+int             mfconn_api_file_delete_batch(mfconn * conn,
+                                             const char **quickkeys,
+                                             int num_keys, int *results);
+
 int             mfconn_api_device_get_status(mfconn * conn,
                                              uint64_t * revision);
 
-int             mfconn_api_device_get_changes(mfconn * conn, uint64_t revision, struct mfconn_device_change
-                                              **changes);
+int             mfconn_api_device_get_changes(mfconn * conn,
+                                              uint64_t revision,
+                                              int (*changes_cb) (struct
+                                                   mfconn_device_change *
+                                                   changes, void *user_ptr),
+                                              void *user_ptr,
+                                              uint64_t * device_revision);
 
 int             mfconn_api_device_get_updates(mfconn * conn,
                                               const char *quickkey,
@@ -145,9 +192,14 @@ int             mfconn_api_device_get_patch(mfconn * conn, mfpatch * patch,
 int             mfconn_api_upload_check(mfconn * conn, const char *filename,
                                         const char *hash,
                                         uint64_t size, const char *folder_key,
+                                        bool resumable,
                                         struct mfconn_upload_check_result
                                         *result);
 
+void            mfconn_upload_check_result_free(struct
+                                                mfconn_upload_check_result
+                                                *result);
+
 int             mfconn_api_upload_instant(mfconn * conn, const char *quick_key,
                                           const char *filename,
                                           const char *hash, uint64_t size,
@@ -164,8 +216,26 @@ int             mfconn_api_upload_patch(mfconn * conn, const char *quickkey,
                                         const char *patch_path,
                                         char **upload_key);
 
+int             mfconn_api_upload_resumable(mfconn * conn,
+                                            const char *action_token,
+                                            const char *folder_key,
+                                            const char *file_name,
+                                            uint64_t file_size,
+                                            const char *file_hash, int fd,
+                                            uint32_t unit_id,
+                                            uint64_t unit_offset,
+                                            uint64_t unit_size,
+                                            const char *unit_hash,
+                                            char **upload_key);
+
+int             mfconn_api_user_get_action_token(mfconn * conn,
+                                                 const char *type,
+                                                 int lifespan,
+                                                 char **action_token);
+
 int             mfconn_api_upload_poll_upload(mfconn * conn,
-                                              const char *upload_key,
-                                              int *status, int *fileerror);
+                                              const char **upload_keys,
+                                              int num_keys, int *status,
+                                              int *fileerror);
 
 #endif
@@ -29,71 +29,156 @@
 #include "../mfconn.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
+/* device/get_changes reports the changes in blocks of this many revisions
+ * unless the response says otherwise */
+#define DEVICE_CHANGES_BLOCK 500
+
+struct device_get_changes {
+    struct mfconn_device_change *changes;
+    size_t          num_changes;
+    size_t          max_changes;
+    uint64_t        device_revision;
+    uint64_t        block;
+};
+
+static int      changes_reserve(struct device_get_changes *state);
+
 static int      _decode_device_get_changes(mfhttp * conn, void *data);
 
 /*
- * the mfconn_device_change array will be realloc'ed so it must either point
- * to a malloc'ed memory or be NULL
+ * fetches the changes after revision and hands them to changes_cb one block
+ * of revisions at a time, so that only a single block is held in memory no
+ * matter how far behind revision is
+ *
+ * the array passed to changes_cb is sorted by revision and terminated by an
+ * entry with change type MFCONN_DEVICE_CHANGE_END whose revision is the last
+ * revision that the block covers. It is only valid during the callback.
  *
- * the returned array will be sorted by revision
+ * stops with an error if changes_cb returns non-zero
+ *
+ * on success, device_revision (if not NULL) is set to the current device
+ * revision
  */
 int mfconn_api_device_get_changes(mfconn * conn, uint64_t revision,
-                                  struct mfconn_device_change **changes)
+                                  int (*changes_cb) (struct
+                                                     mfconn_device_change *
+                                                     changes, void *user_ptr),
+                                  void *user_ptr, uint64_t * device_revision)
 {
     const char     *api_call;
     int             retval;
     mfhttp         *http;
-    int             i;
+    struct mfconn_retry retry;
+    struct device_get_changes state;
+    struct mfconn_device_change *end;
+    uint64_t        block_end;
 
-    if (conn == NULL)
+    if (conn == NULL || changes_cb == NULL)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
-        if (*changes != NULL) {
-            free(*changes);
-            *changes = NULL;
-        }
+    memset(&state, 0, sizeof(state));
 
-        api_call = mfconn_create_signed_get(conn, 0, "device/get_changes.php",
-                                            "?revision=%" PRIu64
-                                            "&response_format=json", revision);
-        if (api_call == NULL) {
-            fprintf(stderr, "mfconn_create_signed_get failed\n");
-            return -1;
+    for (;;) {
+        if (mfconn_retry_start(conn, &retry, "device/get_changes") != 0) {
+            retval = -1;
+            break;
         }
 
-        http = http_create();
-        retval =
-            http_get_buf(http, api_call, _decode_device_get_changes,
-                         (void *)changes);
-        http_destroy(http);
-        mfconn_update_secret_key(conn);
+        do {
+            state.num_changes = 0;
+            state.block = DEVICE_CHANGES_BLOCK;
+
+            api_call = mfconn_create_signed_get(conn, 0,
+                                                "device/get_changes.php",
+                                                "?revision=%" PRIu64
+                                                "&response_format=json",
+                                                revision);
+            if (api_call == NULL) {
+                fprintf(stderr, "mfconn_create_signed_get failed\n");
+                free(state.changes);
+                return -1;
+            }
+
+            http = http_create();
+            http_set_timeout(http, mfconn_retry_timeout(&retry));
+            retval =
+                http_get_buf(http, api_call, _decode_device_get_changes,
+                             (void *)&state);
+            http_destroy(http);
+            mfconn_update_secret_key(conn);
+
+            free((void *)api_call);
+
+        } while (mfconn_retry_again(conn, &retry, &retval));
+
+        if (retval != 0)
+            break;
 
-        free((void *)api_call);
+        /* the block ends at the next multiple of its size */
+        block_end = (revision / state.block + 1) * state.block;
+        if (block_end > state.device_revision)
+            block_end = state.device_revision;
 
-        if (retval != 127 && retval != 28)
+        if (changes_reserve(&state) != 0) {
+            retval = -1;
             break;
+        }
+        end = state.changes + state.num_changes;
+        memset(end, 0, sizeof(struct mfconn_device_change));
+        end->change = MFCONN_DEVICE_CHANGE_END;
+        end->revision = block_end;
 
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
+        if (changes_cb(state.changes, user_ptr) != 0) {
+            retval = -1;
             break;
         }
+
+        if (block_end <= revision || block_end >= state.device_revision)
+            break;
+        revision = block_end;
     }
 
+    if (retval == 0 && device_revision != NULL)
+        *device_revision = state.device_revision;
+
+    free(state.changes);
+
     return retval;
 }
 
+/*
+ * make room for one more change and the terminating entry
+ *
+ * the array is reused for all blocks, so it only grows until it fits the
+ * largest block
+ */
+static int changes_reserve(struct device_get_changes *state)
+{
+    struct mfconn_device_change *changes;
+    size_t          max_changes;
+
+    if (state->num_changes + 1 < state->max_changes)
+        return 0;
+
+    max_changes = state->max_changes * 2;
+    if (max_changes < 64)
+        max_changes = 64;
+    changes = (struct mfconn_device_change *)
+        realloc(state->changes,
+                max_changes * sizeof(struct mfconn_device_change));
+    if (changes == NULL) {
+        fprintf(stderr, "realloc failed\n");
+        return -1;
+    }
+    state->changes = changes;
+    state->max_changes = max_changes;
+
+    return 0;
+}
+
 static void aux(json_t * key, json_t * parent, json_t * revision,
                 enum mfconn_device_change_type change,
-                struct mfconn_device_change **changes, size_t * len_changes)
+                struct device_get_changes *state)
 {
     struct mfconn_device_change *tmp_change;
 
@@ -101,11 +186,10 @@ static void aux(json_t * key, json_t * parent, json_t * revision,
         fprintf(stderr, "change without either key, revision or parent");
         return;
     }
-    (*len_changes)++;
-    *changes = (struct mfconn_device_change *)
-        realloc(*changes,
-                (*len_changes) * sizeof(struct mfconn_device_change));
-    tmp_change = *changes + (*len_changes) - 1;
+    if (changes_reserve(state) != 0)
+        return;
+    tmp_change = state->changes + state->num_changes;
+    state->num_changes++;
     tmp_change->change = change;
     strncpy(tmp_change->key, json_string_value(key), sizeof(tmp_change->key));
     strncpy(tmp_change->parent, json_string_value(parent),
@@ -115,8 +199,13 @@ static void aux(json_t * key, json_t * parent, json_t * revision,
 
 static int change_compare(const void *a, const void *b)
 {
-    return ((struct mfconn_device_change *)a)->revision
-        - ((struct mfconn_device_change *)b)->revision;
+    uint64_t        revision_a;
+    uint64_t        revision_b;
+
+    revision_a = ((struct mfconn_device_change *)a)->revision;
+    revision_b = ((struct mfconn_device_change *)b)->revision;
+
+    return (revision_a > revision_b) - (revision_a < revision_b);
 }
 
 static int _decode_device_get_changes(mfhttp * conn, void *user_ptr)
@@ -132,16 +221,16 @@ static int _decode_device_get_changes(mfhttp * conn, void *user_ptr)
     json_t         *parent;
     json_t         *revision;
     json_t         *device_revision;
+    json_t         *block;
     int             retval;
 
     int             array_sz;
     int             i = 0;
 
-    struct mfconn_device_change **changes;
-    size_t          len_changes;
+    struct device_get_changes *state;
 
-    changes = (struct mfconn_device_change **)user_ptr;
-    if (changes == NULL)
+    state = (struct device_get_changes *)user_ptr;
+    if (state == NULL)
         return -1;
 
     root = http_parse_buf_json(conn, 0, &error);
@@ -168,8 +257,11 @@ static int _decode_device_get_changes(mfhttp * conn, void *user_ptr)
         json_decref(root);
         return -1;
     }
+    state->device_revision = atoll(json_string_value(device_revision));
 
-    len_changes = 0;
+    block = json_object_get(response, "changes_list_block");
+    if (json_is_string(block) && atoll(json_string_value(block)) > 0)
+        state->block = atoll(json_string_value(block));
 
     node = json_object_get(response, "updated");
 
@@ -184,7 +276,7 @@ static int _decode_device_get_changes(mfhttp * conn, void *user_ptr)
             parent = json_object_get(data, "parent_folderkey");
             revision = json_object_get(data, "revision");
             aux(key, parent, revision, MFCONN_DEVICE_CHANGE_UPDATED_FILE,
-                changes, &len_changes);
+                state);
         }
     }
 
@@ -199,7 +291,7 @@ static int _decode_device_get_changes(mfhttp * conn, void *user_ptr)
             parent = json_object_get(data, "parent_folderkey");
             revision = json_object_get(data, "revision");
             aux(key, parent, revision, MFCONN_DEVICE_CHANGE_UPDATED_FOLDER,
-                changes, &len_changes);
+                state);
         }
     }
 
@@ -216,7 +308,7 @@ static int _decode_device_get_changes(mfhttp * conn, void *user_ptr)
             parent = json_object_get(data, "parent_folderkey");
             revision = json_object_get(data, "revision");
             aux(key, parent, revision, MFCONN_DEVICE_CHANGE_DELETED_FILE,
-                changes, &len_changes);
+                state);
         }
     }
 
@@ -231,22 +323,12 @@ static int _decode_device_get_changes(mfhttp * conn, void *user_ptr)
             parent = json_object_get(data, "parent_folderkey");
             revision = json_object_get(data, "revision");
             aux(key, parent, revision, MFCONN_DEVICE_CHANGE_DELETED_FOLDER,
-                changes, &len_changes);
+                state);
         }
     }
     // sort
-    qsort(*changes, len_changes, sizeof(struct mfconn_device_change),
-          change_compare);
-
-    // put an entry with change type MFCONN_DEVICE_CHANGE_END at the end
-    // encode the current device revision as its revision
-    len_changes++;
-    *changes = (struct mfconn_device_change *)
-        realloc(*changes, len_changes * sizeof(struct mfconn_device_change));
-    memset(*changes + len_changes - 1, 0, sizeof(struct mfconn_device_change));
-    (*changes)[len_changes - 1].change = MFCONN_DEVICE_CHANGE_END;
-    (*changes)[len_changes - 1].revision =
-        atoll(json_string_value(device_revision));
+    qsort(state->changes, state->num_changes,
+          sizeof(struct mfconn_device_change), change_compare);
 
     json_decref(root);
 
@@ -33,12 +33,15 @@ int mfconn_api_device_get_status(mfconn * conn, uint64_t * revision)
     const char     *api_call;
     int             retval;
     mfhttp         *http;
-    int             i;
+    struct mfconn_retry retry;
 
     if (conn == NULL)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    if (mfconn_retry_start(conn, &retry, "device/get_status") != 0)
+        return -1;
+
+    do {
         api_call = mfconn_create_signed_get(conn, 0, "device/get_status.php",
                                             "?response_format=json");
         if (api_call == NULL) {
@@ -47,6 +50,7 @@ int mfconn_api_device_get_status(mfconn * conn, uint64_t * revision)
         }
 
         http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
         retval =
             http_get_buf(http, api_call, _decode_device_get_status,
                          (void *)revision);
@@ -55,22 +59,7 @@ int mfconn_api_device_get_status(mfconn * conn, uint64_t * revision)
 
         free((void *)api_call);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
-    }
+    } while (mfconn_retry_again(conn, &retry, &retval));
 
     return retval;
 }
@@ -39,8 +39,8 @@ int mfconn_api_device_get_updates(mfconn * conn, const char *quickkey,
     int             len;
     mfhttp         *http;
     int             retval;
-    int             i,
-                    j;
+    int             j;
+    struct mfconn_retry retry;
 
     if (conn == NULL)
         return -1;
@@ -56,7 +56,10 @@ int mfconn_api_device_get_updates(mfconn * conn, const char *quickkey,
     if (len != 15)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    if (mfconn_retry_start(conn, &retry, "device/get_updates") != 0)
+        return -1;
+
+    do {
         if (*patches != NULL) {
             for (j = 0; (*patches)[j] != NULL; j++) {
                 patch_free((*patches)[j]);
@@ -88,6 +91,7 @@ int mfconn_api_device_get_updates(mfconn * conn, const char *quickkey,
         }
 
         http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
         retval = http_get_buf(http, api_call, _decode_device_get_updates,
                               (void *)patches);
         http_destroy(http);
@@ -95,22 +99,7 @@ int mfconn_api_device_get_updates(mfconn * conn, const char *quickkey,
 
         free((void *)api_call);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
-    }
+    } while (mfconn_retry_again(conn, &retry, &retval));
 
     return retval;
 }
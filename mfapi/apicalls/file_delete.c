@@ -30,7 +30,7 @@ int mfconn_api_file_delete(mfconn * conn, const char *quickkey)
     const char     *api_call;
     int             retval;
     mfhttp         *http;
-    int             i;
+    struct mfconn_retry retry;
 
     if (conn == NULL)
         return -1;
@@ -41,7 +41,10 @@ int mfconn_api_file_delete(mfconn * conn, const char *quickkey)
     if (strlen(quickkey) != 15)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    if (mfconn_retry_start(conn, &retry, "file/delete") != 0)
+        return -1;
+
+    do {
         api_call = mfconn_create_signed_get(conn, 0, "file/delete.php",
                                             "?quick_key=%s"
                                             "&response_format=json", quickkey);
@@ -51,6 +54,7 @@ int mfconn_api_file_delete(mfconn * conn, const char *quickkey)
         }
 
         http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
         retval =
             http_get_buf(http, api_call, mfapi_decode_common, "file/delete");
         http_destroy(http);
@@ -58,22 +62,86 @@ int mfconn_api_file_delete(mfconn * conn, const char *quickkey)
 
         free((void *)api_call);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
+    } while (mfconn_retry_again(conn, &retry, &retval));
+
+    return retval;
+}
+
+/*
+ * delete num_keys files at once, results[i] is zero if quickkeys[i] was
+ * deleted
+ *
+ * returns zero if all files were deleted
+ */
+int mfconn_api_file_delete_batch(mfconn * conn, const char **quickkeys,
+                                 int num_keys, int *results)
+{
+    const char     *api_call;
+    char           *keys;
+    int             retval;
+    int             failed = 0;
+    int             start;
+    int             count;
+    int             i;
+    mfhttp         *http;
+    struct mfconn_retry retry;
+
+    if (conn == NULL || quickkeys == NULL || results == NULL)
+        return -1;
+
+    // the keys of batches that are not sent because an earlier one could not
+    // be made count as failed as well
+    for (i = 0; i < num_keys; i++)
+        results[i] = -1;
+
+    for (start = 0; start < num_keys; start += MFAPI_MAX_BATCH_KEYS) {
+        count = num_keys - start;
+        if (count > MFAPI_MAX_BATCH_KEYS)
+            count = MFAPI_MAX_BATCH_KEYS;
+
+        keys = mfapi_join_keys(quickkeys + start, count);
+        if (keys == NULL)
+            return -1;
+
+        if (mfconn_retry_start(conn, &retry, "file/delete") != 0) {
+            free(keys);
+            return -1;
+        }
+
+        do {
+            api_call = mfconn_create_signed_get(conn, 0, "file/delete.php",
+                                                "?quick_key=%s"
+                                                "&response_format=json", keys);
+            if (api_call == NULL) {
+                fprintf(stderr, "mfconn_create_signed_get failed\n");
+                free(keys);
+                return -1;
+            }
+
+            http = http_create();
+            http_set_timeout(http, mfconn_retry_timeout(&retry));
+            retval = http_get_buf(http, api_call, mfapi_decode_common,
+                                  "file/delete");
+            http_destroy(http);
+            mfconn_update_secret_key(conn);
+
+            free((void *)api_call);
+
+        } while (mfconn_retry_again(conn, &retry, &retval));
+
+        free(keys);
+
+        for (i = start; i < start + count; i++) {
+            // the whole list is rejected if one of its keys is invalid, so
+            // delete the files one by one to find out which
+            if (retval >= MFAPI_MIN_ERROR_CODE && count > 1)
+                results[i] = mfconn_api_file_delete(conn, quickkeys[i]);
+            else
+                results[i] = retval;
+            if (results[i] != 0)
+                failed++;
         }
     }
 
-    return retval;
+    return failed == 0 ? 0 : -1;
 }
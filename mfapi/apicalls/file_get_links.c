@@ -28,6 +28,15 @@
 #include "../apicalls.h"        // IWYU pragma: keep
 
 static int      _decode_file_get_links(mfhttp * conn, void *data);
+static int      _decode_file_get_links_batch(mfhttp * conn, void *data);
+static void     _decode_file_links(json_t * node, mffile * file);
+
+struct file_get_links_batch {
+    mffile        **files;
+    const char    **quickkeys;
+    int             num_keys;
+    int            *results;
+};
 
 int mfconn_api_file_get_links(mfconn * conn, mffile * file,
                               const char *quickkey,
@@ -37,7 +46,7 @@ int mfconn_api_file_get_links(mfconn * conn, mffile * file,
     int             retval;
     int             len;
     mfhttp         *http;
-    int             i;
+    struct mfconn_retry retry;
 
     if (conn == NULL)
         return -1;
@@ -53,7 +62,10 @@ int mfconn_api_file_get_links(mfconn * conn, mffile * file,
     if (len != 11 && len != 15)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    if (mfconn_retry_start(conn, &retry, "file/get_links") != 0)
+        return -1;
+
+    do {
         api_call = mfconn_create_signed_get(conn, 0, "file/get_links.php",
                                             "?quick_key=%s"
                                             "&link_type=%s"
@@ -66,30 +78,106 @@ int mfconn_api_file_get_links(mfconn * conn, mffile * file,
         }
 
         http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
         retval = http_get_buf(http, api_call, _decode_file_get_links, file);
         http_destroy(http);
         mfconn_update_secret_key(conn);
 
         free((void *)api_call);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
+    } while (mfconn_retry_again(conn, &retry, &retval));
+
+    return retval;
+}
+
+/*
+ * get the links of num_keys files at once, results[i] is zero if the links of
+ * quickkeys[i] were stored in files[i]
+ *
+ * returns zero if the links of all files were retrieved
+ */
+int mfconn_api_file_get_links_batch(mfconn * conn, mffile ** files,
+                                    const char **quickkeys, int num_keys,
+                                    enum mfconn_file_link_type link_mask,
+                                    int *results)
+{
+    struct file_get_links_batch batch;
+    const char     *api_call;
+    char           *keys;
+    int             retval;
+    int             failed = 0;
+    int             start;
+    int             i;
+    mfhttp         *http;
+    struct mfconn_retry retry;
+
+    if (conn == NULL || files == NULL || quickkeys == NULL || results == NULL)
+        return -1;
+
+    // the keys of batches that are not sent because an earlier one could not
+    // be made count as failed as well
+    for (i = 0; i < num_keys; i++)
+        results[i] = -1;
+
+    for (start = 0; start < num_keys; start += MFAPI_MAX_BATCH_KEYS) {
+        batch.files = files + start;
+        batch.quickkeys = quickkeys + start;
+        batch.num_keys = num_keys - start;
+        if (batch.num_keys > MFAPI_MAX_BATCH_KEYS)
+            batch.num_keys = MFAPI_MAX_BATCH_KEYS;
+        batch.results = results + start;
+
+        keys = mfapi_join_keys(batch.quickkeys, batch.num_keys);
+        if (keys == NULL)
+            return -1;
+
+        if (mfconn_retry_start(conn, &retry, "file/get_links") != 0) {
+            free(keys);
+            return -1;
+        }
+
+        do {
+            api_call = mfconn_create_signed_get(conn, 0, "file/get_links.php",
+                                                "?quick_key=%s"
+                                                "&link_type=%s"
+                                                "&response_format=json",
+                                                keys,
+                                                mfconn_file_link_types
+                                                [link_mask]);
+            if (api_call == NULL) {
+                fprintf(stderr, "mfconn_create_signed_get failed\n");
+                free(keys);
+                return -1;
+            }
+
+            http = http_create();
+            http_set_timeout(http, mfconn_retry_timeout(&retry));
+            retval = http_get_buf(http, api_call,
+                                  _decode_file_get_links_batch, &batch);
+            http_destroy(http);
+            mfconn_update_secret_key(conn);
+
+            free((void *)api_call);
+
+        } while (mfconn_retry_again(conn, &retry, &retval));
+
+        free(keys);
+
+        for (i = 0; i < batch.num_keys; i++) {
+            // the whole list is rejected if one of its keys is invalid, so
+            // ask for the files one by one to find out which
+            if (retval >= MFAPI_MIN_ERROR_CODE && batch.num_keys > 1)
+                batch.results[i] =
+                    mfconn_api_file_get_links(conn, batch.files[i],
+                                              batch.quickkeys[i], link_mask);
+            else if (retval != 0)
+                batch.results[i] = retval;
+            if (batch.results[i] != 0)
+                failed++;
         }
     }
 
-    return retval;
+    return failed == 0 ? 0 : -1;
 }
 
 static int _decode_file_get_links(mfhttp * conn, void *data)
@@ -97,10 +185,6 @@ static int _decode_file_get_links(mfhttp * conn, void *data)
     json_error_t    error;
     json_t         *root;
     json_t         *node;
-    json_t         *quickkey;
-    json_t         *share_link;
-    json_t         *direct_link;
-    json_t         *onetime_link;
     json_t         *links_array;
     int             retval = 0;
     mffile         *file;
@@ -132,9 +216,83 @@ static int _decode_file_get_links(mfhttp * conn, void *data)
         json_decref(root);
         return -1;
     }
-    // just get the first one.  maybe later support multi-quickkey
+    // just get the first one, mfconn_api_file_get_links_batch asks for more
     node = json_array_get(links_array, 0);
 
+    _decode_file_links(node, file);
+
+    json_decref(root);
+
+    return retval;
+}
+
+static int _decode_file_get_links_batch(mfhttp * conn, void *data)
+{
+    json_error_t    error;
+    json_t         *root;
+    json_t         *node;
+    json_t         *links_array;
+    struct file_get_links_batch *batch;
+    int             retval = 0;
+    size_t          i;
+    int             j;
+
+    if (data == NULL)
+        return -1;
+
+    batch = (struct file_get_links_batch *)data;
+
+    for (j = 0; j < batch->num_keys; j++)
+        batch->results[j] = -1;
+
+    root = http_parse_buf_json(conn, 0, &error);
+
+    if (root == NULL) {
+        fprintf(stderr, "http_parse_buf_json failed at line %d\n", error.line);
+        fprintf(stderr, "error message: %s\n", error.text);
+        return -1;
+    }
+
+    node = json_object_get(root, "response");
+
+    retval = mfapi_check_response(node, "file/get_links");
+    if (retval != 0) {
+        fprintf(stderr, "invalid response\n");
+        json_decref(root);
+        return retval;
+    }
+
+    links_array = json_object_get(node, "links");
+    if (!json_is_array(links_array)) {
+        json_decref(root);
+        return -1;
+    }
+
+    // keys that the server skipped keep their -1
+    for (i = 0; i < json_array_size(links_array); i++) {
+        node = json_array_get(links_array, i);
+        j = mfapi_batch_match(batch->quickkeys, batch->num_keys,
+                              batch->results,
+                              json_string_value(json_object_get(node,
+                                                                "quickkey")));
+        if (j >= 0) {
+            _decode_file_links(node, batch->files[j]);
+            batch->results[j] = 0;
+        }
+    }
+
+    json_decref(root);
+
+    return 0;
+}
+
+static void _decode_file_links(json_t * node, mffile * file)
+{
+    json_t         *quickkey;
+    json_t         *share_link;
+    json_t         *direct_link;
+    json_t         *onetime_link;
+
     quickkey = json_object_get(node, "quickkey");
     if (quickkey != NULL)
         file_set_key(file, json_string_value(quickkey));
@@ -155,8 +313,4 @@ static int _decode_file_get_links(mfhttp * conn, void *data)
     // if this is false something went horribly wrong
     // if (share_link == NULL)
     //    retval = -1;
-
-    json_decref(root);
-
-    return retval;
 }
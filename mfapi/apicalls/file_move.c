@@ -31,7 +31,7 @@ int mfconn_api_file_move(mfconn * conn, const char *quickkey,
     const char     *api_call;
     int             retval;
     mfhttp         *http;
-    int             i;
+    struct mfconn_retry retry;
 
     if (conn == NULL)
         return -1;
@@ -42,7 +42,10 @@ int mfconn_api_file_move(mfconn * conn, const char *quickkey,
     if (strlen(quickkey) != 15)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    if (mfconn_retry_start(conn, &retry, "file/move") != 0)
+        return -1;
+
+    do {
         if (folderkey == NULL) {
             api_call = mfconn_create_signed_get(conn, 0, "file/move.php",
                                                 "?quick_key=%s"
@@ -61,6 +64,7 @@ int mfconn_api_file_move(mfconn * conn, const char *quickkey,
         }
 
         http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
         retval =
             http_get_buf(http, api_call, mfapi_decode_common, "file/move");
         http_destroy(http);
@@ -68,22 +72,7 @@ int mfconn_api_file_move(mfconn * conn, const char *quickkey,
 
         free((void *)api_call);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
-    }
+    } while (mfconn_retry_again(conn, &retry, &retval));
 
     return retval;
 }
@@ -30,7 +30,7 @@ int mfconn_api_folder_delete(mfconn * conn, const char *folderkey)
     const char     *api_call;
     int             retval;
     mfhttp         *http;
-    int             i;
+    struct mfconn_retry retry;
 
     if (conn == NULL)
         return -1;
@@ -41,7 +41,10 @@ int mfconn_api_folder_delete(mfconn * conn, const char *folderkey)
     if (strlen(folderkey) != 13)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    if (mfconn_retry_start(conn, &retry, "folder/delete") != 0)
+        return -1;
+
+    do {
         api_call = mfconn_create_signed_get(conn, 0, "folder/delete.php",
                                             "?folder_key=%s"
                                             "&response_format=json",
@@ -52,6 +55,7 @@ int mfconn_api_folder_delete(mfconn * conn, const char *folderkey)
         }
 
         http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
         retval = http_get_buf(http, api_call, mfapi_decode_common,
                               "folder/delete");
         http_destroy(http);
@@ -59,22 +63,7 @@ int mfconn_api_folder_delete(mfconn * conn, const char *folderkey)
 
         free((void *)api_call);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
-    }
+    } while (mfconn_retry_again(conn, &retry, &retval));
 
     return retval;
 }
@@ -30,6 +30,15 @@
 #include "../apicalls.h"        // IWYU pragma: keep
 
 static int      _decode_folder_get_info(mfhttp * conn, void *data);
+static int      _decode_folder_get_info_batch(mfhttp * conn, void *data);
+static int      _decode_folder_info(json_t * node, mffolder * folder);
+
+struct folder_get_info_batch {
+    mffolder      **folders;
+    const char    **folderkeys;
+    int             num_keys;
+    int            *results;
+};
 
 int
 mfconn_api_folder_get_info(mfconn * conn, mffolder * folder,
@@ -38,7 +47,7 @@ mfconn_api_folder_get_info(mfconn * conn, mffolder * folder,
     const char     *api_call;
     int             retval;
     mfhttp         *http;
-    int             i;
+    struct mfconn_retry retry;
 
     if (conn == NULL)
         return -1;
@@ -51,7 +60,10 @@ mfconn_api_folder_get_info(mfconn * conn, mffolder * folder,
         return -1;
     }
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    if (mfconn_retry_start(conn, &retry, "folder/get_info") != 0)
+        return -1;
+
+    do {
         if (folderkey == NULL) {
             api_call = mfconn_create_signed_get(conn, 0, "folder/get_info.php",
                                                 "?response_format=json");
@@ -67,30 +79,104 @@ mfconn_api_folder_get_info(mfconn * conn, mffolder * folder,
         }
 
         http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
         retval = http_get_buf(http, api_call, _decode_folder_get_info, folder);
         http_destroy(http);
         mfconn_update_secret_key(conn);
 
         free((void *)api_call);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
+    } while (mfconn_retry_again(conn, &retry, &retval));
+
+    return retval;
+}
+
+/*
+ * get the information of num_keys folders at once, results[i] is zero if
+ * folders[i] was filled in with the information of folderkeys[i]
+ *
+ * the root cannot be part of the list. Returns zero if the information of
+ * all folders was retrieved.
+ */
+int mfconn_api_folder_get_info_batch(mfconn * conn, mffolder ** folders,
+                                     const char **folderkeys, int num_keys,
+                                     int *results)
+{
+    struct folder_get_info_batch batch;
+    const char     *api_call;
+    char           *keys;
+    int             retval;
+    int             failed = 0;
+    int             start;
+    int             i;
+    mfhttp         *http;
+    struct mfconn_retry retry;
+
+    if (conn == NULL || folders == NULL || folderkeys == NULL
+        || results == NULL)
+        return -1;
+
+    // the keys of batches that are not sent because an earlier one could not
+    // be made count as failed as well
+    for (i = 0; i < num_keys; i++)
+        results[i] = -1;
+
+    for (start = 0; start < num_keys; start += MFAPI_MAX_BATCH_KEYS) {
+        batch.folders = folders + start;
+        batch.folderkeys = folderkeys + start;
+        batch.num_keys = num_keys - start;
+        if (batch.num_keys > MFAPI_MAX_BATCH_KEYS)
+            batch.num_keys = MFAPI_MAX_BATCH_KEYS;
+        batch.results = results + start;
+
+        keys = mfapi_join_keys(batch.folderkeys, batch.num_keys);
+        if (keys == NULL)
+            return -1;
+
+        if (mfconn_retry_start(conn, &retry, "folder/get_info") != 0) {
+            free(keys);
+            return -1;
+        }
+
+        do {
+            api_call = mfconn_create_signed_get(conn, 0, "folder/get_info.php",
+                                                "?folder_key=%s"
+                                                "&response_format=json",
+                                                keys);
+            if (api_call == NULL) {
+                fprintf(stderr, "mfconn_create_signed_get failed\n");
+                free(keys);
+                return -1;
+            }
+
+            http = http_create();
+            http_set_timeout(http, mfconn_retry_timeout(&retry));
+            retval = http_get_buf(http, api_call,
+                                  _decode_folder_get_info_batch, &batch);
+            http_destroy(http);
+            mfconn_update_secret_key(conn);
+
+            free((void *)api_call);
+
+        } while (mfconn_retry_again(conn, &retry, &retval));
+
+        free(keys);
+
+        for (i = 0; i < batch.num_keys; i++) {
+            // the whole list is rejected if one of its keys is invalid, so
+            // ask for the folders one by one to find out which
+            if (retval >= MFAPI_MIN_ERROR_CODE && batch.num_keys > 1)
+                batch.results[i] =
+                    mfconn_api_folder_get_info(conn, batch.folders[i],
+                                               batch.folderkeys[i]);
+            else if (retval != 0)
+                batch.results[i] = retval;
+            if (batch.results[i] != 0)
+                failed++;
         }
     }
 
-    return retval;
+    return failed == 0 ? 0 : -1;
 }
 
 static int _decode_folder_get_info(mfhttp * conn, void *data)
@@ -98,15 +184,8 @@ static int _decode_folder_get_info(mfhttp * conn, void *data)
     json_error_t    error;
     json_t         *root;
     json_t         *node;
-    json_t         *folderkey;
-    json_t         *folder_name;
-    json_t         *revision;
-    json_t         *created;
-    json_t         *parent_folder;
     int             retval = 0;
     mffolder       *folder;
-    char           *ret;
-    struct tm       tm;
 
     if (data == NULL)
         return -1;
@@ -132,6 +211,84 @@ static int _decode_folder_get_info(mfhttp * conn, void *data)
 
     node = json_object_get(node, "folder_info");
 
+    retval = _decode_folder_info(node, folder);
+
+    json_decref(root);
+
+    return retval;
+}
+
+// a single key is answered with folder_info, several keys with folder_infos
+static int _decode_folder_get_info_batch(mfhttp * conn, void *data)
+{
+    json_error_t    error;
+    json_t         *root;
+    json_t         *node;
+    json_t         *infos;
+    json_t         *info;
+    struct folder_get_info_batch *batch;
+    int             retval = 0;
+    size_t          num_infos;
+    size_t          i;
+    int             j;
+
+    if (data == NULL)
+        return -1;
+
+    batch = (struct folder_get_info_batch *)data;
+
+    for (j = 0; j < batch->num_keys; j++)
+        batch->results[j] = -1;
+
+    root = http_parse_buf_json(conn, 0, &error);
+
+    if (root == NULL) {
+        fprintf(stderr, "http_parse_buf_json failed at line %d\n", error.line);
+        fprintf(stderr, "error message: %s\n", error.text);
+        return -1;
+    }
+
+    node = json_object_get(root, "response");
+
+    retval = mfapi_check_response(node, "folder/get_info");
+    if (retval != 0) {
+        fprintf(stderr, "invalid response\n");
+        json_decref(root);
+        return retval;
+    }
+
+    infos = json_object_get(node, "folder_infos");
+    num_infos = json_is_array(infos) ? json_array_size(infos) : 1;
+
+    // keys that the server skipped keep their -1
+    for (i = 0; i < num_infos; i++) {
+        if (json_is_array(infos))
+            info = json_array_get(infos, i);
+        else
+            info = json_object_get(node, "folder_info");
+        j = mfapi_batch_match(batch->folderkeys, batch->num_keys,
+                              batch->results,
+                              json_string_value(json_object_get(info,
+                                                                "folderkey")));
+        if (j >= 0)
+            batch->results[j] = _decode_folder_info(info, batch->folders[j]);
+    }
+
+    json_decref(root);
+
+    return 0;
+}
+
+static int _decode_folder_info(json_t * node, mffolder * folder)
+{
+    json_t         *folderkey;
+    json_t         *folder_name;
+    json_t         *revision;
+    json_t         *created;
+    json_t         *parent_folder;
+    char           *ret;
+    struct tm       tm;
+
     folderkey = json_object_get(node, "folderkey");
     if (folderkey != NULL)
         folder_set_key(folder, json_string_value(folderkey));
@@ -165,11 +322,9 @@ static int _decode_folder_get_info(mfhttp * conn, void *data)
     }
 
     if (folderkey == NULL)
-        retval = -1;
-
-    json_decref(root);
+        return -1;
 
-    return retval;
+    return 0;
 }
 
 // sample user callback
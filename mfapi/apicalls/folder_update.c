@@ -31,7 +31,7 @@ int mfconn_api_folder_update(mfconn * conn, const char *folder_key,
     const char     *api_call;
     int             retval;
     mfhttp         *http;
-    int             i;
+    struct mfconn_retry retry;
     char           *foldername_urlenc;
 
     if (conn == NULL)
@@ -49,7 +49,10 @@ int mfconn_api_folder_update(mfconn * conn, const char *folder_key,
     if (strlen(foldername) < 3 || strlen(foldername) > 255)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    if (mfconn_retry_start(conn, &retry, "folder/update") != 0)
+        return -1;
+
+    do {
         foldername_urlenc = urlencode(foldername);
         if (foldername_urlenc == NULL) {
             fprintf(stderr, "urlencode failed\n");
@@ -67,6 +70,7 @@ int mfconn_api_folder_update(mfconn * conn, const char *folder_key,
         }
 
         http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
         retval =
             http_get_buf(http, api_call, mfapi_decode_common, "folder/update");
         http_destroy(http);
@@ -74,22 +78,7 @@ int mfconn_api_folder_update(mfconn * conn, const char *folder_key,
 
         free((void *)api_call);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
-    }
+    } while (mfconn_retry_again(conn, &retry, &retval));
 
     return retval;
 }
@@ -16,6 +16,9 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200809L // for strdup
+#define _DEFAULT_SOURCE         // for strdup on old systems
+
 #include <jansson.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -29,16 +32,24 @@
 #include "../apicalls.h"        // IWYU pragma: keep
 
 static int      _decode_upload_check(mfhttp * conn, void *data);
+static int      _decode_resumable_upload(json_t * node,
+                                         struct mfconn_upload_check_result
+                                         *result);
 
+/*
+ * with resumable set, the server also reports the unit size and which units
+ * of a resumable upload of the file it already received. The result must be
+ * released with mfconn_upload_check_result_free.
+ */
 int mfconn_api_upload_check(mfconn * conn, const char *filename,
                             const char *hash, uint64_t size,
-                            const char *folder_key,
+                            const char *folder_key, bool resumable,
                             struct mfconn_upload_check_result *result)
 {
     const char     *api_call;
     int             retval;
     mfhttp         *http;
-    int             i;
+    struct mfconn_retry retry;
     char           *filename_urlenc;
 
     if (conn == NULL)
@@ -59,7 +70,14 @@ int mfconn_api_upload_check(mfconn * conn, const char *filename,
         return -1;
     }
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    memset(result, 0, sizeof(struct mfconn_upload_check_result));
+
+    if (mfconn_retry_start(conn, &retry, "upload/check") != 0)
+        return -1;
+
+    do {
+        mfconn_upload_check_result_free(result);
+
         filename_urlenc = urlencode(filename);
         if (filename_urlenc == NULL) {
             fprintf(stderr, "urlencode failed\n");
@@ -70,8 +88,10 @@ int mfconn_api_upload_check(mfconn * conn, const char *filename,
                                             "&filename=%s"
                                             "&size=%" PRIu64
                                             "&hash=%s"
-                                            "&folder_key=%s", filename_urlenc,
-                                            size, hash, folder_key);
+                                            "&folder_key=%s"
+                                            "&resumable=%s", filename_urlenc,
+                                            size, hash, folder_key,
+                                            resumable ? "yes" : "no");
         free(filename_urlenc);
         if (api_call == NULL) {
             fprintf(stderr, "mfconn_create_signed_get failed\n");
@@ -79,6 +99,7 @@ int mfconn_api_upload_check(mfconn * conn, const char *filename,
         }
 
         http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
         retval = http_get_buf(http, api_call, _decode_upload_check,
                               (void *)result);
         http_destroy(http);
@@ -86,26 +107,19 @@ int mfconn_api_upload_check(mfconn * conn, const char *filename,
 
         free((void *)api_call);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
-    }
+    } while (mfconn_retry_again(conn, &retry, &retval));
 
     return retval;
 }
 
+void mfconn_upload_check_result_free(struct mfconn_upload_check_result
+                                     *result)
+{
+    free(result->bitmap);
+    free(result->upload_key);
+    memset(result, 0, sizeof(struct mfconn_upload_check_result));
+}
+
 static int _decode_upload_check(mfhttp * conn, void *data)
 {
     json_error_t    error;
@@ -231,7 +245,64 @@ static int _decode_upload_check(mfhttp * conn, void *data)
         }
     }
 
+    /* retrieve response/resumable_upload */
+    node = json_object_get(node, "resumable_upload");
+    if (node != NULL && _decode_resumable_upload(node, result) != 0) {
+        json_decref(root);
+        return -1;
+    }
+
     json_decref(root);
 
     return 0;
 }
+
+static int _decode_resumable_upload(json_t * node,
+                                    struct mfconn_upload_check_result *result)
+{
+    json_t         *obj;
+    json_t         *words;
+    size_t          i;
+
+    obj = json_object_get(node, "all_units_ready");
+    if (obj != NULL && json_is_string(obj))
+        result->all_units_ready = strcmp(json_string_value(obj), "yes") == 0;
+
+    obj = json_object_get(node, "number_of_units");
+    if (obj == NULL || !json_is_string(obj)) {
+        fprintf(stderr, "cannot get node resumable_upload/number_of_units\n");
+        return -1;
+    }
+    result->number_of_units = atol(json_string_value(obj));
+
+    obj = json_object_get(node, "unit_size");
+    if (obj == NULL || !json_is_string(obj)) {
+        fprintf(stderr, "cannot get node resumable_upload/unit_size\n");
+        return -1;
+    }
+    result->unit_size = atoll(json_string_value(obj));
+
+    if (result->number_of_units == 0 || result->unit_size == 0) {
+        fprintf(stderr, "resumable_upload has no units\n");
+        return -1;
+    }
+
+    words = json_object_get(json_object_get(node, "bitmap"), "words");
+    if (words != NULL && json_is_array(words) && json_array_size(words) > 0) {
+        result->bitmap_count = json_array_size(words);
+        result->bitmap = (uint16_t *) calloc(result->bitmap_count,
+                                             sizeof(uint16_t));
+        for (i = 0; i < result->bitmap_count; i++) {
+            obj = json_array_get(words, i);
+            if (json_is_string(obj))
+                result->bitmap[i] = atol(json_string_value(obj));
+        }
+    }
+
+    obj = json_object_get(node, "upload_key");
+    if (obj != NULL && json_is_string(obj)
+        && json_string_value(obj)[0] != '\0')
+        result->upload_key = strdup(json_string_value(obj));
+
+    return 0;
+}
@@ -32,7 +32,7 @@ int mfconn_api_upload_instant(mfconn * conn, const char *quick_key,
     const char     *api_call;
     int             retval;
     mfhttp         *http;
-    int             i;
+    struct mfconn_retry retry;
     char           *filename_urlenc;
 
     if (conn == NULL)
@@ -43,7 +43,10 @@ int mfconn_api_upload_instant(mfconn * conn, const char *quick_key,
         return -1;
     }
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    if (mfconn_retry_start(conn, &retry, "upload/instant") != 0)
+        return -1;
+
+    do {
         if (quick_key != NULL && quick_key[0] != '\0') {
             // update an existing file
             api_call = mfconn_create_signed_get(conn, 0, "upload/instant.php",
@@ -80,6 +83,7 @@ int mfconn_api_upload_instant(mfconn * conn, const char *quick_key,
         }
 
         http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
         retval =
             http_get_buf(http, api_call, mfapi_decode_common,
                          "upload/instant");
@@ -88,22 +92,7 @@ int mfconn_api_upload_instant(mfconn * conn, const char *quick_key,
 
         free((void *)api_call);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
-    }
+    } while (mfconn_retry_again(conn, &retry, &retval));
 
     return retval;
 }
@@ -46,7 +46,7 @@ mfconn_api_upload_patch(mfconn * conn, const char *quickkey,
     const char     *api_call;
     int             retval;
     mfhttp         *http;
-    int             i;
+    struct mfconn_retry retry;
     FILE           *patch_fh;
     struct curl_slist *custom_headers = NULL;
     char           *tmpheader;
@@ -65,7 +65,10 @@ mfconn_api_upload_patch(mfconn * conn, const char *quickkey,
 
     patch_size = file_info.st_size;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    if (mfconn_retry_start(conn, &retry, "upload/patch") != 0)
+        return -1;
+
+    do {
         if (*upload_key != NULL) {
             free(*upload_key);
             *upload_key = NULL;
@@ -102,6 +105,7 @@ mfconn_api_upload_patch(mfconn * conn, const char *quickkey,
         free(tmpheader);
 
         http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
         retval = http_post_file(http, api_call, patch_fh, &custom_headers,
                                 patch_size, _decode_upload_patch, upload_key);
         http_destroy(http);
@@ -110,22 +114,7 @@ mfconn_api_upload_patch(mfconn * conn, const char *quickkey,
         fclose(patch_fh);
         free((void *)api_call);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
-    }
+    } while (mfconn_retry_again(conn, &retry, &retval));
 
     return retval;
 }
@@ -28,76 +28,115 @@
 #include "../apicalls.h"        // IWYU pragma: keep
 
 struct upload_poll_upload_response {
-    int             status;
-    int             fileerror;
+    const char    **upload_keys;
+    int             num_keys;
+    int            *status;
+    int            *fileerror;
 };
 
 static int      _decode_upload_poll_upload(mfhttp * conn, void *data);
 
+/*
+ * poll the state of num_keys uploads with one request, the server takes
+ * their keys as a comma separated list. status and fileerror receive one
+ * value per key and a key the server did not answer for gets status 0.
+ *
+ * The call is only made once. It is made by the completion poller thread of
+ * mfconn.c which polls again on its own schedule and which must not touch
+ * the retry state of the connection.
+ */
 int
-mfconn_api_upload_poll_upload(mfconn * conn, const char *upload_key,
-                              int *status, int *fileerror)
+mfconn_api_upload_poll_upload(mfconn * conn, const char **upload_keys,
+                              int num_keys, int *status, int *fileerror)
 {
     const char     *api_call;
     int             retval;
+    int             i;
+    size_t          len;
+    char           *keys;
     mfhttp         *http;
     struct upload_poll_upload_response response;
-    int             i;
 
     if (conn == NULL)
         return -1;
 
-    if (upload_key == NULL)
+    if (upload_keys == NULL || num_keys < 1)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
-        // make an UNSIGNED get
-        api_call = mfconn_create_unsigned_get(conn, 0,
-                                              "upload/poll_upload.php",
-                                              "?response_format=json"
-                                              "&key=%s", upload_key);
-        if (api_call == NULL) {
-            fprintf(stderr, "mfconn_create_unsigned_get failed\n");
-            return -1;
-        }
+    len = 0;
+    for (i = 0; i < num_keys; i++) {
+        len += strlen(upload_keys[i]) + 1;
+    }
+    keys = (char *)malloc(len);
+    keys[0] = '\0';
+    for (i = 0; i < num_keys; i++) {
+        if (i > 0)
+            strcat(keys, ",");
+        strcat(keys, upload_keys[i]);
+    }
 
-        http = http_create();
-        retval = http_get_buf(http, api_call, _decode_upload_poll_upload,
-                              &response);
-        http_destroy(http);
-
-        free((void *)api_call);
-
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
+    // make an UNSIGNED get
+    api_call = mfconn_create_unsigned_get(conn, 0,
+                                          "upload/poll_upload.php",
+                                          "?response_format=json"
+                                          "&key=%s", keys);
+    free(keys);
+    if (api_call == NULL) {
+        fprintf(stderr, "mfconn_create_unsigned_get failed\n");
+        return -1;
     }
 
-    *status = response.status;
-    *fileerror = response.fileerror;
+    response.upload_keys = upload_keys;
+    response.num_keys = num_keys;
+    response.status = status;
+    response.fileerror = fileerror;
+
+    http = http_create();
+    retval = http_get_buf(http, api_call, _decode_upload_poll_upload,
+                          &response);
+    http_destroy(http);
+
+    free((void *)api_call);
 
     return retval;
 }
 
+static int
+_decode_upload_poll_upload_state(json_t * node,
+                                 struct upload_poll_upload_response *response,
+                                 int i)
+{
+    json_t         *j_obj;
+
+    // make sure that the result code is zero (success)
+    j_obj = json_object_get(node, "result");
+    if (j_obj == NULL || strcmp(json_string_value(j_obj), "0") != 0)
+        return -1;
+
+    j_obj = json_object_get(node, "status");
+    if (j_obj != NULL) {
+        response->status[i] = atol(json_string_value(j_obj));
+    }
+
+    j_obj = json_object_get(node, "fileerror");
+    if (j_obj != NULL) {
+        response->fileerror[i] = atol(json_string_value(j_obj));
+    }
+
+    return 0;
+}
+
 static int _decode_upload_poll_upload(mfhttp * conn, void *user_ptr)
 {
     json_error_t    error;
     json_t         *root;
     json_t         *node;
     json_t         *j_obj;
+    json_t         *data;
+    const char     *key;
     int             retval;
+    int             i;
+    size_t          j;
 
     struct upload_poll_upload_response *response;
 
@@ -105,8 +144,10 @@ static int _decode_upload_poll_upload(mfhttp * conn, void *user_ptr)
     if (response == NULL)
         return -1;
 
-    response->status = 0;
-    response->fileerror = 0;
+    for (i = 0; i < response->num_keys; i++) {
+        response->status[i] = 0;
+        response->fileerror[i] = 0;
+    }
 
     root = http_parse_buf_json(conn, 0, &error);
 
@@ -127,21 +168,29 @@ static int _decode_upload_poll_upload(mfhttp * conn, void *user_ptr)
 
     node = json_object_get(node, "doupload");
 
-    // make sure that the result code is zero (success)
-    j_obj = json_object_get(node, "result");
-    if (j_obj == NULL || strcmp(json_string_value(j_obj), "0") != 0) {
+    // a single key is answered with an object, several with an array
+    if (!json_is_array(node)) {
+        retval = -1;
+        if (response->num_keys == 1)
+            retval = _decode_upload_poll_upload_state(node, response, 0);
         json_decref(root);
-        return -1;
-    }
-
-    j_obj = json_object_get(node, "status");
-    if (j_obj != NULL) {
-        response->status = atol(json_string_value(j_obj));
+        return retval;
     }
 
-    j_obj = json_object_get(node, "fileerror");
-    if (j_obj != NULL) {
-        response->fileerror = atol(json_string_value(j_obj));
+    for (j = 0; j < json_array_size(node); j++) {
+        data = json_array_get(node, j);
+        j_obj = json_object_get(data, "key");
+        if (j_obj == NULL || !json_is_string(j_obj))
+            continue;
+        key = json_string_value(j_obj);
+        for (i = 0; i < response->num_keys; i++) {
+            if (strcmp(response->upload_keys[i], key) != 0)
+                continue;
+            if (_decode_upload_poll_upload_state(data, response, i) != 0) {
+                json_decref(root);
+                return -1;
+            }
+        }
     }
 
     json_decref(root);
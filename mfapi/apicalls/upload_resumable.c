@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L // for strdup
+#define _DEFAULT_SOURCE         // for strdup on old systems
+
+#include <jansson.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <curl/curl.h>
+
+#include "../../utils/http.h"
+#include "../../utils/strings.h"
+#include "../mfconn.h"
+#include "../apicalls.h"        // IWYU pragma: keep
+
+static int      _decode_upload_resumable(mfhttp * conn, void *data);
+
+/*
+ * Upload a single unit of a resumable upload. The call is authenticated by an
+ * upload action token and not signed, so it does not touch the secret key of
+ * the connection and several units of the same file can be sent from
+ * different threads at the same time. It is only tried once because the
+ * caller retries the units the server did not confirm in its next round.
+ *
+ * upload_key is set once the server has received all units of the file.
+ */
+int
+mfconn_api_upload_resumable(mfconn * conn, const char *action_token,
+                            const char *folder_key, const char *file_name,
+                            uint64_t file_size, const char *file_hash,
+                            int fd, uint32_t unit_id, uint64_t unit_offset,
+                            uint64_t unit_size, const char *unit_hash,
+                            char **upload_key)
+{
+    const char     *api_call;
+    int             retval;
+    mfhttp         *http;
+    struct curl_slist *custom_headers = NULL;
+    char           *tmpheader;
+
+    if (conn == NULL)
+        return -1;
+
+    if (action_token == NULL || file_name == NULL || file_hash == NULL
+        || unit_hash == NULL || upload_key == NULL)
+        return -1;
+
+    *upload_key = NULL;
+
+    if (folder_key == NULL) {
+        api_call = mfconn_create_unsigned_get(conn, 0,
+                                              "upload/resumable.php",
+                                              "?session_token=%s"
+                                              "&response_format=json",
+                                              action_token);
+    } else {
+        api_call = mfconn_create_unsigned_get(conn, 0,
+                                              "upload/resumable.php",
+                                              "?session_token=%s"
+                                              "&folder_key=%s"
+                                              "&response_format=json",
+                                              action_token, folder_key);
+    }
+    if (api_call == NULL) {
+        fprintf(stderr, "mfconn_create_unsigned_get failed\n");
+        return -1;
+    }
+    // the following pseudo headers are interpreted by the mediafire server
+    tmpheader = strdup_printf("x-filename: %s", file_name);
+    custom_headers = curl_slist_append(custom_headers, tmpheader);
+    free(tmpheader);
+    tmpheader = strdup_printf("x-filesize: %" PRIu64, file_size);
+    custom_headers = curl_slist_append(custom_headers, tmpheader);
+    free(tmpheader);
+    tmpheader = strdup_printf("x-filehash: %s", file_hash);
+    custom_headers = curl_slist_append(custom_headers, tmpheader);
+    free(tmpheader);
+    tmpheader = strdup_printf("x-unit-hash: %s", unit_hash);
+    custom_headers = curl_slist_append(custom_headers, tmpheader);
+    free(tmpheader);
+    tmpheader = strdup_printf("x-unit-id: %" PRIu32, unit_id);
+    custom_headers = curl_slist_append(custom_headers, tmpheader);
+    free(tmpheader);
+    tmpheader = strdup_printf("x-unit-size: %" PRIu64, unit_size);
+    custom_headers = curl_slist_append(custom_headers, tmpheader);
+    free(tmpheader);
+
+    http = http_create();
+    retval = http_post_file_range(http, api_call, fd, unit_offset, unit_size,
+                                  &custom_headers, _decode_upload_resumable,
+                                  upload_key);
+    http_destroy(http);
+
+    if (custom_headers != NULL)
+        curl_slist_free_all(custom_headers);
+    free((void *)api_call);
+
+    return retval;
+}
+
+static int _decode_upload_resumable(mfhttp * conn, void *user_ptr)
+{
+    json_error_t    error;
+    json_t         *root;
+    json_t         *node;
+    json_t         *j_obj;
+    int             retval;
+
+    char          **upload_key;
+
+    upload_key = (char **)user_ptr;
+    if (upload_key == NULL)
+        return -1;
+
+    root = http_parse_buf_json(conn, 0, &error);
+
+    if (root == NULL) {
+        fprintf(stderr, "http_parse_buf_json failed at line %d\n", error.line);
+        fprintf(stderr, "error message: %s\n", error.text);
+        return -1;
+    }
+
+    node = json_object_get(root, "response");
+
+    retval = mfapi_check_response(node, "upload/resumable");
+    if (retval != 0) {
+        fprintf(stderr, "invalid response\n");
+        json_decref(root);
+        return retval;
+    }
+
+    node = json_object_get(node, "doupload");
+
+    j_obj = json_object_get(node, "result");
+    if (j_obj == NULL || !json_is_string(j_obj)
+        || strcmp(json_string_value(j_obj), "0") != 0) {
+        fprintf(stderr, "upload/resumable: unit was not accepted\n");
+        json_decref(root);
+        return -1;
+    }
+
+    j_obj = json_object_get(node, "key");
+    if (j_obj != NULL && json_is_string(j_obj)
+        && strcmp(json_string_value(j_obj), "") != 0) {
+        *upload_key = strdup(json_string_value(j_obj));
+    }
+
+    json_decref(root);
+
+    return 0;
+}
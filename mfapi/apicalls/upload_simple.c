@@ -45,7 +45,7 @@ mfconn_api_upload_simple(mfconn * conn, const char *folderkey,
     mfhttp         *http;
     long            l_file_size;
     uint64_t        file_size;
-    int             i;
+    struct mfconn_retry retry;
     struct curl_slist *custom_headers = NULL;
     char           *tmpheader;
 
@@ -71,7 +71,10 @@ mfconn_api_upload_simple(mfconn * conn, const char *folderkey,
     // make sure that we are at the beginning of the file
     rewind(fh);
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    if (mfconn_retry_start(conn, &retry, "upload/simple") != 0)
+        return -1;
+
+    do {
         if (*upload_key != NULL) {
             free(*upload_key);
             *upload_key = NULL;
@@ -108,6 +111,7 @@ mfconn_api_upload_simple(mfconn * conn, const char *folderkey,
         free(tmpheader);
 
         http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
         retval = http_post_file(http, api_call, fh, &custom_headers, file_size,
                                 _decode_upload_simple, upload_key);
         http_destroy(http);
@@ -119,22 +123,7 @@ mfconn_api_upload_simple(mfconn * conn, const char *folderkey,
         }
         free((void *)api_call);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
-    }
+    } while (mfconn_retry_again(conn, &retry, &retval));
 
     return retval;
 }
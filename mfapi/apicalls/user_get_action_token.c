@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L // for strdup
+#define _DEFAULT_SOURCE         // for strdup on old systems
+
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../utils/http.h"
+#include "../mfconn.h"
+#include "../apicalls.h"        // IWYU pragma: keep
+
+static int      _decode_user_get_action_token(mfhttp * conn, void *data);
+
+/*
+ * An action token of type "upload" replaces the session token in upload
+ * calls. Such calls are not signed and therefore do not advance the secret
+ * key, so they can be made in parallel. The lifespan is given in minutes.
+ */
+int
+mfconn_api_user_get_action_token(mfconn * conn, const char *type,
+                                 int lifespan, char **action_token)
+{
+    const char     *api_call;
+    int             retval;
+    mfhttp         *http;
+    struct mfconn_retry retry;
+
+    if (conn == NULL)
+        return -1;
+
+    if (type == NULL || action_token == NULL)
+        return -1;
+
+    *action_token = NULL;
+
+    if (mfconn_retry_start(conn, &retry, "user/get_action_token") != 0)
+        return -1;
+
+    do {
+        free(*action_token);
+        *action_token = NULL;
+
+        api_call = mfconn_create_signed_get(conn, 0,
+                                            "user/get_action_token.php",
+                                            "?type=%s"
+                                            "&lifespan=%d"
+                                            "&response_format=json", type,
+                                            lifespan);
+        if (api_call == NULL) {
+            fprintf(stderr, "mfconn_create_signed_get failed\n");
+            return -1;
+        }
+
+        http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
+        retval = http_get_buf(http, api_call, _decode_user_get_action_token,
+                              (void *)action_token);
+        http_destroy(http);
+        mfconn_update_secret_key(conn);
+
+        free((void *)api_call);
+
+    } while (mfconn_retry_again(conn, &retry, &retval));
+
+    return retval;
+}
+
+static int _decode_user_get_action_token(mfhttp * conn, void *user_ptr)
+{
+    json_error_t    error;
+    json_t         *root;
+    json_t         *node;
+    json_t         *j_obj;
+    int             retval;
+    char          **action_token;
+
+    action_token = (char **)user_ptr;
+    if (action_token == NULL)
+        return -1;
+
+    root = http_parse_buf_json(conn, 0, &error);
+
+    if (root == NULL) {
+        fprintf(stderr, "http_parse_buf_json failed at line %d\n", error.line);
+        fprintf(stderr, "error message: %s\n", error.text);
+        return -1;
+    }
+
+    node = json_object_get(root, "response");
+
+    retval = mfapi_check_response(node, "user/get_action_token");
+    if (retval != 0) {
+        fprintf(stderr, "invalid response\n");
+        json_decref(root);
+        return retval;
+    }
+
+    j_obj = json_object_get(node, "action_token");
+    if (j_obj == NULL || !json_is_string(j_obj)) {
+        fprintf(stderr, "json: no /action_token content\n");
+        json_decref(root);
+        return -1;
+    }
+    *action_token = strdup(json_string_value(j_obj));
+
+    json_decref(root);
+
+    return 0;
+}
@@ -32,25 +32,33 @@ int mfconn_api_user_get_info(mfconn * conn)
     const char     *api_call;
     int             retval;
     mfhttp         *http;
+    struct mfconn_retry retry;
 
     // char        *rx_buffer;
 
     if (conn == NULL)
         return -1;
 
-    api_call = mfconn_create_signed_get(conn, 0, "user/get_info.php",
-                                        "?response_format=json");
-    if (api_call == NULL) {
-        fprintf(stderr, "mfconn_create_signed_get failed\n");
+    if (mfconn_retry_start(conn, &retry, "user/get_info") != 0)
         return -1;
-    }
 
-    http = http_create();
-    retval = http_get_buf(http, api_call, _decode_user_get_info, NULL);
-    http_destroy(http);
-    mfconn_update_secret_key(conn);
+    do {
+        api_call = mfconn_create_signed_get(conn, 0, "user/get_info.php",
+                                            "?response_format=json");
+        if (api_call == NULL) {
+            fprintf(stderr, "mfconn_create_signed_get failed\n");
+            return -1;
+        }
+
+        http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
+        retval = http_get_buf(http, api_call, _decode_user_get_info, NULL);
+        http_destroy(http);
+        mfconn_update_secret_key(conn);
+
+        free((void *)api_call);
 
-    free((void *)api_call);
+    } while (mfconn_retry_again(conn, &retry, &retval));
 
     return retval;
 }
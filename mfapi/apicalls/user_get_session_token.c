@@ -54,14 +54,20 @@ mfconn_api_user_get_session_token(mfconn * conn, const char *server,
     int             retval;
     struct user_get_session_token_response response;
     mfhttp         *http;
-    int             i;
+    struct mfconn_retry retry;
     char           *username_urlenc;
     char           *password_urlenc;
 
     if (conn == NULL)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    if (mfconn_retry_start(conn, &retry, "user/get_session_token") != 0)
+        return -1;
+
+    // a failed login must not hand out uninitialized pointers
+    memset(&response, 0, sizeof(response));
+
+    do {
         if (*secret_time != NULL) {
             free(*secret_time);
             *secret_time = NULL;
@@ -106,6 +112,7 @@ mfconn_api_user_get_session_token(mfconn * conn, const char *server,
         free((void *)user_signature);
 
         http = http_create();
+        http_set_timeout(http, mfconn_retry_timeout(&retry));
         retval =
             http_post_buf(http, login_url, post_args,
                           _decode_get_session_token, (void *)(&response));
@@ -114,22 +121,7 @@ mfconn_api_user_get_session_token(mfconn * conn, const char *server,
         free(login_url);
         free(post_args);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
-    }
+    } while (mfconn_retry_again(conn, &retry, &retval));
 
     *secret_key = response.secret_key;
     *secret_time = response.secret_time;
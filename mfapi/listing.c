@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _XOPEN_SOURCE           // for strptime
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "listing.h"
+
+#define LISTING_BLOCK_SIZE 16384
+#define LISTING_MIN_ENTRIES 64
+
+struct mflisting_block {
+    struct mflisting_block *next;
+    size_t          size;
+    size_t          used;
+    char            data[];
+};
+
+void listing_init(mflisting * listing)
+{
+    memset(listing, 0, sizeof(mflisting));
+}
+
+/*
+ * forget all entries but keep the memory for the next listing
+ */
+void listing_clear(mflisting * listing)
+{
+    struct mflisting_block *block;
+
+    for (block = listing->blocks; block != NULL; block = block->next)
+        block->used = 0;
+    listing->block_curr = listing->blocks;
+    listing->num_entries = 0;
+}
+
+void listing_free(mflisting * listing)
+{
+    struct mflisting_block *block;
+    struct mflisting_block *next;
+
+    for (block = listing->blocks; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+    free(listing->entries);
+    listing_init(listing);
+}
+
+static char    *listing_strdup(mflisting * listing, const char *str)
+{
+    struct mflisting_block *block;
+    struct mflisting_block *last;
+    size_t          len;
+    char           *ret;
+
+    len = strlen(str) + 1;
+
+    /* the blocks after the current one are unused */
+    last = NULL;
+    for (block = listing->block_curr; block != NULL; block = block->next) {
+        if (block->size - block->used >= len)
+            break;
+        last = block;
+    }
+
+    if (block == NULL) {
+        block = (struct mflisting_block *)
+            malloc(sizeof(struct mflisting_block) + LISTING_BLOCK_SIZE);
+        if (block == NULL) {
+            fprintf(stderr, "malloc failed\n");
+            return NULL;
+        }
+        block->next = NULL;
+        block->size = LISTING_BLOCK_SIZE;
+        block->used = 0;
+        if (last != NULL)
+            last->next = block;
+        else
+            listing->blocks = block;
+    }
+    listing->block_curr = block;
+
+    ret = block->data + block->used;
+    memcpy(ret, str, len);
+    block->used += len;
+
+    return ret;
+}
+
+/*
+ * append an entry with the given key and name, all other members are zero
+ *
+ * returns NULL if the key or the name are invalid
+ */
+struct mflisting_entry *listing_add(mflisting * listing, const char *key,
+                                    const char *name)
+{
+    struct mflisting_entry *entry;
+    struct mflisting_entry *entries;
+    size_t          max_entries;
+    size_t          len;
+
+    if (key == NULL || name == NULL) {
+        fprintf(stderr, "key and name cannot be NULL\n");
+        return NULL;
+    }
+
+    len = strlen(key);
+    if (len == 0 || len > MFAPI_MAX_LEN_KEY) {
+        fprintf(stderr, "invalid key: %s\n", key);
+        return NULL;
+    }
+
+    if (strlen(name) > MFAPI_MAX_LEN_NAME) {
+        fprintf(stderr, "name of %s is too long\n", key);
+        return NULL;
+    }
+
+    if (listing->num_entries == listing->max_entries) {
+        max_entries = listing->max_entries * 2;
+        if (max_entries < LISTING_MIN_ENTRIES)
+            max_entries = LISTING_MIN_ENTRIES;
+        entries = (struct mflisting_entry *)realloc(listing->entries,
+                                                    max_entries *
+                                                    sizeof(struct
+                                                           mflisting_entry));
+        if (entries == NULL) {
+            fprintf(stderr, "realloc failed\n");
+            return NULL;
+        }
+        listing->entries = entries;
+        listing->max_entries = max_entries;
+    }
+
+    entry = listing->entries + listing->num_entries;
+    memset(entry, 0, sizeof(struct mflisting_entry));
+    memcpy(entry->key, key, len + 1);
+    entry->name = listing_strdup(listing, name);
+    if (entry->name == NULL)
+        return NULL;
+
+    listing->num_entries++;
+
+    return entry;
+}
+
+/*
+ * drop the entries after the first num_entries, for example to retry a chunk
+ * of a listing. The names of the dropped entries stay allocated until the
+ * listing is cleared.
+ */
+void listing_truncate(mflisting * listing, size_t num_entries)
+{
+    if (num_entries < listing->num_entries)
+        listing->num_entries = num_entries;
+}
+
+static int parse_digits(const char *str, int num)
+{
+    int             ret;
+    int             i;
+
+    ret = 0;
+    for (i = 0; i < num; i++) {
+        if (str[i] < '0' || str[i] > '9')
+            return -1;
+        ret = ret * 10 + str[i] - '0';
+    }
+
+    return ret;
+}
+
+/*
+ * parse a timestamp of the form "%F %T" the same way as strptime and mktime
+ * would do it
+ *
+ * the entries of a listing were mostly created on a handful of days, so only
+ * the date goes through mktime and the result is remembered for the next
+ * entry. As tm_isdst is always zero, the time of day is a plain offset from
+ * midnight.
+ *
+ * returns zero if the timestamp cannot be parsed
+ */
+time_t listing_parse_time(mflisting * listing, const char *str)
+{
+    struct tm       tm;
+    char           *ret;
+    int             hour;
+    int             min;
+    int             sec;
+
+    hour = min = sec = -1;
+    if (strlen(str) == 19 && str[10] == ' ' && str[13] == ':'
+        && str[16] == ':') {
+        hour = parse_digits(str + 11, 2);
+        min = parse_digits(str + 14, 2);
+        sec = parse_digits(str + 17, 2);
+    }
+
+    if (hour < 0 || min < 0 || sec < 0) {
+        /* not the format the API uses, let strptime figure it out */
+        memset(&tm, 0, sizeof(struct tm));
+        ret = strptime(str, "%F %T", &tm);
+        if (ret == NULL || ret[0] != '\0')
+            return 0;
+        return mktime(&tm);
+    }
+
+    if (memcmp(listing->date, str, 10) != 0) {
+        memset(&tm, 0, sizeof(struct tm));
+        ret = strptime(str, "%F", &tm);
+        if (ret == NULL || ret != str + 10)
+            return 0;
+        listing->midnight = mktime(&tm);
+        memcpy(listing->date, str, 10);
+        listing->date[10] = '\0';
+    }
+
+    return listing->midnight + hour * 3600 + min * 60 + sec;
+}
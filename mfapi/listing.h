@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef __MFAPI_LISTING_H__
+#define __MFAPI_LISTING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <openssl/sha.h>
+
+#include "apicalls.h"
+
+/*
+ * one file or folder of a folder listing
+ *
+ * unlike mffile and mffolder, the name is not a fixed size buffer but points
+ * into the arena of the listing it belongs to, so it stays valid until the
+ * listing is cleared or freed
+ */
+struct mflisting_entry {
+    char            key[MFAPI_MAX_LEN_KEY + 1];
+    const char     *name;
+    uint64_t        revision;
+    time_t          created;
+
+    /* only for files */
+    uint64_t        size;
+    /* binary hash, all zero if the listing did not contain one */
+    unsigned char   hash[SHA256_DIGEST_LENGTH];
+};
+
+struct mflisting_block;
+
+/*
+ * the content of a folder, as returned by folder/get_content
+ *
+ * the entries array grows by doubling and the names are allocated from
+ * blocks that are kept when the listing is cleared, so a listing that is
+ * reused costs no allocations once it has grown to the size of the largest
+ * folder
+ */
+typedef struct mflisting {
+    struct mflisting_entry *entries;
+    size_t          num_entries;
+
+    /* private */
+    size_t          max_entries;
+    struct mflisting_block *blocks;
+    struct mflisting_block *block_curr;
+    /* the last date that was parsed and the time_t of its midnight */
+    char            date[11];
+    time_t          midnight;
+} mflisting;
+
+void            listing_init(mflisting * listing);
+
+void            listing_clear(mflisting * listing);
+
+void            listing_free(mflisting * listing);
+
+struct mflisting_entry *listing_add(mflisting * listing, const char *key,
+                                    const char *name);
+
+void            listing_truncate(mflisting * listing, size_t num_entries);
+
+time_t          listing_parse_time(mflisting * listing, const char *str);
+
+#endif
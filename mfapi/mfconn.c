@@ -17,37 +17,128 @@
  *
  */
 
-#define _POSIX_C_SOURCE 200809L // for strdup
+#define _POSIX_C_SOURCE 200809L // for strdup, getline and strtok_r
 #define _DEFAULT_SOURCE         // for strdup on old systems
 
+#include <curl/curl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <openssl/evp.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../utils/hash.h"
 #include "../utils/strings.h"
 #include "apicalls.h"
 #include "mfconn.h"
 
-struct mfconn {
-    char           *server;
+/*
+ * Sessions
+ *
+ * Every signed call advances the secret key of the session it was made with,
+ * so the calls of one session have to be made one after another. To let
+ * several threads make signed calls at the same time, a connection keeps a
+ * pool of up to max_sessions sessions, each with its own session token and
+ * chain of secret keys. Sessions are logged in on demand when all existing
+ * ones are in use. The first num_sessions entries of the pool are logged in,
+ * logins in progress are counted in num_logins until they succeed.
+ *
+ * mfconn_create_signed_get takes a free session from the pool for the
+ * calling thread and mfconn_retry_again returns it after the attempt. A
+ * session whose token expired is logged in again by the retry policy like
+ * before.
+ *
+ * So that calls do not run into expired tokens in the first place, a renewer
+ * thread logs every idle session in again once it reaches three quarters of
+ * session_lifetime. If a session file is set, the renewer and mfconn_destroy
+ * store the sessions in it and mfconn_create picks them up again, which saves
+ * the round trip of logging in when mounting again shortly after. The file
+ * holds credentials, so it is only written and read with mode 0600.
+ */
+
+#define MFCONN_MAX_SESSIONS 32
+#define MFCONN_SESSION_LIFETIME 600.0
+#define MFCONN_SESSION_RENEW 0.75
+// wait this long before trying again to renew a session that failed
+#define MFCONN_SESSION_RENEW_RETRY 30.0
+
+struct mfsession {
     uint32_t        secret_key;
     char           *secret_time;
     char           *session_token;
     char           *ekey;
+    // wall clock time of the login, kept in the session file
+    time_t          login_time;
+    // monotonic time at which the renewer logs the session in again
+    double          renew_at;
+    bool            busy;
+};
+
+struct mfconn {
+    char           *server;
     char           *username;
     char           *password;
     int             app_id;
     char           *app_key;
     int             max_num_retries;
+    // protects the pool of sessions and the state of the retry policy
+    pthread_mutex_t mutex;
+    pthread_cond_t  session_cond;
+    struct mfsession *sessions[MFCONN_MAX_SESSIONS];
+    int             num_sessions;
+    int             num_logins;
+    int             max_sessions;
+    // the session of the calling thread
+    pthread_key_t   session_key;
+    double          session_lifetime;
+    char           *session_file;
+    // renewer of the sessions, see mfconn_renewer
+    pthread_cond_t  renew_cond;
+    pthread_t       renew_thread;
+    // the process that runs the renewer, the thread does not survive a fork
+    pid_t           renew_pid;
+    bool            renew_stop;
+    // circuit breaker of the retry policy
+    int             breaker_failures;
+    double          breaker_open_until;
+    unsigned int    retry_seed;
+    // completion poller of uploads, see mfconn_upload_poll_async
+    pthread_mutex_t poll_mutex;
+    // wakes the poller thread
+    pthread_cond_t  poll_cond;
+    // wakes the callers of mfconn_upload_poll_for_completion
+    pthread_cond_t  poll_done_cond;
+    pthread_t       poll_thread;
+    bool            poll_started;
+    bool            poll_stop;
+    bool            poll_no_batch;
+    struct mfconn_poll *polls;
 };
 
+static void     mfconn_upload_poll_stop(mfconn * conn);
+static int      mfconn_session_login(mfconn * conn,
+                                     struct mfsession *session);
+static void     mfconn_session_free(struct mfsession *session);
+static int      mfconn_session_load(mfconn * conn);
+static double   mfconn_now(void);
+
+/*
+ * if session_file is not NULL, the sessions stored in it are used instead of
+ * logging in and the current sessions are stored in it for the next time
+ */
 mfconn         *mfconn_create(const char *server, const char *username,
                               const char *password, int app_id,
-                              const char *app_key, int max_num_retries)
+                              const char *app_key, int max_num_retries,
+                              const char *session_file)
 {
     mfconn         *conn;
     int             retval;
@@ -75,73 +166,543 @@ mfconn         *mfconn_create(const char *server, const char *username,
     else
         conn->app_key = NULL;
     conn->max_num_retries = max_num_retries;
-    conn->secret_time = NULL;
-    conn->session_token = NULL;
-    conn->ekey = NULL;
-    retval = mfconn_api_user_get_session_token(conn, conn->server,
-                                               conn->username, conn->password,
-                                               conn->app_id, conn->app_key,
-                                               &(conn->secret_key),
-                                               &(conn->secret_time),
-                                               &(conn->session_token),
-                                               &(conn->ekey));
+    conn->retry_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    pthread_mutex_init(&(conn->poll_mutex), NULL);
+    pthread_cond_init(&(conn->poll_cond), NULL);
+    pthread_cond_init(&(conn->poll_done_cond), NULL);
+    pthread_mutex_init(&(conn->mutex), NULL);
+    pthread_cond_init(&(conn->session_cond), NULL);
+    pthread_key_create(&(conn->session_key), NULL);
+    pthread_cond_init(&(conn->renew_cond), NULL);
+    conn->session_lifetime = MFCONN_SESSION_LIFETIME;
+    conn->max_sessions = 1;
+    if (session_file != NULL) {
+        conn->session_file = strdup(session_file);
+        if (mfconn_session_load(conn) == 0)
+            return conn;
+    }
+    conn->num_sessions = 1;
+    conn->sessions[0] = (struct mfsession *)calloc(1,
+                                                   sizeof(struct mfsession));
+    retval = mfconn_session_login(conn, conn->sessions[0]);
 
     if (retval != 0) {
         fprintf(stderr, "error: mfconn_api_user_get_session_token\n");
+        // there is nothing worth storing in the session file
+        free(conn->session_file);
+        conn->session_file = NULL;
+        mfconn_destroy(conn);
         return NULL;
     }
 
     return conn;
 }
 
-int mfconn_refresh_token(mfconn * conn)
+/*
+ * the session keeps its old token if logging in fails, so that the renewer
+ * does not take away a token that might still be valid
+ */
+static int mfconn_session_login(mfconn * conn, struct mfsession *session)
 {
     int             retval;
+    uint32_t        secret_key;
+    char           *secret_time = NULL;
+    char           *session_token = NULL;
+    char           *ekey = NULL;
 
-    free(conn->secret_time);
-    conn->secret_time = NULL;
-    free(conn->session_token);
-    conn->session_token = NULL;
-    free(conn->ekey);
-    conn->ekey = NULL;
     retval = mfconn_api_user_get_session_token(conn, conn->server,
                                                conn->username, conn->password,
                                                conn->app_id, conn->app_key,
-                                               &(conn->secret_key),
-                                               &(conn->secret_time),
-                                               &(conn->session_token),
-                                               &(conn->ekey));
+                                               &secret_key, &secret_time,
+                                               &session_token, &ekey);
     if (retval != 0) {
         fprintf(stderr, "user/get_session_token failed\n");
+        free(secret_time);
+        free(session_token);
+        free(ekey);
+        return -1;
+    }
+
+    free(session->secret_time);
+    free(session->session_token);
+    free(session->ekey);
+    session->secret_key = secret_key;
+    session->secret_time = secret_time;
+    session->session_token = session_token;
+    session->ekey = ekey;
+    session->login_time = time(NULL);
+    // the renewer reads renew_at and session_lifetime with the lock held
+    pthread_mutex_lock(&(conn->mutex));
+    session->renew_at = mfconn_now()
+        + conn->session_lifetime * MFCONN_SESSION_RENEW;
+    pthread_mutex_unlock(&(conn->mutex));
+
+    return 0;
+}
+
+static void mfconn_session_free(struct mfsession *session)
+{
+    free(session->secret_time);
+    free(session->session_token);
+    free(session->ekey);
+    free(session);
+}
+
+/*
+ * the session of the calling thread or, outside of a call, the first one of
+ * the pool
+ */
+static struct mfsession *mfconn_session(mfconn * conn)
+{
+    struct mfsession *session;
+
+    session = pthread_getspecific(conn->session_key);
+    if (session == NULL)
+        session = conn->sessions[0];
+
+    return session;
+}
+
+/*
+ * take a free session from the pool, logging in a new one if necessary
+ *
+ * If logging in fails, the caller waits for one of the existing sessions
+ * instead of trying again. Returns NULL if there is none to wait for.
+ */
+static struct mfsession *mfconn_session_take(mfconn * conn)
+{
+    struct mfsession *session;
+    bool            login_failed;
+    int             i;
+
+    login_failed = false;
+    pthread_mutex_lock(&(conn->mutex));
+    for (;;) {
+        for (i = 0; i < conn->num_sessions; i++) {
+            session = conn->sessions[i];
+            if (!session->busy) {
+                session->busy = true;
+                pthread_mutex_unlock(&(conn->mutex));
+                return session;
+            }
+        }
+
+        if (!login_failed
+            && conn->num_sessions + conn->num_logins < conn->max_sessions) {
+            // log in without holding the lock
+            conn->num_logins++;
+            pthread_mutex_unlock(&(conn->mutex));
+
+            session = (struct mfsession *)calloc(1,
+                                                 sizeof(struct mfsession));
+            session->busy = true;
+            if (mfconn_session_login(conn, session) != 0) {
+                mfconn_session_free(session);
+                session = NULL;
+            }
+
+            pthread_mutex_lock(&(conn->mutex));
+            conn->num_logins--;
+            if (session != NULL) {
+                conn->sessions[conn->num_sessions++] = session;
+                fprintf(stderr, "logged in session %d\n",
+                        conn->num_sessions);
+                pthread_mutex_unlock(&(conn->mutex));
+                return session;
+            }
+            // others might have waited for this login
+            pthread_cond_broadcast(&(conn->session_cond));
+            login_failed = true;
+            // a session might have been returned during the login
+            continue;
+        }
+
+        if (conn->num_sessions == 0 && conn->num_logins == 0) {
+            pthread_mutex_unlock(&(conn->mutex));
+            fprintf(stderr, "no session available\n");
+            return NULL;
+        }
+
+        pthread_cond_wait(&(conn->session_cond), &(conn->mutex));
+    }
+}
+
+static void mfconn_session_put(mfconn * conn, struct mfsession *session)
+{
+    pthread_mutex_lock(&(conn->mutex));
+    session->busy = false;
+    pthread_cond_signal(&(conn->session_cond));
+    pthread_mutex_unlock(&(conn->mutex));
+}
+
+// return the session that mfconn_create_signed_get took for the calling thread
+static void mfconn_session_release(mfconn * conn)
+{
+    struct mfsession *session;
+
+    session = pthread_getspecific(conn->session_key);
+    if (session == NULL)
+        return;
+
+    pthread_setspecific(conn->session_key, NULL);
+    mfconn_session_put(conn, session);
+}
+
+/*
+ * the pool grows up to num_sessions sessions, which allows as many threads
+ * to make signed calls at the same time
+ */
+int mfconn_set_num_sessions(mfconn * conn, int num_sessions)
+{
+    if (num_sessions < 1 || num_sessions > MFCONN_MAX_SESSIONS) {
+        fprintf(stderr, "the number of sessions must be between 1 and %d\n",
+                MFCONN_MAX_SESSIONS);
         return -1;
     }
+
+    pthread_mutex_lock(&(conn->mutex));
+    conn->max_sessions = num_sessions;
+    pthread_mutex_unlock(&(conn->mutex));
+
     return 0;
 }
 
+// log the session of the calling thread in again
+int mfconn_refresh_token(mfconn * conn)
+{
+    return mfconn_session_login(conn, mfconn_session(conn));
+}
+
+/*
+ * read the sessions that mfconn_session_save stored for the same account
+ *
+ * sessions that are due for renewal are dropped because logging them in
+ * again costs the same as a new login. Returns -1 if no session is left.
+ */
+static int mfconn_session_load(mfconn * conn)
+{
+    struct mfsession *session;
+    struct stat     st;
+    FILE           *fp;
+    int             fd;
+    char           *header;
+    char           *line = NULL;
+    size_t          len = 0;
+    char           *saveptr;
+    char           *fields[5];
+    double          age;
+    time_t          now;
+    int             i;
+
+    fd = open(conn->session_file, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &st) != 0 || st.st_uid != getuid()
+        || (st.st_mode & 077) != 0) {
+        fprintf(stderr, "ignoring %s, it must only be accessible by its "
+                "owner\n", conn->session_file);
+        close(fd);
+        return -1;
+    }
+
+    fp = fdopen(fd, "r");
+    if (fp == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    header = strdup_printf("%s %s\n", conn->server, conn->username);
+    if (getline(&line, &len, fp) == -1 || strcmp(line, header) != 0) {
+        free(header);
+        free(line);
+        fclose(fp);
+        return -1;
+    }
+    free(header);
+
+    // session_token secret_time secret_key ekey login_time
+    now = time(NULL);
+    while (conn->num_sessions < MFCONN_MAX_SESSIONS
+           && getline(&line, &len, fp) != -1) {
+        fields[0] = strtok_r(line, " \n", &saveptr);
+        for (i = 1; i < 5 && fields[i - 1] != NULL; i++)
+            fields[i] = strtok_r(NULL, " \n", &saveptr);
+        if (i < 5 || fields[4] == NULL)
+            continue;
+
+        age = difftime(now, (time_t) strtoll(fields[4], NULL, 10));
+        if (age < 0 || age >= conn->session_lifetime * MFCONN_SESSION_RENEW)
+            continue;
+
+        session = (struct mfsession *)calloc(1, sizeof(struct mfsession));
+        session->session_token = strdup(fields[0]);
+        session->secret_time = strdup(fields[1]);
+        session->secret_key = strtoul(fields[2], NULL, 10);
+        session->ekey = strdup(fields[3]);
+        session->login_time = now - (time_t) age;
+        session->renew_at = mfconn_now()
+            + conn->session_lifetime * MFCONN_SESSION_RENEW - age;
+        conn->sessions[conn->num_sessions++] = session;
+    }
+    free(line);
+    fclose(fp);
+
+    if (conn->num_sessions == 0)
+        return -1;
+
+    fprintf(stderr, "reusing %d stored sessions\n", conn->num_sessions);
+
+    return 0;
+}
+
+/*
+ * store the idle sessions in the session file
+ *
+ * busy sessions are left out because their secret key is about to change.
+ * The file is replaced atomically so that a crash does not leave a truncated
+ * one behind.
+ */
+static void mfconn_session_save(mfconn * conn)
+{
+    struct mfsession saved[MFCONN_MAX_SESSIONS];
+    struct mfsession *session;
+    char           *session_file;
+    char           *tmpfile;
+    FILE           *fp = NULL;
+    int             num_saved = 0;
+    int             fd;
+    int             i;
+
+    pthread_mutex_lock(&(conn->mutex));
+    if (conn->session_file == NULL) {
+        pthread_mutex_unlock(&(conn->mutex));
+        return;
+    }
+    session_file = strdup(conn->session_file);
+    for (i = 0; i < conn->num_sessions; i++) {
+        session = conn->sessions[i];
+        if (session->busy || session->session_token == NULL)
+            continue;
+        saved[num_saved].session_token = strdup(session->session_token);
+        saved[num_saved].secret_time = strdup(session->secret_time);
+        saved[num_saved].secret_key = session->secret_key;
+        saved[num_saved].ekey = strdup(session->ekey);
+        saved[num_saved].login_time = session->login_time;
+        num_saved++;
+    }
+    pthread_mutex_unlock(&(conn->mutex));
+
+    tmpfile = strdup_printf("%s.tmp", session_file);
+    fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    // the file might be left over with a wider mode
+    if (fd != -1 && fchmod(fd, 0600) == 0)
+        fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "cannot open %s for writing\n", tmpfile);
+        if (fd != -1) {
+            close(fd);
+            unlink(tmpfile);
+        }
+    } else {
+        fprintf(fp, "%s %s\n", conn->server, conn->username);
+        for (i = 0; i < num_saved; i++) {
+            fprintf(fp, "%s %s %" PRIu32 " %s %lld\n",
+                    saved[i].session_token, saved[i].secret_time,
+                    saved[i].secret_key, saved[i].ekey,
+                    (long long)saved[i].login_time);
+        }
+        if (fclose(fp) != 0 || rename(tmpfile, session_file) != 0) {
+            fprintf(stderr, "cannot write %s\n", session_file);
+            unlink(tmpfile);
+        }
+    }
+
+    for (i = 0; i < num_saved; i++) {
+        free(saved[i].session_token);
+        free(saved[i].secret_time);
+        free(saved[i].ekey);
+    }
+    free(tmpfile);
+    free(session_file);
+}
+
+// store the sessions in session_file from now on
+void mfconn_set_session_file(mfconn * conn, const char *session_file)
+{
+    pthread_mutex_lock(&(conn->mutex));
+    free(conn->session_file);
+    conn->session_file = NULL;
+    if (session_file != NULL)
+        conn->session_file = strdup(session_file);
+    pthread_mutex_unlock(&(conn->mutex));
+}
+
+/*
+ * the time in seconds after which the server lets a session token expire,
+ * sessions are renewed before
+ */
+void mfconn_set_session_lifetime(mfconn * conn, double seconds)
+{
+    int             i;
+
+    pthread_mutex_lock(&(conn->mutex));
+    for (i = 0; i < conn->num_sessions; i++) {
+        conn->sessions[i]->renew_at += (seconds - conn->session_lifetime)
+            * MFCONN_SESSION_RENEW;
+    }
+    conn->session_lifetime = seconds;
+    pthread_cond_signal(&(conn->renew_cond));
+    pthread_mutex_unlock(&(conn->mutex));
+}
+
+/*
+ * log idle sessions in again before their token expires
+ *
+ * A session is marked busy while it is renewed, so that no call is signed
+ * with it in the meantime. Sessions that are in use are renewed as soon as
+ * they are returned to the pool.
+ */
+static void    *mfconn_renewer(void *user_ptr)
+{
+    mfconn         *conn = (mfconn *) user_ptr;
+    struct mfsession *session;
+    struct timespec deadline;
+    bool            renewed = false;
+    double          now;
+    double          wake;
+    int             retval;
+    int             i;
+
+    pthread_mutex_lock(&(conn->mutex));
+    while (!conn->renew_stop) {
+        now = mfconn_now();
+        wake = now + conn->session_lifetime * MFCONN_SESSION_RENEW;
+        session = NULL;
+        for (i = 0; i < conn->num_sessions; i++) {
+            if (conn->sessions[i]->renew_at > now) {
+                if (conn->sessions[i]->renew_at < wake)
+                    wake = conn->sessions[i]->renew_at;
+                continue;
+            }
+            if (conn->sessions[i]->busy) {
+                if (now + 1 < wake)
+                    wake = now + 1;
+                continue;
+            }
+            session = conn->sessions[i];
+            break;
+        }
+
+        if (session != NULL) {
+            session->busy = true;
+            pthread_mutex_unlock(&(conn->mutex));
+            retval = mfconn_session_login(conn, session);
+            pthread_mutex_lock(&(conn->mutex));
+            if (retval == 0)
+                renewed = true;
+            else
+                session->renew_at = mfconn_now() + MFCONN_SESSION_RENEW_RETRY;
+            session->busy = false;
+            pthread_cond_signal(&(conn->session_cond));
+            continue;
+        }
+
+        if (renewed) {
+            pthread_mutex_unlock(&(conn->mutex));
+            mfconn_session_save(conn);
+            pthread_mutex_lock(&(conn->mutex));
+            renewed = false;
+            continue;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        wake = deadline.tv_sec + deadline.tv_nsec / 1e9 + (wake - now);
+        deadline.tv_sec = (time_t) wake;
+        deadline.tv_nsec = (wake - deadline.tv_sec) * 1e9;
+        pthread_cond_timedwait(&(conn->renew_cond), &(conn->mutex),
+                               &deadline);
+    }
+    pthread_mutex_unlock(&(conn->mutex));
+
+    return NULL;
+}
+
+/*
+ * start the renewer on the first signed call of a process, which is after
+ * fuse forked into the background
+ */
+static void mfconn_renewer_start(mfconn * conn)
+{
+    pid_t           pid;
+
+    pid = getpid();
+    pthread_mutex_lock(&(conn->mutex));
+    if (conn->renew_pid != pid) {
+        conn->renew_pid = pid;
+        conn->renew_stop = false;
+        if (pthread_create(&(conn->renew_thread), NULL, mfconn_renewer,
+                           conn) != 0) {
+            fprintf(stderr, "cannot start the session renewer\n");
+            conn->renew_pid = -1;
+        }
+    }
+    pthread_mutex_unlock(&(conn->mutex));
+}
+
+static void mfconn_renewer_stop(mfconn * conn)
+{
+    pthread_mutex_lock(&(conn->mutex));
+    if (conn->renew_pid != getpid()) {
+        pthread_mutex_unlock(&(conn->mutex));
+        return;
+    }
+    conn->renew_stop = true;
+    conn->renew_pid = 0;
+    pthread_cond_signal(&(conn->renew_cond));
+    pthread_mutex_unlock(&(conn->mutex));
+    pthread_join(conn->renew_thread, NULL);
+}
+
 void mfconn_destroy(mfconn * conn)
 {
+    int             i;
+
+    mfconn_upload_poll_stop(conn);
+    mfconn_renewer_stop(conn);
+    mfconn_session_save(conn);
+    pthread_mutex_destroy(&(conn->poll_mutex));
+    pthread_cond_destroy(&(conn->poll_cond));
+    pthread_cond_destroy(&(conn->poll_done_cond));
+    for (i = 0; i < conn->num_sessions; i++)
+        mfconn_session_free(conn->sessions[i]);
+    pthread_key_delete(conn->session_key);
+    pthread_mutex_destroy(&(conn->mutex));
+    pthread_cond_destroy(&(conn->session_cond));
+    pthread_cond_destroy(&(conn->renew_cond));
+    free(conn->session_file);
     free(conn->server);
     free(conn->username);
     free(conn->password);
     if (conn->app_key != NULL)
         free(conn->app_key);
-    free(conn->secret_time);
-    free(conn->session_token);
-    free(conn->ekey);
     free(conn);
 }
 
 void mfconn_update_secret_key(mfconn * conn)
 {
+    struct mfsession *session;
     uint64_t        new_val;
 
     if (conn == NULL)
         return;
 
-    new_val = ((uint64_t) conn->secret_key) * 16807;
+    session = mfconn_session(conn);
+
+    new_val = ((uint64_t) session->secret_key) * 16807;
     new_val %= 0x7FFFFFFF;
 
-    conn->secret_key = new_val;
+    session->secret_key = new_val;
 
     return;
 }
@@ -152,9 +713,7 @@ const char     *mfconn_create_user_signature(mfconn * conn,
                                              const char *app_key)
 {
     char           *signature_raw;
-    unsigned char   signature_enc[20];  // sha1 is 160 bits
-    char            signature_hex[41];
-    int             i;
+    unsigned char   signature_enc[SHA_DIGEST_LENGTH];
 
     if (conn == NULL)
         return NULL;
@@ -171,273 +730,869 @@ const char     *mfconn_create_user_signature(mfconn * conn,
 
     free(signature_raw);
 
-    for (i = 0; i < 20; i++) {
-        sprintf(&signature_hex[i * 2], "%02x", signature_enc[i]);
-    }
-    signature_hex[40] = '\0';
+    return binary2hex(signature_enc, SHA_DIGEST_LENGTH);
+}
 
-    return strdup((const char *)signature_hex);
+/*
+ * Building the URLs of API calls
+ *
+ * URLs are assembled in a buffer of the calling thread that is kept across
+ * calls and only grows, so that building one is a single pass over its
+ * pieces without allocations once the buffer is large enough. The signature
+ * is computed over the pieces in place instead of over a copy of them.
+ */
+
+struct mfconn_urlbuf {
+    char           *data;
+    size_t          size;
+    // computes the signature of the URL
+    EVP_MD_CTX     *md5;
+};
+
+static pthread_once_t mfconn_urlbuf_once = PTHREAD_ONCE_INIT;
+static pthread_key_t mfconn_urlbuf_key;
+
+static void mfconn_urlbuf_free(void *user_ptr)
+{
+    struct mfconn_urlbuf *buf = (struct mfconn_urlbuf *)user_ptr;
+
+    EVP_MD_CTX_free(buf->md5);
+    free(buf->data);
+    free(buf);
 }
 
-const char     *mfconn_create_call_signature(mfconn * conn, const char *url,
-                                             const char *args)
+static void mfconn_urlbuf_init(void)
 {
-    char           *signature_raw;
-    unsigned char   signature_enc[16];  // md5 is 128 bits
-    char            signature_hex[33];
-    char           *api;
-    int             i;
+    pthread_key_create(&mfconn_urlbuf_key, mfconn_urlbuf_free);
+}
 
-    if (conn == NULL)
-        return NULL;
-    if (url == NULL)
-        return NULL;
-    if (args == NULL)
+// make room for size bytes in the buffer of the calling thread
+static struct mfconn_urlbuf *mfconn_urlbuf(size_t size)
+{
+    struct mfconn_urlbuf *buf;
+    char           *data;
+    size_t          new_size;
+
+    pthread_once(&mfconn_urlbuf_once, mfconn_urlbuf_init);
+    buf = pthread_getspecific(mfconn_urlbuf_key);
+    if (buf == NULL) {
+        buf = (struct mfconn_urlbuf *)calloc(1, sizeof(struct mfconn_urlbuf));
+        if (buf == NULL)
+            return NULL;
+        buf->md5 = EVP_MD_CTX_new();
+        if (buf->md5 == NULL) {
+            fprintf(stderr, "cannot allocate memory\n");
+            free(buf);
+            return NULL;
+        }
+        pthread_setspecific(mfconn_urlbuf_key, buf);
+    }
+
+    if (buf->size >= size)
+        return buf;
+
+    new_size = buf->size > 0 ? buf->size : 512;
+    while (new_size < size)
+        new_size *= 2;
+    data = (char *)realloc(buf->data, new_size);
+    if (data == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
         return NULL;
+    }
+    buf->data = data;
+    buf->size = new_size;
+
+    return buf;
+}
+
+/*
+ * MD5 over the lowest byte of the secret key in decimal, the secret time and
+ * the part of the URL from /api/ on, in lower case hex
+ *
+ * md5 is the context of the calling thread, which is reset for every URL.
+ */
+static int
+mfconn_sign(EVP_MD_CTX * md5, struct mfsession *session, const char *path,
+            size_t path_len, char *signature_hex)
+{
+    unsigned char   signature_enc[MD5_DIGEST_LENGTH];
+    char            key[4];
+    int             key_len;
+
+    key_len = snprintf(key, sizeof(key), "%d",
+                       (int)(session->secret_key % 256));
+
+    if (EVP_DigestInit_ex(md5, EVP_md5(), NULL) != 1
+        || EVP_DigestUpdate(md5, key, key_len) != 1
+        || EVP_DigestUpdate(md5, session->secret_time,
+                            strlen(session->secret_time)) != 1
+        || EVP_DigestUpdate(md5, path, path_len) != 1
+        || EVP_DigestFinal_ex(md5, signature_enc, NULL) != 1) {
+        fprintf(stderr, "cannot compute the signature\n");
+        return -1;
+    }
 
-    // printf("url: %s\n\rargs: %s\n\r",url,args);
+    binary2hex_buf(signature_enc, MD5_DIGEST_LENGTH, signature_hex);
 
-    api = strstr(url, "/api/");
+    return 0;
+}
 
-    if (api == NULL)
-        return NULL;
+static size_t mfconn_url_append(char *dst, const char *src)
+{
+    size_t          len;
 
-    signature_raw = strdup_printf("%d%s%s%s",
-                                  (conn->secret_key % 256),
-                                  conn->secret_time, api, args);
-    if (signature_raw == NULL) {
-        fprintf(stderr, "strdup_printf failed\n");
-        return NULL;
+    len = strlen(src);
+    memcpy(dst, src, len);
+
+    return len;
+}
+
+/*
+ * build the URL of an API call in the buffer of the calling thread
+ *
+ * if session is not NULL, its token is appended to the arguments and the
+ * call is signed with it. Returns the length of the URL or -1.
+ */
+static int
+mfconn_build_url(mfconn * conn, int ssl, const char *api,
+                 struct mfsession *session, char **url, const char *fmt,
+                 va_list ap)
+{
+    struct mfconn_urlbuf *buf;
+    va_list         aq;
+    size_t          len;
+    size_t          path;
+    size_t          rest;
+    int             args_len;
+
+    // everything but the arguments, plus slack for short arguments
+    len = strlen(conn->server) + strlen(api) + 256;
+    if (session != NULL)
+        len += strlen(session->session_token);
+
+    buf = mfconn_urlbuf(len);
+    if (buf == NULL)
+        return -1;
+
+    len = mfconn_url_append(buf->data, ssl ? "https://" : "http://");
+    len += mfconn_url_append(buf->data + len, conn->server);
+    path = len;
+    len += mfconn_url_append(buf->data + len, "/api/" MFAPI_VERSION "/");
+    len += mfconn_url_append(buf->data + len, api);
+
+    // the session token and signature need less than 128 bytes besides the
+    // token itself
+    rest = 128 + (session != NULL ? strlen(session->session_token) : 0);
+
+    va_copy(aq, ap);
+    args_len = vsnprintf(buf->data + len, buf->size - len, fmt, aq);
+    va_end(aq);
+    if (args_len < 0)
+        return -1;
+    if (len + args_len + rest > buf->size) {
+        buf = mfconn_urlbuf(len + args_len + rest);
+        if (buf == NULL)
+            return -1;
+        vsnprintf(buf->data + len, buf->size - len, fmt, ap);
     }
+    len += args_len;
+
+    if (session != NULL) {
+        len += mfconn_url_append(buf->data + len, "&session_token=");
+        len += mfconn_url_append(buf->data + len, session->session_token);
+        len += mfconn_url_append(buf->data + len, "&signature=");
+        if (mfconn_sign(buf->md5, session, buf->data + path,
+                        len - path - strlen("&signature="),
+                        buf->data + len) != 0)
+            return -1;
+        len += MD5_DIGEST_LENGTH * 2;
+    }
+    buf->data[len] = '\0';
 
-    MD5((const unsigned char *)signature_raw,
-        strlen(signature_raw), signature_enc);
+    *url = buf->data;
 
-    free(signature_raw);
+    return len;
+}
+
+// copy the URL out of the buffer of the calling thread
+static const char *mfconn_url_dup(const char *url, int len)
+{
+    char           *copy;
 
-    for (i = 0; i < 16; i++) {
-        sprintf(&signature_hex[i * 2], "%02x", signature_enc[i]);
+    copy = (char *)malloc(len + 1);
+    if (copy == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return NULL;
     }
-    signature_hex[32] = '\0';
+    memcpy(copy, url, len + 1);
 
-    return strdup((const char *)signature_hex);
+    return copy;
 }
 
-const char     *mfconn_create_unsigned_get(mfconn * conn, int ssl,
-                                           const char *api, const char *fmt,
-                                           ...)
+// make sure the api (ex: user/get_info.php) is sane
+static int mfconn_check_api(mfconn * conn, const char *api)
 {
-    char           *api_request = NULL;
-    char           *api_args = NULL;
-    int             bytes_to_alloc;
-    int             api_args_len;
-    int             api_len;
-    va_list         ap;
+    size_t          api_len;
 
     if (conn == NULL) {
         fprintf(stderr, "conn cannot be NULL\n");
-        return NULL;
+        return -1;
     }
     if (conn->server == NULL) {
         fprintf(stderr, "server cannot be NULL\n");
-        return NULL;
+        return -1;
     }
-    // make sure the api (ex: user/get_info.php) is sane
     if (api == NULL) {
         fprintf(stderr, "api call cannot be NULL\n");
-        return NULL;
+        return -1;
     }
     api_len = strlen(api);
     if (api_len < 3) {
         fprintf(stderr, "api call length cannot be less than 3\n");
-        return NULL;
+        return -1;
     }
-    // calculate how big of a buffer we need
-    va_start(ap, fmt);
-    api_args_len = (vsnprintf(NULL, 0, fmt, ap) + 1);   // + 1 for NULL
-    va_end(ap);
-
-    // create the correctly sized buffer and process the args
-    api_args = (char *)calloc(api_args_len, sizeof(char));
-
-    // printf("\n\r%d\n\r",api_args_len);
-
-    va_start(ap, fmt);
-    vsnprintf(api_args, api_args_len, fmt, ap);
-    va_end(ap);
-
     // correct user error of trailing slash
     if (api[api_len - 1] == '/') {
         fprintf(stderr, "api call must not end with slash\n");
-        return NULL;
+        return -1;
     }
 
-    api_request = strdup_printf("%s//%s/api/%s/%s",
-                                (ssl ? "https:" : "http:"),
-                                conn->server, MFAPI_VERSION, api);
+    return 0;
+}
 
-    // compute the amount of space requred to realloc() the request
-    bytes_to_alloc = api_args_len;
-    bytes_to_alloc += strlen(api_request);
-    bytes_to_alloc += 1;        // null termination
+const char     *mfconn_create_unsigned_get(mfconn * conn, int ssl,
+                                           const char *api, const char *fmt,
+                                           ...)
+{
+    char           *url;
+    int             len;
+    va_list         ap;
 
-    // append api GET args to api request
-    api_request = (char *)realloc(api_request, bytes_to_alloc);
-    if (api_request == NULL) {
-        fprintf(stderr, "cannot allocate memory\n");
+    if (mfconn_check_api(conn, api) != 0)
         return NULL;
-    }
-
-    strncat(api_request, api_args, api_args_len);
 
-    free(api_args);
+    va_start(ap, fmt);
+    len = mfconn_build_url(conn, ssl, api, NULL, &url, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return NULL;
 
-    return api_request;
+    return mfconn_url_dup(url, len);
 }
 
 const char     *mfconn_create_signed_get(mfconn * conn, int ssl,
                                          const char *api, const char *fmt, ...)
 {
-    char           *api_request = NULL;
-    char           *api_args = NULL;
-    char           *signature;
-    const char     *call_hash;
-    char           *session_token;
-    int             bytes_to_alloc;
-    int             api_args_len;
-    int             api_len;
+    struct mfsession *session;
+    const char     *copy;
+    char           *url;
+    int             len;
     va_list         ap;
 
-    if (conn == NULL) {
-        fprintf(stderr, "conn cannot be NULL\n");
-        return NULL;
-    }
-    if (conn->server == NULL) {
-        fprintf(stderr, "server cannot be NULL\n");
+    if (mfconn_check_api(conn, api) != 0)
         return NULL;
+
+    mfconn_renewer_start(conn);
+
+    // sign with the session of this thread or take one from the pool which
+    // mfconn_retry_again returns after the call
+    session = pthread_getspecific(conn->session_key);
+    if (session == NULL) {
+        session = mfconn_session_take(conn);
+        if (session == NULL)
+            return NULL;
+        pthread_setspecific(conn->session_key, session);
     }
-    if (conn->secret_time == NULL) {
-        fprintf(stderr, "secret_time cannot be NULL\n");
+    va_start(ap, fmt);
+    len = mfconn_build_url(conn, ssl, api, session, &url, fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        mfconn_session_release(conn);
         return NULL;
     }
-    if (conn->session_token == NULL) {
-        fprintf(stderr, "session_token cannot be NULL\n");
-        return NULL;
+
+    copy = mfconn_url_dup(url, len);
+    if (copy == NULL)
+        mfconn_session_release(conn);
+
+    return copy;
+}
+
+const char     *mfconn_get_session_token(mfconn * conn)
+{
+    return mfconn_session(conn)->session_token;
+}
+
+const char     *mfconn_get_secret_time(mfconn * conn)
+{
+    return mfconn_session(conn)->secret_time;
+}
+
+uint32_t mfconn_get_secret_key(mfconn * conn)
+{
+    return mfconn_session(conn)->secret_key;
+}
+
+int mfconn_get_max_num_retries(mfconn * conn)
+{
+    return conn->max_num_retries;
+}
+
+int mfconn_get_num_sessions(mfconn * conn)
+{
+    int             num_sessions;
+
+    pthread_mutex_lock(&(conn->mutex));
+    num_sessions = conn->max_sessions;
+    pthread_mutex_unlock(&(conn->mutex));
+
+    return num_sessions;
+}
+
+const char     *mfconn_get_ekey(mfconn * conn)
+{
+    return mfconn_session(conn)->ekey;
+}
+
+/*
+ * Retry policy of the API calls
+ *
+ * An API call is attempted at most max_num_retries times and, if its endpoint
+ * has a deadline, only as long as the deadline is not exceeded. The deadline
+ * also limits the duration of each single transfer. The outcome of every
+ * attempt is put into one of three classes:
+ *
+ *  - token errors: the session token expired or the server rejected our
+ *    signature. A curl timeout also belongs here because we do not know
+ *    whether the server accepted the call and advanced the secret key. A new
+ *    session token is negotiated. The first token error is retried right away,
+ *    further ones after a backoff.
+ *  - transient errors: the server could not be reached, the connection broke
+ *    or the server answered with a 5xx or 429 status. The call is retried
+ *    after an exponential backoff with jitter, so that many clients do not
+ *    hammer a recovering server in lockstep.
+ *  - everything else, including success and API errors like a missing file,
+ *    is returned to the caller immediately.
+ *
+ * Transient errors and timeouts of consecutive attempts, across all calls,
+ * are counted by a circuit breaker. Once it trips, all calls fail right away
+ * instead of each of them waiting through its own backoff while the server is
+ * down. After a cool down, calls go through again but the first failure
+ * trips the breaker again. Any answer of the server resets it.
+ */
+
+#define MFCONN_BACKOFF_BASE 0.25
+#define MFCONN_BACKOFF_MAX 8.0
+#define MFCONN_BREAKER_THRESHOLD 5
+#define MFCONN_BREAKER_COOLDOWN 30.0
+
+enum {
+    MFCONN_ERROR_PERMANENT,
+    MFCONN_ERROR_TOKEN,
+    MFCONN_ERROR_TRANSIENT,
+};
+
+// deadlines in seconds of endpoints, zero means that there is none
+static const struct {
+    const char     *api;
+    double          deadline;
+} mfconn_deadlines[] = {
+    // the list of changes can be huge on the first call
+    {"device/get_changes", 120},
+    {"folder/get_content", 60},
+    // uploads take as long as the file needs
+    {"upload/simple", 0},
+    {"upload/patch", 0},
+    {NULL, 30}
+};
+
+static double mfconn_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int mfconn_classify_error(const char *api, int retval)
+{
+    switch (retval) {
+        case 105:              // session token expired or invalid
+        case 127:              // invalid signature
+            // logging in does not use a session token, the credentials or
+            // the application key are wrong
+            if (strcmp(api, "user/get_session_token") == 0)
+                return MFCONN_ERROR_PERMANENT;
+            return MFCONN_ERROR_TOKEN;
+        case CURLE_OPERATION_TIMEDOUT:
+            if (strcmp(api, "user/get_session_token") == 0)
+                return MFCONN_ERROR_TRANSIENT;
+            return MFCONN_ERROR_TOKEN;
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_HTTP_RETURNED_ERROR:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SSL_CONNECT_ERROR:
+            return MFCONN_ERROR_TRANSIENT;
+        default:
+            return MFCONN_ERROR_PERMANENT;
     }
-    // make sure the api (ex: user/get_info.php) is sane
-    if (api == NULL) {
-        fprintf(stderr, "api name cannot be NULL\n");
-        return NULL;
+}
+
+/*
+ * prepare the retries of an API call
+ *
+ * returns -1 without making the call if the circuit breaker is open
+ */
+int mfconn_retry_start(mfconn * conn, struct mfconn_retry *retry,
+                       const char *api)
+{
+    double          now;
+    double          open_until;
+    int             i;
+
+    now = mfconn_now();
+    pthread_mutex_lock(&(conn->mutex));
+    open_until = conn->breaker_open_until;
+    pthread_mutex_unlock(&(conn->mutex));
+    if (open_until > now) {
+        fprintf(stderr, "%s: server unreachable, not trying again for "
+                "%.0f seconds\n", api, open_until - now);
+        return -1;
     }
-    api_len = strlen(api);
-    if (api_len < 3) {
-        fprintf(stderr, "api name length cannot be less than 3\n");
-        return NULL;
+
+    for (i = 0; mfconn_deadlines[i].api != NULL; i++) {
+        if (strcmp(mfconn_deadlines[i].api, api) == 0)
+            break;
     }
-    // calculate how big of a buffer we need
-    va_start(ap, fmt);
-    api_args_len = (vsnprintf(NULL, 0, fmt, ap) + 1);   // + 1 for NULL
-    va_end(ap);
 
-    session_token = strdup_printf("&session_token=%s", conn->session_token);
+    retry->api = api;
+    retry->attempt = 0;
+    retry->token_errors = 0;
+    retry->start = now;
+    retry->deadline = mfconn_deadlines[i].deadline;
+    retry->had_session = pthread_getspecific(conn->session_key) != NULL;
 
-    api_args_len += strlen(session_token);
+    return 0;
+}
 
-    // create the correctly sized buffer and process the args
-    api_args = (char *)calloc(api_args_len, sizeof(char));
+/*
+ * the time in seconds that is left for the next attempt of the call or zero
+ * if there is no limit
+ */
+double mfconn_retry_timeout(struct mfconn_retry *retry)
+{
+    double          left;
 
-    // printf("\n\r%d\n\r",api_args_len);
+    if (retry->deadline <= 0)
+        return 0;
 
-    va_start(ap, fmt);
-    vsnprintf(api_args, api_args_len, fmt, ap);
-    va_end(ap);
+    left = retry->start + retry->deadline - mfconn_now();
+    // let even the last attempt establish a connection
+    if (left < 1)
+        left = 1;
 
-    strcat(api_args, session_token);
-    free(session_token);
+    return left;
+}
 
-    // correct user error of trailing slash
-    if (api[api_len - 1] == '/') {
-        fprintf(stderr, "api name cannot end with slash\n");
-        return NULL;
-    }
+static bool
+mfconn_retry_decide(mfconn * conn, struct mfconn_retry *retry, int *retval)
+{
+    int             kind;
+    double          now;
+    double          delay;
+    double          jitter;
+    double          open_until;
+    struct timespec ts;
+    int             i;
 
-    api_request = strdup_printf("%s//%s/api/%s/%s",
-                                (ssl ? "https:" : "http:"),
-                                conn->server, MFAPI_VERSION, api);
+    kind = mfconn_classify_error(retry->api, *retval);
+    now = mfconn_now();
+
+    pthread_mutex_lock(&(conn->mutex));
+    if (kind == MFCONN_ERROR_TRANSIENT
+        || *retval == CURLE_OPERATION_TIMEDOUT) {
+        conn->breaker_failures++;
+        // a failure after the cool down trips the breaker right away
+        if (conn->breaker_failures >= MFCONN_BREAKER_THRESHOLD
+            || conn->breaker_open_until > 0) {
+            if (conn->breaker_open_until <= now)
+                fprintf(stderr, "%d consecutive failures, pausing API calls "
+                        "for %.0f seconds\n", conn->breaker_failures,
+                        MFCONN_BREAKER_COOLDOWN);
+            conn->breaker_open_until = now + MFCONN_BREAKER_COOLDOWN;
+        }
+    } else {
+        conn->breaker_failures = 0;
+        conn->breaker_open_until = 0;
+    }
+    open_until = conn->breaker_open_until;
+    jitter = rand_r(&conn->retry_seed) / (double)RAND_MAX;
+    pthread_mutex_unlock(&(conn->mutex));
+
+    if (kind == MFCONN_ERROR_PERMANENT)
+        return false;
+
+    retry->attempt++;
+    if (retry->attempt >= conn->max_num_retries) {
+        fprintf(stderr, "%s: giving up after %d attempts\n", retry->api,
+                retry->attempt);
+        return false;
+    }
 
-    call_hash = mfconn_create_call_signature(conn, api_request, api_args);
-    signature = strdup_printf("&signature=%s", call_hash);
-    free((void *)call_hash);
+    if (open_until > now) {
+        fprintf(stderr, "%s: giving up, server unreachable\n", retry->api);
+        return false;
+    }
 
-    // compute the amount of space requred to realloc() the request
-    bytes_to_alloc = api_args_len;
-    bytes_to_alloc += strlen(api_request);
-    bytes_to_alloc += strlen(signature);
-    bytes_to_alloc += 1;        // null termination
+    if (kind == MFCONN_ERROR_TOKEN && retry->token_errors++ == 0) {
+        delay = 0;
+    } else {
+        // exponential backoff with equal jitter: wait between half and the
+        // full backoff time
+        delay = MFCONN_BACKOFF_BASE;
+        for (i = 1; i < retry->attempt && delay < MFCONN_BACKOFF_MAX; i++)
+            delay *= 2;
+        if (delay > MFCONN_BACKOFF_MAX)
+            delay = MFCONN_BACKOFF_MAX;
+        delay = delay / 2 + delay / 2 * jitter;
+    }
 
-    // append api GET args to api request
-    api_request = (char *)realloc(api_request, bytes_to_alloc);
-    if (api_request == NULL) {
-        fprintf(stderr, "cannot allocate memory\n");
-        return NULL;
+    if (retry->deadline > 0 && now + delay >= retry->start + retry->deadline) {
+        fprintf(stderr, "%s: giving up after %.1f seconds\n", retry->api,
+                now - retry->start);
+        return false;
     }
 
-    strncat(api_request, api_args, api_args_len);
-    strcat(api_request, signature);
+    fprintf(stderr, "%s: got error %d - retrying in %.2f seconds\n",
+            retry->api, *retval, delay);
+    if (delay > 0) {
+        ts.tv_sec = (time_t) delay;
+        ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR) ;
+    }
 
-    free(signature);
-    free(api_args);
+    if (kind == MFCONN_ERROR_TOKEN) {
+        // on a curl timeout we get a new token because it is likely that we
+        // lost signature synchronization (we don't know whether the server
+        // accepted or rejected the last call)
+        fprintf(stderr, "negotiate a new token\n");
+        if (mfconn_refresh_token(conn) != 0) {
+            fprintf(stderr, "failed to get a new token\n");
+            *retval = -1;
+            return false;
+        }
+    }
 
-    return api_request;
+    return true;
 }
 
-const char     *mfconn_get_session_token(mfconn * conn)
+/*
+ * decide whether an API call that returned *retval should be attempted again
+ *
+ * waits for the backoff and negotiates a new token if necessary before
+ * returning true. If the token cannot be renewed, *retval is set to -1.
+ */
+bool mfconn_retry_again(mfconn * conn, struct mfconn_retry *retry,
+                        int *retval)
 {
-    return conn->session_token;
+    bool            again;
+
+    again = mfconn_retry_decide(conn, retry, retval);
+
+    // a session taken by mfconn_create_signed_get for this call goes back to
+    // the pool after every attempt but not one of an outer call that is
+    // renewing its token right now
+    if (!retry->had_session)
+        mfconn_session_release(conn);
+
+    return again;
 }
 
-const char     *mfconn_get_secret_time(mfconn * conn)
+/*
+ * Completion of uploads
+ *
+ * After an upload, the server still processes the file before it shows up
+ * in the account. Instead of every upload polling on its own, the keys of
+ * all outstanding uploads of a connection are handed to a single poller
+ * thread which asks upload/poll_upload about up to MFCONN_POLL_BATCH of them
+ * with one request. A key is first polled shortly after it was added, when
+ * a small file is often done already, and then in intervals which double up
+ * to MFCONN_POLL_MAX. The waiters are completed through callbacks.
+ *
+ * Should the server refuse a batch, the keys are polled one at a time from
+ * then on.
+ *
+ * Batches only form if several uploads are outstanding at the same time.
+ * The shell and the fuse module currently upload one file at a time and
+ * wait for it with mfconn_upload_poll_for_completion, the latter while
+ * holding its global lock, so there is only ever one key to poll. Until
+ * uploads are done asynchronously, the poller only contributes the short
+ * first interval and the backoff.
+ */
+
+#define MFCONN_POLL_FIRST 0.1
+#define MFCONN_POLL_MAX 2.0
+#define MFCONN_POLL_BATCH 20
+
+struct mfconn_poll {
+    char           *upload_key;
+    double          next_poll;
+    double          interval;
+    int             failures;
+    int             retval;
+    void            (*done_cb) (mfconn * conn, const char *upload_key,
+                                int retval, void *user_ptr);
+    void           *user_ptr;
+    struct mfconn_poll *next;
+};
+
+struct mfconn_poll_wait {
+    bool            done;
+    int             retval;
+};
+
+static void mfconn_poll_finish(mfconn * conn, struct mfconn_poll *done)
 {
-    return conn->secret_time;
+    struct mfconn_poll *poll;
+
+    while (done != NULL) {
+        poll = done;
+        done = poll->next;
+        poll->done_cb(conn, poll->upload_key, poll->retval, poll->user_ptr);
+        free(poll->upload_key);
+        free(poll);
+    }
 }
 
-uint32_t mfconn_get_secret_key(mfconn * conn)
+// called with poll_mutex held, returns with it held
+static void mfconn_poll_once(mfconn * conn, double now)
 {
-    return conn->secret_key;
+    struct mfconn_poll *batch[MFCONN_POLL_BATCH];
+    const char     *keys[MFCONN_POLL_BATCH];
+    int             status[MFCONN_POLL_BATCH];
+    int             fileerror[MFCONN_POLL_BATCH];
+    struct mfconn_poll **p;
+    struct mfconn_poll *poll;
+    struct mfconn_poll *done;
+    int             max_batch;
+    int             num_batch;
+    int             retval;
+    int             i;
+
+    max_batch = conn->poll_no_batch ? 1 : MFCONN_POLL_BATCH;
+
+    // take the keys that are due out of the list
+    num_batch = 0;
+    p = &(conn->polls);
+    while (*p != NULL && num_batch < max_batch) {
+        poll = *p;
+        if (poll->next_poll <= now) {
+            *p = poll->next;
+            batch[num_batch] = poll;
+            keys[num_batch] = poll->upload_key;
+            num_batch++;
+        } else {
+            p = &(poll->next);
+        }
+    }
+
+    pthread_mutex_unlock(&(conn->poll_mutex));
+    retval = mfconn_api_upload_poll_upload(conn, keys, num_batch, status,
+                                           fileerror);
+    if (retval != 0)
+        fprintf(stderr, "mfconn_api_upload_poll_upload failed\n");
+    now = mfconn_now();
+    pthread_mutex_lock(&(conn->poll_mutex));
+
+    // the error codes of the API start at 100, lower ones are from curl
+    if (retval >= 100 && num_batch > 1) {
+        fprintf(stderr, "polling upload keys one at a time\n");
+        conn->poll_no_batch = true;
+    }
+
+    done = NULL;
+    for (i = 0; i < num_batch; i++) {
+        poll = batch[i];
+        if (retval == 0) {
+            fprintf(stderr, "%s: status: %d, filerror: %d\n",
+                    poll->upload_key, status[i], fileerror[i]);
+            poll->failures = 0;
+            // values 98 and 99 are terminal states for a completed upload
+            if (status[i] == 99 || status[i] == 98) {
+                poll->retval = 0;
+                poll->next = done;
+                done = poll;
+                continue;
+            }
+        } else if (!(conn->poll_no_batch && num_batch > 1)) {
+            poll->failures++;
+            if (poll->failures >= conn->max_num_retries) {
+                poll->retval = -1;
+                poll->next = done;
+                done = poll;
+                continue;
+            }
+        }
+        poll->interval *= 2;
+        if (poll->interval > MFCONN_POLL_MAX)
+            poll->interval = MFCONN_POLL_MAX;
+        poll->next_poll = now + poll->interval;
+        poll->next = conn->polls;
+        conn->polls = poll;
+    }
+
+    // the callbacks may add new keys
+    pthread_mutex_unlock(&(conn->poll_mutex));
+    mfconn_poll_finish(conn, done);
+    pthread_mutex_lock(&(conn->poll_mutex));
 }
 
-int mfconn_get_max_num_retries(mfconn * conn)
+static void    *mfconn_poller(void *user_ptr)
 {
-    return conn->max_num_retries;
+    mfconn         *conn = (mfconn *) user_ptr;
+    struct mfconn_poll *poll;
+    struct mfconn_poll *done;
+    struct timespec deadline;
+    double          now;
+    double          wake;
+
+    pthread_mutex_lock(&(conn->poll_mutex));
+    while (!conn->poll_stop) {
+        if (conn->polls == NULL) {
+            pthread_cond_wait(&(conn->poll_cond), &(conn->poll_mutex));
+            continue;
+        }
+
+        now = mfconn_now();
+        wake = conn->polls->next_poll;
+        for (poll = conn->polls; poll != NULL; poll = poll->next) {
+            if (poll->next_poll < wake)
+                wake = poll->next_poll;
+        }
+
+        if (wake <= now) {
+            mfconn_poll_once(conn, now);
+            continue;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        wake = deadline.tv_sec + deadline.tv_nsec / 1e9 + (wake - now);
+        deadline.tv_sec = (time_t) wake;
+        deadline.tv_nsec = (wake - deadline.tv_sec) * 1e9;
+        pthread_cond_timedwait(&(conn->poll_cond), &(conn->poll_mutex),
+                               &deadline);
+    }
+
+    // nobody is going to poll the remaining keys anymore
+    done = conn->polls;
+    conn->polls = NULL;
+    for (poll = done; poll != NULL; poll = poll->next) {
+        poll->retval = -1;
+    }
+    pthread_mutex_unlock(&(conn->poll_mutex));
+    mfconn_poll_finish(conn, done);
+
+    return NULL;
 }
 
-const char     *mfconn_get_ekey(mfconn * conn)
+static void mfconn_upload_poll_stop(mfconn * conn)
 {
-    return conn->ekey;
+    pthread_mutex_lock(&(conn->poll_mutex));
+    if (!conn->poll_started) {
+        pthread_mutex_unlock(&(conn->poll_mutex));
+        return;
+    }
+    conn->poll_stop = true;
+    pthread_cond_signal(&(conn->poll_cond));
+    pthread_mutex_unlock(&(conn->poll_mutex));
+
+    pthread_join(conn->poll_thread, NULL);
+    conn->poll_started = false;
 }
 
-int mfconn_upload_poll_for_completion(mfconn * conn, const char *upload_key)
+/*
+ * wait in the background until the server processed the upload with
+ * upload_key and then call done_cb with zero or, if the state of the upload
+ * could not be retrieved, with -1
+ *
+ * done_cb is called from the poller thread. It must not block but it may
+ * add further keys.
+ */
+int
+mfconn_upload_poll_async(mfconn * conn, const char *upload_key,
+                         void (*done_cb) (mfconn * conn,
+                                          const char *upload_key, int retval,
+                                          void *user_ptr), void *user_ptr)
 {
-    int             status;
-    int             fileerror;
-    int             retval;
+    struct mfconn_poll *poll;
 
-    for (;;) {
-        // no need to update the secret key after this
-        retval = mfconn_api_upload_poll_upload(conn, upload_key, &status,
-                                               &fileerror);
-        if (retval != 0) {
-            fprintf(stderr, "mfconn_api_upload_poll_upload failed\n");
-            return -1;
-        }
-        fprintf(stderr, "status: %d, filerror: %d\n", status, fileerror);
+    if (conn == NULL || upload_key == NULL || done_cb == NULL)
+        return -1;
 
-        // values 98 and 99 are terminal states for a completed upload
-        if (status == 99 || status == 98) {
-            fprintf(stderr, "done\n");
-            break;
+    pthread_mutex_lock(&(conn->poll_mutex));
+    if (!conn->poll_started) {
+        conn->poll_stop = false;
+        if (pthread_create(&(conn->poll_thread), NULL, mfconn_poller,
+                           conn) != 0) {
+            fprintf(stderr, "cannot start the upload poller\n");
+            pthread_mutex_unlock(&(conn->poll_mutex));
+            return -1;
         }
-        sleep(1);
+        conn->poll_started = true;
     }
+
+    poll = (struct mfconn_poll *)calloc(1, sizeof(struct mfconn_poll));
+    poll->upload_key = strdup(upload_key);
+    poll->interval = MFCONN_POLL_FIRST;
+    poll->next_poll = mfconn_now() + poll->interval;
+    poll->done_cb = done_cb;
+    poll->user_ptr = user_ptr;
+    poll->next = conn->polls;
+    conn->polls = poll;
+    pthread_cond_signal(&(conn->poll_cond));
+    pthread_mutex_unlock(&(conn->poll_mutex));
+
     return 0;
 }
+
+static void
+mfconn_poll_wake(mfconn * conn, const char *upload_key, int retval,
+                 void *user_ptr)
+{
+    struct mfconn_poll_wait *wait = (struct mfconn_poll_wait *)user_ptr;
+
+    (void)upload_key;
+
+    pthread_mutex_lock(&(conn->poll_mutex));
+    wait->retval = retval;
+    wait->done = true;
+    pthread_cond_broadcast(&(conn->poll_done_cond));
+    pthread_mutex_unlock(&(conn->poll_mutex));
+}
+
+int mfconn_upload_poll_for_completion(mfconn * conn, const char *upload_key)
+{
+    struct mfconn_poll_wait wait;
+
+    wait.done = false;
+    wait.retval = -1;
+
+    if (mfconn_upload_poll_async(conn, upload_key, mfconn_poll_wake,
+                                 &wait) != 0)
+        return -1;
+
+    pthread_mutex_lock(&(conn->poll_mutex));
+    while (!wait.done) {
+        pthread_cond_wait(&(conn->poll_done_cond), &(conn->poll_mutex));
+    }
+    pthread_mutex_unlock(&(conn->poll_mutex));
+
+    if (wait.retval == 0)
+        fprintf(stderr, "done\n");
+
+    return wait.retval;
+}
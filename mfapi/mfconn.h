@@ -19,19 +19,40 @@
 #ifndef __MFAPI_MFCONN_H__
 #define __MFAPI_MFCONN_H__
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
 
 #include "file.h"
 
 typedef struct mfconn mfconn;
 
+/* state of the retries of a single API call, see mfconn_retry_again */
+struct mfconn_retry {
+    const char     *api;
+    int             attempt;
+    int             token_errors;
+    double          start;
+    double          deadline;
+    // whether the thread held a session when the call started
+    bool            had_session;
+};
+
 mfconn         *mfconn_create(const char *server, const char *username,
                               const char *password, int app_id,
-                              const char *app_key, int max_num_retries);
+                              const char *app_key, int max_num_retries,
+                              const char *session_file);
 
 int             mfconn_refresh_token(mfconn * conn);
 
+int             mfconn_set_num_sessions(mfconn * conn, int num_sessions);
+
+void            mfconn_set_session_file(mfconn * conn,
+                                        const char *session_file);
+
+void            mfconn_set_session_lifetime(mfconn * conn, double seconds);
+
 void            mfconn_destroy(mfconn * conn);
 
 ssize_t         mfconn_download_direct(mffile * file, const char *local_dir);
@@ -61,7 +82,31 @@ const char     *mfconn_get_ekey(mfconn * conn);
 
 int             mfconn_get_max_num_retries(mfconn * conn);
 
+int             mfconn_get_num_sessions(mfconn * conn);
+
+int             mfconn_retry_start(mfconn * conn, struct mfconn_retry *retry,
+                                   const char *api);
+
+bool            mfconn_retry_again(mfconn * conn, struct mfconn_retry *retry,
+                                   int *retval);
+
+double          mfconn_retry_timeout(struct mfconn_retry *retry);
+
 int             mfconn_upload_poll_for_completion(mfconn * conn,
                                                   const char *upload_key);
 
+int             mfconn_upload_poll_async(mfconn * conn,
+                                         const char *upload_key,
+                                         void (*done_cb) (mfconn * conn,
+                                                          const char
+                                                          *upload_key,
+                                                          int retval,
+                                                          void *user_ptr),
+                                         void *user_ptr);
+
+int             mfconn_upload_file(mfconn * conn, const char *folder_key,
+                                   FILE * fh, const char *file_name,
+                                   const unsigned char *fhash,
+                                   uint64_t fsize);
+
 #endif
@@ -0,0 +1,389 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L // for pread and strdup
+#define _DEFAULT_SOURCE         // for strdup on old systems
+
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../utils/hash.h"
+#include "apicalls.h"
+#include "mfconn.h"
+
+/*
+ * Files that the server wants in more than one unit are sent with
+ * upload/resumable. The units are hashed and sent by several threads at the
+ * same time, so that the hashing of one unit overlaps with the transfer of
+ * the others. The calls of the threads are authenticated by an upload action
+ * token instead of the session token because signed calls have to be made
+ * one after another.
+ *
+ * Every unit is only tried once per round. After each round, upload/check
+ * reports which units the server received and the missing ones are sent in
+ * the next round. The same happens when an interrupted upload of the same
+ * file is started again: only the units the server does not have yet are
+ * sent.
+ */
+
+#define MFCONN_UPLOAD_THREADS 4
+// lifespan of the action token in minutes
+#define MFCONN_UPLOAD_TOKEN_LIFESPAN 1440
+#define MFCONN_UPLOAD_READ_SIZE (1024 * 1024)
+
+struct upload_state {
+    mfconn         *conn;
+    const char     *action_token;
+    const char     *folder_key;
+    const char     *file_name;
+    const char     *file_hash;
+    int             fd;
+    uint64_t        file_size;
+    uint64_t        unit_size;
+    uint32_t        number_of_units;
+    pthread_mutex_t mutex;
+    // the units the server confirmed
+    bool           *confirmed;
+    uint32_t        next_unit;
+    uint32_t        num_failed;
+    char           *upload_key;
+};
+
+static char    *upload_hash_unit(int fd, uint64_t offset, uint64_t size,
+                                 unsigned char *buffer)
+{
+    EVP_MD_CTX     *ctx;
+    unsigned char   hash[SHA256_DIGEST_LENGTH];
+    ssize_t         bytes_read;
+    size_t          len;
+
+    ctx = EVP_MD_CTX_new();
+    if (ctx == NULL || hash_init(ctx) != 0) {
+        EVP_MD_CTX_free(ctx);
+        return NULL;
+    }
+    while (size > 0) {
+        len = size < MFCONN_UPLOAD_READ_SIZE ? size : MFCONN_UPLOAD_READ_SIZE;
+        bytes_read = pread(fd, buffer, len, offset);
+        if (bytes_read <= 0) {
+            fprintf(stderr, "cannot read unit at offset %" PRIu64 "\n",
+                    offset);
+            EVP_MD_CTX_free(ctx);
+            return NULL;
+        }
+        EVP_DigestUpdate(ctx, buffer, bytes_read);
+        offset += bytes_read;
+        size -= bytes_read;
+    }
+    if (EVP_DigestFinal_ex(ctx, hash, NULL) != 1) {
+        EVP_MD_CTX_free(ctx);
+        return NULL;
+    }
+    EVP_MD_CTX_free(ctx);
+
+    return binary2hex(hash, SHA256_DIGEST_LENGTH);
+}
+
+static void    *upload_worker(void *user_ptr)
+{
+    struct upload_state *state = user_ptr;
+    unsigned char  *buffer;
+    char           *unit_hash;
+    char           *upload_key;
+    uint64_t        offset;
+    uint64_t        size;
+    uint32_t        unit;
+    int             retval;
+
+    buffer = (unsigned char *)malloc(MFCONN_UPLOAD_READ_SIZE);
+    if (buffer == NULL) {
+        fprintf(stderr, "cannot allocate read buffer\n");
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&(state->mutex));
+        unit = state->next_unit;
+        while (unit < state->number_of_units && state->confirmed[unit])
+            unit++;
+        state->next_unit = unit + 1;
+        pthread_mutex_unlock(&(state->mutex));
+
+        if (unit >= state->number_of_units)
+            break;
+
+        offset = unit * state->unit_size;
+        size = state->file_size - offset;
+        if (size > state->unit_size)
+            size = state->unit_size;
+
+        upload_key = NULL;
+        unit_hash = upload_hash_unit(state->fd, offset, size, buffer);
+        if (unit_hash == NULL) {
+            retval = -1;
+        } else {
+            retval = mfconn_api_upload_resumable(state->conn,
+                                                 state->action_token,
+                                                 state->folder_key,
+                                                 state->file_name,
+                                                 state->file_size,
+                                                 state->file_hash, state->fd,
+                                                 unit, offset, size,
+                                                 unit_hash, &upload_key);
+            free(unit_hash);
+        }
+
+        pthread_mutex_lock(&(state->mutex));
+        if (retval == 0) {
+            state->confirmed[unit] = true;
+            if (upload_key != NULL && state->upload_key == NULL) {
+                state->upload_key = upload_key;
+                upload_key = NULL;
+            }
+        } else {
+            fprintf(stderr, "unit %" PRIu32 " failed\n", unit);
+            state->num_failed++;
+        }
+        pthread_mutex_unlock(&(state->mutex));
+
+        free(upload_key);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static void upload_run_workers(struct upload_state *state)
+{
+    pthread_t       threads[MFCONN_UPLOAD_THREADS];
+    int             num_threads;
+    int             t;
+
+    state->next_unit = 0;
+    state->num_failed = 0;
+
+    for (t = 0; t < MFCONN_UPLOAD_THREADS; t++) {
+        if (pthread_create(&threads[t], NULL, upload_worker, state) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            break;
+        }
+    }
+    // upload in this thread as well in case not a single thread was created
+    if (t == 0)
+        upload_worker(state);
+    num_threads = t;
+    for (t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+static int
+upload_units(mfconn * conn, const char *folder_key, FILE * fh,
+             const char *file_name, const char *hash, uint64_t size,
+             struct mfconn_upload_check_result *check, char **upload_key)
+{
+    struct upload_state state;
+    char           *action_token = NULL;
+    uint32_t        missing;
+    uint32_t        unit;
+    int             round;
+    int             retval;
+
+    retval = mfconn_api_user_get_action_token(conn, "upload",
+                                              MFCONN_UPLOAD_TOKEN_LIFESPAN,
+                                              &action_token);
+    if (retval != 0 || action_token == NULL) {
+        fprintf(stderr, "mfconn_api_user_get_action_token failed\n");
+        return -1;
+    }
+
+    memset(&state, 0, sizeof(state));
+    state.conn = conn;
+    state.action_token = action_token;
+    state.folder_key = folder_key;
+    state.file_name = file_name;
+    state.file_hash = hash;
+    state.fd = fileno(fh);
+    state.file_size = size;
+    state.unit_size = check->unit_size;
+    state.number_of_units = check->number_of_units;
+    state.confirmed = (bool *)calloc(state.number_of_units, sizeof(bool));
+    pthread_mutex_init(&(state.mutex), NULL);
+
+    // pass the file once from start to end
+    posix_fadvise(state.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    retval = -1;
+    for (round = 0;; round++) {
+        if (check->number_of_units != state.number_of_units
+            || check->unit_size != state.unit_size) {
+            fprintf(stderr, "the units of the upload changed\n");
+            break;
+        }
+        // the units the server already has are not sent again
+        missing = 0;
+        for (unit = 0; unit < state.number_of_units; unit++) {
+            if (unit / 16 < check->bitmap_count
+                && (check->bitmap[unit / 16] >> (unit % 16)) & 1)
+                state.confirmed[unit] = true;
+            if (!state.confirmed[unit])
+                missing++;
+        }
+
+        if (state.upload_key == NULL && check->upload_key != NULL) {
+            state.upload_key = check->upload_key;
+            check->upload_key = NULL;
+        }
+        if (state.upload_key != NULL) {
+            retval = 0;
+            break;
+        }
+
+        if (round >= mfconn_get_max_num_retries(conn)) {
+            fprintf(stderr, "giving up after %d rounds\n", round);
+            break;
+        }
+
+        if (missing > 0) {
+            fprintf(stderr, "uploading %" PRIu32 " of %" PRIu32
+                    " units\n", missing, state.number_of_units);
+            upload_run_workers(&state);
+            if (state.upload_key != NULL) {
+                retval = 0;
+                break;
+            }
+        }
+        // ask the server which units it received
+        if (mfconn_api_upload_check(conn, file_name, hash, size, folder_key,
+                                    true, check) != 0) {
+            fprintf(stderr, "mfconn_api_upload_check failed\n");
+            break;
+        }
+    }
+
+    pthread_mutex_destroy(&(state.mutex));
+    free(state.confirmed);
+    free(action_token);
+
+    *upload_key = state.upload_key;
+
+    return retval;
+}
+
+/*
+ * upload the content of fh as file_name into the folder with folder_key or,
+ * if folder_key is NULL, into the root folder and wait until the server
+ * processed the upload
+ *
+ * fhash and fsize are the SHA256 and the size of the content if the caller
+ * already knows them. If fhash is NULL, they are computed from fh.
+ */
+int
+mfconn_upload_file(mfconn * conn, const char *folder_key, FILE * fh,
+                   const char *file_name, const unsigned char *fhash,
+                   uint64_t fsize)
+{
+    struct mfconn_upload_check_result check;
+    unsigned char   bhash[SHA256_DIGEST_LENGTH];
+    char           *hash;
+    char           *upload_key;
+    uint64_t        size;
+    int             retval;
+
+    if (conn == NULL || fh == NULL || file_name == NULL)
+        return -1;
+
+    if (folder_key == NULL)
+        folder_key = "myfiles";
+
+    if (fhash != NULL) {
+        memcpy(bhash, fhash, SHA256_DIGEST_LENGTH);
+        size = fsize;
+    } else {
+        rewind(fh);
+        retval = calc_sha256(fh, bhash, &size);
+        rewind(fh);
+        if (retval != 0) {
+            fprintf(stderr, "failed to calculate hash\n");
+            return -1;
+        }
+    }
+
+    hash = binary2hex(bhash, SHA256_DIGEST_LENGTH);
+
+    retval = mfconn_api_upload_check(conn, file_name, hash, size, folder_key,
+                                     true, &check);
+    if (retval != 0) {
+        fprintf(stderr, "mfconn_api_upload_check failed\n");
+        free(hash);
+        return -1;
+    }
+
+    if (check.hash_exists) {
+        // hash exists, so use upload/instant
+        retval = mfconn_api_upload_instant(conn, NULL, file_name, hash, size,
+                                           folder_key);
+        mfconn_upload_check_result_free(&check);
+        free(hash);
+        if (retval != 0) {
+            fprintf(stderr, "mfconn_api_upload_instant failed\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    upload_key = NULL;
+    if (check.number_of_units > 1) {
+        retval = upload_units(conn, folder_key, fh, file_name, hash, size,
+                              &check, &upload_key);
+    } else {
+        // hash does not exist, so do full upload
+        retval = mfconn_api_upload_simple(conn, folder_key, fh, file_name,
+                                          &upload_key);
+    }
+    mfconn_upload_check_result_free(&check);
+    free(hash);
+
+    if (retval != 0 || upload_key == NULL) {
+        fprintf(stderr, "upload of %s failed\n", file_name);
+        free(upload_key);
+        return -1;
+    }
+
+    fprintf(stderr, "upload_key: %s\n", upload_key);
+
+    // poll for completion
+    retval = mfconn_upload_poll_for_completion(conn, upload_key);
+    free(upload_key);
+
+    if (retval != 0) {
+        fprintf(stderr, "mfconn_upload_poll_for_completion failed\n");
+        return -1;
+    }
+
+    return 0;
+}
@@ -26,13 +26,43 @@
 #include "../mfshell.h"
 #include "../commands.h"        // IWYU pragma: keep
 
+static int print_changes(struct mfconn_device_change *changes,
+                         void *user_ptr)
+{
+    (void)user_ptr;
+    int             i;
+
+    for (i = 0; changes[i].change != MFCONN_DEVICE_CHANGE_END; i++) {
+        switch (changes[i].change) {
+            case MFCONN_DEVICE_CHANGE_DELETED_FOLDER:
+                printf("%" PRIu64 " deleted folder: %s\n", changes[i].revision,
+                       changes[i].key);
+                break;
+            case MFCONN_DEVICE_CHANGE_DELETED_FILE:
+                printf("%" PRIu64 " deleted file:   %s\n", changes[i].revision,
+                       changes[i].key);
+                break;
+            case MFCONN_DEVICE_CHANGE_UPDATED_FOLDER:
+                printf("%" PRIu64 " updated folder: %s\n", changes[i].revision,
+                       changes[i].key);
+                break;
+            case MFCONN_DEVICE_CHANGE_UPDATED_FILE:
+                printf("%" PRIu64 " updated file:   %s\n", changes[i].revision,
+                       changes[i].key);
+                break;
+            case MFCONN_DEVICE_CHANGE_END:
+                break;
+        }
+    }
+
+    return 0;
+}
+
 int mfshell_cmd_changes(mfshell * mfshell, int argc, char *const argv[])
 {
     (void)argv;
     int             retval;
     uint64_t        revision;
-    struct mfconn_device_change *changes;
-    int             i;
 
     if (mfshell == NULL)
         return -1;
@@ -54,38 +84,13 @@ int mfshell_cmd_changes(mfshell * mfshell, int argc, char *const argv[])
             return -1;
     }
 
-    changes = NULL;
-    retval = mfconn_api_device_get_changes(mfshell->conn, revision, &changes);
+    retval = mfconn_api_device_get_changes(mfshell->conn, revision,
+                                           print_changes, NULL, NULL);
 
     if (retval != 0) {
         fprintf(stderr, "mfconn_api_device_get_changes failed\n");
         return -1;
     }
 
-    for (i = 0; changes[i].change != MFCONN_DEVICE_CHANGE_END; i++) {
-        switch (changes[i].change) {
-            case MFCONN_DEVICE_CHANGE_DELETED_FOLDER:
-                printf("%" PRIu64 " deleted folder: %s\n", changes[i].revision,
-                       changes[i].key);
-                break;
-            case MFCONN_DEVICE_CHANGE_DELETED_FILE:
-                printf("%" PRIu64 " deleted file:   %s\n", changes[i].revision,
-                       changes[i].key);
-                break;
-            case MFCONN_DEVICE_CHANGE_UPDATED_FOLDER:
-                printf("%" PRIu64 " updated folder: %s\n", changes[i].revision,
-                       changes[i].key);
-                break;
-            case MFCONN_DEVICE_CHANGE_UPDATED_FILE:
-                printf("%" PRIu64 " updated file:   %s\n", changes[i].revision,
-                       changes[i].key);
-                break;
-            case MFCONN_DEVICE_CHANGE_END:
-                break;
-        }
-    }
-
-    free(changes);
-
     return retval;
 }
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <openssl/sha.h>
 
 #include "../../mfapi/apicalls.h"
 #include "../mfshell.h"
@@ -32,6 +33,7 @@
 #include "../commands.h"        // IWYU pragma: keep
 #include "../../utils/strings.h"
 #include "../../utils/http.h"
+#include "../../utils/hash.h"
 
 int mfshell_cmd_get(mfshell * mfshell, int argc, char *const argv[])
 {
@@ -45,6 +47,7 @@ int mfshell_cmd_get(mfshell * mfshell, int argc, char *const argv[])
     const char     *url;
     struct stat     file_info;
     mfhttp         *http;
+    unsigned char   hash[SHA256_DIGEST_LENGTH];
 
     if (mfshell == NULL)
         return -1;
@@ -106,12 +109,23 @@ int mfshell_cmd_get(mfshell * mfshell, int argc, char *const argv[])
         return -1;
 
     http = http_create();
-    retval = http_get_file(http, url, file_path);
+    retval = http_get_file_segmented(http, url, file_path,
+                                     file_get_size(file), 0);
     http_destroy(http);
 
     if (retval != 0)
         return -1;
 
+    // make sure that all segments were put together correctly
+    hex2binary(file_get_hash(file), hash);
+    retval = file_check_integrity_hash(file_path, hash);
+    if (retval != 0) {
+        fprintf(stderr, "the downloaded file has the wrong hash\n");
+        free((void *)file_path);
+        file_free(file);
+        return -1;
+    }
+
     memset(&file_info, 0, sizeof(file_info));
     retval = stat(file_path, &file_info);
 
@@ -23,16 +23,15 @@
 #include "../../mfapi/apicalls.h"
 #include "../mfshell.h"
 #include "../../mfapi/folder.h"
-#include "../../mfapi/file.h"
+#include "../../mfapi/listing.h"
 #include "../commands.h"        // IWYU pragma: keep
 
 int mfshell_cmd_list(mfshell * mfshell, int argc, char *const argv[])
 {
     (void)argv;
     int             retval;
-    mffolder      **folder_result;
-    mffile        **file_result;
-    int             i;
+    mflisting       listing;
+    size_t          i;
 
     if (mfshell == NULL)
         return -1;
@@ -46,43 +45,36 @@ int mfshell_cmd_list(mfshell * mfshell, int argc, char *const argv[])
         fprintf(stderr, "Invalid number of arguments\n");
         return -1;
     }
+
+    listing_init(&listing);
+
     // first folders
-    folder_result = NULL;
     retval =
         mfconn_api_folder_get_content(mfshell->conn, 0,
                                       folder_get_key(mfshell->folder_curr),
-                                      &folder_result, NULL);
-
-    if (folder_result == NULL) {
+                                      &listing);
+    if (retval != 0) {
+        listing_free(&listing);
         return -1;
     }
 
-    for (i = 0; folder_result[i] != NULL; i++) {
-        printf("%s %s\n", folder_get_name(folder_result[i]),
-               folder_get_key(folder_result[i]));
+    for (i = 0; i < listing.num_entries; i++) {
+        printf("%s %s\n", listing.entries[i].name, listing.entries[i].key);
     }
 
-    for (i = 0; folder_result[i] != NULL; i++) {
-        folder_free(folder_result[i]);
-    }
-    free(folder_result);
-
     // then files
-    file_result = NULL;
     retval =
         mfconn_api_folder_get_content(mfshell->conn, 1,
                                       folder_get_key(mfshell->folder_curr),
-                                      NULL, &file_result);
-
-    for (i = 0; file_result[i] != NULL; i++) {
-        printf("%s %s\n", file_get_name(file_result[i]),
-               file_get_key(file_result[i]));
+                                      &listing);
+    if (retval == 0) {
+        for (i = 0; i < listing.num_entries; i++) {
+            printf("%s %s\n", listing.entries[i].name,
+                   listing.entries[i].key);
+        }
     }
 
-    for (i = 0; file_result[i] != NULL; i++) {
-        file_free(file_result[i]);
-    }
-    free(file_result);
+    listing_free(&listing);
 
     return retval;
 }
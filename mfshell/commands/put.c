@@ -36,7 +36,6 @@ int mfshell_cmd_put(mfshell * mfshell, int argc, char *const argv[])
     const char     *file_path;
     char           *temp;
     char           *file_name;
-    char           *upload_key;
     FILE           *fh;
 
     if (mfshell == NULL)
@@ -67,26 +66,15 @@ int mfshell_cmd_put(mfshell * mfshell, int argc, char *const argv[])
     temp = strdup(argv[1]);
     file_name = basename(temp);
 
-    retval = mfconn_api_upload_simple(mfshell->conn,
-                                      folder_get_key(mfshell->folder_curr),
-                                      fh, file_name, &upload_key);
+    retval = mfconn_upload_file(mfshell->conn,
+                                folder_get_key(mfshell->folder_curr), fh,
+                                file_name, NULL, 0);
 
     fclose(fh);
     free(temp);
 
-    if (retval != 0 || upload_key == NULL) {
-        fprintf(stderr, "mfconn_api_upload_simple failed\n");
-        return -1;
-    }
-
-    fprintf(stderr, "upload_key: %s\n", upload_key);
-
-    // poll for completion
-    retval = mfconn_upload_poll_for_completion(mfshell->conn, upload_key);
-    free(upload_key);
-
     if (retval != 0) {
-        fprintf(stderr, "mfconn_upload_poll_for_completion failed\n");
+        fprintf(stderr, "mfconn_upload_file failed\n");
         return -1;
     }
 
@@ -18,6 +18,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "../../mfapi/apicalls.h"
@@ -27,7 +28,8 @@
 int mfshell_cmd_rm(mfshell * mfshell, int argc, char *const argv[])
 {
     int             retval;
-    const char     *quickkey;
+    int            *results;
+    int             i;
 
     if (mfshell == NULL)
         return -1;
@@ -37,21 +39,30 @@ int mfshell_cmd_rm(mfshell * mfshell, int argc, char *const argv[])
         return -1;
     }
 
-    if (argc != 2) {
+    if (argc < 2) {
         fprintf(stderr, "Invalid number of arguments\n");
         return -1;
     }
 
-    quickkey = argv[1];
-    if (quickkey == NULL)
-        return -1;
+    // check the lenght of the keys
+    for (i = 1; i < argc; i++) {
+        if (strlen(argv[i]) != 15) {
+            fprintf(stderr, "invalid quickkey: %s\n", argv[i]);
+            return -1;
+        }
+    }
 
-    // check the lenght of the key
-    if (strlen(quickkey) != 15) {
-        return -1;
+    results = (int *)malloc(sizeof(int) * (argc - 1));
+
+    retval = mfconn_api_file_delete_batch(mfshell->conn,
+                                          (const char **)argv + 1, argc - 1,
+                                          results);
+    for (i = 1; i < argc; i++) {
+        if (results[i - 1] != 0)
+            fprintf(stderr, "cannot remove %s\n", argv[i]);
     }
 
-    retval = mfconn_api_file_delete(mfshell->conn, quickkey);
+    free(results);
 
     return retval;
 }
@@ -26,6 +26,7 @@
 #include <string.h>
 #include <stdio.h>
 
+#include "../utils/http.h"
 #include "../utils/strings.h"
 #include "mfshell.h"
 #include "config.h"
@@ -89,6 +90,8 @@ int main(int argc, char *const argv[])
 
     mfshell_destroy(shell);
 
+    http_pool_cleanup();
+
     if (opts.server != NULL)
         free(opts.server);
     if (opts.username != NULL)
@@ -59,7 +59,7 @@ struct mfcmd    commands[] = {
     {"get", "[quickkey]", "download a file", mfshell_cmd_get},
     {"put", "[local filename]", "upload a file", mfshell_cmd_put},
     {"rmdir", "[folderkey]", "remove directory", mfshell_cmd_rmdir},
-    {"rm", "[quickkey]", "remove file", mfshell_cmd_rm},
+    {"rm", "[quickkey...]", "remove files", mfshell_cmd_rm},
     {"status", "", "device status", mfshell_cmd_status},
     {"changes", "<revision>", "device changes (default: 0)",
      mfshell_cmd_changes},
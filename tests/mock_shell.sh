@@ -0,0 +1,88 @@
+#!/bin/sh
+
+set -e
+
+case $# in
+	0)
+		source_dir="."
+		binary_dir="."
+		;;
+	2)
+		source_dir=$1
+		binary_dir=$2
+		;;
+	*)
+		echo "usage: $0 [source_dir] [binary_dir]"
+		exit 1
+		;;
+esac
+
+tmpdir=`mktemp -d`
+
+python3 "${source_dir}/tests/mockserver.py" --port 0 \
+	--port-file "$tmpdir/port" --files 2000 --folders 20 \
+	--max-size 100000 --unit-size 65536 2> "$tmpdir/server.log" &
+serverpid="$!"
+
+cleanup() {
+	kill "$serverpid" 2>/dev/null || true
+	wait "$serverpid" 2>/dev/null || true
+	rm -rf "$tmpdir"
+}
+trap cleanup EXIT
+
+# wait for the server to listen
+for i in `seq 1 50`; do
+	if [ -f "$tmpdir/port" ]; then
+		break
+	fi
+	sleep 0.2
+done
+
+if [ ! -f "$tmpdir/port" ]; then
+	echo "mock server did not start" >&2
+	cat "$tmpdir/server.log" >&2
+	exit 1
+fi
+
+MEDIAFIRE_CA_BUNDLE=`sed -n 's/^CA certificate: //p' "$tmpdir/server.log"`
+export MEDIAFIRE_CA_BUNDLE
+
+# do not pick up the configuration of a real account
+XDG_CONFIG_HOME="$tmpdir"
+export XDG_CONFIG_HOME
+
+printf "foobar" > "$tmpdir/foobar"
+# large enough to be sent in several units
+head -c 200000 /dev/urandom > "$tmpdir/units.bin"
+
+cd "$tmpdir"
+"${binary_dir}/mediafire-shell" -u user@example.com -p password \
+	-s "127.0.0.1:`cat "$tmpdir/port"`" \
+	-c "whoami; ls; mkdir test; put foobar; put units.bin; ls; status; changes; get 0y0000000000000; rm sr0000000000000 w30000000000000; file w30000000000000" \
+	> "$tmpdir/out" 2> "$tmpdir/err" || true
+
+fail=0
+for expected in "Authentication SUCCESS" "dir1 1000000000000" \
+		"file1000.bin sr0000000000000" "updated folder:" \
+		"updated file:" "Downloaded .* bytes OK"; do
+	if ! grep -q "$expected" "$tmpdir/out"; then
+		echo "missing in output: $expected" >&2
+		fail=1
+	fi
+done
+if ! grep -q "uploading 4 of 4 units" "$tmpdir/err" \
+		|| ! grep -q "units.bin" "$tmpdir/out"; then
+	echo "resumable upload failed" >&2
+	fail=1
+fi
+if grep -q "cannot remove" "$tmpdir/err" \
+		|| ! grep -q "mfconn_api_file_get_info failed" "$tmpdir/err"; then
+	echo "removing several files failed" >&2
+	fail=1
+fi
+
+if [ $fail -ne 0 ]; then
+	cat "$tmpdir/out" "$tmpdir/err" >&2
+	exit 1
+fi
@@ -0,0 +1,1550 @@
+#!/usr/bin/env python3
+"""
+A local stand-in for the MediaFire REST API.
+
+It implements the calls under mfapi/apicalls with the JSON shapes the client
+decodes, checks the secret key signature of every signed call, serves the
+direct download links (with Range support) and the patches of
+device/get_patch, and accepts uploads including xdelta3 patches.
+
+The account is synthetic: --files and --folders describe a deterministic tree
+that is only generated as far as it is looked at, so accounts with millions of
+entries cost nothing until they are listed. Changes made through the API are
+kept in memory and reported by device/get_changes in blocks of 500
+revisions.
+
+Latency, bandwidth limits and failures can be injected to benchmark the
+client or to exercise its error handling.
+
+Login goes over https while all other calls use plain http on the same host
+and port, so the server speaks both on one port. Unless --certfile and
+--keyfile are given, a self-signed certificate for 127.0.0.1 is generated with
+the openssl command line tool. Point the client to it with:
+
+    MEDIAFIRE_CA_BUNDLE=<certificate> mediafire-shell -s 127.0.0.1:<port> \\
+        -u user@example.com -p password
+"""
+
+from __future__ import print_function
+
+import argparse
+import hashlib
+import itertools
+import json
+import os
+import random
+import re
+import secrets
+import socket
+import ssl
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, quote, unquote, urlsplit
+
+API_VERSION = "1.2"
+ROOT = "myfiles"
+FOLDER_KEY_LEN = 13
+FILE_KEY_LEN = 15
+EPOCH = 1420070400  # 2015-01-01 00:00:00 UTC
+# device/get_changes reports this many revisions per call
+CHANGES_BLOCK = 500
+BASE36 = "0123456789abcdefghijklmnopqrstuvwxyz"
+
+# the calls which are not signed with the secret key
+UNSIGNED = ("user/get_session_token", "upload/poll_upload")
+# the calls which accept an upload action token instead of a session token
+ACTION_UPLOAD = ("upload/check", "upload/instant", "upload/simple",
+                 "upload/resumable", "upload/patch")
+
+ERR_UNKNOWN_CALL = 100
+ERR_SESSION_TOKEN = 105
+ERR_CREDENTIALS = 107
+ERR_FOLDER_KEY = 110
+ERR_QUICK_KEY = 111
+ERR_PARAMETER = 114
+ERR_UPLOAD = 125
+ERR_SIGNATURE = 127
+
+API_RE = re.compile(r"^/api/(?:\d+\.\d+/)?([a-z_]+/[a-z_]+)\.php$")
+
+
+class ApiError(Exception):
+    def __init__(self, code, message):
+        Exception.__init__(self, message)
+        self.code = code
+        self.message = message
+
+
+def encode_key(idx, length):
+    # least significant digit first so that the keys spread evenly over the
+    # buckets of the client which hashes on the first three characters
+    out = []
+    for _ in range(length):
+        idx, digit = divmod(idx, 36)
+        out.append(BASE36[digit])
+    return "".join(out)
+
+
+def decode_key(key):
+    idx = 0
+    for c in reversed(key):
+        digit = BASE36.find(c)
+        if digit < 0:
+            return None
+        idx = idx * 36 + digit
+    return idx
+
+
+def timestamp(t):
+    return time.strftime("%Y-%m-%d %H:%M:%S", time.gmtime(t))
+
+
+class Blob(object):
+    """file content held in memory"""
+
+    def __init__(self, data):
+        self.data = bytes(data)
+        self.size = len(self.data)
+        self._sha256 = None
+
+    def read(self, offset, length):
+        return self.data[offset:offset + length]
+
+    def sha256(self):
+        if self._sha256 is None:
+            self._sha256 = hashlib.sha256(self.data).hexdigest()
+        return self._sha256
+
+
+class Pattern(Blob):
+    """content of a synthetic file, generated from its seed on demand"""
+
+    def __init__(self, seed, size):
+        self.block = hashlib.sha256(seed).digest() * 2048
+        self.size = size
+        self._sha256 = None
+
+    def read(self, offset, length):
+        end = min(self.size, offset + length)
+        out = bytearray()
+        while offset < end:
+            start = offset % len(self.block)
+            n = min(len(self.block) - start, end - offset)
+            out += self.block[start:start + n]
+            offset += n
+        return bytes(out)
+
+    def sha256(self):
+        if self._sha256 is None:
+            h = hashlib.sha256()
+            for offset in range(0, self.size, 1 << 20):
+                h.update(self.read(offset, 1 << 20))
+            self._sha256 = h.hexdigest()
+        return self._sha256
+
+
+# VCDIFF (RFC 3284) as produced and consumed by the xdelta3 library. Only the
+# default code table is supported and no secondary compression, which is what
+# utils/xdelta3.c configures.
+
+VCD_SOURCE, VCD_TARGET, VCD_ADLER32 = 1, 2, 4
+VCD_DECOMPRESS, VCD_CODETABLE, VCD_APPHEADER = 1, 2, 4
+NOOP, ADD, RUN, COPY = 0, 1, 2, 3
+
+
+def _default_code_table():
+    noop = (NOOP, 0, 0)
+    table = [((RUN, 0, 0), noop)]
+    table += [((ADD, size, 0), noop) for size in range(18)]
+    for mode in range(9):
+        table.append(((COPY, 0, mode), noop))
+        table += [((COPY, size, mode), noop) for size in range(4, 19)]
+    for mode in range(6):
+        for add in range(1, 5):
+            for copy in range(4, 7):
+                table.append(((ADD, add, 0), (COPY, copy, mode)))
+    for mode in range(6, 9):
+        for add in range(1, 5):
+            table.append(((ADD, add, 0), (COPY, 4, mode)))
+    for mode in range(9):
+        table.append(((COPY, 4, mode), (ADD, 1, 0)))
+    return table
+
+
+CODE_TABLE = _default_code_table()
+
+
+def varint(n):
+    out = [n & 0x7f]
+    n >>= 7
+    while n:
+        out.append(0x80 | (n & 0x7f))
+        n >>= 7
+    return bytes(reversed(out))
+
+
+class Reader(object):
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def byte(self):
+        if self.pos >= len(self.data):
+            raise ValueError("truncated delta")
+        self.pos += 1
+        return self.data[self.pos - 1]
+
+    def varint(self):
+        n = 0
+        while True:
+            b = self.byte()
+            n = (n << 7) | (b & 0x7f)
+            if not b & 0x80:
+                return n
+
+    def take(self, n):
+        if self.pos + n > len(self.data):
+            raise ValueError("truncated delta")
+        self.pos += n
+        return self.data[self.pos - n:self.pos]
+
+    def done(self):
+        return self.pos >= len(self.data)
+
+
+def _vcdiff_window(seg, tlen, data, inst, addr):
+    near = [0] * 4
+    near_slot = 0
+    same = [0] * (3 * 256)
+    target = bytearray()
+    while not inst.done():
+        for kind, size, mode in CODE_TABLE[inst.byte()]:
+            if kind == NOOP:
+                continue
+            if size == 0:
+                size = inst.varint()
+            if kind == ADD:
+                target += data.take(size)
+                continue
+            if kind == RUN:
+                target += data.take(1) * size
+                continue
+            here = len(seg) + len(target)
+            if mode == 0:
+                a = addr.varint()
+            elif mode == 1:
+                a = here - addr.varint()
+            elif mode < 6:
+                a = near[mode - 2] + addr.varint()
+            else:
+                a = same[(mode - 6) * 256 + addr.byte()]
+            near[near_slot] = a
+            near_slot = (near_slot + 1) % 4
+            same[a % len(same)] = a
+            if a + size <= len(seg):
+                target += seg[a:a + size]
+            elif a >= len(seg) and a - len(seg) + size <= len(target):
+                target += target[a - len(seg):a - len(seg) + size]
+            else:
+                for i in range(a, a + size):
+                    target.append(seg[i] if i < len(seg)
+                                  else target[i - len(seg)])
+    if len(target) != tlen:
+        raise ValueError("window size mismatch")
+    return target
+
+
+def vcdiff_decode(patch, source):
+    p = Reader(patch)
+    if p.take(4)[:3] != b"\xd6\xc3\xc4":
+        raise ValueError("not a VCDIFF delta")
+    indicator = p.byte()
+    if indicator & (VCD_DECOMPRESS | VCD_CODETABLE):
+        raise ValueError("unsupported VCDIFF header")
+    if indicator & VCD_APPHEADER:
+        p.take(p.varint())
+    out = bytearray()
+    while not p.done():
+        win = p.byte()
+        seg = b""
+        if win & (VCD_SOURCE | VCD_TARGET):
+            seglen = p.varint()
+            segpos = p.varint()
+            if win & VCD_SOURCE:
+                if segpos + seglen > source.size:
+                    raise ValueError("source segment out of range")
+                seg = source.read(segpos, seglen)
+            else:
+                seg = bytes(out[segpos:segpos + seglen])
+        p.varint()  # length of the delta encoding
+        tlen = p.varint()
+        if p.byte() != 0:
+            raise ValueError("secondary compression is not supported")
+        dlen = p.varint()
+        ilen = p.varint()
+        alen = p.varint()
+        if win & VCD_ADLER32:
+            p.take(4)
+        data = Reader(p.take(dlen))
+        inst = Reader(p.take(ilen))
+        addr = Reader(p.take(alen))
+        out += _vcdiff_window(seg, tlen, data, inst, addr)
+    return bytes(out)
+
+
+def vcdiff_encode(source, target, window=1 << 20):
+    """
+    windows which are unchanged at the same offset become a single copy from
+    the source, all others are added verbatim
+    """
+    out = bytearray(b"\xd6\xc3\xc4\x00\x00")
+    for offset in range(0, max(target.size, 1), window):
+        n = min(window, target.size - offset)
+        chunk = target.read(offset, n)
+        if (n > 0 and offset + n <= source.size
+                and source.read(offset, n) == chunk):
+            head = bytes([VCD_SOURCE]) + varint(n) + varint(offset)
+            data, inst, addr = b"", bytes([19]) + varint(n), varint(0)
+        else:
+            head = bytes([0])
+            data, addr = chunk, b""
+            inst = bytes([1]) + varint(n) if n > 0 else b""
+        body = (varint(n) + b"\x00" + varint(len(data)) + varint(len(inst))
+                + varint(len(addr)) + data + inst + addr)
+        out += head + varint(len(body)) + body
+    return bytes(out)
+
+
+class Node(object):
+    __slots__ = ("key", "name", "parent", "revision", "created", "is_folder",
+                 "content", "history")
+
+    def __init__(self, key, name, parent, revision, created, is_folder,
+                 content=None):
+        self.key = key
+        self.name = name
+        self.parent = parent
+        self.revision = revision
+        self.created = created
+        self.is_folder = is_folder
+        self.content = content
+        self.history = {revision: content} if content is not None else None
+
+
+class Overlay(object):
+    """changes to the synthetic children of a folder"""
+
+    def __init__(self):
+        self.folders = []
+        self.files = []
+        self.removed = set()
+
+
+class Account(object):
+    """
+    The synthetic tree has --folders folders (including the root) where
+    folder i > 0 is a child of folder (i - 1) / fanout, and --files files
+    where file k lives in folder k % folders. Entries are only turned into
+    Node objects when they are looked at and only stored once modified.
+    """
+
+    def __init__(self, opts):
+        self.lock = threading.RLock()
+        self.nfiles = max(0, opts.files)
+        self.nfolders = max(1, opts.folders)
+        self.fanout = max(1, opts.fanout)
+        self.max_size = max(0, opts.max_size)
+        self.seed = opts.seed
+        self.nodes = {ROOT: Node(ROOT, "myfiles", None, 1, EPOCH, True)}
+        self.names = {}
+        self.overlays = {}
+        self.deleted = set()
+        self.hashes = {}
+        self.patches = {}
+        self.next_folder = self.nfolders
+        self.next_file = self.nfiles
+        self.device_revision = 1
+        self.changes = []
+        # as if the account had been used for a while
+        for i in range(opts.history // 2 if self.nfiles > 0 else 0):
+            key = encode_key(i % self.nfiles, FILE_KEY_LEN)
+            self.rename(self.get(key), "%s.%d" % (key, i))
+
+    # synthetic entries
+
+    def _folder_index(self, key):
+        if key == ROOT:
+            return 0
+        idx = decode_key(key) if len(key) == FOLDER_KEY_LEN else None
+        if idx is None or idx <= 0 or idx >= self.nfolders:
+            return None
+        return idx
+
+    def _folder_key(self, idx):
+        return ROOT if idx == 0 else encode_key(idx, FOLDER_KEY_LEN)
+
+    def _synthetic(self, key):
+        if len(key) == FOLDER_KEY_LEN:
+            idx = self._folder_index(key)
+            if idx is None:
+                return None
+            parent = self._folder_key((idx - 1) // self.fanout)
+            return Node(key, "dir%d" % idx, parent, 1, EPOCH + idx, True)
+        if len(key) == FILE_KEY_LEN:
+            idx = decode_key(key)
+            if idx is None or idx >= self.nfiles:
+                return None
+            size = (idx * 2654435761 + self.seed * 40503) % (self.max_size + 1)
+            seed = ("%d:%s" % (self.seed, key)).encode()
+            return Node(key, "file%d.bin" % idx,
+                        self._folder_key(idx % self.nfolders), 1, EPOCH + idx,
+                        False, Pattern(seed, size))
+        return None
+
+    def _synthetic_children(self, key, files):
+        """returns the range of indices of the synthetic children"""
+        idx = self._folder_index(key)
+        if idx is None:
+            return range(0)
+        if files:
+            return range(idx, self.nfiles, self.nfolders)
+        first = idx * self.fanout + 1
+        return range(first, min(first + self.fanout, self.nfolders))
+
+    def _synthetic_parent(self, node):
+        created = self._synthetic(node.key)
+        return created.parent if created is not None else None
+
+    # lookups
+
+    def _lookup(self, key):
+        node = self.nodes.get(key)
+        if node is None:
+            node = self._synthetic(key)
+        return node
+
+    def get(self, key):
+        with self.lock:
+            node = self._lookup(key)
+            n = node
+            while n is not None:
+                if n.key in self.deleted:
+                    return None
+                if n.parent is None:
+                    return node
+                n = self._lookup(n.parent)
+            return None
+
+    def folder(self, key):
+        node = self.get(key or ROOT)
+        if node is None or not node.is_folder:
+            raise ApiError(ERR_FOLDER_KEY, "Invalid or missing folder key")
+        return node
+
+    def file(self, key):
+        node = self.get(key or "")
+        if node is None or node.is_folder:
+            raise ApiError(ERR_QUICK_KEY, "Invalid or missing quick key")
+        return node
+
+    def children(self, folder, files, start, count):
+        """returns a chunk of the child keys and the number of children"""
+        length = FILE_KEY_LEN if files else FOLDER_KEY_LEN
+        synthetic = self._synthetic_children(folder.key, files)
+        overlay = self.overlays.get(folder.key)
+        if overlay is None:
+            return ([encode_key(i, length)
+                     for i in synthetic[start:start + count]],
+                    len(synthetic))
+        extra = overlay.files if files else overlay.folders
+        removed = overlay.removed
+        keys = itertools.chain(
+            (k for k in (encode_key(i, length) for i in synthetic)
+             if k not in removed), extra)
+        nremoved = sum(1 for k in removed if len(k) == length)
+        return (list(itertools.islice(keys, start, start + count)),
+                len(synthetic) - nremoved + len(extra))
+
+    def find_child(self, folder, name, is_folder):
+        key = self.names.get((folder.key, name, is_folder))
+        if key is not None:
+            node = self.get(key)
+            if (node is not None and node.parent == folder.key
+                    and node.name == name):
+                return node
+        m = re.match(r"^%s(\d+)%s$" % (("dir", "") if is_folder
+                                        else ("file", r"\.bin")), name)
+        if m is None:
+            return None
+        key = encode_key(int(m.group(1)),
+                         FOLDER_KEY_LEN if is_folder else FILE_KEY_LEN)
+        if key in self.nodes:
+            return None
+        node = self.get(key)
+        if node is not None and node.parent == folder.key:
+            return node
+        return None
+
+    def file_hash(self, node):
+        h = node.content.sha256()
+        self.hashes.setdefault(h, node.content)
+        return h
+
+    # modifications
+
+    def _bump(self):
+        self.device_revision += 1
+        return self.device_revision
+
+    def _own(self, node):
+        if node.key not in self.nodes:
+            self.nodes[node.key] = node
+            self.names[(node.parent, node.name, node.is_folder)] = node.key
+        return node
+
+    def _touch(self, node, deleted=False):
+        node.revision = self._bump()
+        # like the real service, never report changes of the root
+        if node.key == ROOT:
+            return
+        if node.history is not None and not deleted:
+            node.history[node.revision] = node.content
+        self.changes.append((node.revision, node.is_folder, node.key,
+                             node.parent or ROOT, deleted))
+
+    def _detach(self, node):
+        overlay = self.overlays.setdefault(node.parent, Overlay())
+        extra = overlay.folders if node.is_folder else overlay.files
+        if node.key in extra:
+            extra.remove(node.key)
+        else:
+            overlay.removed.add(node.key)
+        self.names.pop((node.parent, node.name, node.is_folder), None)
+
+    def _attach(self, node, parent):
+        node.parent = parent.key
+        overlay = self.overlays.setdefault(parent.key, Overlay())
+        if node.key in overlay.removed:
+            overlay.removed.discard(node.key)
+        elif self._synthetic_parent(node) != parent.key:
+            extra = overlay.folders if node.is_folder else overlay.files
+            extra.append(node.key)
+        self.names[(parent.key, node.name, node.is_folder)] = node.key
+
+    def create_folder(self, parent, name):
+        with self.lock:
+            if self.find_child(parent, name, True) is not None:
+                raise ApiError(ERR_PARAMETER, "Folder already exists")
+            key = encode_key(self.next_folder, FOLDER_KEY_LEN)
+            self.next_folder += 1
+            node = Node(key, name, None, 0, time.time(), True)
+            self.nodes[key] = node
+            self._attach(node, self._own(parent))
+            self._touch(node)
+            self._touch(parent)
+            return node
+
+    def put_file(self, parent, name, content):
+        """creates a new file or replaces the content of an existing one"""
+        with self.lock:
+            node = self.find_child(parent, name, False)
+            if node is not None:
+                self.replace(node, content)
+                return node
+            key = encode_key(self.next_file, FILE_KEY_LEN)
+            self.next_file += 1
+            node = Node(key, name, None, 0, time.time(), False, content)
+            node.history = {}
+            self.nodes[key] = node
+            self._attach(node, self._own(parent))
+            self._touch(node)
+            self._touch(parent)
+            self.file_hash(node)
+            return node
+
+    def replace(self, node, content):
+        with self.lock:
+            node = self._own(node)
+            node.content = content
+            self._touch(node)
+            self.file_hash(node)
+
+    def delete(self, node):
+        with self.lock:
+            node = self._own(node)
+            parent = self._own(self.get(node.parent))
+            self._detach(node)
+            self.deleted.add(node.key)
+            self._touch(node, deleted=True)
+            self._touch(parent)
+
+    def move(self, node, parent):
+        with self.lock:
+            n = parent
+            while n is not None:
+                if n.key == node.key:
+                    raise ApiError(ERR_FOLDER_KEY, "Cannot move a folder "
+                                   "into itself")
+                n = self.get(n.parent) if n.parent is not None else None
+            if self.find_child(parent, node.name, node.is_folder):
+                raise ApiError(ERR_PARAMETER, "Destination already exists")
+            node = self._own(node)
+            old = self._own(self.get(node.parent))
+            self._detach(node)
+            self._attach(node, self._own(parent))
+            self._touch(node)
+            self._touch(old)
+            self._touch(parent)
+
+    def rename(self, node, name):
+        with self.lock:
+            parent = self.get(node.parent)
+            if self.find_child(parent, name, node.is_folder):
+                raise ApiError(ERR_PARAMETER, "Destination already exists")
+            node = self._own(node)
+            self.names.pop((node.parent, node.name, node.is_folder), None)
+            node.name = name
+            self.names[(node.parent, name, node.is_folder)] = node.key
+            self._touch(node)
+            self._touch(self._own(parent))
+
+    def patch(self, node, source, target):
+        with self.lock:
+            if source not in node.history or target not in node.history:
+                raise ApiError(ERR_PARAMETER, "Unknown revision")
+            cached = self.patches.get((node.key, source, target))
+            if cached is None:
+                cached = Blob(vcdiff_encode(node.history[source],
+                                            node.history[target]))
+                self.patches[(node.key, source, target)] = cached
+            return cached
+
+
+class Sessions(object):
+    def __init__(self, opts):
+        self.opts = opts
+        self.lock = threading.Lock()
+        self.tokens = {}
+        self.actions = {}
+        self.ekey = hashlib.md5(("%d" % opts.seed).encode()).hexdigest()
+
+    def login(self, args):
+        opts = self.opts
+        raw = "%s%s%s" % (opts.email, opts.password,
+                          args.get("application_id", ""))
+        if opts.app_key:
+            raw += opts.app_key
+        signature = hashlib.sha1(raw.encode()).hexdigest()
+        if (args.get("email") != opts.email
+                or args.get("password") != opts.password
+                or args.get("signature") != signature):
+            raise ApiError(ERR_CREDENTIALS, "The Credentials you entered "
+                           "are invalid")
+        token = secrets.token_hex(64)
+        now = time.time()
+        session = {
+            "key": random.randint(1, 0x7ffffffe),
+            "time": "%d.%04d" % (now, (now % 1) * 10000),
+            "created": now,
+        }
+        with self.lock:
+            self.tokens[token] = session
+        return {
+            "session_token": token,
+            "secret_key": "%d" % session["key"],
+            "time": session["time"],
+            "ekey": self.ekey,
+            "pkey": self.ekey[:10],
+        }
+
+    def action_token(self, kind, lifespan):
+        """hands out a token for unsigned calls, lifespan in minutes"""
+        if kind not in ("image", "upload"):
+            raise ApiError(ERR_PARAMETER, "Invalid action token type")
+        token = secrets.token_hex(32)
+        with self.lock:
+            self.actions[token] = {
+                "type": kind,
+                "expires": time.time() + max(1, min(lifespan, 1440)) * 60,
+            }
+        return token
+
+    def action_allowed(self, name, args):
+        """whether the call is made with a valid upload action token"""
+        with self.lock:
+            action = self.actions.get(args.get("session_token"))
+        if action is None or action["type"] != "upload":
+            return False
+        if name not in ACTION_UPLOAD:
+            raise ApiError(ERR_SESSION_TOKEN, "The action token is not "
+                           "valid for this call")
+        if time.time() > action["expires"]:
+            raise ApiError(ERR_SESSION_TOKEN, "The action token has expired")
+        return True
+
+    def verify(self, path, args):
+        """checks the signature and advances the secret key of the session"""
+        with self.lock:
+            session = self.tokens.get(args.get("session_token"))
+            if session is None:
+                raise ApiError(ERR_SESSION_TOKEN, "The Session Token is "
+                               "missing or invalid")
+            end = path.rfind("&signature=")
+            raw = "%d%s%s" % (session["key"] % 256, session["time"],
+                              path[:end] if end >= 0 else path)
+            # the client advances its key for every call it sends
+            session["key"] = session["key"] * 16807 % 0x7fffffff
+        lifetime = self.opts.token_lifetime
+        if lifetime > 0 and time.time() - session["created"] > lifetime:
+            raise ApiError(ERR_SESSION_TOKEN, "The Session Token has expired")
+        expected = hashlib.md5(raw.encode()).hexdigest()
+        if self.opts.check_signatures and args.get("signature") != expected:
+            raise ApiError(ERR_SIGNATURE, "The signature you specified is "
+                           "invalid")
+
+
+class Faults(object):
+    def __init__(self, opts):
+        self.rate = opts.error_rate
+        self.kinds = [k for k in opts.error_kinds.split(",") if k]
+        self.codes = [int(c) for c in opts.error_codes.split(",") if c]
+        self.match = re.compile(opts.error_match)
+        self.outage = opts.outage
+        self.t0 = time.monotonic()
+        self.rng = random.Random(opts.seed)
+        self.lock = threading.Lock()
+
+    def pick(self, path, api):
+        kinds = self.kinds
+        if not api:
+            kinds = [k for k in kinds if k != "api"] or ["http"]
+        if not self.match.search(path):
+            return None
+        if self.outage is not None:
+            now = time.monotonic() - self.t0
+            start, duration = self.outage
+            if start <= now < start + duration:
+                return kinds[0]
+        with self.lock:
+            if self.rate > 0 and self.rng.random() < self.rate:
+                return self.rng.choice(kinds)
+        return None
+
+    def code(self):
+        with self.lock:
+            return self.rng.choice(self.codes)
+
+
+class Throttle(object):
+    """paces the bytes sent or received over one connection"""
+
+    def __init__(self, rate):
+        self.rate = rate
+        self.start = None
+        self.count = 0
+
+    def __call__(self, n):
+        if self.rate <= 0:
+            return
+        now = time.monotonic()
+        # do not let idle time be spent on a later burst
+        if self.start is None or now > self.start + self.count / self.rate:
+            self.start = now
+            self.count = 0
+        self.count += n
+        ahead = self.start + self.count / self.rate - now
+        if ahead > 0:
+            time.sleep(ahead)
+
+
+def single(args):
+    return dict((k, v[-1]) for k, v in args.items())
+
+
+def to_int(args, name, default=None):
+    value = args.get(name)
+    if value is None or value == "":
+        if default is None:
+            raise ApiError(ERR_PARAMETER, "Missing parameter %s" % name)
+        return default
+    try:
+        return int(value)
+    except ValueError:
+        raise ApiError(ERR_PARAMETER, "Invalid parameter %s" % name)
+
+
+class Api(object):
+    """one method per API call, returning the fields of the response"""
+
+    def __init__(self, opts, account, sessions):
+        self.opts = opts
+        self.account = account
+        self.sessions = sessions
+        self.uploads = {}
+        # units of resumable uploads by file hash and size
+        self.resumable = {}
+        self.lock = threading.Lock()
+
+    # helpers
+
+    def folder_item(self, node, info=False):
+        item = {
+            "folderkey": node.key,
+            "name": node.name,
+            "created": timestamp(node.created),
+            "revision": "%d" % node.revision,
+            "privacy": "private",
+        }
+        if node.parent is not None and node.parent != ROOT:
+            item["parent_folderkey" if info else "parent"] = node.parent
+        return item
+
+    def file_item(self, node, info=False):
+        item = {
+            "quickkey": node.key,
+            "hash": self.account.file_hash(node),
+            "filename": node.name,
+            "size": "%d" % node.content.size,
+            "created": timestamp(node.created),
+            "revision": "%d" % node.revision,
+            "privacy": "private",
+            "mimetype": "application/octet-stream",
+        }
+        if info and node.parent != ROOT:
+            item["parent_folderkey"] = node.parent
+        return item
+
+    def upload_done(self, node, req):
+        key = secrets.token_hex(6)[:11]
+        with self.lock:
+            self.uploads[key] = {
+                "ready": time.monotonic() + self.opts.upload_delay,
+                "quickkey": node.key,
+                "filename": node.name,
+                "size": node.content.size,
+                "revision": node.revision,
+            }
+        return {"doupload": {"result": "0", "key": key}}
+
+    def resumable_state(self, digest, size):
+        unit_size = self.opts.unit_size
+        count = max(1, (size + unit_size - 1) // unit_size)
+        with self.lock:
+            upload = self.resumable.get((digest, size))
+            units = list(upload["units"]) if upload is not None else []
+            key = upload["key"] if upload is not None else None
+        words = [0] * ((count + 15) // 16)
+        for unit in units:
+            words[unit // 16] |= 1 << (unit % 16)
+        state = {
+            "all_units_ready": "yes" if len(units) == count else "no",
+            "number_of_units": "%d" % count,
+            "unit_size": "%d" % unit_size,
+            "bitmap": {
+                "count": "%d" % len(words),
+                "words": ["%d" % w for w in words],
+            },
+        }
+        if key:
+            state["upload_key"] = key
+        return state
+
+    def body_content(self, req, body):
+        size = req.headers.get("x-filesize")
+        if size is not None and int(size) != len(body):
+            raise ApiError(ERR_UPLOAD, "x-filesize does not match the body")
+        return Blob(body)
+
+    # user
+
+    def user_get_session_token(self, args, body, req):
+        return self.sessions.login(args)
+
+    def user_get_action_token(self, args, body, req):
+        return {"action_token": self.sessions.action_token(
+            args.get("type"), to_int(args, "lifespan", 15))}
+
+    def user_get_info(self, args, body, req):
+        return {"user_info": {
+            "email": self.opts.email,
+            "first_name": "Mock",
+            "last_name": "User",
+            "display_name": "Mock User",
+            "premium": "yes",
+        }}
+
+    # folder
+
+    def folder_get_info(self, args, body, req):
+        keys = (args.get("folder_key") or ROOT).split(",")
+        infos = [self.folder_item(self.account.folder(k), True) for k in keys]
+        if len(infos) == 1:
+            return {"folder_info": infos[0]}
+        return {"folder_infos": infos}
+
+    def folder_get_content(self, args, body, req):
+        account = self.account
+        content_type = args.get("content_type", "files")
+        if content_type not in ("files", "folders"):
+            raise ApiError(ERR_PARAMETER, "Invalid content_type")
+        chunk_size = min(max(to_int(args, "chunk_size", 100), 1), 1000)
+        chunk = max(to_int(args, "chunk", 1), 1)
+        files = content_type == "files"
+        with account.lock:
+            folder = account.folder(args.get("folder_key"))
+            start = (chunk - 1) * chunk_size
+            keys, total = account.children(folder, files, start, chunk_size)
+            items = []
+            for key in keys:
+                node = account.get(key)
+                items.append(self.file_item(node) if files
+                             else self.folder_item(node))
+        return {"folder_content": {
+            "chunk_size": "%d" % chunk_size,
+            "content_type": content_type,
+            "chunk_number": "%d" % chunk,
+            "folderkey": folder.key,
+            content_type: items,
+            "more_chunks": "yes" if start + chunk_size < total else "no",
+        }}
+
+    def folder_create(self, args, body, req):
+        name = args.get("foldername")
+        if not name:
+            raise ApiError(ERR_PARAMETER, "Missing parameter foldername")
+        parent = self.account.folder(args.get("parent_key"))
+        node = self.account.create_folder(parent, name)
+        return {
+            "folder_key": node.key,
+            "upload_key": node.key,
+            "parent_folderkey": parent.key,
+            "name": node.name,
+            "created": timestamp(node.created),
+            "revision": "%d" % node.revision,
+            "new_device_revision": "%d" % self.account.device_revision,
+        }
+
+    def folder_delete(self, args, body, req):
+        node = self.account.folder(args.get("folder_key"))
+        if node.key == ROOT:
+            raise ApiError(ERR_FOLDER_KEY, "Cannot delete the root folder")
+        self.account.delete(node)
+        return {"new_device_revision": "%d" % self.account.device_revision}
+
+    def folder_move(self, args, body, req):
+        node = self.account.folder(args.get("folder_key_src"))
+        if node.key == ROOT:
+            raise ApiError(ERR_FOLDER_KEY, "Cannot move the root folder")
+        self.account.move(node,
+                          self.account.folder(args.get("folder_key_dst")))
+        return {"new_device_revision": "%d" % self.account.device_revision}
+
+    def folder_update(self, args, body, req):
+        node = self.account.folder(args.get("folder_key"))
+        if args.get("foldername"):
+            self.account.rename(node, args["foldername"])
+        return {"new_device_revision": "%d" % self.account.device_revision}
+
+    # file
+
+    def file_get_info(self, args, body, req):
+        keys = args.get("quick_key", "").split(",")
+        infos = [self.file_item(self.account.file(k), True) for k in keys]
+        if len(infos) == 1:
+            return {"file_info": infos[0]}
+        return {"file_infos": infos}
+
+    def file_get_links(self, args, body, req):
+        link_type = args.get("link_type")
+        links = []
+        for key in args.get("quick_key", "").split(","):
+            node = self.account.file(key)
+            name = quote(node.name)
+            direct = "%s/download/%s/%d/%s" % (req.base_url(), node.key,
+                                              node.revision, name)
+            link = {"quickkey": node.key}
+            all_links = {
+                "view": "%s/view/%s/%s" % (req.base_url(), node.key, name),
+                "normal_download": "%s/file/%s/%s" % (req.base_url(),
+                                                      node.key, name),
+                "direct_download": direct,
+                "one_time_download": direct,
+            }
+            if link_type is None:
+                link["normal_download"] = all_links["normal_download"]
+                link["direct_download"] = direct
+            elif link_type in all_links:
+                link[link_type] = all_links[link_type]
+            links.append(link)
+        return {"links": links}
+
+    def file_delete(self, args, body, req):
+        # either all files of a list are deleted or none
+        keys = (args.get("quick_key") or "").split(",")
+        nodes = [self.account.file(k) for k in keys]
+        for node in nodes:
+            self.account.delete(node)
+        return {"new_device_revision": "%d" % self.account.device_revision}
+
+    def file_move(self, args, body, req):
+        node = self.account.file(args.get("quick_key"))
+        self.account.move(node, self.account.folder(args.get("folder_key")))
+        return {"new_device_revision": "%d" % self.account.device_revision}
+
+    def file_update(self, args, body, req):
+        node = self.account.file(args.get("quick_key"))
+        if args.get("filename"):
+            self.account.rename(node, args["filename"])
+        return {"new_device_revision": "%d" % self.account.device_revision}
+
+    # device
+
+    def device_get_status(self, args, body, req):
+        return {
+            "device_revision": "%d" % self.account.device_revision,
+            "async_jobs_in_progress": "no",
+        }
+
+    def device_get_changes(self, args, body, req):
+        account = self.account
+        revision = to_int(args, "revision", 0)
+        # the block of revisions that revision falls into
+        end = (revision // CHANGES_BLOCK + 1) * CHANGES_BLOCK
+        latest = {}
+        with account.lock:
+            for change in account.changes:
+                if revision < change[0] <= end:
+                    latest[change[2]] = change
+            current = account.device_revision
+        result = {
+            "updated": {"files": [], "folders": []},
+            "deleted": {"files": [], "folders": []},
+        }
+        for rev, is_folder, key, parent, deleted in sorted(latest.values()):
+            item = {
+                "folderkey" if is_folder else "quickkey": key,
+                "parent_folderkey": parent,
+                "revision": "%d" % rev,
+            }
+            result["deleted" if deleted else "updated"][
+                "folders" if is_folder else "files"].append(item)
+        result["device_revision"] = "%d" % current
+        result["changes_list_block"] = "%d" % CHANGES_BLOCK
+        return result
+
+    def device_get_updates(self, args, body, req):
+        node = self.account.file(args.get("quick_key"))
+        revision = to_int(args, "revision")
+        with self.account.lock:
+            target = to_int(args, "target_revision", node.revision)
+            revisions = sorted(r for r in node.history
+                               if revision <= r <= target)
+            if not revisions or revisions[0] != revision:
+                raise ApiError(ERR_PARAMETER, "Unknown revision")
+            updates = []
+            for source, dest in zip(revisions, revisions[1:]):
+                updates.append({
+                    "source_revision": "%d" % source,
+                    "target_revision": "%d" % dest,
+                    "source_hash": node.history[source].sha256(),
+                    "target_hash": node.history[dest].sha256(),
+                    "patch_hash":
+                        self.account.patch(node, source, dest).sha256(),
+                })
+        return {"quickkey": node.key, "current_revision":
+                "%d" % node.revision, "updates": updates}
+
+    def device_get_patch(self, args, body, req):
+        node = self.account.file(args.get("quick_key"))
+        source = to_int(args, "source_revision")
+        target = to_int(args, "target_revision")
+        patch = self.account.patch(node, source, target)
+        return {
+            "patch_hash": patch.sha256(),
+            "patch_size": "%d" % patch.size,
+            "patch_link": "%s/patch/%s/%d/%d" % (req.base_url(), node.key,
+                                                  source, target),
+        }
+
+    # upload
+
+    def upload_check(self, args, body, req):
+        account = self.account
+        name = args.get("filename")
+        digest = args.get("hash", "")
+        if not name or not digest:
+            raise ApiError(ERR_PARAMETER, "Missing filename or hash")
+        with account.lock:
+            folder = account.folder(args.get("folder_key"))
+            existing = account.find_child(folder, name, False)
+            result = {
+                "hash_exists": "yes" if digest in account.hashes else "no",
+                "file_exists": "yes" if existing is not None else "no",
+                "storage_limit_exceeded": "no",
+            }
+            if digest in account.hashes:
+                result["in_account"] = "yes"
+            if existing is not None:
+                result["duplicate_quickkey"] = existing.key
+                result["different_hash"] = \
+                    "no" if account.file_hash(existing) == digest else "yes"
+        if args.get("resumable") == "yes":
+            result["resumable_upload"] = self.resumable_state(
+                digest, to_int(args, "size", 0))
+        return result
+
+    def upload_instant(self, args, body, req):
+        account = self.account
+        digest = args.get("hash", "")
+        size = to_int(args, "size")
+        with account.lock:
+            content = account.hashes.get(digest)
+            if content is None or content.size != size:
+                raise ApiError(ERR_UPLOAD, "No file with this hash and size")
+            if args.get("quick_key"):
+                node = account.file(args["quick_key"])
+                account.replace(node, content)
+            else:
+                name = args.get("filename")
+                if not name:
+                    raise ApiError(ERR_PARAMETER, "Missing filename")
+                node = account.put_file(
+                    account.folder(args.get("folder_key")), name, content)
+        return {
+            "quickkey": node.key,
+            "filename": node.name,
+            "new_device_revision": "%d" % account.device_revision,
+        }
+
+    def upload_simple(self, args, body, req):
+        name = req.headers.get("x-filename")
+        if not name:
+            raise ApiError(ERR_UPLOAD, "Missing x-filename header")
+        content = self.body_content(req, body or b"")
+        node = self.account.put_file(
+            self.account.folder(args.get("folder_key")), name, content)
+        return self.upload_done(node, req)
+
+    def upload_resumable(self, args, body, req):
+        account = self.account
+        headers = req.headers
+        name = headers.get("x-filename")
+        digest = headers.get("x-filehash")
+        try:
+            size = int(headers.get("x-filesize"))
+            unit = int(headers.get("x-unit-id"))
+            unit_size = int(headers.get("x-unit-size"))
+        except (TypeError, ValueError):
+            raise ApiError(ERR_PARAMETER, "Missing or invalid x-filesize, "
+                           "x-unit-id or x-unit-size header")
+        count = max(1, (size + self.opts.unit_size - 1) // self.opts.unit_size)
+        if not name or not digest or not 0 <= unit < count:
+            raise ApiError(ERR_PARAMETER, "Missing x-filename or x-filehash "
+                           "header or invalid unit")
+        body = body or b""
+        expected = min(self.opts.unit_size, size - unit * self.opts.unit_size)
+        if unit_size != len(body) or unit_size != expected:
+            raise ApiError(ERR_UPLOAD, "x-unit-size does not match the unit")
+        if hashlib.sha256(body).hexdigest() != headers.get("x-unit-hash"):
+            raise ApiError(ERR_UPLOAD, "x-unit-hash does not match the unit")
+        data = None
+        with self.lock:
+            upload = self.resumable.setdefault(
+                (digest, size), {"units": {}, "key": None})
+            upload["units"][unit] = body
+            # only the request completing the upload creates the file
+            if len(upload["units"]) == count and upload["key"] is None:
+                data = b"".join(upload["units"][i] for i in range(count))
+                upload["key"] = ""
+        result = {"doupload": {"result": "0", "key": ""}}
+        if data is not None:
+            content = Blob(data)
+            if content.sha256() != digest:
+                with self.lock:
+                    del self.resumable[(digest, size)]
+                raise ApiError(ERR_UPLOAD, "The units do not match "
+                               "x-filehash")
+            node = account.put_file(
+                account.folder(args.get("folder_key")), name, content)
+            result = self.upload_done(node, req)
+            with self.lock:
+                upload["key"] = result["doupload"]["key"]
+                # the content lives on in the file
+                upload["units"] = dict.fromkeys(upload["units"], b"")
+        result["resumable_upload"] = self.resumable_state(digest, size)
+        return result
+
+    def upload_patch(self, args, body, req):
+        account = self.account
+        node = account.file(args.get("quickkey"))
+        patch = self.body_content(req, body or b"")
+        with account.lock:
+            if account.file_hash(node) != args.get("source_hash"):
+                raise ApiError(ERR_UPLOAD, "source_hash does not match")
+            try:
+                target = Blob(vcdiff_decode(patch.data, node.content))
+            except ValueError as e:
+                raise ApiError(ERR_UPLOAD, "Cannot apply patch: %s" % e)
+            if (target.size != to_int(args, "target_size")
+                    or target.sha256() != args.get("target_hash")):
+                raise ApiError(ERR_UPLOAD, "Patched file does not match")
+            source = node.revision
+            account.replace(node, target)
+            # hand out the uploaded patch to other clients
+            account.patches[(node.key, source, node.revision)] = patch
+        return self.upload_done(node, req)
+
+    def upload_poll_upload(self, args, body, req):
+        # several keys can be polled at once, they are answered with an array
+        keys = (args.get("key") or "").split(",")
+        states = [self.upload_state(key) for key in keys]
+        if len(states) == 1:
+            return {"doupload": states[0]}
+        return {"doupload": states}
+
+    def upload_state(self, key):
+        with self.lock:
+            upload = self.uploads.get(key)
+        if upload is None:
+            raise ApiError(ERR_UPLOAD, "Unknown upload key")
+        done = time.monotonic() >= upload["ready"]
+        return {
+            "key": key,
+            "result": "0",
+            "status": "99" if done else "17",
+            "description": "No more requests for this key" if done
+                           else "Verifying file",
+            "fileerror": "",
+            "quickkey": upload["quickkey"] if done else "",
+            "filename": upload["filename"],
+            "size": "%d" % upload["size"],
+            "revision": "%d" % upload["revision"],
+        }
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    server_version = "mediafire-mock/" + API_VERSION
+    # headers and body are written separately, so with Nagle's algorithm
+    # every response on a kept-alive connection waits for the delayed ACK
+    # of the client
+    disable_nagle_algorithm = True
+
+    def setup(self):
+        BaseHTTPRequestHandler.setup(self)
+        self.throttle = Throttle(self.server.opts.bandwidth * 1024)
+
+    def log_message(self, fmt, *args):
+        if self.server.opts.verbose:
+            BaseHTTPRequestHandler.log_message(self, fmt, *args)
+
+    def base_url(self):
+        scheme = "https" if isinstance(self.connection, ssl.SSLSocket) \
+            else "http"
+        return "%s://%s" % (scheme, self.headers.get("Host", "127.0.0.1"))
+
+    def do_GET(self):
+        self.dispatch(None)
+
+    def do_HEAD(self):
+        self.dispatch(None, head=True)
+
+    def do_POST(self):
+        length = int(self.headers.get("Content-Length", 0))
+        body = bytearray()
+        while len(body) < length:
+            chunk = self.rfile.read(min(65536, length - len(body)))
+            if not chunk:
+                break
+            body += chunk
+            self.throttle(len(chunk))
+        self.dispatch(bytes(body))
+
+    def dispatch(self, body, head=False):
+        opts = self.server.opts
+        if opts.latency > 0 or opts.jitter > 0:
+            time.sleep((opts.latency + random.random() * opts.jitter) / 1000.0)
+        url = urlsplit(self.path)
+        m = API_RE.match(url.path)
+        if m is not None:
+            self.api(m.group(1), url, body)
+            return
+        fault = self.server.faults.pick(url.path, api=False)
+        if fault is not None:
+            self.fail(fault)
+            return
+        self.download(url.path, head)
+
+    def api(self, name, url, body):
+        srv = self.server
+        args = single(parse_qs(url.query, keep_blank_values=True))
+        if name == "user/get_session_token" and body:
+            args.update(single(parse_qs(body.decode("utf-8", "replace"),
+                                        keep_blank_values=True)))
+        try:
+            if (name not in UNSIGNED
+                    and not srv.sessions.action_allowed(name, args)):
+                srv.sessions.verify(self.path, args)
+            fault = srv.faults.pick(url.path, api=True)
+            if fault == "api":
+                raise ApiError(srv.faults.code(), "Injected error")
+            if fault is not None:
+                self.fail(fault)
+                return
+            handler = getattr(srv.api, name.replace("/", "_"), None)
+            if handler is None:
+                raise ApiError(ERR_UNKNOWN_CALL, "Unknown API call")
+            response = {"action": name}
+            response.update(handler(args, body, self))
+            response["result"] = "Success"
+        except ApiError as e:
+            response = {
+                "action": name,
+                "message": e.message,
+                "error": e.code,
+                "result": "Error",
+            }
+        response["current_api_version"] = API_VERSION
+        data = json.dumps({"response": response}).encode()
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", "%d" % len(data))
+        self.end_headers()
+        self.send_body(Blob(data), 0, len(data))
+
+    def download(self, path, head):
+        account = self.server.account
+        parts = [unquote(p) for p in path.split("/")[1:]]
+        content = None
+        try:
+            if parts[0] in ("download", "file", "view") and len(parts) >= 2:
+                node = account.file(parts[1])
+                content = node.content
+                if parts[0] == "download" and len(parts) >= 3:
+                    content = node.history.get(int(parts[2]))
+            elif parts[0] == "patch" and len(parts) == 4:
+                content = account.patch(account.file(parts[1]),
+                                        int(parts[2]), int(parts[3]))
+        except (ApiError, ValueError):
+            content = None
+        if content is None:
+            self.send_plain(404, "Not Found\n")
+            return
+        start, end = 0, content.size
+        status = 200
+        rng = self.headers.get("Range")
+        if rng is not None:
+            m = re.match(r"^bytes=(\d*)-(\d*)$", rng.strip())
+            if m is None or m.group(1) == m.group(2) == "":
+                start = None
+            elif m.group(1) == "":
+                start = max(0, content.size - int(m.group(2)))
+            else:
+                start = int(m.group(1))
+                if m.group(2) != "":
+                    end = min(end, int(m.group(2)) + 1)
+            if start is None or start >= content.size or start >= end:
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d"
+                                 % content.size)
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            status = 206
+        self.send_response(status)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", "%d" % (end - start))
+        self.send_header("Accept-Ranges", "bytes")
+        if status == 206:
+            self.send_header("Content-Range", "bytes %d-%d/%d"
+                             % (start, end - 1, content.size))
+        self.end_headers()
+        if not head:
+            self.send_body(content, start, end - start)
+
+    def send_body(self, content, offset, length):
+        end = offset + length
+        while offset < end:
+            chunk = content.read(offset, min(65536, end - offset))
+            self.throttle(len(chunk))
+            self.wfile.write(chunk)
+            offset += len(chunk)
+
+    def send_plain(self, status, text):
+        data = text.encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", "%d" % len(data))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def fail(self, kind):
+        if kind == "http":
+            status = self.server.opts.http_status
+            data = ("%d %s\n" % (status, self.responses.get(
+                status, ("Error",))[0])).encode()
+            self.send_response(status)
+            self.send_header("Retry-After", "1")
+            self.send_header("Content-Type", "text/plain")
+            self.send_header("Content-Length", "%d" % len(data))
+            self.end_headers()
+            self.wfile.write(data)
+            return
+        if kind == "stall":
+            time.sleep(self.server.opts.stall)
+        # close the connection without an answer, with a reset
+        self.close_connection = True
+        self.connection.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER,
+                                   struct.pack("ii", 1, 0))
+
+
+class MockServer(ThreadingHTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, opts, sslctx):
+        ThreadingHTTPServer.__init__(self, (opts.host, opts.port), Handler)
+        self.opts = opts
+        self.sslctx = sslctx
+        self.account = Account(opts)
+        self.sessions = Sessions(opts)
+        self.faults = Faults(opts)
+        self.api = Api(opts, self.account, self.sessions)
+
+    def finish_request(self, request, client_address):
+        # login uses https and everything else http on the same port, so
+        # look at the first byte to tell a TLS client hello from a request
+        try:
+            first = request.recv(1, socket.MSG_PEEK)
+        except OSError:
+            return
+        if first == b"\x16" and self.sslctx is not None:
+            try:
+                request = self.sslctx.wrap_socket(request, server_side=True)
+            except (ssl.SSLError, OSError):
+                return
+        try:
+            self.RequestHandlerClass(request, client_address, self)
+        finally:
+            if isinstance(request, ssl.SSLSocket):
+                request.close()
+
+
+def make_certificate(directory):
+    cert = os.path.join(directory, "cert.pem")
+    key = os.path.join(directory, "key.pem")
+    subprocess.check_call(
+        ["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes",
+         "-days", "30", "-subj", "/CN=127.0.0.1",
+         "-addext", "subjectAltName=IP:127.0.0.1,DNS:localhost",
+         "-keyout", key, "-out", cert],
+        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return cert, key
+
+
+def parse_outage(value):
+    start, duration = value.split(":")
+    return float(start), float(duration)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Local mock of the MediaFire API")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8443,
+                        help="0 picks a free port (see --port-file)")
+    parser.add_argument("--port-file",
+                        help="write the port to this file once listening")
+    parser.add_argument("--certfile")
+    parser.add_argument("--keyfile")
+    parser.add_argument("--email", default="user@example.com")
+    parser.add_argument("--password", default="password")
+    parser.add_argument("--app-key", default="",
+                        help="API key that login signatures must include")
+    parser.add_argument("--no-signature-check", dest="check_signatures",
+                        action="store_false")
+    parser.add_argument("--token-lifetime", type=float, default=0,
+                        help="seconds until a session token expires "
+                        "(default: never)")
+    parser.add_argument("--files", type=int, default=1000,
+                        help="number of files in the synthetic account")
+    parser.add_argument("--folders", type=int, default=None,
+                        help="number of folders in the synthetic account "
+                        "including the root (default: files / 100)")
+    parser.add_argument("--history", type=int, default=0,
+                        help="number of revisions that renames of synthetic "
+                        "files took before the server started")
+    parser.add_argument("--fanout", type=int, default=16,
+                        help="subfolders per synthetic folder")
+    parser.add_argument("--max-size", type=int, default=256 * 1024,
+                        help="maximum size of a synthetic file in bytes")
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--latency", type=float, default=0,
+                        help="milliseconds added to every request")
+    parser.add_argument("--jitter", type=float, default=0,
+                        help="random milliseconds added on top of latency")
+    parser.add_argument("--bandwidth", type=float, default=0,
+                        help="KiB/s per connection and direction")
+    parser.add_argument("--unit-size", type=int, default=4 * 1024 * 1024,
+                        help="unit size in bytes of resumable uploads")
+    parser.add_argument("--upload-delay", type=float, default=0,
+                        help="seconds until poll_upload reports an upload "
+                        "as done")
+    parser.add_argument("--error-rate", type=float, default=0,
+                        help="probability that a request fails")
+    parser.add_argument("--error-kinds", default="api",
+                        help="comma separated list of api (error response), "
+                        "http (error status), reset (connection reset) and "
+                        "stall (no answer)")
+    parser.add_argument("--http-status", type=int, default=503,
+                        help="HTTP status sent by the http error kind")
+    parser.add_argument("--error-codes", default="127",
+                        help="comma separated API error codes to inject")
+    parser.add_argument("--error-match", default="",
+                        help="only inject errors for paths matching this "
+                        "regular expression")
+    parser.add_argument("--outage", type=parse_outage, default=None,
+                        metavar="START:DURATION",
+                        help="fail every matching request with the first "
+                        "error kind from START until START+DURATION seconds "
+                        "after startup")
+    parser.add_argument("--stall", type=float, default=30,
+                        help="seconds a stalled request is held")
+    parser.add_argument("-v", "--verbose", action="store_true")
+    opts = parser.parse_args()
+
+    if opts.folders is None:
+        opts.folders = max(1, opts.files // 100)
+    for kind in opts.error_kinds.split(","):
+        if kind not in ("api", "http", "reset", "stall"):
+            parser.error("unknown error kind: %s" % kind)
+
+    if opts.certfile is None:
+        directory = tempfile.mkdtemp(prefix="mediafire-mock-")
+        opts.certfile, opts.keyfile = make_certificate(directory)
+    sslctx = ssl.create_default_context(ssl.Purpose.CLIENT_AUTH)
+    sslctx.load_cert_chain(opts.certfile, opts.keyfile)
+
+    server = MockServer(opts, sslctx)
+    port = server.server_address[1]
+    sys.stderr.write("listening on %s:%d\nCA certificate: %s\n"
+                     % (opts.host, port, opts.certfile))
+    sys.stderr.flush()
+    if opts.port_file is not None:
+        with open(opts.port_file + ".tmp", "w") as f:
+            f.write("%d\n" % port)
+        os.rename(opts.port_file + ".tmp", opts.port_file)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    server.server_close()
+
+
+if __name__ == "__main__":
+    main()
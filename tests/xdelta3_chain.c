@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * check that applying a chain of xdelta3 patches at once with
+ * xdelta3_patch_chain gives the same result as applying them one after the
+ * other with xdelta3_patch and report how long both took
+ *
+ * usage: xdelta3_chain [file size]
+ */
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../utils/xdelta3.h"
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void fill_random(unsigned char *buf, size_t len)
+{
+    size_t          i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = rng() & 0xff;
+}
+
+/*
+ * derive the next revision from buf by overwriting, inserting, deleting and
+ * duplicating a few random ranges
+ *
+ * buf must have room for size + 64 KiB bytes and the new size is returned
+ */
+static size_t mutate(unsigned char *buf, size_t size)
+{
+    int             i;
+    size_t          pos;
+    size_t          src;
+    size_t          len;
+
+    for (i = 0; i < 8; i++) {
+        len = rng() % 4096 + 1;
+        if (len > size / 4)
+            len = size / 4;
+        pos = rng() % (size - len);
+        switch (rng() % 4) {
+            case 0:
+                fill_random(buf + pos, len);
+                break;
+            case 1:
+                memmove(buf + pos + len, buf + pos, size - pos);
+                fill_random(buf + pos, len);
+                size += len;
+                break;
+            case 2:
+                memmove(buf + pos, buf + pos + len, size - pos - len);
+                size -= len;
+                break;
+            case 3:
+                src = rng() % (size - len);
+                memmove(buf + pos + len, buf + pos, size - pos);
+                if (src >= pos)
+                    src += len;
+                memmove(buf + pos, buf + src, len);
+                size += len;
+                break;
+        }
+    }
+
+    return size;
+}
+
+static FILE    *file_from_buffer(const unsigned char *buf, size_t size)
+{
+    FILE           *fh;
+
+    fh = tmpfile();
+    if (fh == NULL)
+        return NULL;
+    if (fwrite(buf, 1, size, fh) != size) {
+        fclose(fh);
+        return NULL;
+    }
+    rewind(fh);
+
+    return fh;
+}
+
+static int file_equals_buffer(FILE * fh, const unsigned char *buf,
+                              size_t size)
+{
+    unsigned char   chunk[65536];
+    size_t          offset;
+    size_t          len;
+
+    rewind(fh);
+    offset = 0;
+    while ((len = fread(chunk, 1, sizeof(chunk), fh)) > 0) {
+        if (offset + len > size || memcmp(chunk, buf + offset, len) != 0)
+            return 0;
+        offset += len;
+    }
+
+    return offset == size;
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec)
+        + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int check_chain(size_t size, int num_patches)
+{
+    unsigned char  *buf;
+    FILE           *source;
+    FILE          **revisions;
+    FILE          **patches;
+    FILE           *sequential;
+    FILE           *chained;
+    struct timespec start;
+    double          sequential_time;
+    double          chained_time;
+    int             retval;
+    int             i;
+
+    buf = malloc(size + (num_patches + 1) * 65536);
+    revisions = calloc(num_patches + 1, sizeof(FILE *));
+    patches = calloc(num_patches, sizeof(FILE *));
+
+    fill_random(buf, size);
+    revisions[0] = file_from_buffer(buf, size);
+    for (i = 0; i < num_patches; i++) {
+        size = mutate(buf, size);
+        revisions[i + 1] = file_from_buffer(buf, size);
+        patches[i] = tmpfile();
+        if (xdelta3_diff(revisions[i], revisions[i + 1], patches[i]) != 0) {
+            fprintf(stderr, "cannot create patch %d\n", i);
+            return -1;
+        }
+    }
+
+    /* apply the patches one after the other like it used to be done */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    source = revisions[0];
+    sequential = NULL;
+    retval = 0;
+    for (i = 0; retval == 0 && i < num_patches; i++) {
+        sequential = tmpfile();
+        rewind(patches[i]);
+        retval = xdelta3_patch(source, patches[i], sequential);
+        fflush(sequential);
+        if (source != revisions[0])
+            fclose(source);
+        source = sequential;
+    }
+    sequential_time = elapsed(&start);
+    if (retval != 0) {
+        fprintf(stderr, "xdelta3_patch failed\n");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    chained = tmpfile();
+    for (i = 0; i < num_patches; i++)
+        rewind(patches[i]);
+    retval = xdelta3_patch_chain(revisions[0], patches, num_patches,
+                                 chained);
+    fflush(chained);
+    chained_time = elapsed(&start);
+    if (retval != 0) {
+        fprintf(stderr, "xdelta3_patch_chain failed\n");
+        return -1;
+    }
+
+    printf("%2d patches on %zu bytes: sequential %.3f s, chained %.3f s\n",
+           num_patches, size, sequential_time, chained_time);
+
+    retval = 0;
+    if (!file_equals_buffer(sequential, buf, size)) {
+        fprintf(stderr, "sequential result differs from the target\n");
+        retval = -1;
+    }
+    if (!file_equals_buffer(chained, buf, size)) {
+        fprintf(stderr, "chained result differs from the target\n");
+        retval = -1;
+    }
+
+    fclose(sequential);
+    fclose(chained);
+    for (i = 0; i < num_patches; i++) {
+        fclose(revisions[i]);
+        fclose(patches[i]);
+    }
+    fclose(revisions[num_patches]);
+    free(revisions);
+    free(patches);
+    free(buf);
+
+    return retval;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t          size = 1024 * 1024;
+    int             num_patches[] = { 1, 2, 5, 20 };
+    int             fail;
+    size_t          i;
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [file size]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 2)
+        size = strtoul(argv[1], NULL, 10);
+    if (size < 65536) {
+        fprintf(stderr, "the file size must be at least 65536 bytes\n");
+        return 1;
+    }
+
+    fail = 0;
+    for (i = 0; i < sizeof(num_patches) / sizeof(num_patches[0]); i++) {
+        if (check_chain(size, num_patches[i]) != 0)
+            fail = 1;
+    }
+
+    return fail;
+}
@@ -16,10 +16,17 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200809L // for pread and posix_fadvise
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <openssl/sha.h>
 #include <openssl/md5.h>
+#include <openssl/evp.h>
 #include <stddef.h>
 #include <inttypes.h>
 #include <sys/stat.h>
@@ -29,6 +36,19 @@
 
 #define bufsize 32768
 
+/*
+ * Whole files are hashed through EVP, which picks the fastest implementation
+ * of SHA256 the CPU supports, in blocks of HASH_BLOCK_SIZE bytes. Large
+ * blocks keep the number of read calls low, so that hashing a file that is
+ * in the page cache is bound by the digest alone.
+ */
+#define HASH_BLOCK_SIZE (1024 * 1024)
+// hash_files never starts more threads than this
+#define HASH_MAX_THREADS 16
+
+static pthread_once_t hash_md_once = PTHREAD_ONCE_INIT;
+static const EVP_MD *hash_md = NULL;
+
 /*
  * we use this table to convert from a base36 char (ignoring case) to an
  * integer or from a hex string to binary (in the latter case letters g-z and
@@ -99,32 +119,384 @@ int calc_md5(FILE * file, unsigned char *hash)
     return 0;
 }
 
+/*
+ * The fast checksum is XXH64 with a seed of zero. It is no protection
+ * against deliberate changes but tells a file that was truncated or damaged
+ * on disk from the one that was verified with SHA256 when it was retrieved,
+ * at a small fraction of the cost of SHA256.
+ */
+#define CHECKSUM_PRIME1 0x9E3779B185EBCA87ULL
+#define CHECKSUM_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define CHECKSUM_PRIME3 0x165667B19E3779F9ULL
+#define CHECKSUM_PRIME4 0x85EBCA77C2B2AE63ULL
+#define CHECKSUM_PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t checksum_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t checksum_read64(const unsigned char *p)
+{
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16
+        | (uint64_t) p[3] << 24 | (uint64_t) p[4] << 32
+        | (uint64_t) p[5] << 40 | (uint64_t) p[6] << 48
+        | (uint64_t) p[7] << 56;
+}
+
+static inline uint64_t checksum_read32(const unsigned char *p)
+{
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16
+        | (uint64_t) p[3] << 24;
+}
+
+static inline uint64_t checksum_round(uint64_t acc, uint64_t input)
+{
+    acc += input * CHECKSUM_PRIME2;
+    acc = checksum_rotl(acc, 31);
+    return acc * CHECKSUM_PRIME1;
+}
+
+static inline uint64_t checksum_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= checksum_round(0, val);
+    return acc * CHECKSUM_PRIME1 + CHECKSUM_PRIME4;
+}
+
+// consume a stripe of CHECKSUM_STRIPE bytes
+static inline void checksum_stripe(struct checksum_ctx *ctx,
+                                   const unsigned char *p)
+{
+    ctx->acc[0] = checksum_round(ctx->acc[0], checksum_read64(p));
+    ctx->acc[1] = checksum_round(ctx->acc[1], checksum_read64(p + 8));
+    ctx->acc[2] = checksum_round(ctx->acc[2], checksum_read64(p + 16));
+    ctx->acc[3] = checksum_round(ctx->acc[3], checksum_read64(p + 24));
+}
+
+void checksum_init(struct checksum_ctx *ctx)
+{
+    ctx->acc[0] = CHECKSUM_PRIME1 + CHECKSUM_PRIME2;
+    ctx->acc[1] = CHECKSUM_PRIME2;
+    ctx->acc[2] = 0;
+    ctx->acc[3] = -CHECKSUM_PRIME1;
+    ctx->total_len = 0;
+    ctx->buf_len = 0;
+}
+
+void checksum_update(struct checksum_ctx *ctx, const void *data, size_t len)
+{
+    const unsigned char *p;
+    size_t          n;
+
+    p = (const unsigned char *)data;
+    ctx->total_len += len;
+
+    if (ctx->buf_len > 0) {
+        n = CHECKSUM_STRIPE - ctx->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(ctx->buf + ctx->buf_len, p, n);
+        ctx->buf_len += n;
+        p += n;
+        len -= n;
+        if (ctx->buf_len < CHECKSUM_STRIPE)
+            return;
+        checksum_stripe(ctx, ctx->buf);
+        ctx->buf_len = 0;
+    }
+
+    for (; len >= CHECKSUM_STRIPE; p += CHECKSUM_STRIPE,
+         len -= CHECKSUM_STRIPE)
+        checksum_stripe(ctx, p);
+
+    memcpy(ctx->buf, p, len);
+    ctx->buf_len = len;
+}
+
+uint64_t checksum_final(const struct checksum_ctx *ctx)
+{
+    const unsigned char *p;
+    size_t          len;
+    uint64_t        h;
+
+    if (ctx->total_len >= CHECKSUM_STRIPE) {
+        h = checksum_rotl(ctx->acc[0], 1) + checksum_rotl(ctx->acc[1], 7)
+            + checksum_rotl(ctx->acc[2], 12)
+            + checksum_rotl(ctx->acc[3], 18);
+        h = checksum_merge(h, ctx->acc[0]);
+        h = checksum_merge(h, ctx->acc[1]);
+        h = checksum_merge(h, ctx->acc[2]);
+        h = checksum_merge(h, ctx->acc[3]);
+    } else {
+        h = CHECKSUM_PRIME5;
+    }
+    h += ctx->total_len;
+
+    p = ctx->buf;
+    len = ctx->buf_len;
+    for (; len >= 8; p += 8, len -= 8) {
+        h ^= checksum_round(0, checksum_read64(p));
+        h = checksum_rotl(h, 27) * CHECKSUM_PRIME1 + CHECKSUM_PRIME4;
+    }
+    if (len >= 4) {
+        h ^= checksum_read32(p) * CHECKSUM_PRIME1;
+        h = checksum_rotl(h, 23) * CHECKSUM_PRIME2 + CHECKSUM_PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+        h ^= *p * CHECKSUM_PRIME5;
+        h = checksum_rotl(h, 11) * CHECKSUM_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= CHECKSUM_PRIME2;
+    h ^= h >> 29;
+    h *= CHECKSUM_PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static void hash_md_init(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    // with OpenSSL 3, EVP_sha256 looks up the implementation again on every
+    // EVP_DigestInit_ex, which threads hashing many small files contend on
+    hash_md = EVP_MD_fetch(NULL, "SHA256", NULL);
+#endif
+    if (hash_md == NULL)
+        hash_md = EVP_sha256();
+}
+
+/*
+ * start a SHA256 in ctx, which the caller feeds with EVP_DigestUpdate and
+ * completes with EVP_DigestFinal_ex
+ */
+int hash_init(EVP_MD_CTX * ctx)
+{
+    pthread_once(&hash_md_once, hash_md_init);
+
+    if (EVP_DigestInit_ex(ctx, hash_md, NULL) != 1)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * hash everything that can be read from fd with the given buffer of
+ * HASH_BLOCK_SIZE bytes into hash with ctx and, unless it is NULL, into the
+ * checksum in sum, which the caller sets up and completes
+ *
+ * if ctx is NULL, only the checksum is computed
+ */
+static int hash_fd(EVP_MD_CTX * ctx, unsigned char *hash,
+                   struct checksum_ctx *sum, char *buffer, int fd,
+                   uint64_t * size)
+{
+    ssize_t         bytesRead;
+    uint64_t        bytesRead_sum;
+
+    if (ctx != NULL && hash_init(ctx) != 0)
+        return -1;
+
+    bytesRead_sum = 0;
+    for (;;) {
+        bytesRead = read(fd, buffer, HASH_BLOCK_SIZE);
+        if (bytesRead < 0 && errno == EINTR)
+            continue;
+        if (bytesRead < 0)
+            return -1;
+        if (bytesRead == 0)
+            break;
+        if (ctx != NULL)
+            EVP_DigestUpdate(ctx, buffer, bytesRead);
+        if (sum != NULL)
+            checksum_update(sum, buffer, bytesRead);
+        bytesRead_sum += bytesRead;
+    }
+
+    if (ctx != NULL && EVP_DigestFinal_ex(ctx, hash, NULL) != 1)
+        return -1;
+    if (size != NULL) {
+        *size = bytesRead_sum;
+    }
+    return 0;
+}
+
 /*
  * calculate the SHA256 sum and optionally (if size != NULL) count the file
  * size
+ *
+ * the file is read through its descriptor from the current position, so
+ * the caller has to rewind it before using it with stdio again
  */
 int calc_sha256(FILE * file, unsigned char *hash, uint64_t * size)
 {
-    int             bytesRead;
     char           *buffer;
-    SHA256_CTX      sha256;
-    uint64_t        bytesRead_sum;
+    EVP_MD_CTX     *ctx;
+    int             retval;
+
+    buffer = malloc(HASH_BLOCK_SIZE);
+    ctx = EVP_MD_CTX_new();
+    if (buffer == NULL || ctx == NULL) {
+        free(buffer);
+        EVP_MD_CTX_free(ctx);
+        return -1;
+    }
+
+    retval = hash_fd(ctx, hash, NULL, buffer, fileno(file), size);
+
+    EVP_MD_CTX_free(ctx);
+    free(buffer);
+    return retval;
+}
+
+/* state shared by the threads of hash_files */
+struct hash_files_state {
+    pthread_mutex_t mutex;
+    struct hash_file *files;
+    size_t          num_files;
+    size_t          next_file;
+};
+
+static void    *hash_files_worker(void *user_ptr)
+{
+    struct hash_files_state *state;
+    struct hash_file *file;
+    struct checksum_ctx sum;
+    char           *buffer;
+    EVP_MD_CTX     *ctx;
+    int             fd;
+
+    state = (struct hash_files_state *)user_ptr;
+
+    buffer = malloc(HASH_BLOCK_SIZE);
+    ctx = EVP_MD_CTX_new();
+
+    for (;;) {
+        pthread_mutex_lock(&(state->mutex));
+        if (state->next_file >= state->num_files) {
+            pthread_mutex_unlock(&(state->mutex));
+            break;
+        }
+        file = &(state->files[state->next_file++]);
+        pthread_mutex_unlock(&(state->mutex));
+
+        file->retval = -1;
+        if (buffer == NULL || ctx == NULL)
+            continue;
+
+        fd = open(file->path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "cannot open %s\n", file->path);
+            continue;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        checksum_init(&sum);
+        file->retval = hash_fd(file->checksum_only ? NULL : ctx, file->hash,
+                               &sum, buffer, fd, &(file->size));
+        file->checksum = checksum_final(&sum);
+        if (file->retval != 0)
+            fprintf(stderr, "cannot read %s\n", file->path);
+        close(fd);
+    }
+
+    EVP_MD_CTX_free(ctx);
+    free(buffer);
+
+    return NULL;
+}
+
+/*
+ * calculate the SHA256 sums, fast checksums and sizes of a batch of files
+ * with num_threads threads or, if num_threads is zero, one per online
+ * processor. For files with checksum_only set, the SHA256 is skipped.
+ *
+ * The files are handed to the threads in the order of the array, so a
+ * caller that knows their sizes should put the largest first, so that no
+ * thread is left with a large file at the end. The retval member of every
+ * file tells whether it could be hashed.
+ */
+void hash_files(struct hash_file *files, size_t num_files, int num_threads)
+{
+    struct hash_files_state state;
+    pthread_t      *threads;
+    long            t;
+
+    if (num_threads <= 0)
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > HASH_MAX_THREADS)
+        num_threads = HASH_MAX_THREADS;
+    if ((size_t) num_threads > num_files)
+        num_threads = num_files;
+
+    state.files = files;
+    state.num_files = num_files;
+    state.next_file = 0;
+    pthread_mutex_init(&(state.mutex), NULL);
+
+    threads = NULL;
+    if (num_threads > 1)
+        threads = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+    t = 0;
+    if (threads != NULL) {
+        for (t = 0; t < num_threads; t++) {
+            if (pthread_create(&threads[t], NULL, hash_files_worker,
+                               &state) != 0)
+                break;
+        }
+    }
+    // hash in this thread as well in case not a single thread was created
+    if (t == 0)
+        hash_files_worker(&state);
+    num_threads = t;
+    for (t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&(state.mutex));
+}
+
+/*
+ * feed len bytes of fd starting at offset into a SHA256 and, unless sum is
+ * NULL, a fast checksum that are being computed, so that hashes kept up to
+ * date while a file is written can be completed with the parts that did not
+ * pass through them
+ */
+int hash_update_fd(EVP_MD_CTX * ctx, struct checksum_ctx *sum, int fd,
+                   uint64_t offset, uint64_t len)
+{
+    char           *buffer;
+    ssize_t         bytesRead;
+    size_t          n;
+
+    if (len == 0)
+        return 0;
 
-    SHA256_Init(&sha256);
     buffer = malloc(bufsize);
     if (buffer == NULL) {
         return -1;
     }
 
-    bytesRead_sum = 0;
-    while ((bytesRead = fread(buffer, 1, bufsize, file))) {
-        SHA256_Update(&sha256, buffer, bytesRead);
-        bytesRead_sum += bytesRead;
-    }
-    SHA256_Final(hash, &sha256);
-    if (size != NULL) {
-        *size = bytesRead_sum;
+    while (len > 0) {
+        n = bufsize;
+        if (n > len)
+            n = len;
+        bytesRead = pread(fd, buffer, n, offset);
+        if (bytesRead < 0 && errno == EINTR)
+            continue;
+        if (bytesRead <= 0) {
+            free(buffer);
+            return -1;
+        }
+        EVP_DigestUpdate(ctx, buffer, bytesRead);
+        if (sum != NULL)
+            checksum_update(sum, buffer, bytesRead);
+        offset += bytesRead;
+        len -= bytesRead;
     }
+
     free(buffer);
     return 0;
 }
@@ -150,22 +522,27 @@ void hex2binary(const char *hex, unsigned char *binary)
     }
 }
 
+/* encodes length bytes into 2 * length hex characters at out, without a
+ * terminating zero
+ */
+void binary2hex_buf(const unsigned char *binary, size_t length, char *out)
+{
+    size_t          i;
+
+    for (i = 0; i < length; i++)
+        memcpy(out + i * 2, base16_encoding_table[binary[i]], 2);
+}
+
 char           *binary2hex(const unsigned char *binary, size_t length)
 {
     char           *out;
-    char           *p;
-    size_t          i;
 
     out = malloc(length * 2 + 1);
     if (out == NULL) {
         fprintf(stderr, "cannot allocate memory\n");
         return NULL;
     }
-    for (i = 0; i < length; i++) {
-        p = base16_encoding_table[binary[i]];
-        out[i * 2] = p[0];
-        out[i * 2 + 1] = p[1];
-    }
+    binary2hex_buf(binary, length, out);
     out[length * 2] = '\0';
     return out;
 }
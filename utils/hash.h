@@ -19,11 +19,50 @@
 #ifndef _MFSHELL_HASH_H_
 #define _MFSHELL_HASH_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#define CHECKSUM_STRIPE 32
+
+/* state of a fast checksum to detect local damage of files */
+struct checksum_ctx {
+    uint64_t        acc[4];
+    uint64_t        total_len;
+    unsigned char   buf[CHECKSUM_STRIPE];
+    size_t          buf_len;
+};
+
+/* a file to hash with hash_files */
+struct hash_file {
+    const char     *path;
+    // only compute the checksum, which is much faster
+    bool            checksum_only;
+    // filled in by hash_files
+    unsigned char   hash[SHA256_DIGEST_LENGTH];
+    uint64_t        checksum;
+    uint64_t        size;
+    int             retval;
+};
+
 int             calc_md5(FILE * file, unsigned char *hash);
 int             calc_sha256(FILE * file, unsigned char *hash,
                             uint64_t * file_size);
+int             hash_init(EVP_MD_CTX * ctx);
+int             hash_update_fd(EVP_MD_CTX * ctx, struct checksum_ctx *sum,
+                               int fd, uint64_t offset, uint64_t len);
+void            checksum_init(struct checksum_ctx *ctx);
+void            checksum_update(struct checksum_ctx *ctx, const void *data,
+                                size_t len);
+uint64_t        checksum_final(const struct checksum_ctx *ctx);
+void            hash_files(struct hash_file *files, size_t num_files,
+                           int num_threads);
 int             base36_decode_triplet(const char *key);
 void            hex2binary(const char *hex, unsigned char *binary);
+void            binary2hex_buf(const unsigned char *binary, size_t length,
+                               char *out);
 char           *binary2hex(const unsigned char *binary, size_t length);
 int             file_check_integrity(const char *path, uint64_t fsize,
                                      const unsigned char *fhash);
@@ -16,14 +16,34 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200809L // for ftello, ftruncate, fsync, pread,
+                                // pwrite, posix_fallocate, posix_fadvise,
+                                // posix_memalign, clock_gettime and
+                                // nanosleep
+
 #include <stdlib.h>
 #include <string.h>
 #include <curl/curl.h>
 #include <curl/easy.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
 
 #include "http.h"
+#include "hash.h"
+#include "strings.h"
+
+struct http_segments;
 
 static int      http_progress_cb(void *user_ptr, double dltotal, double dlnow,
                                  double ultotal, double ulnow);
@@ -35,27 +55,437 @@ static size_t   http_write_buf_cb(char *data, size_t size, size_t nmemb,
                                   void *user_ptr);
 static size_t   http_write_file_cb(char *data, size_t size, size_t nmemb,
                                    void *user_ptr);
+static void     http_engine_cleanup(void);
+static int      http_complete_get_segment(mfhttp * conn, int retval);
+static bool     http_segments_cancelled(struct http_segments *segments);
+static void     http_engine_hold(mfhttp * conn, double delay);
+static size_t   http_json_load_cb(void *buffer, size_t buflen,
+                                  void *user_ptr);
 
 struct mfhttp {
     CURL           *curl_handle;
+    // next idle handle in the pool
+    mfhttp         *next;
     char           *write_buf;
     size_t          write_buf_len;
+    size_t          write_buf_size;
+    // state of a response that is parsed while it is received
+    CURLM          *multi;
+    size_t          write_buf_pos;
+    bool            streaming;
+    bool            stream_done;
+    int             stream_result;
     double          ul_len;
     double          ul_now;
     double          dl_len;
     double          dl_now;
     bool            show_progress;
+    // limit for the duration of a transfer in seconds, zero for none
+    double          timeout;
     char            error_buf[CURL_ERROR_SIZE];
-    FILE           *stream;
+    // file of a download or an upload, downloads are written through
+    // file_buf which starts at file_offset in the file
+    int             file_fd;
+    uint64_t        file_offset;
+    char           *file_buf;
+    size_t          file_buf_len;
+    // end of the part of the file an upload sends
+    uint64_t        file_end;
+    // state of a resumable download with http_get_file
+    char           *url;
+    char           *path;
+    char           *part_path;
+    char           *progress_path;
+    uint64_t        resume_offset;
+    int64_t         expected_size;
+    uint64_t        durable_offset;
+    uint64_t        unsynced_bytes;
+    bool            started;
+    bool            range_mismatch;
+    // state of one segment of http_get_file_segmented
+    uint64_t        segment_offset;
+    uint64_t        segment_end;
+    int             segment_index;
+    struct http_segments *segments;
+    struct http_hasher *hasher;
+    // SHA256 and fast checksum of a download, fed with the data as it is
+    // written so that the file does not have to be read again to verify it
+    EVP_MD_CTX     *hash_ctx;
+    struct checksum_ctx checksum_ctx;
+    bool            hashing;
+    bool            hash_valid;
+    uint64_t        hash_len;
+    unsigned char   hash[SHA256_DIGEST_LENGTH];
+    uint64_t        checksum;
+    // scheduling class of the current transfer
+    int             cls;
+    bool            active;
+    // set while the transfer is run by the engine
+    bool            in_engine;
+    // set while the engine holds the transfer back until resume_at
+    bool            held;
+    mfhttp         *held_next;
+    double          resume_at;
+    // state of the current transfer for evaluating its result
+    int             op;
+    int             (*data_handler) (mfhttp * conn, void *data);
+    void           *data;
+    struct curl_slist *headers;
+    // completion of an asynchronous transfer
+    void            (*done_cb) (mfhttp * conn, int retval, void *user_ptr);
+    void           *done_data;
+    bool            done;
+    int             retval;
 };
 
+enum {
+    HTTP_OP_GET_BUF,
+    HTTP_OP_POST_BUF,
+    HTTP_OP_GET_FILE,
+    HTTP_OP_POST_FILE,
+    HTTP_OP_GET_SEGMENT,
+};
+
+/*
+ * with MEDIAFIRE_DEBUG set to at least this level in the environment, all
+ * response bodies are echoed to stderr
+ */
+#define HTTP_DEBUG_BODY 1
+
+// the response buffer starts out with this size and then doubles
+#define HTTP_WRITE_BUF_MIN 4096
+// pooled handles keep their response buffer unless it grew beyond this size
+#define HTTP_WRITE_BUF_KEEP (1024 * 1024)
+
+static int      http_debug = 0;
+
+/*
+ * downloads in progress are flushed to disk and their progress record is
+ * updated whenever this many bytes were written
+ */
+#define HTTP_DOWNLOAD_SYNC_INTERVAL (16 * 1024 * 1024)
+
+/*
+ * Files are moved in large pieces, so that transferring a gigabyte takes
+ * few syscalls and callbacks: curl hands out up to HTTP_RECV_BUF_SIZE bytes
+ * per call of the write callback and asks for up to HTTP_SEND_BUF_SIZE bytes
+ * per call of the read callback. Downloads are collected in an aligned
+ * buffer of HTTP_FILE_BUF_SIZE bytes before they go to the file, because
+ * over TLS curl rarely hands out more than a record of 16 kB at a time.
+ */
+#define HTTP_RECV_BUF_SIZE (512 * 1024)
+#define HTTP_SEND_BUF_SIZE (1024 * 1024)
+#define HTTP_FILE_BUF_SIZE (4 * 1024 * 1024)
+#define HTTP_FILE_BUF_ALIGN 4096
+
 /*
  * This set of functions is made such that the mfhttp struct and the curl
  * handle it stores can be reused for multiple operations
  *
- * We do not use a single global instance because mediafire does not support
- * keep-alive anyways.
+ * Handles are not freed by http_destroy() but returned to a pool from which
+ * http_create() takes them again. A curl handle keeps its connections open
+ * after a transfer, so whenever the server allows keep-alive, the next
+ * request to the same host skips the TCP and TLS handshakes. On top of that,
+ * all handles share their DNS cache, TLS sessions and connection cache, so
+ * that a handle can also pick up a connection or a TLS session that was
+ * established by another one.
+ *
+ * The pool is protected by a mutex, so handles can be borrowed from
+ * multiple threads. A single handle must still only be used by one thread
+ * at a time.
+ */
+
+// maximum number of idle handles kept in the pool
+#define HTTP_POOL_MAX 8
+
+static pthread_once_t http_pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t http_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mfhttp  *http_pool = NULL;
+static size_t   http_pool_len = 0;
+static CURLSH  *http_share = NULL;
+static pthread_mutex_t http_share_mutex[CURL_LOCK_DATA_LAST];
+// scheduling class of the transfers started by a thread, see http_begin
+static pthread_key_t http_thread_class_key;
+
+static void http_share_lock(CURL * handle, curl_lock_data data,
+                            curl_lock_access access, void *user_ptr)
+{
+    (void)handle;
+    (void)access;
+    (void)user_ptr;
+
+    pthread_mutex_lock(&(http_share_mutex[data]));
+}
+
+static void http_share_unlock(CURL * handle, curl_lock_data data,
+                              void *user_ptr)
+{
+    (void)handle;
+    (void)user_ptr;
+
+    pthread_mutex_unlock(&(http_share_mutex[data]));
+}
+
+static void http_pool_init(void)
+{
+    int             i;
+    const char     *debug;
+
+    pthread_key_create(&http_thread_class_key, NULL);
+
+    // curl_easy_init would do this implicitly but not in a thread safe way
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&(http_share_mutex[i]), NULL);
+    }
+
+    debug = getenv("MEDIAFIRE_DEBUG");
+    if (debug != NULL)
+        http_debug = strtol(debug, NULL, 10);
+
+    http_share = curl_share_init();
+    if (http_share == NULL) {
+        fprintf(stderr, "cannot create curl share - not sharing caches\n");
+        return;
+    }
+    curl_share_setopt(http_share, CURLSHOPT_LOCKFUNC, http_share_lock);
+    curl_share_setopt(http_share, CURLSHOPT_UNLOCKFUNC, http_share_unlock);
+    curl_share_setopt(http_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(http_share, CURLSHOPT_SHARE,
+                      CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(http_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+}
+
+/*
+ * free all idle handles and the shared caches
+ *
+ * This must only be called once no handle is in use anymore, usually right
+ * before the program exits. Transfers still queued in the transfer engine
+ * are completed first.
+ */
+static void http_free(mfhttp * conn)
+{
+    if (conn->multi != NULL)
+        curl_multi_cleanup(conn->multi);
+    curl_easy_cleanup(conn->curl_handle);
+    EVP_MD_CTX_free(conn->hash_ctx);
+    free(conn->write_buf);
+    free(conn);
+}
+
+void http_pool_cleanup(void)
+{
+    mfhttp         *conn;
+    int             i;
+
+    http_engine_cleanup();
+
+    pthread_mutex_lock(&http_pool_mutex);
+    while (http_pool != NULL) {
+        conn = http_pool;
+        http_pool = conn->next;
+        http_free(conn);
+    }
+    http_pool_len = 0;
+    pthread_mutex_unlock(&http_pool_mutex);
+
+    if (http_share != NULL) {
+        curl_share_cleanup(http_share);
+        http_share = NULL;
+        for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+            pthread_mutex_destroy(&(http_share_mutex[i]));
+        }
+    }
+}
+
+/*
+ * Every transfer belongs to one of the HTTP_CLASS_* classes. Transfers of
+ * the prefetching or uploading classes yield to interactive ones: while an
+ * interactive transfer is running, they are held back after every chunk.
+ * In addition, every class can be capped to a number of bytes per second
+ * with a token bucket which holds up to one second worth of tokens.
+ *
+ * Holding back a transfer means sleeping in its callback for blocking
+ * transfers and pausing the curl handle for transfers run by the engine,
+ * so that the engine thread keeps serving the others.
+ */
+
+// how long a background transfer waits before checking again for
+// interactive transfers
+#define HTTP_YIELD_DELAY 0.05
+
+static const char *http_class_names[HTTP_NUM_CLASSES] = {
+    "metadata", "data", "prefetch", "upload"
+};
+
+static pthread_mutex_t http_sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct http_class {
+    uint64_t        rate;       // bytes per second or zero for no cap
+    double          tokens;
+    double          last_refill;
+    size_t          active;
+    uint64_t        transfers;
+    uint64_t        bytes;
+} http_classes[HTTP_NUM_CLASSES];
+
+static double http_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// transfers started by the calling thread are put into the given class
+void http_set_thread_class(int cls)
+{
+    pthread_once(&http_pool_once, http_pool_init);
+    pthread_setspecific(http_thread_class_key, (void *)(intptr_t) (cls + 1));
+}
+
+void http_set_class_rate(int cls, uint64_t bytes_per_second)
+{
+    pthread_mutex_lock(&http_sched_mutex);
+    http_classes[cls].rate = bytes_per_second;
+    http_classes[cls].tokens = bytes_per_second;
+    pthread_mutex_unlock(&http_sched_mutex);
+}
+
+void http_print_class_stats(FILE * fh)
+{
+    int             i;
+
+    pthread_mutex_lock(&http_sched_mutex);
+    for (i = 0; i < HTTP_NUM_CLASSES; i++) {
+        fprintf(fh, "%-8s %" PRIu64 " transfers, %" PRIu64 " bytes",
+                http_class_names[i], http_classes[i].transfers,
+                http_classes[i].bytes);
+        if (http_classes[i].rate > 0)
+            fprintf(fh, " (capped at %" PRIu64 " B/s)",
+                    http_classes[i].rate);
+        fprintf(fh, "\n");
+    }
+    pthread_mutex_unlock(&http_sched_mutex);
+}
+
+// mark the start of a transfer and pick its class
+static void http_begin(mfhttp * conn, int op)
+{
+    int             cls;
+
+    conn->op = op;
+    conn->hash_valid = false;
+
+    cls = (intptr_t) pthread_getspecific(http_thread_class_key) - 1;
+    if (cls < 0) {
+        switch (op) {
+            case HTTP_OP_POST_FILE:
+                cls = HTTP_CLASS_UPLOAD;
+                break;
+            case HTTP_OP_GET_FILE:
+            case HTTP_OP_GET_SEGMENT:
+                cls = HTTP_CLASS_DATA;
+                break;
+            default:
+                cls = HTTP_CLASS_METADATA;
+                break;
+        }
+    }
+    conn->cls = cls;
+
+    pthread_mutex_lock(&http_sched_mutex);
+    http_classes[cls].active++;
+    http_classes[cls].transfers++;
+    pthread_mutex_unlock(&http_sched_mutex);
+    conn->active = true;
+}
+
+static void http_end(mfhttp * conn)
+{
+    if (!conn->active)
+        return;
+
+    pthread_mutex_lock(&http_sched_mutex);
+    http_classes[conn->cls].active--;
+    pthread_mutex_unlock(&http_sched_mutex);
+    conn->active = false;
+}
+
+/*
+ * account for len bytes transferred by conn and hold the transfer back if
+ * its class is over its cap or has to yield
  */
+static void http_throttle(mfhttp * conn, size_t len)
+{
+    double          delay;
+    double          now;
+    struct timespec ts;
+    struct http_class *cls;
+
+    if (len == 0)
+        return;
+
+    delay = 0;
+    pthread_mutex_lock(&http_sched_mutex);
+    cls = &(http_classes[conn->cls]);
+    cls->bytes += len;
+    if (cls->rate > 0) {
+        now = http_now();
+        cls->tokens += (now - cls->last_refill) * cls->rate;
+        cls->last_refill = now;
+        if (cls->tokens > cls->rate)
+            cls->tokens = cls->rate;
+        // the tokens may go negative, which is paid back by waiting
+        cls->tokens -= len;
+        if (cls->tokens < 0)
+            delay = -cls->tokens / cls->rate;
+    }
+    if (conn->cls >= HTTP_CLASS_PREFETCH
+        && (http_classes[HTTP_CLASS_METADATA].active > 0
+            || http_classes[HTTP_CLASS_DATA].active > 0)
+        && delay < HTTP_YIELD_DELAY)
+        delay = HTTP_YIELD_DELAY;
+    pthread_mutex_unlock(&http_sched_mutex);
+
+    if (delay <= 0)
+        return;
+
+    if (conn->in_engine) {
+        http_engine_hold(conn, delay);
+        return;
+    }
+
+    ts.tv_sec = delay;
+    ts.tv_nsec = (delay - ts.tv_sec) * 1e9;
+    nanosleep(&ts, NULL);
+}
+
+// print how long the last transfer took and where the time went
+static void http_log_timing(mfhttp * conn)
+{
+    double          namelookup;
+    double          connect;
+    double          appconnect;
+    double          total;
+    long            num_connects;
+
+    if (curl_easy_getinfo(conn->curl_handle, CURLINFO_NAMELOOKUP_TIME,
+                          &namelookup) != CURLE_OK
+        || curl_easy_getinfo(conn->curl_handle, CURLINFO_CONNECT_TIME,
+                             &connect) != CURLE_OK
+        || curl_easy_getinfo(conn->curl_handle, CURLINFO_APPCONNECT_TIME,
+                             &appconnect) != CURLE_OK
+        || curl_easy_getinfo(conn->curl_handle, CURLINFO_TOTAL_TIME,
+                             &total) != CURLE_OK
+        || curl_easy_getinfo(conn->curl_handle, CURLINFO_NUM_CONNECTS,
+                             &num_connects) != CURLE_OK)
+        return;
+
+    fprintf(stderr, "time: %.3f s (dns %.3f s, connect %.3f s, "
+            "tls %.3f s, %s connection)\n", total, namelookup, connect,
+            appconnect, num_connects > 0 ? "new" : "reused");
+}
 
 static void http_curl_reset(mfhttp * conn)
 {
@@ -68,12 +498,26 @@ static void http_curl_reset(mfhttp * conn)
     curl_easy_setopt(conn->curl_handle, CURLOPT_SSLENGINE, NULL);
     curl_easy_setopt(conn->curl_handle, CURLOPT_SSLENGINE_DEFAULT, 1L);
     curl_easy_setopt(conn->curl_handle, CURLOPT_ERRORBUFFER, conn->error_buf);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_PRIVATE, (void *)conn);
     curl_easy_setopt(conn->curl_handle, CURLOPT_PROXY, getenv("http_proxy"));
     curl_easy_setopt(conn->curl_handle, CURLOPT_VERBOSE, 0L);
+    if (http_share != NULL)
+        curl_easy_setopt(conn->curl_handle, CURLOPT_SHARE, http_share);
+    // keep idle connections in the pool from being dropped by middleboxes
+    curl_easy_setopt(conn->curl_handle, CURLOPT_TCP_KEEPALIVE, 1L);
 
     // it should never take 5 seconds to establish a connection to the server
     curl_easy_setopt(conn->curl_handle, CURLOPT_CONNECTTIMEOUT, 5);
 
+    if (conn->timeout > 0)
+        curl_easy_setopt(conn->curl_handle, CURLOPT_TIMEOUT_MS,
+                         (long)(conn->timeout * 1000));
+
+    // allow to trust the self-signed certificate of a local test server
+    if (getenv("MEDIAFIRE_CA_BUNDLE") != NULL)
+        curl_easy_setopt(conn->curl_handle, CURLOPT_CAINFO,
+                         getenv("MEDIAFIRE_CA_BUNDLE"));
+
     //curl_easy_setopt(conn->curl_handle, CURLOPT_SSL_VERIFYPEER, 0L);
 }
 
@@ -82,28 +526,103 @@ mfhttp         *http_create(void)
     mfhttp         *conn;
     CURL           *curl_handle;
 
+    pthread_once(&http_pool_once, http_pool_init);
+
+    pthread_mutex_lock(&http_pool_mutex);
+    conn = http_pool;
+    if (conn != NULL) {
+        http_pool = conn->next;
+        http_pool_len--;
+    }
+    pthread_mutex_unlock(&http_pool_mutex);
+
+    if (conn != NULL) {
+        conn->next = NULL;
+        return conn;
+    }
+
     curl_handle = curl_easy_init();
     if (curl_handle == NULL)
         return NULL;
 
     conn = (mfhttp *) calloc(1, sizeof(mfhttp));
     conn->curl_handle = curl_handle;
+    conn->hash_ctx = EVP_MD_CTX_new();
+    if (conn->hash_ctx == NULL) {
+        curl_easy_cleanup(curl_handle);
+        free(conn);
+        return NULL;
+    }
 
     conn->show_progress = false;
     return conn;
 }
 
+/*
+ * When called from the data_handler of a blocking http_get_buf or
+ * http_post_buf, the response is still being received. It is then parsed
+ * while it arrives, so that a large response never has to be held in memory
+ * as a whole next to the objects decoded from it. Otherwise the complete
+ * response in the buffer is parsed.
+ */
 json_t         *http_parse_buf_json(mfhttp * conn, size_t flags,
                                     json_error_t * error)
 {
+    if (conn->streaming)
+        return json_load_callback(http_json_load_cb, conn, flags, error);
+
     return json_loadb(conn->write_buf, conn->write_buf_len, flags, error);
 }
 
 void http_destroy(mfhttp * conn)
 {
-    curl_easy_cleanup(conn->curl_handle);
-    free(conn->write_buf);
-    free(conn);
+    CURL           *curl_handle;
+    CURLM          *multi;
+    EVP_MD_CTX     *hash_ctx;
+    char           *write_buf;
+    size_t          write_buf_size;
+
+    // a single huge response should not pin its buffer forever
+    if (conn->write_buf_size > HTTP_WRITE_BUF_KEEP) {
+        free(conn->write_buf);
+        conn->write_buf = NULL;
+        conn->write_buf_size = 0;
+    }
+
+    // keep the curl handle, its open connections, the hash context and the
+    // response buffer around for reuse
+    pthread_mutex_lock(&http_pool_mutex);
+    if (http_pool_len < HTTP_POOL_MAX) {
+        curl_handle = conn->curl_handle;
+        multi = conn->multi;
+        hash_ctx = conn->hash_ctx;
+        write_buf = conn->write_buf;
+        write_buf_size = conn->write_buf_size;
+        memset(conn, 0, sizeof(mfhttp));
+        conn->curl_handle = curl_handle;
+        conn->multi = multi;
+        conn->hash_ctx = hash_ctx;
+        conn->write_buf = write_buf;
+        conn->write_buf_size = write_buf_size;
+        conn->show_progress = false;
+        conn->next = http_pool;
+        http_pool = conn;
+        http_pool_len++;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&http_pool_mutex);
+
+    if (conn != NULL)
+        http_free(conn);
+}
+
+/*
+ * limit the duration of the following transfers with this handle, zero
+ * means no limit. The limit is cleared when the handle goes back to the pool.
+ */
+void http_set_timeout(mfhttp * conn, double seconds)
+{
+    conn->timeout = seconds;
 }
 
 static int
@@ -123,16 +642,165 @@ http_progress_cb(void *user_ptr, double dltotal, double dlnow,
     conn->dl_len = dltotal;
     conn->dl_now = dlnow;
 
+    // also stops a segment that is waiting for data
+    if (conn->segments != NULL && http_segments_cancelled(conn->segments))
+        return 1;
+
     return 0;
 }
 
-int
-http_get_buf(mfhttp * conn, const char *url,
-             int (*data_handler) (mfhttp * conn, void *data), void *data)
+/*
+ * Every transfer is split into a function that sets up the curl handle and
+ * one that evaluates the result. The blocking functions call both around
+ * curl_easy_perform (or around http_perform_streaming for responses that go
+ * into the buffer) while the *_async functions hand the prepared handle to
+ * the transfer engine further below which calls the second half once the
+ * transfer is done.
+ */
+
+/*
+ * an overloaded or failing server often answers with an error page instead
+ * of JSON. If the data_handler could not make sense of such a response, report
+ * it as CURLE_HTTP_RETURNED_ERROR so that callers can tell it apart from a
+ * malformed answer and retry.
+ */
+static int http_check_status(mfhttp * conn, int retval)
+{
+    long            code = 0;
+
+    if (retval != -1)
+        return retval;
+    curl_easy_getinfo(conn->curl_handle, CURLINFO_RESPONSE_CODE, &code);
+    if (code >= 500 || code == 429) {
+        fprintf(stderr, "server answered with HTTP status %ld\n", code);
+        return CURLE_HTTP_RETURNED_ERROR;
+    }
+    return retval;
+}
+
+// evaluate the result of a transfer into the write buffer
+static int http_complete_buf(mfhttp * conn, int retval)
+{
+    http_end(conn);
+    http_log_timing(conn);
+    if (retval != CURLE_OK) {
+        fprintf(stderr, "error curl_easy_perform \"%s\" \"%s\"\n\r",
+                curl_easy_strerror(retval), conn->error_buf);
+        return retval;
+    }
+    if (conn->data_handler != NULL)
+        retval = conn->data_handler(conn, conn->data);
+    return http_check_status(conn, retval);
+}
+
+/*
+ * let the transfer make progress until more data is in the buffer or until
+ * it is done
+ */
+static void http_stream_pump(mfhttp * conn)
+{
+    CURLMsg        *msg;
+    int             running;
+    int             msgs_left;
+
+    if (curl_multi_perform(conn->multi, &running) != CURLM_OK) {
+        conn->stream_done = true;
+        conn->stream_result = CURLE_FAILED_INIT;
+        return;
+    }
+
+    while ((msg = curl_multi_info_read(conn->multi, &msgs_left)) != NULL) {
+        if (msg->msg == CURLMSG_DONE) {
+            conn->stream_done = true;
+            conn->stream_result = msg->data.result;
+        }
+    }
+
+    if (!conn->stream_done && conn->write_buf_len == conn->write_buf_pos)
+        curl_multi_poll(conn->multi, NULL, 0, 1000, NULL);
+}
+
+// hand the received data to json_load_callback as it comes in
+static size_t http_json_load_cb(void *buffer, size_t buflen, void *user_ptr)
+{
+    mfhttp         *conn;
+    size_t          len;
+
+    conn = (mfhttp *) user_ptr;
+
+    while (conn->write_buf_pos == conn->write_buf_len) {
+        if (conn->stream_done)
+            return 0;
+        // everything was consumed, so the buffer can be filled from the start
+        conn->write_buf_pos = 0;
+        conn->write_buf_len = 0;
+        http_stream_pump(conn);
+    }
+
+    len = conn->write_buf_len - conn->write_buf_pos;
+    if (len > buflen)
+        len = buflen;
+    memcpy(buffer, conn->write_buf + conn->write_buf_pos, len);
+    conn->write_buf_pos += len;
+
+    return len;
+}
+
+/*
+ * run a prepared transfer into the write buffer and call the data_handler
+ * right away instead of after the transfer, so that http_parse_buf_json can
+ * decode the response while it is received
+ */
+static int http_perform_streaming(mfhttp * conn)
 {
     int             retval;
 
+    if (conn->multi == NULL)
+        conn->multi = curl_multi_init();
+    if (conn->multi == NULL) {
+        retval = curl_easy_perform(conn->curl_handle);
+        return http_complete_buf(conn, retval);
+    }
+
+    curl_multi_add_handle(conn->multi, conn->curl_handle);
+    conn->streaming = true;
+    conn->stream_done = false;
+    conn->stream_result = CURLE_OK;
+    conn->write_buf_pos = 0;
+
+    retval = 0;
+    if (conn->data_handler != NULL)
+        retval = conn->data_handler(conn, conn->data);
+
+    // receive whatever the data_handler did not consume
+    while (!conn->stream_done) {
+        conn->write_buf_pos = 0;
+        conn->write_buf_len = 0;
+        http_stream_pump(conn);
+    }
+
+    curl_multi_remove_handle(conn->multi, conn->curl_handle);
+    conn->streaming = false;
+    http_end(conn);
+
+    http_log_timing(conn);
+    if (conn->stream_result != CURLE_OK) {
+        fprintf(stderr, "error curl_easy_perform \"%s\" \"%s\"\n\r",
+                curl_easy_strerror(conn->stream_result), conn->error_buf);
+        return conn->stream_result;
+    }
+
+    return http_check_status(conn, retval);
+}
+
+static void http_prepare_get_buf(mfhttp * conn, const char *url,
+                                 int (*data_handler) (mfhttp * conn,
+                                                      void *data), void *data)
+{
     http_curl_reset(conn);
+    http_begin(conn, HTTP_OP_GET_BUF);
+    conn->data_handler = data_handler;
+    conn->data = data;
     conn->write_buf_len = 0;
     curl_easy_setopt(conn->curl_handle, CURLOPT_URL, url);
     curl_easy_setopt(conn->curl_handle, CURLOPT_READFUNCTION,
@@ -142,14 +810,14 @@ http_get_buf(mfhttp * conn, const char *url,
                      http_write_buf_cb);
     curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEDATA, (void *)conn);
     fprintf(stderr, "GET: %s\n", url);
-    retval = curl_easy_perform(conn->curl_handle);
-    if (retval != CURLE_OK) {
-        fprintf(stderr, "error curl_easy_perform %s\n\r", conn->error_buf);
-        return retval;
-    }
-    if (data_handler != NULL)
-        retval = data_handler(conn, data);
-    return retval;
+}
+
+int
+http_get_buf(mfhttp * conn, const char *url,
+             int (*data_handler) (mfhttp * conn, void *data), void *data)
+{
+    http_prepare_get_buf(conn, url, data_handler, data);
+    return http_perform_streaming(conn);
 }
 
 static          size_t
@@ -176,6 +844,8 @@ http_write_buf_cb(char *data, size_t size, size_t nmemb, void *user_ptr)
 {
     mfhttp         *conn;
     size_t          data_len;
+    size_t          new_size;
+    char           *new_buf;
 
     if (user_ptr == NULL)
         return 0;
@@ -184,23 +854,41 @@ http_write_buf_cb(char *data, size_t size, size_t nmemb, void *user_ptr)
     data_len = size * nmemb;
 
     if (data_len > 0) {
-        fwrite(data, size, nmemb, stderr);
-        conn->write_buf = (char *)realloc(conn->write_buf,
-                                          conn->write_buf_len + data_len);
+        if (http_debug >= HTTP_DEBUG_BODY)
+            fwrite(data, size, nmemb, stderr);
+        if (conn->write_buf_len + data_len > conn->write_buf_size) {
+            new_size = conn->write_buf_size;
+            if (new_size < HTTP_WRITE_BUF_MIN)
+                new_size = HTTP_WRITE_BUF_MIN;
+            while (new_size < conn->write_buf_len + data_len)
+                new_size *= 2;
+            new_buf = (char *)realloc(conn->write_buf, new_size);
+            if (new_buf == NULL) {
+                fprintf(stderr, "realloc failed\n");
+                return 0;
+            }
+            conn->write_buf = new_buf;
+            conn->write_buf_size = new_size;
+        }
         memcpy(conn->write_buf + conn->write_buf_len, data, data_len);
         conn->write_buf_len += data_len;
     }
 
+    http_throttle(conn, data_len);
+
     return data_len;
 }
 
-int
-http_post_buf(mfhttp * conn, const char *url, const char *post_args,
-              int (*data_handler) (mfhttp * conn, void *data), void *data)
+static void http_prepare_post_buf(mfhttp * conn, const char *url,
+                                  const char *post_args,
+                                  int (*data_handler) (mfhttp * conn,
+                                                       void *data),
+                                  void *data)
 {
-    int             retval;
-
     http_curl_reset(conn);
+    http_begin(conn, HTTP_OP_POST_BUF);
+    conn->data_handler = data_handler;
+    conn->data = data;
     conn->write_buf_len = 0;
     curl_easy_setopt(conn->curl_handle, CURLOPT_URL, url);
     curl_easy_setopt(conn->curl_handle, CURLOPT_READFUNCTION,
@@ -209,103 +897,651 @@ http_post_buf(mfhttp * conn, const char *url, const char *post_args,
     curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEFUNCTION,
                      http_write_buf_cb);
     curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEDATA, (void *)conn);
-    curl_easy_setopt(conn->curl_handle, CURLOPT_POSTFIELDS, post_args);
+    // copied so that the caller may free post_args before an asynchronous
+    // transfer is done
+    curl_easy_setopt(conn->curl_handle, CURLOPT_COPYPOSTFIELDS, post_args);
     fprintf(stderr, "POST: %s\n", url);
-    retval = curl_easy_perform(conn->curl_handle);
-    if (retval != CURLE_OK) {
-        fprintf(stderr, "error curl_easy_perform \"%s\" \"%s\"\n\r",
-                curl_easy_strerror(retval), conn->error_buf);
-        return retval;
-    }
-    if (data_handler != NULL)
-        retval = data_handler(conn, data);
-    return retval;
 }
 
-int http_get_file(mfhttp * conn, const char *url, const char *path)
+int
+http_post_buf(mfhttp * conn, const char *url, const char *post_args,
+              int (*data_handler) (mfhttp * conn, void *data), void *data)
 {
-    int             retval;
-
-    http_curl_reset(conn);
-    curl_easy_setopt(conn->curl_handle, CURLOPT_URL, url);
-    curl_easy_setopt(conn->curl_handle, CURLOPT_READFUNCTION,
-                     http_read_buf_cb);
-    curl_easy_setopt(conn->curl_handle, CURLOPT_READDATA, (void *)conn);
-    curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEFUNCTION,
-                     http_write_file_cb);
-    curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEDATA, (void *)conn);
-    // FIXME: handle fopen() return value
-    conn->stream = fopen(path, "w+");
-    fprintf(stderr, "GET: %s\n", url);
-    retval = curl_easy_perform(conn->curl_handle);
-    fclose(conn->stream);
-    if (retval != CURLE_OK) {
-        fprintf(stderr, "error curl_easy_perform %s\n\r", conn->error_buf);
-        return retval;
-    }
-    return retval;
+    http_prepare_post_buf(conn, url, post_args, data_handler, data);
+    return http_perform_streaming(conn);
 }
 
-static          size_t
-http_write_file_cb(char *data, size_t size, size_t nmemb, void *user_ptr)
+/*
+ * start writing a download to fd at offset
+ *
+ * if the buffer cannot be allocated, the data is written as it comes
+ */
+static void http_file_open(mfhttp * conn, int fd, uint64_t offset)
 {
-    mfhttp         *conn;
-    size_t          ret;
-
-    if (user_ptr == NULL)
-        return 0;
-    conn = (mfhttp *) user_ptr;
+    void           *buf;
 
-    ret = fwrite(data, size, nmemb, conn->stream);
+    if (posix_memalign(&buf, HTTP_FILE_BUF_ALIGN, HTTP_FILE_BUF_SIZE) != 0)
+        buf = NULL;
+    conn->file_buf = (char *)buf;
+    conn->file_buf_len = 0;
+    conn->file_fd = fd;
+    conn->file_offset = offset;
+}
 
-    fprintf(stderr, "\r   %.0f / %.0f", conn->dl_now, conn->dl_len);
+/*
+ * The segments of http_get_file_segmented arrive out of order, so they
+ * cannot be hashed in the write callback like a download in one piece.
+ * Instead, a thread follows the segments through the part file and hashes
+ * every piece as soon as a segment wrote it, while it is still in the page
+ * cache. It only ever waits for the segment at its position, so when the
+ * last segment arrives, little is left to hash.
+ */
+struct http_hasher {
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    EVP_MD_CTX     *ctx;
+    struct checksum_ctx checksum_ctx;
+    int             fd;
+    uint64_t        size;
+    // end of every segment
+    const uint64_t *end;
+    int             num_segments;
+    // end of the data written by every segment so far
+    uint64_t       *written;
+    // everything before this offset went into ctx
+    uint64_t        hashed;
+    bool            stop;
+    bool            failed;
+};
+
+static void    *http_hasher_run(void *user_ptr)
+{
+    struct http_hasher *hasher;
+    uint64_t        offset;
+    uint64_t        len;
+    int             i;
+    int             retval;
+
+    hasher = (struct http_hasher *)user_ptr;
+
+    i = 0;
+    pthread_mutex_lock(&hasher->mutex);
+    while (hasher->hashed < hasher->size && !hasher->failed) {
+        while (hasher->hashed >= hasher->end[i])
+            i++;
+        if (hasher->written[i] <= hasher->hashed) {
+            if (hasher->stop)
+                break;
+            pthread_cond_wait(&hasher->cond, &hasher->mutex);
+            continue;
+        }
+        offset = hasher->hashed;
+        len = hasher->written[i] - offset;
+        pthread_mutex_unlock(&hasher->mutex);
+
+        retval = hash_update_fd(hasher->ctx, &hasher->checksum_ctx,
+                                hasher->fd, offset, len);
+
+        pthread_mutex_lock(&hasher->mutex);
+        if (retval != 0)
+            hasher->failed = true;
+        else
+            hasher->hashed += len;
+    }
+    pthread_mutex_unlock(&hasher->mutex);
+
+    return NULL;
+}
+
+/*
+ * start hashing the num_segments segments of a part file of the given size
+ * whose data up to done[i] is there already, segment i ends at end[i]
+ */
+static int http_hasher_start(struct http_hasher *hasher, int fd,
+                             uint64_t size, const uint64_t *done,
+                             const uint64_t *end, int num_segments)
+{
+    int             i;
+
+    hasher->ctx = EVP_MD_CTX_new();
+    if (hasher->ctx == NULL || hash_init(hasher->ctx) != 0) {
+        EVP_MD_CTX_free(hasher->ctx);
+        return -1;
+    }
+    hasher->written = (uint64_t *) calloc(num_segments, sizeof(uint64_t));
+    if (hasher->written == NULL) {
+        EVP_MD_CTX_free(hasher->ctx);
+        return -1;
+    }
+    for (i = 0; i < num_segments; i++)
+        hasher->written[i] = done[i];
+
+    checksum_init(&hasher->checksum_ctx);
+    hasher->fd = fd;
+    hasher->size = size;
+    hasher->end = end;
+    hasher->num_segments = num_segments;
+    hasher->hashed = 0;
+    hasher->stop = false;
+    hasher->failed = false;
+    pthread_mutex_init(&hasher->mutex, NULL);
+    pthread_cond_init(&hasher->cond, NULL);
+
+    if (pthread_create(&hasher->thread, NULL, http_hasher_run, hasher) != 0) {
+        pthread_mutex_destroy(&hasher->mutex);
+        pthread_cond_destroy(&hasher->cond);
+        EVP_MD_CTX_free(hasher->ctx);
+        free(hasher->written);
+        return -1;
+    }
+
+    return 0;
+}
+
+// called by a segment whenever it wrote data up to offset
+static void http_hasher_written(struct http_hasher *hasher, int segment,
+                                uint64_t offset)
+{
+    pthread_mutex_lock(&hasher->mutex);
+    hasher->written[segment] = offset;
+    pthread_cond_signal(&hasher->cond);
+    pthread_mutex_unlock(&hasher->mutex);
+}
+
+/*
+ * wait for the hasher to catch up with the segments and store the hash in
+ * conn if all of the file went through it
+ */
+static void http_hasher_finish(struct http_hasher *hasher, mfhttp * conn,
+                               bool complete)
+{
+    pthread_mutex_lock(&hasher->mutex);
+    hasher->stop = true;
+    if (!complete)
+        hasher->failed = true;
+    pthread_cond_signal(&hasher->cond);
+    pthread_mutex_unlock(&hasher->mutex);
+
+    pthread_join(hasher->thread, NULL);
+
+    if (!hasher->failed && hasher->hashed == hasher->size
+        && EVP_DigestFinal_ex(hasher->ctx, conn->hash, NULL) == 1) {
+        conn->checksum = checksum_final(&hasher->checksum_ctx);
+        conn->hash_len = hasher->size;
+        conn->hash_valid = true;
+    }
+
+    pthread_mutex_destroy(&hasher->mutex);
+    pthread_cond_destroy(&hasher->cond);
+    EVP_MD_CTX_free(hasher->ctx);
+    free(hasher->written);
+}
+
+static int http_file_pwrite(mfhttp * conn, const char *data, size_t len)
+{
+    size_t          done;
+    ssize_t         ret;
+
+    for (done = 0; done < len; done += ret) {
+        ret = pwrite(conn->file_fd, data + done, len - done,
+                     conn->file_offset + done);
+        if (ret < 0 && errno == EINTR) {
+            ret = 0;
+        } else if (ret < 0) {
+            fprintf(stderr, "cannot write download: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    conn->file_offset += len;
+
+    if (conn->hasher != NULL)
+        http_hasher_written(conn->hasher, conn->segment_index,
+                            conn->file_offset);
+
+    return 0;
+}
+
+// write out the download buffer
+static int http_file_flush(mfhttp * conn)
+{
+    int             retval;
+
+    retval = http_file_pwrite(conn, conn->file_buf, conn->file_buf_len);
+    conn->file_buf_len = 0;
+
+    return retval;
+}
+
+static int http_file_write(mfhttp * conn, const char *data, size_t len)
+{
+    size_t          n;
+
+    if (conn->file_buf == NULL)
+        return http_file_pwrite(conn, data, len);
+
+    while (len > 0) {
+        n = HTTP_FILE_BUF_SIZE - conn->file_buf_len;
+        if (n > len)
+            n = len;
+        memcpy(conn->file_buf + conn->file_buf_len, data, n);
+        conn->file_buf_len += n;
+        data += n;
+        len -= n;
+        if (conn->file_buf_len == HTTP_FILE_BUF_SIZE
+            && http_file_flush(conn) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+// discard the download buffer, the caller closes the file
+static void http_file_close(mfhttp * conn)
+{
+    free(conn->file_buf);
+    conn->file_buf = NULL;
+    conn->file_buf_len = 0;
+    conn->file_fd = -1;
+}
+
+/*
+ * reserve the space of the remainder of a download of the given size, so
+ * that it does not fragment the file and running out of space is noticed
+ * right away
+ */
+static int http_file_reserve(mfhttp * conn, uint64_t size)
+{
+    int             retval;
+
+    if (size <= conn->file_offset)
+        return 0;
+
+    retval = posix_fallocate(conn->file_fd, conn->file_offset,
+                             size - conn->file_offset);
+    if (retval == EINVAL || retval == EOPNOTSUPP)
+        return 0;
+    if (retval != 0) {
+        fprintf(stderr, "cannot allocate %" PRIu64 " bytes: %s\n", size,
+                strerror(retval));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * the progress record of a download next to <path>.part holds the number of
+ * bytes of the part file that are known to be on disk and the size of the
+ * complete file or -1 if it is not known
+ */
+static int http_read_progress(const char *progress_path, uint64_t * offset,
+                              int64_t * size)
+{
+    FILE           *fh;
+    int             retval;
+
+    fh = fopen(progress_path, "r");
+    if (fh == NULL)
+        return -1;
+
+    retval = fscanf(fh, "%" SCNu64 " %" SCNd64, offset, size);
+    fclose(fh);
+
+    if (retval != 2)
+        return -1;
+
+    return 0;
+}
+
+static int http_write_progress(const char *progress_path, uint64_t offset,
+                               int64_t size)
+{
+    FILE           *fh;
+    int             retval;
+
+    fh = fopen(progress_path, "w");
+    if (fh == NULL) {
+        fprintf(stderr, "cannot open %s\n", progress_path);
+        return -1;
+    }
+
+    retval = fprintf(fh, "%" PRIu64 " %" PRId64 "\n", offset, size);
+    if (retval > 0)
+        retval = fflush(fh);
+    if (retval == 0)
+        retval = fsync(fileno(fh));
+    fclose(fh);
+
+    if (retval != 0) {
+        fprintf(stderr, "cannot write %s\n", progress_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// flush everything written so far to disk and record it as durable
+static int http_sync_download(mfhttp * conn)
+{
+    if (http_file_flush(conn) != 0 || fsync(conn->file_fd) != 0)
+        return -1;
+
+    conn->durable_offset = conn->file_offset;
+    conn->unsynced_bytes = 0;
+
+    return http_write_progress(conn->progress_path, conn->durable_offset,
+                               conn->expected_size);
+}
+
+// set up the curl handle for one attempt at downloading the part file
+static void http_start_get_file(mfhttp * conn)
+{
+    http_curl_reset(conn);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_URL, conn->url);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_READFUNCTION,
+                     http_read_buf_cb);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_READDATA, (void *)conn);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEFUNCTION,
+                     http_write_file_cb);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEDATA, (void *)conn);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_RESUME_FROM_LARGE,
+                     (curl_off_t) conn->resume_offset);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_BUFFERSIZE,
+                     (long)HTTP_RECV_BUF_SIZE);
+
+    conn->durable_offset = conn->resume_offset;
+    conn->unsynced_bytes = 0;
+    conn->started = false;
+    conn->range_mismatch = false;
+
+    if (conn->resume_offset > 0)
+        fprintf(stderr, "GET: %s (resuming at %" PRIu64 ")\n", conn->url,
+                conn->resume_offset);
+    else
+        fprintf(stderr, "GET: %s\n", conn->url);
+}
+
+/*
+ * download url to path
+ *
+ * The data is written to <path>.part which is renamed to path once the
+ * download is complete. If the download is interrupted, the part file and
+ * its progress record in <path>.part.progress are kept, so that the next call
+ * for the same path only requests the remainder with a Range request. The
+ * download starts from scratch if the server does not honour the range or if
+ * the size of the remote file changed.
+ */
+static int http_prepare_get_file(mfhttp * conn, const char *url,
+                                 const char *path)
+{
+    uint64_t        offset;
+    int64_t         size;
+    int             fd;
+    struct stat     st;
+
+    conn->part_path = strdup_printf("%s.part", path);
+    conn->progress_path = strdup_printf("%s.part.progress", path);
+
+    fd = -1;
+    if (http_read_progress(conn->progress_path, &offset, &size) == 0
+        && offset > 0) {
+        fd = open(conn->part_path, O_RDWR);
+        // the part file must hold at least the durable part
+        if (fd >= 0 && (fstat(fd, &st) != 0 || st.st_size < (off_t) offset
+                        || ftruncate(fd, offset) != 0)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+        offset = 0;
+        size = -1;
+        fd = open(conn->part_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s\n", conn->part_path);
+        free(conn->part_path);
+        free(conn->progress_path);
+        conn->part_path = NULL;
+        conn->progress_path = NULL;
+        return -1;
+    }
+
+    // the part received before is read back once to bring the hash up to
+    // where the download continues
+    checksum_init(&conn->checksum_ctx);
+    conn->hash_len = offset;
+    conn->hashing = hash_init(conn->hash_ctx) == 0
+        && hash_update_fd(conn->hash_ctx, &conn->checksum_ctx, fd, 0,
+                          offset) == 0;
+
+    http_begin(conn, HTTP_OP_GET_FILE);
+    http_file_open(conn, fd, offset);
+    conn->url = strdup(url);
+    conn->path = strdup(path);
+    conn->resume_offset = offset;
+    conn->expected_size = size;
+
+    http_start_get_file(conn);
+
+    return 0;
+}
+
+/*
+ * if the part file could not be continued, start over from scratch and
+ * return true, so that the caller performs the transfer again
+ */
+static bool http_restart_get_file(mfhttp * conn, int *retval)
+{
+    if (conn->resume_offset == 0
+        || (!conn->range_mismatch && *retval != CURLE_RANGE_ERROR))
+        return false;
+
+    http_log_timing(conn);
+    fprintf(stderr, "cannot resume download - restarting\n");
+    conn->resume_offset = 0;
+    conn->expected_size = -1;
+    conn->file_offset = 0;
+    conn->file_buf_len = 0;
+    checksum_init(&conn->checksum_ctx);
+    conn->hash_len = 0;
+    conn->hashing = hash_init(conn->hash_ctx) == 0;
+    if (ftruncate(conn->file_fd, 0) != 0) {
+        *retval = -1;
+        return false;
+    }
+
+    http_start_get_file(conn);
+
+    return true;
+}
+
+static int http_complete_get_file(mfhttp * conn, int retval)
+{
+    http_end(conn);
+    http_log_timing(conn);
+
+    if (retval != CURLE_OK) {
+        fprintf(stderr, "error curl_easy_perform %s\n\r", conn->error_buf);
+        // keep what was received so far for the next attempt
+        if (conn->started)
+            http_sync_download(conn);
+    } else if (http_file_flush(conn) != 0) {
+        retval = -1;
+    } else if (conn->hashing
+               && EVP_DigestFinal_ex(conn->hash_ctx, conn->hash, NULL) == 1) {
+        conn->checksum = checksum_final(&conn->checksum_ctx);
+        conn->hash_valid = true;
+    }
+    conn->hashing = false;
+
+    close(conn->file_fd);
+    http_file_close(conn);
+
+    if (retval == CURLE_OK) {
+        retval = rename(conn->part_path, conn->path);
+        if (retval != 0) {
+            fprintf(stderr, "cannot rename %s to %s\n", conn->part_path,
+                    conn->path);
+        }
+        unlink(conn->progress_path);
+    }
+
+    free(conn->part_path);
+    free(conn->progress_path);
+    free(conn->path);
+    free(conn->url);
+    conn->part_path = NULL;
+    conn->progress_path = NULL;
+    conn->path = NULL;
+    conn->url = NULL;
+
+    return retval;
+}
+
+int http_get_file(mfhttp * conn, const char *url, const char *path)
+{
+    int             retval;
+
+    if (http_prepare_get_file(conn, url, path) != 0)
+        return -1;
+
+    do {
+        retval = curl_easy_perform(conn->curl_handle);
+    } while (http_restart_get_file(conn, &retval));
 
-    return size * ret;
+    return http_complete_get_file(conn, retval);
 }
 
 static          size_t
-http_read_file_cb(char *data, size_t size, size_t nmemb, void *user_ptr)
+http_write_file_cb(char *data, size_t size, size_t nmemb, void *user_ptr)
 {
     mfhttp         *conn;
     size_t          ret;
+    long            response_code;
+    double          content_length;
+
+    if (user_ptr == NULL)
+        return 0;
+    conn = (mfhttp *) user_ptr;
+
+    if (!conn->started) {
+        conn->started = true;
+        curl_easy_getinfo(conn->curl_handle, CURLINFO_RESPONSE_CODE,
+                          &response_code);
+        curl_easy_getinfo(conn->curl_handle,
+                          CURLINFO_CONTENT_LENGTH_DOWNLOAD, &content_length);
+        if (conn->resume_offset > 0) {
+            // a resumed download must continue the same remote file
+            if (response_code != 206 || conn->expected_size < 0
+                || content_length < 0
+                || conn->resume_offset + (uint64_t) content_length
+                != (uint64_t) conn->expected_size) {
+                conn->range_mismatch = true;
+                return 0;
+            }
+        } else if (content_length >= 0) {
+            conn->expected_size = (int64_t) content_length;
+        }
+        if (conn->expected_size >= 0
+            && http_file_reserve(conn, conn->expected_size) != 0)
+            return 0;
+    }
+
+    ret = size * nmemb;
+    if (http_file_write(conn, data, ret) != 0)
+        return 0;
+
+    if (conn->hashing) {
+        EVP_DigestUpdate(conn->hash_ctx, data, ret);
+        checksum_update(&conn->checksum_ctx, data, ret);
+        conn->hash_len += ret;
+    }
+
+    conn->unsynced_bytes += ret;
+    if (conn->unsynced_bytes >= HTTP_DOWNLOAD_SYNC_INTERVAL) {
+        if (http_sync_download(conn) != 0)
+            fprintf(stderr, "cannot record download progress\n");
+        fprintf(stderr, "\r   %.0f / %.0f", conn->dl_now, conn->dl_len);
+    }
+
+    http_throttle(conn, ret);
+
+    return ret;
+}
+
+static          size_t
+http_read_file_cb(char *data, size_t size, size_t nmemb, void *user_ptr)
+{
+    mfhttp         *conn;
+    ssize_t         ret;
+    size_t          len;
 
     if (user_ptr == NULL)
         return 0;
     conn = (mfhttp *) user_ptr;
 
-    ret = fread(data, size, nmemb, conn->stream);
+    len = size * nmemb;
+    if (len > conn->file_end - conn->file_offset)
+        len = conn->file_end - conn->file_offset;
+
+    do {
+        ret = pread(conn->file_fd, data, len, conn->file_offset);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        fprintf(stderr, "cannot read upload: %s\n", strerror(errno));
+        return CURL_READFUNC_ABORT;
+    }
+    conn->file_offset += ret;
 
     fprintf(stderr, "\r   %.0f / %.0f", conn->ul_now, conn->ul_len);
 
-    return size * ret;
+    http_throttle(conn, ret);
+
+    return ret;
 }
 
-int
-http_post_file(mfhttp * conn, const char *url, FILE * fh,
-               struct curl_slist **custom_headers, uint64_t filesize,
-               int (*data_handler) (mfhttp * conn, void *data), void *data)
+/*
+ * the list in custom_headers is taken over by the handle and freed once the
+ * transfer is done, which is why *custom_headers is NULL afterwards
+ *
+ * filesize bytes are read with pread from fd starting at offset, so that
+ * large pieces go straight into the buffer of curl and several transfers
+ * can read from the same file at once
+ */
+static void http_prepare_post_file(mfhttp * conn, const char *url, int fd,
+                                   uint64_t offset,
+                                   struct curl_slist **custom_headers,
+                                   uint64_t filesize,
+                                   int (*data_handler) (mfhttp * conn,
+                                                        void *data),
+                                   void *data)
 {
-    int             retval;
-    struct curl_slist *fallback_headers;
+    struct curl_slist *headers;
 
     http_curl_reset(conn);
+    http_begin(conn, HTTP_OP_POST_FILE);
+    conn->data_handler = data_handler;
+    conn->data = data;
     conn->write_buf_len = 0;
 
-    if (custom_headers == NULL) {
-        custom_headers = &fallback_headers;
+    headers = NULL;
+    if (custom_headers != NULL) {
+        headers = *custom_headers;
         *custom_headers = NULL;
     }
     // when using POST, curl implicitly sets
     // Content-Type: application/x-www-form-urlencoded
     // make sure it is set to application/octet-stream instead
-    *custom_headers =
-        curl_slist_append(*custom_headers,
-                          "Content-Type: application/octet-stream");
+    headers = curl_slist_append(headers,
+                                "Content-Type: application/octet-stream");
     // when using POST, curl implicitly sets Expect: 100-continue
     // make sure it is not set
-    *custom_headers = curl_slist_append(*custom_headers, "Expect:");
+    headers = curl_slist_append(headers, "Expect:");
+    conn->headers = headers;
     curl_easy_setopt(conn->curl_handle, CURLOPT_POST, 1);
-    curl_easy_setopt(conn->curl_handle, CURLOPT_HTTPHEADER, *custom_headers);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_HTTPHEADER, headers);
     curl_easy_setopt(conn->curl_handle, CURLOPT_URL, url);
     curl_easy_setopt(conn->curl_handle, CURLOPT_READFUNCTION,
                      http_read_file_cb);
@@ -313,20 +1549,1024 @@ http_post_file(mfhttp * conn, const char *url, FILE * fh,
     curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEFUNCTION,
                      http_write_buf_cb);
     curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEDATA, (void *)conn);
-    curl_easy_setopt(conn->curl_handle, CURLOPT_POSTFIELDSIZE, filesize);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_POSTFIELDSIZE_LARGE,
+                     (curl_off_t) filesize);
+#if LIBCURL_VERSION_NUM >= 0x073e00
+    curl_easy_setopt(conn->curl_handle, CURLOPT_UPLOAD_BUFFERSIZE,
+                     (long)HTTP_SEND_BUF_SIZE);
+#endif
 
-    conn->stream = fh;
+    conn->file_fd = fd;
+    conn->file_offset = offset;
+    conn->file_end = offset + filesize;
+    posix_fadvise(fd, offset, filesize, POSIX_FADV_SEQUENTIAL);
     fprintf(stderr, "POST: %s\n", url);
+}
+
+static uint64_t http_stream_offset(FILE * fh)
+{
+    off_t           offset;
+
+    offset = ftello(fh);
+
+    return offset > 0 ? offset : 0;
+}
+
+static int http_complete_post_file(mfhttp * conn, int retval)
+{
+    curl_slist_free_all(conn->headers);
+    conn->headers = NULL;
+    conn->file_fd = -1;
+    return http_complete_buf(conn, retval);
+}
+
+int
+http_post_file(mfhttp * conn, const char *url, FILE * fh,
+               struct curl_slist **custom_headers, uint64_t filesize,
+               int (*data_handler) (mfhttp * conn, void *data), void *data)
+{
+    int             retval;
+
+    // continue from where the caller left the stream
+    http_prepare_post_file(conn, url, fileno(fh), http_stream_offset(fh),
+                           custom_headers, filesize, data_handler, data);
     retval = curl_easy_perform(conn->curl_handle);
-    curl_slist_free_all(*custom_headers);
-    *custom_headers = NULL;
-    if (retval != CURLE_OK) {
-        fprintf(stderr, "error curl_easy_perform %s\n\r", conn->error_buf);
-        return retval;
+    return http_complete_post_file(conn, retval);
+}
+
+// upload size bytes of fd starting at offset
+int
+http_post_file_range(mfhttp * conn, const char *url, int fd, uint64_t offset,
+                     uint64_t size, struct curl_slist **custom_headers,
+                     int (*data_handler) (mfhttp * conn, void *data),
+                     void *data)
+{
+    int             retval;
+
+    http_prepare_post_file(conn, url, fd, offset, custom_headers, size,
+                           data_handler, data);
+    retval = curl_easy_perform(conn->curl_handle);
+    return http_complete_post_file(conn, retval);
+}
+
+/*
+ * The transfer engine drives all asynchronous transfers from a single thread
+ * using the curl multi interface. Transfers are queued by the *_async
+ * functions and at most HTTP_ENGINE_MAX_TRANSFERS of them run at the same
+ * time, the others wait in the queue until a slot becomes free. There is
+ * one queue per class and free slots go to the queue of the class with the
+ * highest priority first. Background classes never get the last
+ * HTTP_ENGINE_INTERACTIVE_SLOTS slots, so that an interactive transfer can
+ * always start right away.
+ *
+ * Once a transfer is done, its result is evaluated exactly like for the
+ * blocking functions. Then, if a callback was given, it is called with the
+ * handle and the result. The callback runs in the engine thread, so it must
+ * not block and it must not submit further transfers and wait for them.
+ * It may destroy the handle. If no callback was given, http_wait() blocks
+ * until the transfer is done and returns its result.
+ *
+ * The data_handler of a transfer runs in the engine thread as well.
+ */
+
+#define HTTP_ENGINE_MAX_TRANSFERS 64
+#define HTTP_ENGINE_INTERACTIVE_SLOTS 16
+
+static pthread_once_t http_engine_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t http_engine_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t http_engine_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t http_engine_thread;
+static CURLM   *http_multi = NULL;
+static mfhttp  *http_engine_queue[HTTP_NUM_CLASSES];
+static mfhttp  *http_engine_queue_tail[HTTP_NUM_CLASSES];
+static size_t   http_engine_queued = 0;
+static size_t   http_engine_running = 0;
+static size_t   http_engine_running_background = 0;
+static bool     http_engine_stop = false;
+// transfers held back by http_throttle, only touched by the engine thread
+static mfhttp  *http_engine_held = NULL;
+
+static void http_engine_hold(mfhttp * conn, double delay)
+{
+    curl_easy_pause(conn->curl_handle, CURLPAUSE_ALL);
+    conn->resume_at = http_now() + delay;
+    if (!conn->held) {
+        conn->held = true;
+        conn->held_next = http_engine_held;
+        http_engine_held = conn;
     }
-    if (data_handler != NULL)
-        retval = data_handler(conn, data);
-    return retval;
+}
+
+// let all held transfers whose time has come continue
+static void http_engine_release_held(void)
+{
+    mfhttp         *conn;
+    mfhttp         *list;
+    double          now;
+
+    now = http_now();
+    list = http_engine_held;
+    http_engine_held = NULL;
+    while (list != NULL) {
+        conn = list;
+        list = conn->held_next;
+        if (conn->resume_at <= now) {
+            conn->held = false;
+            // this may deliver pending data and hold the transfer again
+            curl_easy_pause(conn->curl_handle, CURLPAUSE_CONT);
+        } else {
+            conn->held_next = http_engine_held;
+            http_engine_held = conn;
+        }
+    }
+}
+
+/*
+ * forget a held transfer that ended while it was paused, e.g. because its
+ * deadline passed, before its handle is reused or freed
+ */
+static void http_engine_unhold(mfhttp * conn)
+{
+    mfhttp        **prev;
+
+    if (!conn->held)
+        return;
+
+    for (prev = &http_engine_held; *prev != NULL; prev = &(*prev)->held_next) {
+        if (*prev == conn) {
+            *prev = conn->held_next;
+            break;
+        }
+    }
+    conn->held = false;
+    conn->held_next = NULL;
+}
+
+// take the next transfer that may start from the queues or return NULL
+static mfhttp  *http_engine_dequeue(void)
+{
+    mfhttp         *conn;
+    int             cls;
+
+    if (http_engine_running >= HTTP_ENGINE_MAX_TRANSFERS)
+        return NULL;
+
+    for (cls = 0; cls < HTTP_NUM_CLASSES; cls++) {
+        if (http_engine_queue[cls] == NULL)
+            continue;
+        if (cls >= HTTP_CLASS_PREFETCH
+            && http_engine_running_background
+            >= HTTP_ENGINE_MAX_TRANSFERS - HTTP_ENGINE_INTERACTIVE_SLOTS)
+            return NULL;
+        conn = http_engine_queue[cls];
+        http_engine_queue[cls] = conn->next;
+        if (http_engine_queue[cls] == NULL)
+            http_engine_queue_tail[cls] = NULL;
+        conn->next = NULL;
+        http_engine_queued--;
+        return conn;
+    }
+
+    return NULL;
+}
+
+static void http_engine_complete(mfhttp * conn, int retval)
+{
+    http_engine_unhold(conn);
+
+    switch (conn->op) {
+        case HTTP_OP_GET_FILE:
+            if (http_restart_get_file(conn, &retval)) {
+                curl_multi_add_handle(http_multi, conn->curl_handle);
+                return;
+            }
+            retval = http_complete_get_file(conn, retval);
+            break;
+        case HTTP_OP_POST_FILE:
+            retval = http_complete_post_file(conn, retval);
+            break;
+        case HTTP_OP_GET_SEGMENT:
+            retval = http_complete_get_segment(conn, retval);
+            break;
+        default:
+            retval = http_complete_buf(conn, retval);
+            break;
+    }
+
+    conn->in_engine = false;
+
+    pthread_mutex_lock(&http_engine_mutex);
+    http_engine_running--;
+    if (conn->cls >= HTTP_CLASS_PREFETCH)
+        http_engine_running_background--;
+    pthread_mutex_unlock(&http_engine_mutex);
+
+    if (conn->done_cb != NULL) {
+        // the callback may free the handle, so do not touch it afterwards
+        conn->done_cb(conn, retval, conn->done_data);
+        return;
+    }
+
+    pthread_mutex_lock(&http_engine_mutex);
+    conn->retval = retval;
+    conn->done = true;
+    pthread_cond_broadcast(&http_engine_cond);
+    pthread_mutex_unlock(&http_engine_mutex);
+}
+
+static void    *http_engine_run(void *user_ptr)
+{
+    (void)user_ptr;
+    mfhttp         *conn;
+    CURLMsg        *msg;
+    CURL           *curl_handle;
+    int             still_running;
+    int             msgs_left;
+    int             retval;
+
+    pthread_mutex_lock(&http_engine_mutex);
+    while (!http_engine_stop || http_engine_queued > 0
+           || http_engine_running > 0) {
+        // start queued transfers as long as there is room
+        while ((conn = http_engine_dequeue()) != NULL) {
+            curl_multi_add_handle(http_multi, conn->curl_handle);
+            http_engine_running++;
+            if (conn->cls >= HTTP_CLASS_PREFETCH)
+                http_engine_running_background++;
+        }
+        pthread_mutex_unlock(&http_engine_mutex);
+
+        http_engine_release_held();
+
+        curl_multi_perform(http_multi, &still_running);
+
+        while ((msg = curl_multi_info_read(http_multi, &msgs_left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            // msg is invalid once the handle was removed
+            curl_handle = msg->easy_handle;
+            retval = msg->data.result;
+            curl_easy_getinfo(curl_handle, CURLINFO_PRIVATE, (char **)&conn);
+            curl_multi_remove_handle(http_multi, curl_handle);
+            http_engine_complete(conn, retval);
+        }
+
+        // wait for network activity or for http_engine_submit to wake us
+        // and come back soon if a held transfer has to be continued
+        curl_multi_poll(http_multi, NULL, 0,
+                        http_engine_held != NULL ? 10 : 1000, NULL);
+
+        pthread_mutex_lock(&http_engine_mutex);
+    }
+    pthread_mutex_unlock(&http_engine_mutex);
+
+    return NULL;
+}
+
+static void http_engine_init(void)
+{
+    pthread_once(&http_pool_once, http_pool_init);
+
+    http_multi = curl_multi_init();
+    if (http_multi == NULL) {
+        fprintf(stderr, "cannot create curl multi handle\n");
+        return;
+    }
+
+    if (pthread_create(&http_engine_thread, NULL, http_engine_run, NULL)
+        != 0) {
+        fprintf(stderr, "cannot start transfer engine\n");
+        curl_multi_cleanup(http_multi);
+        http_multi = NULL;
+    }
+}
+
+static bool http_engine_available(void)
+{
+    pthread_once(&http_engine_once, http_engine_init);
+
+    return http_multi != NULL;
+}
+
+static void http_engine_submit(mfhttp * conn,
+                               void (*done_cb) (mfhttp * conn, int retval,
+                                                void *user_ptr),
+                               void *user_ptr)
+{
+    conn->done_cb = done_cb;
+    conn->done_data = user_ptr;
+    conn->done = false;
+    conn->next = NULL;
+    conn->in_engine = true;
+
+    pthread_mutex_lock(&http_engine_mutex);
+    if (http_engine_queue_tail[conn->cls] == NULL)
+        http_engine_queue[conn->cls] = conn;
+    else
+        http_engine_queue_tail[conn->cls]->next = conn;
+    http_engine_queue_tail[conn->cls] = conn;
+    http_engine_queued++;
+    pthread_mutex_unlock(&http_engine_mutex);
+
+    curl_multi_wakeup(http_multi);
+}
+
+// wait for all transfers to finish and stop the engine
+static void http_engine_cleanup(void)
+{
+    if (http_multi == NULL)
+        return;
+
+    pthread_mutex_lock(&http_engine_mutex);
+    http_engine_stop = true;
+    pthread_mutex_unlock(&http_engine_mutex);
+    curl_multi_wakeup(http_multi);
+
+    pthread_join(http_engine_thread, NULL);
+
+    curl_multi_cleanup(http_multi);
+    http_multi = NULL;
+}
+
+int
+http_get_buf_async(mfhttp * conn, const char *url,
+                   int (*data_handler) (mfhttp * conn, void *data),
+                   void *data,
+                   void (*done_cb) (mfhttp * conn, int retval,
+                                    void *user_ptr), void *user_ptr)
+{
+    if (!http_engine_available())
+        return -1;
+
+    http_prepare_get_buf(conn, url, data_handler, data);
+    http_engine_submit(conn, done_cb, user_ptr);
+
+    return 0;
+}
+
+int
+http_post_buf_async(mfhttp * conn, const char *url, const char *post_args,
+                    int (*data_handler) (mfhttp * conn, void *data),
+                    void *data,
+                    void (*done_cb) (mfhttp * conn, int retval,
+                                     void *user_ptr), void *user_ptr)
+{
+    if (!http_engine_available())
+        return -1;
+
+    http_prepare_post_buf(conn, url, post_args, data_handler, data);
+    http_engine_submit(conn, done_cb, user_ptr);
+
+    return 0;
+}
+
+int
+http_get_file_async(mfhttp * conn, const char *url, const char *path,
+                    void (*done_cb) (mfhttp * conn, int retval,
+                                     void *user_ptr), void *user_ptr)
+{
+    if (!http_engine_available())
+        return -1;
+
+    if (http_prepare_get_file(conn, url, path) != 0)
+        return -1;
+    http_engine_submit(conn, done_cb, user_ptr);
+
+    return 0;
+}
+
+// fh must stay open until the transfer is done
+int
+http_post_file_async(mfhttp * conn, const char *url, FILE * fh,
+                     struct curl_slist **custom_headers, uint64_t filesize,
+                     int (*data_handler) (mfhttp * conn, void *data),
+                     void *data,
+                     void (*done_cb) (mfhttp * conn, int retval,
+                                      void *user_ptr), void *user_ptr)
+{
+    if (!http_engine_available())
+        return -1;
+
+    http_prepare_post_file(conn, url, fileno(fh), http_stream_offset(fh),
+                           custom_headers, filesize, data_handler, data);
+    http_engine_submit(conn, done_cb, user_ptr);
+
+    return 0;
+}
+
+// block until the transfer submitted without a callback is done
+int http_wait(mfhttp * conn)
+{
+    int             retval;
+
+    pthread_mutex_lock(&http_engine_mutex);
+    while (!conn->done)
+        pthread_cond_wait(&http_engine_cond, &http_engine_mutex);
+    retval = conn->retval;
+    pthread_mutex_unlock(&http_engine_mutex);
+
+    return retval;
+}
+
+/*
+ * Segmented downloads split a file into byte ranges which are fetched over
+ * several connections at once through the transfer engine. Every segment is
+ * written to its place in a preallocated part file, which is renamed once
+ * all segments arrived.
+ *
+ * The segments are made large enough for each stream to run for a few
+ * seconds at the per-stream speed observed so far. Fast streams therefore
+ * get fewer, larger segments and the connection setup stays a small
+ * fraction of the transfer. Files that would only make a single segment go
+ * through the resumable http_get_file instead.
+ *
+ * Like http_get_file, a segmented download keeps its part file when it
+ * fails. Every segment regularly syncs what it wrote and records it in the
+ * progress record, whose first line is the same as that of http_get_file
+ * with the part of the file that is complete from the start. A second line
+ * holds the end and the durable end of every segment, so that the next
+ * attempt only requests what is missing. If one segment fails, the others
+ * are stopped right away.
+ */
+
+// smallest segment worth an extra connection
+#define HTTP_SEGMENT_MIN (8 * 1024 * 1024)
+// every stream should be busy for at least this many seconds
+#define HTTP_SEGMENT_SECONDS 4
+#define HTTP_SEGMENT_MAX_COUNT 8
+
+/* the segments of a download and how much of each is on disk */
+struct http_segments {
+    pthread_mutex_t mutex;
+    char           *progress_path;
+    uint64_t        size;
+    int             num_segments;
+    // segment i covers the bytes from end[i - 1] (zero for the first one) to
+    // end[i] of which those before done[i] were synced
+    uint64_t       *done;
+    uint64_t       *end;
+    // set when a segment failed, which stops the others
+    bool            cancel;
+};
+
+static bool http_segments_cancelled(struct http_segments *segments)
+{
+    bool            cancel;
+
+    pthread_mutex_lock(&segments->mutex);
+    cancel = segments->cancel;
+    pthread_mutex_unlock(&segments->mutex);
+
+    return cancel;
+}
+
+/*
+ * lay out num_segments segments of the same size over the bytes after
+ * offset, which are preceded by a complete segment if offset is not zero
+ */
+static int http_segments_split(struct http_segments *segments,
+                               uint64_t offset, int num_segments)
+{
+    uint64_t        segment_size;
+    int             first;
+    int             i;
+
+    first = offset > 0 ? 1 : 0;
+    segments->num_segments = first + num_segments;
+    segments->done = (uint64_t *) calloc(segments->num_segments,
+                                         sizeof(uint64_t));
+    segments->end = (uint64_t *) calloc(segments->num_segments,
+                                        sizeof(uint64_t));
+    if (segments->done == NULL || segments->end == NULL)
+        return -1;
+
+    if (first > 0) {
+        segments->done[0] = offset;
+        segments->end[0] = offset;
+    }
+    segment_size = (segments->size - offset + num_segments - 1)
+        / num_segments;
+    for (i = first; i < segments->num_segments; i++) {
+        segments->done[i] = offset + (i - first) * segment_size;
+        segments->end[i] = segments->done[i] + segment_size;
+        if (segments->end[i] > segments->size)
+            segments->end[i] = segments->size;
+    }
+
+    return 0;
+}
+
+/*
+ * continue the download recorded in the progress record with the segments
+ * listed there or, if it was made by http_get_file, with num_segments new
+ * ones after the part it completed
+ *
+ * returns -1 if there is no record for a file of this size
+ */
+static int http_segments_read(struct http_segments *segments,
+                              int num_segments)
+{
+    FILE           *fh;
+    uint64_t        offset;
+    uint64_t        start;
+    int64_t         size;
+    int             retval;
+    int             i;
+
+    fh = fopen(segments->progress_path, "r");
+    if (fh == NULL)
+        return -1;
+
+    retval = -1;
+    if (fscanf(fh, "%" SCNu64 " %" SCNd64, &offset, &size) != 2
+        || size != (int64_t) segments->size || offset > segments->size) {
+        fclose(fh);
+        return -1;
+    }
+
+    if (fscanf(fh, "%d", &i) != 1) {
+        fclose(fh);
+        return http_segments_split(segments, offset, num_segments);
+    }
+    if (i < 1 || i > HTTP_SEGMENT_MAX_COUNT + 1) {
+        fclose(fh);
+        return -1;
+    }
+
+    segments->num_segments = i;
+    segments->done = (uint64_t *) calloc(i, sizeof(uint64_t));
+    segments->end = (uint64_t *) calloc(i, sizeof(uint64_t));
+    if (segments->done != NULL && segments->end != NULL) {
+        retval = 0;
+        start = 0;
+        for (i = 0; i < segments->num_segments; i++) {
+            if (fscanf(fh, "%" SCNu64 " %" SCNu64, &segments->done[i],
+                       &segments->end[i]) != 2
+                || segments->done[i] < start
+                || segments->done[i] > segments->end[i]) {
+                retval = -1;
+                break;
+            }
+            start = segments->end[i];
+        }
+        if (start != segments->size)
+            retval = -1;
+    }
+    fclose(fh);
+
+    if (retval != 0) {
+        free(segments->done);
+        free(segments->end);
+        segments->done = NULL;
+        segments->end = NULL;
+    }
+
+    return retval;
+}
+
+// write the progress record, the caller holds the mutex of segments
+static int http_segments_write(struct http_segments *segments)
+{
+    FILE           *fh;
+    uint64_t        offset;
+    int             retval;
+    int             i;
+
+    // the part that http_get_file can continue from
+    offset = segments->size;
+    for (i = 0; i < segments->num_segments; i++) {
+        if (segments->done[i] < segments->end[i]) {
+            offset = segments->done[i];
+            break;
+        }
+    }
+
+    fh = fopen(segments->progress_path, "w");
+    if (fh == NULL) {
+        fprintf(stderr, "cannot open %s\n", segments->progress_path);
+        return -1;
+    }
+
+    retval = fprintf(fh, "%" PRIu64 " %" PRId64 "\n%d", offset,
+                     (int64_t) segments->size, segments->num_segments);
+    for (i = 0; retval > 0 && i < segments->num_segments; i++)
+        retval = fprintf(fh, " %" PRIu64 " %" PRIu64, segments->done[i],
+                         segments->end[i]);
+    if (retval > 0)
+        retval = fprintf(fh, "\n");
+    if (retval > 0)
+        retval = fflush(fh);
+    if (retval == 0)
+        retval = fsync(fileno(fh));
+    fclose(fh);
+
+    if (retval != 0) {
+        fprintf(stderr, "cannot write %s\n", segments->progress_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// flush what a segment wrote so far to disk and record it as durable
+static int http_sync_segment(mfhttp * conn)
+{
+    struct http_segments *segments;
+    int             retval;
+
+    segments = conn->segments;
+    if (http_file_flush(conn) != 0 || fsync(conn->file_fd) != 0)
+        return -1;
+    conn->unsynced_bytes = 0;
+
+    pthread_mutex_lock(&segments->mutex);
+    segments->done[conn->segment_index] = conn->file_offset;
+    retval = http_segments_write(segments);
+    pthread_mutex_unlock(&segments->mutex);
+
+    return retval;
+}
+
+static          size_t
+http_write_segment_cb(char *data, size_t size, size_t nmemb, void *user_ptr)
+{
+    mfhttp         *conn;
+    size_t          data_len;
+    long            response_code;
+
+    if (user_ptr == NULL)
+        return 0;
+    conn = (mfhttp *) user_ptr;
+    data_len = size * nmemb;
+
+    if (http_segments_cancelled(conn->segments))
+        return 0;
+
+    if (!conn->started) {
+        conn->started = true;
+        curl_easy_getinfo(conn->curl_handle, CURLINFO_RESPONSE_CODE,
+                          &response_code);
+        // without a partial response, the segments would overwrite each
+        // other with the start of the file
+        if (response_code == 200) {
+            conn->range_mismatch = true;
+            return 0;
+        }
+        // an error page fails the segment, the next attempt continues it
+        if (response_code != 206) {
+            fprintf(stderr, "server answered with HTTP status %ld\n",
+                    response_code);
+            return 0;
+        }
+    }
+
+    if (conn->segment_offset + data_len > conn->segment_end) {
+        fprintf(stderr, "server sent more than the requested range\n");
+        conn->range_mismatch = true;
+        return 0;
+    }
+
+    if (http_file_write(conn, data, data_len) != 0)
+        return 0;
+    conn->segment_offset += data_len;
+
+    conn->unsynced_bytes += data_len;
+    if (conn->unsynced_bytes >= HTTP_DOWNLOAD_SYNC_INTERVAL
+        && http_sync_segment(conn) != 0)
+        fprintf(stderr, "cannot record download progress\n");
+
+    http_throttle(conn, data_len);
+
+    return data_len;
+}
+
+static void http_prepare_get_segment(mfhttp * conn, const char *url, int fd,
+                                     uint64_t start, uint64_t end)
+{
+    char           *range;
+
+    http_curl_reset(conn);
+    http_begin(conn, HTTP_OP_GET_SEGMENT);
+    http_file_open(conn, fd, start);
+    conn->segment_offset = start;
+    conn->segment_end = end;
+    conn->unsynced_bytes = 0;
+    conn->started = false;
+    conn->range_mismatch = false;
+
+    range = strdup_printf("%" PRIu64 "-%" PRIu64, start, end - 1);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_URL, url);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_RANGE, range);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEFUNCTION,
+                     http_write_segment_cb);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_BUFFERSIZE,
+                     (long)HTTP_RECV_BUF_SIZE);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEDATA, (void *)conn);
+    fprintf(stderr, "GET: %s (bytes %s)\n", url, range);
+    free(range);
+}
+
+static int http_complete_get_segment(mfhttp * conn, int retval)
+{
+    http_end(conn);
+    http_log_timing(conn);
+
+    if (retval == CURLE_OK && http_file_flush(conn) != 0)
+        retval = -1;
+    // keep what was received so far for the next attempt
+    if (conn->started && http_sync_segment(conn) != 0)
+        fprintf(stderr, "cannot record download progress\n");
+    http_file_close(conn);
+
+    if (retval != CURLE_OK) {
+        fprintf(stderr, "error curl_easy_perform \"%s\" \"%s\"\n\r",
+                curl_easy_strerror(retval), conn->error_buf);
+    } else if (conn->segment_offset != conn->segment_end) {
+        fprintf(stderr, "segment ended %" PRIu64 " bytes early\n",
+                conn->segment_end - conn->segment_offset);
+        retval = -1;
+    }
+
+    // the download fails anyway, so do not let the others finish first
+    if (retval != 0) {
+        pthread_mutex_lock(&conn->segments->mutex);
+        conn->segments->cancel = true;
+        pthread_mutex_unlock(&conn->segments->mutex);
+    }
+
+    return retval;
+}
+
+/*
+ * open the part file of a segmented download and lay out its segments,
+ * continuing an earlier attempt if its progress record fits the file
+ */
+static int http_segments_open(struct http_segments *segments,
+                              const char *part_path, int num_segments)
+{
+    struct stat     st;
+    uint64_t        done;
+    int             retval;
+    int             fd;
+    int             i;
+
+    fd = -1;
+    if (http_segments_read(segments, num_segments) == 0) {
+        fd = open(part_path, O_RDWR);
+        // the part file must hold at least the durable parts
+        done = 0;
+        for (i = 0; i < segments->num_segments; i++) {
+            if (segments->done[i] > (i > 0 ? segments->end[i - 1] : 0))
+                done = segments->done[i];
+        }
+        if (fd >= 0 && (fstat(fd, &st) != 0 || st.st_size < (off_t) done)) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd < 0) {
+            free(segments->done);
+            free(segments->end);
+            segments->done = NULL;
+            segments->end = NULL;
+        }
+    }
+    if (fd < 0) {
+        if (http_segments_split(segments, 0, num_segments) != 0)
+            return -1;
+        fd = open(part_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s\n", part_path);
+        return -1;
+    }
+    // reserve the space up front so that the segments do not fragment the
+    // file and running out of space is noticed right away
+    retval = posix_fallocate(fd, 0, segments->size);
+    if (retval == EINVAL || retval == EOPNOTSUPP)
+        retval = ftruncate(fd, segments->size);
+    if (retval != 0) {
+        fprintf(stderr, "cannot allocate %" PRIu64 " bytes for %s\n",
+                segments->size, part_path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * fetch the segments that are not complete yet into the part file and
+ * rename it to path once all of them arrived
+ */
+static int http_get_segments(mfhttp * conn, const char *url, const char *path,
+                             const char *part_path,
+                             struct http_segments *segments,
+                             int num_segments)
+{
+    int             num_active;
+    int             i;
+    int             fd;
+    int             retval;
+    bool            range_mismatch;
+    bool            hashing;
+    mfhttp        **https;
+    struct http_hasher hasher;
+
+    fd = http_segments_open(segments, part_path, num_segments);
+    if (fd < 0)
+        return -1;
+
+    // a handle for every segment that is not complete yet, conn being the
+    // first one
+    https = (mfhttp **) calloc(segments->num_segments, sizeof(mfhttp *));
+    num_active = 0;
+    retval = 0;
+    for (i = 0; https != NULL && i < segments->num_segments; i++) {
+        if (segments->done[i] == segments->end[i])
+            continue;
+        https[i] = num_active++ == 0 ? conn : http_create();
+        if (https[i] == NULL)
+            retval = -1;
+    }
+    if (https == NULL || retval != 0) {
+        // the part file is continued from where it is complete
+        for (i = 0; https != NULL && i < segments->num_segments; i++) {
+            if (https[i] != NULL && https[i] != conn)
+                http_destroy(https[i]);
+        }
+        free(https);
+        close(fd);
+        return http_get_file(conn, url, path);
+    }
+
+    fprintf(stderr, "downloading %" PRIu64 " bytes in %d of %d segments\n",
+            segments->size, num_active, segments->num_segments);
+
+    // without the hasher, the caller reads the file back to verify it
+    hashing = http_hasher_start(&hasher, fd, segments->size, segments->done,
+                                segments->end, segments->num_segments) == 0;
+
+    for (i = 0; i < segments->num_segments; i++) {
+        if (https[i] == NULL)
+            continue;
+        http_prepare_get_segment(https[i], url, fd, segments->done[i],
+                                 segments->end[i]);
+        https[i]->segments = segments;
+        https[i]->segment_index = i;
+        if (hashing)
+            https[i]->hasher = &hasher;
+        http_engine_submit(https[i], NULL, NULL);
+    }
+
+    range_mismatch = false;
+    for (i = 0; i < segments->num_segments; i++) {
+        if (https[i] == NULL)
+            continue;
+        if (http_wait(https[i]) != 0)
+            retval = -1;
+        if (https[i]->range_mismatch)
+            range_mismatch = true;
+        https[i]->segments = NULL;
+        https[i]->hasher = NULL;
+        if (https[i] != conn)
+            http_destroy(https[i]);
+    }
+    free(https);
+
+    if (hashing)
+        http_hasher_finish(&hasher, conn, retval == 0);
+
+    if (retval == 0 && fsync(fd) != 0)
+        retval = -1;
+    close(fd);
+
+    if (retval == 0) {
+        retval = rename(part_path, path);
+        if (retval != 0)
+            fprintf(stderr, "cannot rename %s to %s\n", part_path, path);
+        else
+            unlink(segments->progress_path);
+    } else {
+        fprintf(stderr, "keeping %s for the next attempt\n", part_path);
+    }
+
+    if (range_mismatch) {
+        fprintf(stderr, "server does not support ranges - downloading "
+                "in one piece\n");
+        return http_get_file(conn, url, path);
+    }
+
+    return retval;
+}
+
+/*
+ * download url with the given size to path
+ *
+ * stream_speed is the throughput in bytes per second a single connection
+ * achieved so far or zero if it is not known. When this function returns,
+ * conn holds the statistics of one of the streams.
+ */
+int http_get_file_segmented(mfhttp * conn, const char *url, const char *path,
+                            uint64_t size, double stream_speed)
+{
+    uint64_t        segment_size;
+    int             num_segments;
+    int             retval;
+    char           *part_path;
+    struct http_segments segments;
+
+    segment_size = HTTP_SEGMENT_MIN;
+    if (stream_speed * HTTP_SEGMENT_SECONDS > segment_size)
+        segment_size = stream_speed * HTTP_SEGMENT_SECONDS;
+    num_segments = (size + segment_size - 1) / segment_size;
+    if (num_segments > HTTP_SEGMENT_MAX_COUNT)
+        num_segments = HTTP_SEGMENT_MAX_COUNT;
+
+    if (num_segments < 2 || !http_engine_available())
+        return http_get_file(conn, url, path);
+
+    memset(&segments, 0, sizeof(segments));
+    segments.size = size;
+    segments.progress_path = strdup_printf("%s.part.progress", path);
+    pthread_mutex_init(&segments.mutex, NULL);
+    part_path = strdup_printf("%s.part", path);
+
+    retval = http_get_segments(conn, url, path, part_path, &segments,
+                               num_segments);
+
+    pthread_mutex_destroy(&segments.mutex);
+    free(segments.progress_path);
+    free(segments.done);
+    free(segments.end);
+    free(part_path);
+
+    return retval;
+}
+
+/*
+ * store the SHA256 of the file written by the last http_get_file,
+ * http_get_file_async or http_get_file_segmented with the given handle in
+ * hash, which must hold SHA256_DIGEST_LENGTH bytes, its fast checksum (see
+ * checksum_update) in checksum unless that is NULL and its size in size
+ *
+ * The hash is computed while the data arrives. If the download did not pass
+ * through it completely, -1 is returned and the caller has to read the file
+ * back to verify it.
+ */
+int http_get_file_hash(mfhttp * conn, unsigned char *hash,
+                       uint64_t * checksum, uint64_t * size)
+{
+    if (!conn->hash_valid)
+        return -1;
+
+    memcpy(hash, conn->hash, SHA256_DIGEST_LENGTH);
+    if (checksum != NULL)
+        *checksum = conn->checksum;
+    if (size != NULL)
+        *size = conn->hash_len;
+
+    return 0;
+}
+
+/*
+ * the following functions return statistics about the last transfer that was
+ * carried out with the given handle
+ */
+
+// time in seconds until the first byte was received
+double http_get_latency(mfhttp * conn)
+{
+    double          value;
+
+    if (curl_easy_getinfo(conn->curl_handle, CURLINFO_STARTTRANSFER_TIME,
+                          &value) != CURLE_OK)
+        return -1;
+
+    return value;
+}
+
+// average download speed in bytes per second
+double http_get_download_speed(mfhttp * conn)
+{
+    double          value;
+
+    if (curl_easy_getinfo(conn->curl_handle, CURLINFO_SPEED_DOWNLOAD,
+                          &value) != CURLE_OK)
+        return -1;
+
+    return value;
+}
+
+// number of bytes downloaded
+double http_get_download_size(mfhttp * conn)
+{
+    double          value;
+
+    if (curl_easy_getinfo(conn->curl_handle, CURLINFO_SIZE_DOWNLOAD,
+                          &value) != CURLE_OK)
+        return -1;
+
+    return value;
 }
 
 // we roll our own urlencode function because curl_easy_escape requires a curl
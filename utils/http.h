@@ -27,8 +27,22 @@
 
 typedef struct mfhttp mfhttp;
 
+/* scheduling classes of transfers, in the order of their priority */
+enum {
+    HTTP_CLASS_METADATA,
+    HTTP_CLASS_DATA,
+    HTTP_CLASS_PREFETCH,
+    HTTP_CLASS_UPLOAD,
+    HTTP_NUM_CLASSES
+};
+
 mfhttp         *http_create(void);
 void            http_destroy(mfhttp * conn);
+void            http_pool_cleanup(void);
+void            http_set_timeout(mfhttp * conn, double seconds);
+void            http_set_thread_class(int cls);
+void            http_set_class_rate(int cls, uint64_t bytes_per_second);
+void            http_print_class_stats(FILE * fh);
 int             http_get_buf(mfhttp * conn, const char *url,
                              int (*data_handler) (mfhttp * conn, void *data),
                              void *data);
@@ -38,6 +52,9 @@ int             http_post_buf(mfhttp * conn, const char *url,
                               void *data);
 int             http_get_file(mfhttp * conn, const char *url,
                               const char *path);
+int             http_get_file_segmented(mfhttp * conn, const char *url,
+                                        const char *path, uint64_t size,
+                                        double stream_speed);
 json_t         *http_parse_buf_json(mfhttp * conn, size_t flags,
                                     json_error_t * error);
 int             http_post_file(mfhttp * conn, const char *url, FILE * fh,
@@ -45,6 +62,52 @@ int             http_post_file(mfhttp * conn, const char *url, FILE * fh,
                                uint64_t filesize,
                                int (*data_handler) (mfhttp * conn, void *data),
                                void *data);
+int             http_post_file_range(mfhttp * conn, const char *url, int fd,
+                                     uint64_t offset, uint64_t size,
+                                     struct curl_slist **custom_headers,
+                                     int (*data_handler) (mfhttp * conn,
+                                                          void *data),
+                                     void *data);
+int             http_get_buf_async(mfhttp * conn, const char *url,
+                                   int (*data_handler) (mfhttp * conn,
+                                                        void *data),
+                                   void *data,
+                                   void (*done_cb) (mfhttp * conn,
+                                                    int retval,
+                                                    void *user_ptr),
+                                   void *user_ptr);
+int             http_post_buf_async(mfhttp * conn, const char *url,
+                                    const char *post_args,
+                                    int (*data_handler) (mfhttp * conn,
+                                                         void *data),
+                                    void *data,
+                                    void (*done_cb) (mfhttp * conn,
+                                                     int retval,
+                                                     void *user_ptr),
+                                    void *user_ptr);
+int             http_get_file_async(mfhttp * conn, const char *url,
+                                    const char *path,
+                                    void (*done_cb) (mfhttp * conn,
+                                                     int retval,
+                                                     void *user_ptr),
+                                    void *user_ptr);
+int             http_post_file_async(mfhttp * conn, const char *url,
+                                     FILE * fh,
+                                     struct curl_slist **custom_headers,
+                                     uint64_t filesize,
+                                     int (*data_handler) (mfhttp * conn,
+                                                          void *data),
+                                     void *data,
+                                     void (*done_cb) (mfhttp * conn,
+                                                      int retval,
+                                                      void *user_ptr),
+                                     void *user_ptr);
+int             http_wait(mfhttp * conn);
+int             http_get_file_hash(mfhttp * conn, unsigned char *hash,
+                                   uint64_t * checksum, uint64_t * size);
+double          http_get_latency(mfhttp * conn);
+double          http_get_download_speed(mfhttp * conn);
+double          http_get_download_size(mfhttp * conn);
 
 char           *urlencode(const char *input);
 
@@ -106,3 +106,15 @@ int stringv_del(stringv * sv, const char *e)
     }
     return 0;
 }
+
+size_t stringv_len(stringv * sv)
+{
+    return sv->len;
+}
+
+const char     *stringv_get(stringv * sv, size_t i)
+{
+    if (i >= sv->len)
+        return NULL;
+    return sv->array[i];
+}
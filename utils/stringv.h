@@ -20,6 +20,7 @@
 #define _STRING_V_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef struct stringv stringv;
 
@@ -33,4 +34,8 @@ int             stringv_add(stringv * sv, const char *e);
 
 int             stringv_del(stringv * sv, const char *e);
 
+size_t          stringv_len(stringv * sv);
+
+const char     *stringv_get(stringv * sv, size_t i);
+
 #endif
@@ -25,6 +25,13 @@
 #include "../3rdparty/xdelta3-3.0.8/xdelta3.c"
 #include "../3rdparty/xdelta3-3.0.8/xdelta3-decode.h"
 
+// xdelta3-merge.h reports errors through the xdelta3 command line
+// frontend which is not compiled in, so route them to stderr instead
+#undef XPR
+#define XPR(...) fprintf(stderr, __VA_ARGS__)
+#define XD3_LIB_ERRMSG(stream, ret) "%s: %d\n", xd3_errstring(stream), ret
+#include "../3rdparty/xdelta3-3.0.8/xdelta3-merge.h"
+
 //---------------------------------------------------------------------------
 static int code(int encode, FILE * InFile, FILE * SrcFile, FILE * OutFile,
                 unsigned int BufSize)
@@ -113,3 +120,193 @@ int xdelta3_patch(FILE * old, FILE * diff, FILE * new)
 {
     return code(0, diff, old, new, 0x1000);
 }
+
+/*
+ * decode a single delta into the whole_target instruction list of the given
+ * stream without applying it to any source
+ */
+static int decode_whole(FILE * DiffFile, xd3_stream * stream,
+                        unsigned int BufSize)
+{
+    int             ret;
+    xd3_config      config;
+    void           *Input_Buf;
+    unsigned int    Input_Buf_Read;
+
+    memset(stream, 0, sizeof(*stream));
+    xd3_init_config(&config, XD3_ADLER32_NOVER | XD3_SKIP_EMIT);
+    config.winsize = BufSize;
+    ret = xd3_config_stream(stream, &config);
+    if (ret != 0)
+        return ret;
+    ret = xd3_whole_state_init(stream);
+    if (ret != 0)
+        return ret;
+
+    Input_Buf = malloc(BufSize);
+    if (Input_Buf == NULL)
+        return ENOMEM;
+    fseek(DiffFile, 0, SEEK_SET);
+
+    do {
+        Input_Buf_Read = fread(Input_Buf, 1, BufSize, DiffFile);
+        if (Input_Buf_Read < BufSize) {
+            xd3_set_flags(stream, XD3_FLUSH | stream->flags);
+        }
+        xd3_avail_input(stream, Input_Buf, Input_Buf_Read);
+        for (;;) {
+            ret = xd3_decode_input(stream);
+            if (ret == XD3_INPUT) {
+                break;
+            } else if (ret == XD3_OUTPUT) {
+                ret = xd3_whole_append_window(stream);
+                if (ret != 0) {
+                    free(Input_Buf);
+                    return ret;
+                }
+                xd3_consume_output(stream);
+            } else if (ret == XD3_GOTHEADER || ret == XD3_WINSTART
+                       || ret == XD3_WINFINISH) {
+            } else {
+                fprintf(stderr, "!!! INVALID %s %d !!!\n", stream->msg, ret);
+                free(Input_Buf);
+                return ret;
+            }
+        }
+    } while (Input_Buf_Read == BufSize);
+    free(Input_Buf);
+    xd3_close_stream(stream);
+    return 0;
+}
+
+/*
+ * write out the target described by a whole_target instruction list
+ *
+ * source copies are read from SrcFile while target copies are read back from
+ * what was already written to OutFile. Target copies may overlap with the
+ * data they produce, so they are done in pieces no larger than the distance
+ * between their address and their position.
+ */
+static int apply_whole(FILE * SrcFile, xd3_whole_state * whole, FILE * OutFile,
+                       unsigned int BufSize)
+{
+    usize_t         i;
+    xd3_winst      *inst;
+    xoff_t          done;
+    xoff_t          chunk;
+    uint8_t        *buf;
+    int             ret;
+
+    buf = malloc(BufSize);
+    if (buf == NULL)
+        return ENOMEM;
+
+    ret = 0;
+    for (i = 0; ret == 0 && i < whole->instlen; i++) {
+        inst = &whole->inst[i];
+        switch (inst->type) {
+            case XD3_ADD:
+                if (fwrite(whole->adds + inst->addr, 1, inst->size, OutFile)
+                    != inst->size)
+                    ret = -1;
+                break;
+            case XD3_RUN:
+                memset(buf, whole->adds[inst->addr], BufSize);
+                for (done = 0; ret == 0 && done < inst->size; done += chunk) {
+                    chunk = min(BufSize, inst->size - done);
+                    if (fwrite(buf, 1, chunk, OutFile) != chunk)
+                        ret = -1;
+                }
+                break;
+            default:
+                if (inst->mode == VCD_SOURCE) {
+                    if (fseek(SrcFile, inst->addr, SEEK_SET) != 0) {
+                        ret = -1;
+                        break;
+                    }
+                    for (done = 0; ret == 0 && done < inst->size;
+                         done += chunk) {
+                        chunk = min(BufSize, inst->size - done);
+                        if (fread(buf, 1, chunk, SrcFile) != chunk
+                            || fwrite(buf, 1, chunk, OutFile) != chunk)
+                            ret = -1;
+                    }
+                    break;
+                }
+                if (inst->addr >= inst->position) {
+                    fprintf(stderr, "invalid target copy\n");
+                    ret = -1;
+                    break;
+                }
+                for (done = 0; ret == 0 && done < inst->size; done += chunk) {
+                    chunk = min(BufSize, inst->size - done);
+                    chunk = min(chunk, inst->position - inst->addr);
+                    if (fseek(OutFile, inst->addr + done, SEEK_SET) != 0
+                        || fread(buf, 1, chunk, OutFile) != chunk
+                        || fseek(OutFile, 0, SEEK_END) != 0
+                        || fwrite(buf, 1, chunk, OutFile) != chunk)
+                        ret = -1;
+                }
+                break;
+        }
+    }
+    free(buf);
+
+    if (ret != 0) {
+        fprintf(stderr, "failed to write patched output\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * apply a chain of deltas to old in a single pass
+ *
+ * Instead of materializing every intermediate revision, the deltas are
+ * decoded into instruction lists and merged into one delta from the first
+ * source to the last target which is then applied. The output file must be
+ * opened for reading and writing because target copies read back from it.
+ */
+int xdelta3_patch_chain(FILE * old, FILE ** diffs, size_t num_diffs,
+                        FILE * new)
+{
+    int             ret;
+    size_t          i;
+    xd3_stream      stream;
+    xd3_stream      merged;
+
+    if (num_diffs == 0)
+        return -1;
+
+    memset(&merged, 0, sizeof(merged));
+    ret = xd3_config_stream(&merged, NULL);
+    if (ret == 0)
+        ret = xd3_whole_state_init(&merged);
+    if (ret != 0) {
+        xd3_free_stream(&merged);
+        return ret;
+    }
+
+    for (i = 0; i < num_diffs; i++) {
+        ret = decode_whole(diffs[i], &stream, 0x1000);
+        if (ret == 0 && i > 0) {
+            // apply this delta to the merge of all previous ones
+            ret = xd3_merge_input_output(&stream, &merged.whole_target);
+        }
+        if (ret == 0) {
+            xd3_swap_whole_state(&stream.whole_target, &merged.whole_target);
+        }
+        xd3_free_stream(&stream);
+        if (ret != 0) {
+            fprintf(stderr, "failed to merge patch %zu\n", i);
+            xd3_free_stream(&merged);
+            return ret;
+        }
+    }
+
+    ret = apply_whole(old, &merged.whole_target, new, 0x1000);
+    xd3_free_stream(&merged);
+
+    return ret;
+}
@@ -23,5 +23,7 @@
 
 int             xdelta3_diff(FILE * old, FILE * new, FILE * diff);
 int             xdelta3_patch(FILE * old, FILE * diff, FILE * new);
+int             xdelta3_patch_chain(FILE * old, FILE ** diffs,
+                                    size_t num_diffs, FILE * new);
 
 #endif